@@ -0,0 +1,180 @@
+#include "admin.h"
+#include "storage.h"
+#include "transport.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+// Admin interface, on a UNIX socket only the server's user can reach
+//  one command per line, each answered by any output lines and then a
+//  final line starting with "OK" or "ERR"
+//   stats           server diagnostics, as printed on SIGUSR1
+//   backup <path>   start an online backup of the database to path
+//   reload          pick up accounts and lists changed in the database
+//   help
+//   quit
+
+// longest command line, the rest is ignored
+#define ADMIN_LINE_MAX 1024
+
+struct admin {
+	char line[ADMIN_LINE_MAX];
+	size_t line_len;
+	int line_overflow;
+};
+
+// prints server diagnostics, from main.c
+static void (*admin_report)(FILE * out);
+
+int admin_setup(void (*report)(FILE * out))
+{
+	admin_report = report;
+	return 0;
+}
+
+void admin_teardown()
+{
+}
+
+struct admin * admin_init(struct transport * t)
+{
+	struct admin * a = calloc(1, sizeof(struct admin));
+	(void)t;
+
+	if (a == NULL)
+		perror("calloc(struct admin)");
+
+	return a;
+}
+
+static int admin_stats(const char * arg, struct transport * t)
+{
+	(void)arg;
+
+	char * out = NULL;
+	size_t out_len = 0;
+	FILE * f = open_memstream(&out, &out_len);
+
+	if (f == NULL) {
+		perror("open_memstream");
+		return transport_puts(t, "ERR out of memory\n");
+	}
+
+	admin_report(f);
+	fclose(f);
+
+	const int ret = transport_write(t, out, out_len);
+	free(out);
+
+	return ret == -1 ? -1 : transport_puts(t, "OK\n");
+}
+
+static int admin_backup(const char * arg, struct transport * t)
+{
+	if (arg == NULL)
+		return transport_puts(t, "ERR usage: backup <path>\n");
+
+	if (storage_backup(arg) == -1)
+		return transport_puts(t, "ERR backup not started, see the server log\n");
+
+	return transport_puts(t, "OK backup started, progress is in the server log and stats\n");
+}
+
+static int admin_reload(const char * arg, struct transport * t)
+{
+	(void)arg;
+
+	if (storage_reload() == -1)
+		return transport_puts(t, "ERR reload failed, see the server log\n");
+
+	return transport_puts(t, "OK\n");
+}
+
+static int admin_help(const char * arg, struct transport * t)
+{
+	(void)arg;
+
+	return transport_puts(t, "stats\nbackup <path>\nreload\nhelp\nquit\nOK\n");
+}
+
+static int admin_quit(const char * arg, struct transport * t)
+{
+	(void)arg;
+
+	transport_puts(t, "OK\n");
+	return -1;
+}
+
+static const struct {
+	const char * name;
+	int (*handler)(const char * arg, struct transport * t);
+} commands[] = {
+	{ "stats", admin_stats },
+	{ "backup", admin_backup },
+	{ "reload", admin_reload },
+	{ "help", admin_help },
+	{ "quit", admin_quit }
+};
+
+static int admin_command(char * line, struct transport * t)
+{
+	char * arg = strchr(line, ' ');
+
+	if (arg != NULL) {
+		*arg ++ = '\0';
+		while (*arg == ' ')
+			arg ++;
+		if (*arg == '\0')
+			arg = NULL;
+	}
+
+	printf(" . Admin command: %s%s%s\n", line, arg ? " " : "", arg ? arg : "");
+
+	for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i ++)
+		if (strcmp(line, commands[i].name) == 0)
+			return commands[i].handler(arg, t);
+
+	return transport_puts(t, "ERR unknown command, try help\n");
+}
+
+int admin_process(struct admin * a, const char * buffer, int len, struct transport * t)
+{
+	for (int i = 0; i < len; i ++) {
+		if (buffer[i] != '\n') {
+			if (a->line_len < ADMIN_LINE_MAX - 1)
+				a->line[a->line_len ++] = buffer[i];
+			else
+				a->line_overflow = 1;
+			continue;
+		}
+
+		// CRLF is fine too
+		if (a->line_len > 0 && a->line[a->line_len - 1] == '\r')
+			a->line_len --;
+		a->line[a->line_len] = '\0';
+
+		int ret;
+		if (a->line_overflow)
+			ret = transport_puts(t, "ERR line too long\n");
+		else if (a->line_len == 0)
+			ret = 0;
+		else
+			ret = admin_command(a->line, t);
+
+		a->line_len = 0;
+		a->line_overflow = 0;
+
+		if (ret == -1) {
+			transport_flush(t);
+			return -1;
+		}
+	}
+
+	return transport_flush(t);
+}
+
+void admin_free(struct admin * a)
+{
+	free(a);
+}
@@ -0,0 +1,16 @@
+#ifndef ADMIN_H_
+#define ADMIN_H_
+
+#include <stdio.h>
+
+struct admin;
+struct transport;
+
+int admin_setup(void (*report)(FILE * out));
+void admin_teardown();
+
+struct admin * admin_init(struct transport * t);
+int admin_process(struct admin * a, const char * buffer, int len, struct transport * t);
+void admin_free(struct admin * a);
+
+#endif
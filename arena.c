@@ -0,0 +1,111 @@
+#include "arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// first block size, later blocks double up to the max
+#define ARENA_BLOCK_MIN 1024
+#define ARENA_BLOCK_MAX (64 * 1024)
+
+// every allocation is rounded up to this, keeping pointers and numbers aligned
+#define ARENA_ALIGN sizeof(long long)
+
+// blocks are chained newest first, only the newest one is allocated from
+struct arena_block {
+	struct arena_block * prev;
+	size_t size;
+	long long data[];
+};
+
+void arena_init(struct arena * a)
+{
+	a->block = NULL;
+	a->used = 0;
+}
+
+void * arena_alloc(struct arena * a, size_t size)
+{
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	if (a->block == NULL || a->block->size - a->used < size) {
+		size_t block_size = a->block ? a->block->size * 2 : ARENA_BLOCK_MIN;
+		if (block_size > ARENA_BLOCK_MAX)
+			block_size = ARENA_BLOCK_MAX;
+		if (block_size < size)
+			block_size = size;
+
+		struct arena_block * b = malloc(sizeof(struct arena_block) + block_size);
+
+		if (b == NULL) {
+			perror("malloc(struct arena_block)");
+			return NULL;
+		}
+
+		b->prev = a->block;
+		b->size = block_size;
+		a->block = b;
+		a->used = 0;
+	}
+
+	void * p = (char *)a->block->data + a->used;
+	a->used += size;
+	return p;
+}
+
+char * arena_strndup(struct arena * a, const char * s, size_t len)
+{
+	char * p = arena_alloc(a, len + 1);
+
+	if (p != NULL) {
+		memcpy(p, s, len);
+		p[len] = '\0';
+	}
+
+	return p;
+}
+
+struct arena_mark arena_mark(const struct arena * a)
+{
+	struct arena_mark m = { a->block, a->used };
+	return m;
+}
+
+// Drop everything allocated since the mark was taken
+//  as with a reset, a mark on an empty arena keeps the first block
+void arena_rollback(struct arena * a, struct arena_mark m)
+{
+	while (a->block != m.block && (m.block != NULL || a->block->prev != NULL)) {
+		struct arena_block * prev = a->block->prev;
+		free(a->block);
+		a->block = prev;
+	}
+
+	a->used = m.used;
+}
+
+// Drop everything allocated so far
+//  the newest (largest) block is kept, so a session doing the same work
+//  again doesn't go back to malloc
+void arena_reset(struct arena * a)
+{
+	if (a->block == NULL)
+		return;
+
+	struct arena_block * b = a->block->prev;
+	while (b != NULL) {
+		struct arena_block * prev = b->prev;
+		free(b);
+		b = prev;
+	}
+
+	a->block->prev = NULL;
+	a->used = 0;
+}
+
+void arena_free(struct arena * a)
+{
+	arena_reset(a);
+	free(a->block);
+	a->block = NULL;
+}
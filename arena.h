@@ -0,0 +1,29 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+struct arena_block;
+
+// A bump allocator: allocations are never freed one by one, the whole
+//  arena is reset at once when the data in it is no longer needed
+struct arena {
+	struct arena_block * block;
+	size_t used;
+};
+
+// A point to roll an arena back to, dropping what was allocated after it
+struct arena_mark {
+	struct arena_block * block;
+	size_t used;
+};
+
+void arena_init(struct arena * a);
+void * arena_alloc(struct arena * a, size_t size);
+char * arena_strndup(struct arena * a, const char * s, size_t len);
+struct arena_mark arena_mark(const struct arena * a);
+void arena_rollback(struct arena * a, struct arena_mark m);
+void arena_reset(struct arena * a);
+void arena_free(struct arena * a);
+
+#endif
@@ -0,0 +1,252 @@
+#include "backup.h"
+#include "shard.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+// Online backup of the database with the SQLite backup API.  The copy is
+//  made a few pages at a time from the event loop, so clients never wait
+//  on more than one step of it.  It goes to <path>.part, which is synced
+//  and renamed to <path> once complete.
+//  The source is the writer connection: changes it makes during the copy
+//  are applied to the backup as they happen instead of restarting it.
+//  The shards of a sharded layout are copied one after the other, each
+//  to <path>.N as the server names them, so the copy opens as a layout.
+static sqlite3 * const * dbs;
+static int dbs_len;
+// pages copied per step
+static int backup_pages;
+
+// the backup in progress, if any
+static sqlite3 * dest;
+static sqlite3_backup * backup;
+static char * dest_path;
+// the shard being copied, and the file it goes to
+static int shard;
+static char * shard_dest;
+static struct timespec backup_start_time;
+// progress already printed, in tenths
+static int backup_tenths;
+
+// counters for backup_report()
+static unsigned long backups_done, backups_failed;
+static char * last_path;
+static double last_seconds;
+
+// db[i] is shard i, which must stay open as long as the module is set up
+int backup_setup(sqlite3 * const * db, int len, int pages)
+{
+	dbs = db;
+	dbs_len = len;
+	backup_pages = pages > 0 ? pages : 1;
+	return 0;
+}
+
+static double elapsed_s(const struct timespec * start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static char * part_path(const char * path)
+{
+	char * part = malloc(strlen(path) + sizeof(".part"));
+
+	if (part == NULL)
+		perror("malloc(backup path)");
+	else
+		sprintf(part, "%s.part", path);
+
+	return part;
+}
+
+// Start copying the current shard to its file
+//  returns 0 on success, -1 on failure
+static int shard_start()
+{
+	shard_dest = shard_path(dest_path, shard);
+	char * part = shard_dest == NULL ? NULL : part_path(shard_dest);
+
+	if (part == NULL)
+		return -1;
+
+	// a leftover from an interrupted backup is overwritten
+	unlink(part);
+
+	// nothing of the partial file is worth protecting, so no journal and no syncs
+	if (sqlite3_open_v2(part, &dest, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK ||
+		sqlite3_exec(dest, "PRAGMA journal_mode = OFF; PRAGMA synchronous = OFF", NULL, NULL, NULL) != SQLITE_OK ||
+		(backup = sqlite3_backup_init(dest, "main", dbs[shard], "main")) == NULL) {
+		fprintf(stderr, "Failed to start backup to %s: %s\n", shard_dest, sqlite3_errmsg(dest));
+		sqlite3_close(dest);
+		dest = NULL;
+		unlink(part);
+		free(part);
+		return -1;
+	}
+
+	free(part);
+	backup_tenths = 0;
+	return 0;
+}
+
+// Close the current shard's copy, and put it in place if it is complete
+//  returns 0 on success, -1 on failure
+static int shard_finish(int complete)
+{
+	int ret = complete ? 0 : -1;
+
+	if (sqlite3_backup_finish(backup) != SQLITE_OK)
+		ret = -1;
+	if (sqlite3_close(dest) != SQLITE_OK)
+		ret = -1;
+	backup = NULL;
+	dest = NULL;
+
+	char * part = part_path(shard_dest);
+
+	if (part == NULL)
+		ret = -1;
+	else if (ret == 0) {
+		// the copy was made without syncing, so do it once now
+		int fd = open(part, O_WRONLY | O_CLOEXEC);
+
+		if (fd == -1 || fsync(fd) == -1 || rename(part, shard_dest) == -1) {
+			perror("backup");
+			ret = -1;
+		}
+		if (fd != -1)
+			close(fd);
+	}
+
+	if (part != NULL && ret == -1)
+		unlink(part);
+	free(part);
+	free(shard_dest);
+	shard_dest = NULL;
+
+	return ret;
+}
+
+// End the backup, successful or not
+static void backup_finish(int complete)
+{
+	if (backup != NULL && shard_finish(complete) == -1)
+		complete = 0;
+	free(shard_dest);
+	shard_dest = NULL;
+
+	if (complete) {
+		backups_done ++;
+		last_seconds = elapsed_s(&backup_start_time);
+		free(last_path);
+		last_path = dest_path;
+		printf(" . Backup to %s complete in %.1f s\n", dest_path, last_seconds);
+	} else {
+		backups_failed ++;
+		fprintf(stderr, "Backup to %s failed.\n", dest_path);
+		free(dest_path);
+	}
+
+	dest_path = NULL;
+}
+
+void backup_teardown()
+{
+	if (dest_path != NULL)
+		backup_finish(0);
+
+	free(last_path);
+	last_path = NULL;
+}
+
+// Start a backup to path, copied over later calls to backup_step()
+//  returns 0 on success, -1 on failure (or if one is already running)
+int backup_start(const char * path)
+{
+	if (dest_path != NULL) {
+		fprintf(stderr, "A backup to %s is already running.\n", dest_path);
+		return -1;
+	}
+
+	dest_path = strdup(path);
+
+	if (dest_path == NULL) {
+		perror("strdup(backup path)");
+		return -1;
+	}
+
+	shard = 0;
+	if (shard_start() == -1) {
+		free(shard_dest);
+		shard_dest = NULL;
+		free(dest_path);
+		dest_path = NULL;
+		backups_failed ++;
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &backup_start_time);
+	printf(" . Backing up database to %s, %d pages per step\n", path, backup_pages);
+	return 0;
+}
+
+// Nonzero while a backup is in progress
+int backup_running()
+{
+	return dest_path != NULL;
+}
+
+// Copy the next few pages of the backup in progress
+void backup_step()
+{
+	if (backup == NULL)
+		return;
+
+	const int rv = sqlite3_backup_step(backup, backup_pages);
+
+	if (rv == SQLITE_DONE) {
+		// on to the next shard, if there is one
+		if (shard + 1 == dbs_len)
+			backup_finish(1);
+		else if (shard_finish(1) == -1)
+			backup_finish(0);
+		else {
+			shard ++;
+			if (shard_start() == -1)
+				backup_finish(0);
+		}
+	} else if (rv == SQLITE_OK || rv == SQLITE_BUSY || rv == SQLITE_LOCKED) {
+		// busy: someone else holds the source, try again next step
+		const int total = sqlite3_backup_pagecount(backup);
+		const int tenths = total ? (total - sqlite3_backup_remaining(backup)) * 10 / total : 0;
+
+		if (tenths > backup_tenths) {
+			backup_tenths = tenths;
+			printf(" . Backup to %s: %d0%% of %d pages\n", shard_dest, tenths, total);
+		}
+	} else {
+		fprintf(stderr, "Backup step failed: %s\n", sqlite3_errstr(rv));
+		backup_finish(0);
+	}
+}
+
+// Print backup diagnostics
+void backup_report(FILE * out)
+{
+	if (backup != NULL) {
+		const int total = sqlite3_backup_pagecount(backup);
+		fprintf(out, " . Backup: to %s, %d of %d pages copied in %.1f s\n", shard_dest,
+			total - sqlite3_backup_remaining(backup), total, elapsed_s(&backup_start_time));
+	}
+
+	fprintf(out, " . Backups: %lu done, %lu failed", backups_done, backups_failed);
+	if (last_path != NULL)
+		fprintf(out, ", last to %s in %.1f s", last_path, last_seconds);
+	fputc('\n', out);
+}
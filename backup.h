@@ -0,0 +1,17 @@
+#ifndef BACKUP_H_
+#define BACKUP_H_
+
+// for our storage db
+#include <sqlite3.h>
+
+#include <stdio.h>
+
+int backup_setup(sqlite3 * const * db, int len, int pages);
+void backup_teardown();
+
+int backup_start(const char * path);
+int backup_running();
+void backup_step();
+void backup_report(FILE * out);
+
+#endif
@@ -0,0 +1,744 @@
+/*
+** bridgemail-bench - load generator for a running BridgeMail
+*  Opens many concurrent SMTP sessions delivering generated mail, then
+*  POP3 sessions which download and delete it again, and reports
+*  throughput and per-command latency percentiles.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+// generated body lines, never starting with '.' so no dot-stuffing is needed
+#define BODY_LINE 80
+// longest reply line we keep, the rest is skipped
+#define REPLY_MAX 512
+
+// every command we time, in the order they are reported
+enum command {
+	CMD_NONE = -1,
+	SMTP_CONNECT, SMTP_HELO, SMTP_MAIL, SMTP_RCPT, SMTP_DATA, SMTP_BODY, SMTP_QUIT,
+	POP3_CONNECT, POP3_USER, POP3_PASS, POP3_LIST, POP3_RETR, POP3_DELE, POP3_QUIT,
+	CMD_COUNT
+};
+
+static struct timing {
+	const char * name;
+	double * us;
+	size_t len, max;
+	unsigned long errors;
+} timings[CMD_COUNT] = {
+	{ .name = "SMTP connect" }, { .name = "SMTP HELO" }, { .name = "SMTP MAIL" }, { .name = "SMTP RCPT" }, { .name = "SMTP DATA" }, { .name = "SMTP <body>." }, { .name = "SMTP QUIT" },
+	{ .name = "POP3 connect" }, { .name = "POP3 USER" }, { .name = "POP3 PASS" }, { .name = "POP3 LIST" }, { .name = "POP3 RETR" }, { .name = "POP3 DELE" }, { .name = "POP3 QUIT" }
+};
+
+// one client connection
+struct session {
+	int smtp;
+	int fd;
+	int connecting;
+
+	// command waiting for its reply, and when it was sent
+	enum command cmd;
+	double sent;
+
+	// queued output: a command, or a message body and its terminator
+	char cmd_buf[REPLY_MAX];
+	const char * out[2];
+	size_t out_len[2];
+
+	// reply being read
+	char line[REPLY_MAX];
+	size_t line_len;
+	// in a POP3 multi-line reply: progress through "\r\n.\r\n", and lines seen
+	int multi, match;
+	unsigned long lines;
+
+	// SMTP: recipients still to send for the current message
+	int rcpt_left, rcpt_next;
+	// POP3: mailbox, and messages listed / next to retrieve or delete
+	int user;
+	unsigned long msgs, next;
+};
+
+// settings
+static const char * host = "127.0.0.1";
+static const char * port_smtp = "25", * port_pop3 = "110";
+static int smtp_sessions = 100, pop3_sessions = 10;
+static long messages = 1000;
+static enum { SIZE_FIXED, SIZE_UNIFORM, SIZE_LOG } size_dist = SIZE_LOG;
+static size_t size_min = 1024, size_max = 65536;
+static int rcpt_min = 1, rcpt_max = 1;
+static char ** users, ** passwords;
+static int user_count;
+
+static struct addrinfo * addr_smtp, * addr_pop3;
+
+// a header and enough body lines for the largest message
+static char * body;
+static size_t body_header;
+
+// work left for the current phase
+static long messages_left;
+static int users_left;
+
+// totals
+static unsigned long long smtp_bytes, pop3_bytes;
+static unsigned long smtp_rcpts, pop3_msgs, connect_errors;
+
+static double now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// xorshift64, seeded so runs are repeatable
+static unsigned long long rng_state = 88172645463325252ULL;
+static unsigned long long rng()
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static double rng_unit()
+{
+	return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void record(enum command cmd, double us, int ok)
+{
+	struct timing * t = &timings[cmd];
+
+	if (! ok)
+		t->errors ++;
+
+	if (t->len == t->max) {
+		size_t new_max = t->max * 2 + 1024;
+		double * new_us = realloc(t->us, new_max * sizeof(double));
+
+		if (new_us == NULL) {
+			perror("realloc(timings)");
+			return;
+		}
+		t->us = new_us;
+		t->max = new_max;
+	}
+
+	t->us[t->len ++] = us;
+}
+
+// pick the size of the next message body
+static size_t message_size()
+{
+	switch (size_dist) {
+	case SIZE_UNIFORM:
+		return size_min + rng() % (size_max - size_min + 1);
+	case SIZE_LOG:
+		return exp(log(size_min) + rng_unit() * (log(size_max) - log(size_min)));
+	default:
+		return size_min;
+	}
+}
+
+// parse "123", "64k" or "1M"
+static size_t parse_size(const char * s, char ** end)
+{
+	size_t n = strtoul(s, end, 10);
+
+	if (**end == 'k' || **end == 'K') {
+		n *= 1024;
+		(*end) ++;
+	} else if (**end == 'm' || **end == 'M') {
+		n *= 1024 * 1024;
+		(*end) ++;
+	}
+
+	return n;
+}
+
+// parse [fixed:|uniform:|log:]min[-max]
+static int parse_sizes(const char * arg)
+{
+	const char * colon = strchr(arg, ':');
+
+	if (colon != NULL) {
+		if (strncmp(arg, "fixed:", 6) == 0) size_dist = SIZE_FIXED;
+		else if (strncmp(arg, "uniform:", 8) == 0) size_dist = SIZE_UNIFORM;
+		else if (strncmp(arg, "log:", 4) == 0) size_dist = SIZE_LOG;
+		else return -1;
+		arg = colon + 1;
+	}
+
+	char * end;
+	size_min = size_max = parse_size(arg, &end);
+	if (*end == '-')
+		size_max = parse_size(end + 1, &end);
+	else if (colon == NULL)
+		size_dist = SIZE_FIXED;
+
+	return (*end != '\0' || size_min == 0 || size_max < size_min) ? -1 : 0;
+}
+
+// parse min[-max]
+static int parse_range(const char * arg, int * min, int * max)
+{
+	char * end;
+	*min = *max = strtol(arg, &end, 10);
+	if (*end == '-')
+		*max = strtol(end + 1, &end, 10);
+
+	return (*end != '\0' || *min < 1 || *max < *min) ? -1 : 0;
+}
+
+// parse user:pass[,user:pass...]
+static int parse_users(char * arg)
+{
+	for (char * p = strtok(arg, ","); p != NULL; p = strtok(NULL, ",")) {
+		char * colon = strchr(p, ':');
+		if (colon == NULL)
+			return -1;
+		*colon = '\0';
+
+		users = realloc(users, (user_count + 1) * sizeof(char *));
+		passwords = realloc(passwords, (user_count + 1) * sizeof(char *));
+		if (users == NULL || passwords == NULL) {
+			perror("realloc(users)");
+			return -1;
+		}
+
+		users[user_count] = p;
+		passwords[user_count] = colon + 1;
+		user_count ++;
+	}
+
+	return user_count ? 0 : -1;
+}
+
+static struct addrinfo * resolve(const char * port)
+{
+	const struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_NUMERICSERV
+	};
+	struct addrinfo * ai;
+	int rv = getaddrinfo(host, port, &hints, &ai);
+
+	if (rv != 0) {
+		fprintf(stderr, "getaddrinfo(%s:%s) (%d): %s\n", host, port, rv, gai_strerror(rv));
+		return NULL;
+	}
+
+	return ai;
+}
+
+// queue a command, timing it from when it is queued
+static void send_cmd(struct session * s, enum command cmd, const char * fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(s->cmd_buf, sizeof s->cmd_buf, fmt, ap);
+	va_end(ap);
+
+	s->out[0] = s->cmd_buf;
+	s->out_len[0] = len;
+	s->out_len[1] = 0;
+	s->cmd = cmd;
+	s->sent = now_us();
+}
+
+// queue the next message: headers, body lines and the terminator
+static void send_body(struct session * s)
+{
+	size_t size = message_size();
+
+	// whole lines only
+	size = body_header + (size + BODY_LINE - 1) / BODY_LINE * BODY_LINE;
+
+	s->out[0] = body;
+	s->out_len[0] = size;
+	s->out[1] = ".\r\n";
+	s->out_len[1] = 3;
+	s->cmd = SMTP_BODY;
+	s->sent = now_us();
+
+	smtp_bytes += size;
+}
+
+// start a new connection, returns -1 on failure
+static int session_open(struct session * s, int smtp)
+{
+	const struct addrinfo * ai = smtp ? addr_smtp : addr_pop3;
+
+	memset(s, 0, sizeof(struct session));
+	s->smtp = smtp;
+	s->cmd = smtp ? SMTP_CONNECT : POP3_CONNECT;
+	s->sent = now_us();
+
+	s->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK, ai->ai_protocol);
+	if (s->fd == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	if (connect(s->fd, ai->ai_addr, ai->ai_addrlen) == -1 && errno != EINPROGRESS) {
+		perror("connect");
+		close(s->fd);
+		s->fd = -1;
+		return -1;
+	}
+
+	s->connecting = 1;
+	if (! smtp)
+		s->user = -- users_left;
+
+	return 0;
+}
+
+static void session_close(struct session * s)
+{
+	close(s->fd);
+	s->fd = -1;
+}
+
+// next SMTP step after a reply with the given code
+static int smtp_next(struct session * s, int code)
+{
+	const enum command cmd = s->cmd;
+	int ok;
+
+	switch (cmd) {
+	case SMTP_CONNECT: ok = (code == 220); break;
+	case SMTP_DATA: ok = (code == 354); break;
+	case SMTP_QUIT: ok = (code == 221); break;
+	default: ok = (code == 250); break;
+	}
+
+	record(cmd, now_us() - s->sent, ok);
+
+	if (! ok) {
+		if (cmd == SMTP_QUIT)
+			return -1;
+		send_cmd(s, SMTP_QUIT, "QUIT\r\n");
+		return 0;
+	}
+
+	switch (cmd) {
+	case SMTP_CONNECT:
+		send_cmd(s, SMTP_HELO, "HELO bench\r\n");
+		break;
+
+	case SMTP_HELO:
+	case SMTP_BODY:
+		if (messages_left == 0) {
+			send_cmd(s, SMTP_QUIT, "QUIT\r\n");
+			break;
+		}
+		messages_left --;
+
+		// recipients are distinct, starting from a random mailbox
+		s->rcpt_left = rcpt_min + rng() % (rcpt_max - rcpt_min + 1);
+		if (s->rcpt_left > user_count)
+			s->rcpt_left = user_count;
+		s->rcpt_next = rng() % user_count;
+		send_cmd(s, SMTP_MAIL, "MAIL FROM:<%s@localhost>\r\n", users[0]);
+		break;
+
+	case SMTP_MAIL:
+	case SMTP_RCPT:
+		if (s->rcpt_left == 0) {
+			send_cmd(s, SMTP_DATA, "DATA\r\n");
+			break;
+		}
+		s->rcpt_left --;
+		smtp_rcpts ++;
+		send_cmd(s, SMTP_RCPT, "RCPT TO:<%s@localhost>\r\n", users[s->rcpt_next]);
+		s->rcpt_next = (s->rcpt_next + 1) % user_count;
+		break;
+
+	case SMTP_DATA:
+		send_body(s);
+		break;
+
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+// next POP3 step after a reply
+static int pop3_next(struct session * s, int ok)
+{
+	const enum command cmd = s->cmd;
+	record(cmd, now_us() - s->sent, ok);
+
+	if (! ok) {
+		if (cmd == POP3_QUIT)
+			return -1;
+		send_cmd(s, POP3_QUIT, "QUIT\r\n");
+		return 0;
+	}
+
+	switch (cmd) {
+	case POP3_CONNECT:
+		send_cmd(s, POP3_USER, "USER %s\r\n", users[s->user]);
+		break;
+
+	case POP3_USER:
+		send_cmd(s, POP3_PASS, "PASS %s\r\n", passwords[s->user]);
+		break;
+
+	case POP3_PASS:
+		send_cmd(s, POP3_LIST, "LIST\r\n");
+		break;
+
+	case POP3_LIST:
+		// the count includes the terminating line
+		s->msgs = s->lines - 1;
+		s->next = 0;
+		// fall through
+	case POP3_RETR:
+		if (cmd == POP3_RETR)
+			pop3_msgs ++;
+		if (s->next < s->msgs) {
+			send_cmd(s, POP3_RETR, "RETR %lu\r\n", ++ s->next);
+			break;
+		}
+		s->next = 0;
+		// fall through
+	case POP3_DELE:
+		if (s->next < s->msgs)
+			send_cmd(s, POP3_DELE, "DELE %lu\r\n", ++ s->next);
+		else
+			send_cmd(s, POP3_QUIT, "QUIT\r\n");
+		break;
+
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+// handle received bytes, returns -1 when the session is over
+static int session_input(struct session * s, const char * buf, size_t len)
+{
+	for (size_t i = 0; i < len; i ++) {
+		const char c = buf[i];
+
+		if (s->multi) {
+			if (s->cmd == POP3_RETR)
+				pop3_bytes ++;
+			if (c == '\n')
+				s->lines ++;
+
+			// look for "\r\n.\r\n"
+			if (c == "\r\n.\r\n"[s->match])
+				s->match ++;
+			else
+				s->match = (c == '\r');
+
+			if (s->match == 5) {
+				s->multi = 0;
+				if (pop3_next(s, 1) == -1)
+					return -1;
+			}
+			continue;
+		}
+
+		if (s->line_len < REPLY_MAX - 1)
+			s->line[s->line_len ++] = c;
+		if (c != '\n')
+			continue;
+
+		s->line[s->line_len] = '\0';
+		s->line_len = 0;
+
+		if (s->smtp) {
+			// "250-" continues a multi-line reply
+			if (s->line[3] == '-')
+				continue;
+			if (smtp_next(s, atoi(s->line)) == -1)
+				return -1;
+		} else {
+			const int ok = (strncmp(s->line, "+OK", 3) == 0);
+
+			if (ok && (s->cmd == POP3_LIST || s->cmd == POP3_RETR)) {
+				// the status line's CRLF may already start the terminator
+				s->multi = 1;
+				s->match = 2;
+				s->lines = 0;
+			} else if (pop3_next(s, ok) == -1)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+// send as much queued output as the socket takes
+static int session_output(struct session * s)
+{
+	for (int i = 0; i < 2; i ++) {
+		while (s->out_len[i] > 0) {
+			ssize_t n = send(s->fd, s->out[i], s->out_len[i], MSG_NOSIGNAL);
+
+			if (n == -1)
+				return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+			s->out[i] += n;
+			s->out_len[i] -= n;
+		}
+	}
+
+	return 0;
+}
+
+// run sessions until there is no work left
+static void run_phase(int smtp, int concurrency)
+{
+	struct session * sessions = calloc(concurrency, sizeof(struct session));
+	struct pollfd * fds = calloc(concurrency, sizeof(struct pollfd));
+
+	if (sessions == NULL || fds == NULL) {
+		perror("calloc(sessions)");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < concurrency; i ++)
+		sessions[i].fd = -1;
+
+	for (;;) {
+		int active = 0;
+
+		for (int i = 0; i < concurrency; i ++) {
+			struct session * s = &sessions[i];
+
+			// replace finished sessions while there is work
+			if (s->fd == -1 && (smtp ? messages_left > 0 : users_left > 0) && session_open(s, smtp) == -1) {
+				connect_errors ++;
+				// stop trying if the server is gone
+				if (connect_errors > 100) {
+					fputs("Too many connection errors, giving up.\n", stderr);
+					messages_left = users_left = 0;
+				}
+			}
+
+			fds[i].fd = s->fd;
+			fds[i].events = POLLIN | ((s->connecting || s->out_len[0] || s->out_len[1]) ? POLLOUT : 0);
+			active += (s->fd != -1);
+		}
+
+		if (active == 0)
+			break;
+
+		if (poll(fds, concurrency, -1) == -1) {
+			if (errno != EINTR) {
+				perror("poll");
+				exit(EXIT_FAILURE);
+			}
+			continue;
+		}
+
+		for (int i = 0; i < concurrency; i ++) {
+			struct session * s = &sessions[i];
+			int failed = 0;
+
+			if (s->fd == -1 || fds[i].revents == 0)
+				continue;
+
+			if (s->connecting && (fds[i].revents & (POLLOUT | POLLERR | POLLHUP))) {
+				int err = 0;
+				socklen_t err_len = sizeof err;
+				getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+
+				if (err != 0) {
+					fprintf(stderr, "connect: %s\n", strerror(err));
+					connect_errors ++;
+					record(s->cmd, now_us() - s->sent, 0);
+					session_close(s);
+					continue;
+				}
+				s->connecting = 0;
+			}
+
+			if (fds[i].revents & POLLOUT)
+				failed = (session_output(s) == -1);
+
+			if (! failed && (fds[i].revents & (POLLIN | POLLERR | POLLHUP))) {
+				char buf[65536];
+				ssize_t n = recv(s->fd, buf, sizeof buf, 0);
+
+				if (n > 0)
+					failed = (session_input(s, buf, n) == -1);
+				else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+					// closed without a reply to the last command
+					if (s->cmd != CMD_NONE)
+						record(s->cmd, now_us() - s->sent, 0);
+					failed = 1;
+				}
+			}
+
+			// output queued by a reply goes out right away
+			if (! failed && (s->out_len[0] || s->out_len[1]))
+				failed = (session_output(s) == -1);
+
+			if (failed)
+				session_close(s);
+		}
+	}
+
+	free(fds);
+	free(sessions);
+}
+
+static int compare_double(const void * a, const void * b)
+{
+	const double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(const struct timing * t, double p)
+{
+	size_t i = ceil(p * t->len);
+	return t->us[i ? i - 1 : 0];
+}
+
+static void report(int first, int last)
+{
+	printf("%-14s %9s %7s %10s %10s %10s\n", "command", "count", "errors", "p50 us", "p99 us", "p999 us");
+
+	for (int i = first; i <= last; i ++) {
+		struct timing * t = &timings[i];
+
+		if (t->len == 0)
+			continue;
+
+		qsort(t->us, t->len, sizeof(double), compare_double);
+		printf("%-14s %9zu %7lu %10.1f %10.1f %10.1f\n", t->name, t->len, t->errors,
+			percentile(t, 0.5), percentile(t, 0.99), percentile(t, 0.999));
+	}
+}
+
+int main(int argc, char * argv[])
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "H:s:p:c:P:n:m:r:u:")) != -1)
+		switch (c) {
+		case 'H': host = optarg; break;
+		case 's': port_smtp = optarg; break;
+		case 'p': port_pop3 = optarg; break;
+		case 'c': smtp_sessions = atoi(optarg); break;
+		case 'P': pop3_sessions = atoi(optarg); break;
+		case 'n': messages = atol(optarg); break;
+
+		case 'm':
+			if (parse_sizes(optarg) == -1) {
+				fprintf(stderr, "Bad message size `%s'.\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+
+		case 'r':
+			if (parse_range(optarg, &rcpt_min, &rcpt_max) == -1) {
+				fprintf(stderr, "Bad recipient count `%s'.\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+
+		case 'u':
+			if (parse_users(optarg) == -1) {
+				fprintf(stderr, "Bad user list `%s'.\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+
+		default:
+			return EXIT_FAILURE;
+		}
+
+	if (optind != argc || user_count == 0 || smtp_sessions < 1 || pop3_sessions < 1 || messages < 0) {
+		printf("Usage: bridgemail-bench -u user:pass[,user:pass...] [-H host] [-s smtp_port] [-p pop3_port]\n"
+			"       [-c smtp_sessions] [-P pop3_sessions] [-n messages]\n"
+			"       [-m [fixed:|uniform:|log:]min[-max]] [-r min[-max] recipients]\n");
+		return EXIT_FAILURE;
+	}
+
+	// thousands of sessions need thousands of descriptors
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	addr_smtp = resolve(port_smtp);
+	addr_pop3 = resolve(port_pop3);
+	if (addr_smtp == NULL || addr_pop3 == NULL)
+		return EXIT_FAILURE;
+
+	// a short header, then lines of "xxx...x\r\n"
+	static const char header[] = "Subject: bridgemail-bench\r\n\r\n";
+	body_header = sizeof header - 1;
+	const size_t body_len = body_header + size_max + BODY_LINE;
+	body = malloc(body_len);
+	if (body == NULL) {
+		perror("malloc(body)");
+		return EXIT_FAILURE;
+	}
+	memcpy(body, header, body_header);
+	for (size_t i = body_header; i < body_len; i ++)
+		body[i] = ((i - body_header) % BODY_LINE == BODY_LINE - 2) ? '\r' :
+			((i - body_header) % BODY_LINE == BODY_LINE - 1) ? '\n' : 'a' + (i % 26);
+
+	printf("SMTP: %ld messages, %d sessions, %zu-%zu bytes, %d-%d recipients\n",
+		messages, smtp_sessions, size_min, size_max, rcpt_min, rcpt_max);
+
+	messages_left = messages;
+	double start = now_us();
+	run_phase(1, smtp_sessions < messages ? smtp_sessions : (messages ? (int)messages : 1));
+	double elapsed = (now_us() - start) / 1e6;
+
+	const unsigned long delivered = timings[SMTP_BODY].len - timings[SMTP_BODY].errors;
+	printf("SMTP: %lu messages (%llu bytes, %lu recipients) in %.2f s: %.1f msg/s, %.2f MB/s\n",
+		delivered, smtp_bytes, smtp_rcpts, elapsed, delivered / elapsed, smtp_bytes / elapsed / 1e6);
+	report(SMTP_CONNECT, SMTP_QUIT);
+
+	users_left = user_count;
+	start = now_us();
+	run_phase(0, pop3_sessions < user_count ? pop3_sessions : user_count);
+	elapsed = (now_us() - start) / 1e6;
+
+	printf("\nPOP3: %lu messages (%llu bytes) retrieved in %.2f s: %.1f msg/s, %.2f MB/s\n",
+		pop3_msgs, pop3_bytes, elapsed, pop3_msgs / elapsed, pop3_bytes / elapsed / 1e6);
+	report(POP3_CONNECT, POP3_QUIT);
+
+	if (connect_errors)
+		printf("\n%lu connection errors\n", connect_errors);
+
+	freeaddrinfo(addr_smtp);
+	freeaddrinfo(addr_pop3);
+	free(body);
+	free(users);
+	free(passwords);
+	for (int i = 0; i < CMD_COUNT; i ++)
+		free(timings[i].us);
+
+	return 0;
+}
@@ -0,0 +1,185 @@
+#include "cache.h"
+
+#include <stdlib.h>
+
+// hash buckets, a power of two
+#define CACHE_BUCKETS 4096
+
+// Byte-bounded LRU cache of message bodies, keyed by message.id.
+//  The cache holds one reference to each entry it contains, and each
+//  open RETR holds another, so an entry that is evicted or invalidated
+//  while being sent is only freed when the last reader lets go.
+static struct cache_entry ** buckets;
+static struct cache_entry * lru_head, * lru_tail;
+
+// bodies bigger than this are never cached, so one huge message can't flush everything
+static size_t max_bytes, max_entry;
+static size_t used_bytes;
+
+// counters for cache_report()
+static unsigned long hits, misses, evictions, invalidations;
+
+static struct cache_entry ** bucket(long long id)
+{
+	return &buckets[(unsigned long long)id & (CACHE_BUCKETS - 1)];
+}
+
+static struct cache_entry * find(long long id)
+{
+	struct cache_entry * e = *bucket(id);
+	while (e != NULL && e->id != id)
+		e = e->chain;
+	return e;
+}
+
+// take an entry out of the table and LRU list, dropping the cache's reference
+static void unlink_entry(struct cache_entry * e)
+{
+	struct cache_entry ** p = bucket(e->id);
+	while (*p != e)
+		p = &(*p)->chain;
+	*p = e->chain;
+
+	if (e->prev) e->prev->next = e->next; else lru_head = e->next;
+	if (e->next) e->next->prev = e->prev; else lru_tail = e->prev;
+
+	used_bytes -= e->len;
+	cache_release(e);
+}
+
+// max_bytes of 0 turns the cache off
+int cache_setup(size_t bytes)
+{
+	max_bytes = bytes;
+	max_entry = bytes / 4;
+
+	if (max_bytes == 0)
+		return 0;
+
+	buckets = calloc(CACHE_BUCKETS, sizeof(struct cache_entry *));
+
+	if (buckets == NULL) {
+		perror("calloc(cache)");
+		return -1;
+	}
+
+	return 0;
+}
+
+void cache_teardown()
+{
+	while (lru_head != NULL)
+		unlink_entry(lru_head);
+
+	free(buckets);
+	buckets = NULL;
+	max_bytes = 0;
+}
+
+// Look up a body, taking a reference to it
+//  returns NULL on a miss
+struct cache_entry * cache_get(long long id)
+{
+	if (max_bytes == 0)
+		return NULL;
+
+	struct cache_entry * e = find(id);
+
+	if (e == NULL) {
+		misses ++;
+		return NULL;
+	}
+
+	hits ++;
+
+	// move to the front of the LRU list
+	if (e != lru_head) {
+		e->prev->next = e->next;
+		if (e->next) e->next->prev = e->prev; else lru_tail = e->prev;
+		e->prev = NULL;
+		e->next = lru_head;
+		lru_head->prev = e;
+		lru_head = e;
+	}
+
+	e->refs ++;
+	return e;
+}
+
+// Make an entry for the caller to fill in before cache_insert()
+//  the caller holds the only reference, returns NULL if the body should not be cached
+struct cache_entry * cache_alloc(long long id, size_t len)
+{
+	if (max_bytes == 0 || len > max_entry)
+		return NULL;
+
+	struct cache_entry * e = malloc(sizeof(struct cache_entry) + len);
+
+	if (e == NULL) {
+		perror("malloc(struct cache_entry)");
+		return NULL;
+	}
+
+	e->id = id;
+	e->refs = 1;
+	e->len = len;
+	e->prev = e->next = e->chain = NULL;
+	return e;
+}
+
+// Add a filled-in entry, evicting the least recently used to make room
+//  the caller keeps its reference
+void cache_insert(struct cache_entry * e)
+{
+	// someone else may have loaded it in the meantime
+	struct cache_entry * old = find(e->id);
+	if (old != NULL)
+		unlink_entry(old);
+
+	while (used_bytes + e->len > max_bytes && lru_tail != NULL) {
+		evictions ++;
+		unlink_entry(lru_tail);
+	}
+
+	struct cache_entry ** b = bucket(e->id);
+	e->chain = *b;
+	*b = e;
+
+	e->prev = NULL;
+	e->next = lru_head;
+	if (lru_head) lru_head->prev = e; else lru_tail = e;
+	lru_head = e;
+
+	used_bytes += e->len;
+	e->refs ++;
+}
+
+void cache_release(struct cache_entry * e)
+{
+	e->refs --;
+	if (e->refs == 0)
+		free(e);
+}
+
+// Drop a body that no longer exists
+void cache_invalidate(long long id)
+{
+	if (max_bytes == 0)
+		return;
+
+	struct cache_entry * e = find(id);
+
+	if (e != NULL) {
+		invalidations ++;
+		unlink_entry(e);
+	}
+}
+
+void cache_report(FILE * out)
+{
+	if (max_bytes == 0)
+		return;
+
+	fprintf(out, " . Message cache: %zu of %zu bytes, %lu hits, %lu misses, %lu evictions, %lu invalidations\n",
+		used_bytes, max_bytes, hits, misses, evictions, invalidations);
+}
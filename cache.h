@@ -0,0 +1,33 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <stdio.h>
+#include <stddef.h>
+
+// A cached message body, shared by reference between POP3 sessions
+//  contents are exactly what RETR sends (already dot-stuffed)
+struct cache_entry {
+	long long id;
+	unsigned int refs;
+	size_t len;
+
+	// LRU list, most recent at the head
+	struct cache_entry * prev, * next;
+	// hash chain
+	struct cache_entry * chain;
+
+	char data[];
+};
+
+int cache_setup(size_t max_bytes);
+void cache_teardown();
+
+struct cache_entry * cache_get(long long id);
+struct cache_entry * cache_alloc(long long id, size_t len);
+void cache_insert(struct cache_entry * e);
+void cache_release(struct cache_entry * e);
+void cache_invalidate(long long id);
+
+void cache_report(FILE * out);
+
+#endif
@@ -0,0 +1,109 @@
+#include "command.h"
+#include "transport.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+// Commands are looked up by their verb, case-folded and packed into a
+//  64-bit word ("QUIT" -> 0x5155495400000000, "TOP" -> 0x544F500000000000),
+//  in a small open-addressed hash table.  Longer verbs share the word of
+//  their first 8 letters, and are told apart by the rest of them.
+static uint64_t verb_word(const char * verb, size_t len)
+{
+	uint64_t word = 0;
+	for (size_t i = 0; i < 8; i ++)
+		word = (word << 8) | (i < len ? (unsigned char)toupper((unsigned char)verb[i]) : 0);
+
+	return word;
+}
+
+static unsigned int slot(uint64_t word)
+{
+	// Fibonacci hashing down to log2(COMMAND_SLOTS) bits
+	return (word * 11400714819323198485u) >> 58;
+}
+
+// Build the lookup table
+int command_table_init(struct command_table * table)
+{
+	memset(table->words, 0, sizeof(table->words));
+	memset(table->slots, 0, sizeof(table->slots));
+
+	for (unsigned int i = 0; i < table->len; i ++) {
+		const struct command * c = &table->commands[i];
+		const uint64_t word = verb_word(c->verb, strlen(c->verb));
+
+		if (word == 0 || table->len > COMMAND_SLOTS / 2) {
+			fprintf(stderr, "Bad command table entry `%s'.\n", c->verb);
+			return -1;
+		}
+
+		unsigned int j = slot(word);
+		while (table->slots[j] != NULL)
+			j = (j + 1) & (COMMAND_SLOTS - 1);
+
+		table->words[j] = word;
+		table->slots[j] = c;
+	}
+
+	return 0;
+}
+
+static const struct command * lookup(const struct command_table * table, const char * verb, size_t len)
+{
+	const uint64_t word = verb_word(verb, len);
+
+	for (unsigned int j = slot(word); table->slots[j] != NULL; j = (j + 1) & (COMMAND_SLOTS - 1)) {
+		const struct command * c = table->slots[j];
+
+		// the word holds the first 8 letters, so check any beyond them
+		//  and that the verb ends where the command does
+		if (table->words[j] == word && (len <= 8 || strncasecmp(c->verb + 8, verb + 8, len - 8) == 0) && c->verb[len] == '\0')
+			return c;
+	}
+
+	return NULL;
+}
+
+// Split a command line (CRLF already removed) into verb and argument,
+//  check it against the table and run its handler
+//  returns the handler's result, or the result of sending a rejection
+int command_dispatch(const struct command_table * table, void * session, unsigned int state, char * line, struct transport * t)
+{
+	// verb ends at the first space, the argument is the rest of the line
+	size_t verb_len = 0;
+	while (line[verb_len] != '\0' && line[verb_len] != ' ')
+		verb_len ++;
+
+	char * arg = line + verb_len;
+	while (*arg == ' ')
+		arg ++;
+	if (*arg == '\0')
+		arg = NULL;
+	line[verb_len] = '\0';
+
+	const struct command * c = lookup(table, line, verb_len);
+	const char * reject = NULL;
+
+	if (c == NULL)
+		reject = table->unknown;
+	else if ((c->args == ARGS_NONE && arg != NULL) || (c->args == ARGS_REQUIRED && arg == NULL))
+		reject = table->bad_args;
+	else if (! (c->states & (1u << state)))
+		reject = table->bad_state;
+
+	if (reject != NULL) {
+		puts(reject);
+		if (table->reject != NULL)
+			return table->reject(session, reject, t);
+		if (transport_puts(t, reject) == -1) {
+			perror("send(reject)");
+			return -1;
+		}
+		return 0;
+	}
+
+	return c->handler(session, arg, t);
+}
@@ -0,0 +1,47 @@
+#ifndef COMMAND_H_
+#define COMMAND_H_
+
+#include <stdint.h>
+
+struct transport;
+
+// hash slots in a command table, a power of two well above the command count
+#define COMMAND_SLOTS 64
+
+// what a command accepts after the verb
+enum command_args {
+	ARGS_NONE,
+	ARGS_REQUIRED,
+	ARGS_OPTIONAL
+};
+
+// One protocol command
+//  states is a mask of (1 << state) the command is accepted in,
+//  handler returns -1 to close the connection
+struct command {
+	const char * verb;
+	unsigned int states;
+	enum command_args args;
+	int (*handler)(void * session, char * arg, struct transport * t);
+};
+
+// All the commands of a protocol, and its replies for rejected ones
+struct command_table {
+	const struct command * commands;
+	unsigned int len;
+	const char * unknown;
+	const char * bad_args;
+	const char * bad_state;
+	// sends one of those replies, for protocols that have to add to
+	//  them (may be NULL, to send them as they are)
+	int (*reject)(void * session, const char * reply, struct transport * t);
+
+	// filled in by command_table_init()
+	uint64_t words[COMMAND_SLOTS];
+	const struct command * slots[COMMAND_SLOTS];
+};
+
+int command_table_init(struct command_table * table);
+int command_dispatch(const struct command_table * table, void * session, unsigned int state, char * line, struct transport * t);
+
+#endif
@@ -0,0 +1,1628 @@
+#include "imap.h"
+#include "storage.h"
+#include "transport.h"
+#include "command.h"
+#include "throttle.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <time.h>
+
+// IMAP4rev1 (RFC 3501), as much of it as a client needs to keep an INBOX
+//  in sync, and IDLE (RFC 2177), so it can hold one quiet connection
+//  open and hear about new mail instead of polling for it.
+//  Every account has just the one mailbox, INBOX.  BridgeMail keeps no
+//  flags, so \Seen and the rest last only as long as the session
+//  (PERMANENTFLAGS is empty, which tells clients to remember them
+//  themselves), but EXPUNGE does remove messages marked \Deleted.
+//  A message's UID is its id in the database.
+
+// longest command line, literals included (RFC 7162 3.2.1)
+#define LINE_MAX 8192
+#define TAG_MAX 64
+
+// data items one FETCH may ask for
+#define FETCH_ITEMS_MAX 32
+// criteria one SEARCH may combine
+#define SEARCH_KEYS_MAX 16
+
+// idle sessions, found by mailbox from a chained hash table
+#define IDLE_BUCKETS 1024
+
+// a message's arrival time is its delivery, in UTC (RFC 3501 date-time)
+#define INTERNALDATE_FORMAT "\"%e-%b-%Y %H:%M:%S +0000\""
+#define INTERNALDATE_MAX sizeof "\"01-Jan-1970 00:00:00 +0000\""
+
+// UIDs are 32 bits, and the ids of one mailbox's messages (all in the
+//  same database file) only differ in the low ones
+// ids are never reused since schema version 8, UIDs handed out before
+//  that may have been, so clients had to forget them
+#define UID(id) ((unsigned long)((id) & 0xFFFFFFFF))
+#define UIDVALIDITY 2
+
+// per message flags, for this session
+#define FLAG_SEEN 0x01
+#define FLAG_ANSWERED 0x02
+#define FLAG_FLAGGED 0x04
+#define FLAG_DELETED 0x08
+#define FLAG_DRAFT 0x10
+// gone from the maildrop, while refresh() works out what changed
+#define FLAG_GONE 0x40
+// size has been corrected for dot-stuffing, see load()
+#define FLAG_SIZED 0x80
+
+static const struct {
+	const char * name;
+	unsigned char flag;
+} flag_names[] = {
+	{ "\\Answered", FLAG_ANSWERED },
+	{ "\\Flagged", FLAG_FLAGGED },
+	{ "\\Deleted", FLAG_DELETED },
+	{ "\\Seen", FLAG_SEEN },
+	{ "\\Draft", FLAG_DRAFT }
+};
+
+// Structure containing all state for an imap connection
+struct imap {
+	enum {
+		INIT,
+		AUTH,
+		SELECTED
+	} state;
+
+	// where updates go while the session is idle
+	struct transport * t;
+
+	// grows as needed, up to LINE_MAX
+	char * line;
+	size_t line_len;
+	size_t line_cap;
+	int line_overflow;
+	// bytes of a literal still to come, and where the last one ended
+	size_t literal;
+	size_t literal_end;
+
+	// of the command being answered
+	char tag[TAG_MAX + 1];
+
+	char username[41];
+
+	// the client's address, and a LOGIN held back by the throttle until
+	//  wake_ms (with username), with the input that came after it
+	char peer[THROTTLE_ADDR_MAX];
+	char password[41];
+	long wake_ms;
+	int check;
+	char * held;
+	int held_len;
+
+	// STARTTLS was accepted, everything since is encrypted
+	int tls;
+
+	// the selected INBOX, its flags, and whether it came from EXAMINE
+	struct storage_msg * store;
+	unsigned char * flags;
+	size_t store_len;
+	int read_only;
+
+	// message being sent by FETCH, without dot-stuffing, and the
+	//  HEADER.FIELDS picked out of it
+	char * body;
+	size_t body_len;
+	size_t body_cap;
+	char * part;
+
+	// in IDLE, and in the chain of sessions idle on the same mailbox
+	int idle;
+	struct imap * idle_next;
+	struct imap ** idle_prev;
+};
+
+static struct imap * idlers[IDLE_BUCKETS];
+
+// for the report
+static int enabled;
+static unsigned long idle_count, updates;
+
+// defined below, with the command handlers
+static struct command_table imap_commands;
+
+static void imap_changed(const char * mailbox);
+
+int imap_setup()
+{
+	if (command_table_init(&imap_commands) == -1)
+		return -1;
+
+	storage_watch(imap_changed);
+	enabled = 1;
+	return 0;
+}
+
+void imap_teardown()
+{
+	storage_watch(NULL);
+	enabled = 0;
+}
+
+void imap_report(FILE * out)
+{
+	if (enabled)
+		fprintf(out, " . IMAP: %lu sessions idle, %lu mailbox updates pushed\n", idle_count, updates);
+}
+
+// Turn a new connection away, when there are too many already
+//  (RFC 3501 7.1.5 allows BYE as the greeting)
+static int bye(struct transport * t, const char * bye)
+{
+	fputs(bye, stdout);
+	if (transport_puts(t, bye) == -1) {
+		perror("send(BYE)");
+		return -1;
+	}
+
+	return 0;
+}
+
+int imap_refuse(struct transport * t)
+{
+	return bye(t, "* BYE [UNAVAILABLE] Too many connections, try again later\r\n");
+}
+
+// The server is being replaced, the client is to reconnect to the new one
+//  (a session is closed between commands, so this may come at any time)
+int imap_restart(struct transport * t)
+{
+	return bye(t, "* BYE [UNAVAILABLE] Server restarting, reconnect\r\n");
+}
+
+struct imap * imap_init(struct transport * t, const char * peer)
+{
+	if (transport_puts(t, "* OK IMAP4rev1 server ready\r\n") == -1 || transport_flush(t) == -1) {
+		perror("send");
+		return NULL;
+	}
+
+	// Allocate state-struct for this connection and set it up
+	struct imap * s = calloc(1, sizeof(struct imap));
+
+	if (s == NULL) {
+		perror("malloc(struct imap)");
+		return NULL;
+	}
+
+	s->state = INIT;
+	s->t = t;
+	if (peer != NULL)
+		snprintf(s->peer, sizeof s->peer, "%s", peer);
+	return s;
+}
+
+// Send a response, formatted like printf(), and log it
+static int respond(struct imap * s, const char * format, ...)
+{
+	char response[256 + TAG_MAX];
+	va_list ap;
+
+	va_start(ap, format);
+	int len = vsnprintf(response, sizeof response, format, ap);
+	va_end(ap);
+
+	if (len >= (int)sizeof response)
+		len = sizeof response - 1;
+
+	fputs(response, stdout);
+	if (len < 0 || transport_write(s->t, response, len) == -1) {
+		perror("send");
+		return -1;
+	}
+	return 0;
+}
+
+// the tagged reply that completes a command
+static int tagged(struct imap * s, const char * text)
+{
+	return respond(s, "%s %s\r\n", s->tag, text);
+}
+
+// Part of a longer reply, not logged
+static int emit(struct imap * s, const char * format, ...)
+{
+	char buf[128];
+	va_list ap;
+
+	va_start(ap, format);
+	const int len = vsnprintf(buf, sizeof buf, format, ap);
+	va_end(ap);
+
+	if (len < 0 || len >= (int)sizeof buf || transport_write(s->t, buf, len) == -1) {
+		perror("send");
+		return -1;
+	}
+	return 0;
+}
+
+// the command table's rejections, which it has logged already
+static int imap_reject(void * session, const char * reply, struct transport * t)
+{
+	struct imap * s = session;
+
+	if (transport_puts(t, s->tag) == -1 || transport_puts(t, " ") == -1 || transport_puts(t, reply) == -1) {
+		perror("send(reject)");
+		return -1;
+	}
+	return 0;
+}
+
+// "(\Seen \Deleted)"
+static void flag_list(unsigned char flags, char * out)
+{
+	strcpy(out, "(");
+	for (size_t i = 0; i < sizeof(flag_names) / sizeof(flag_names[0]); i ++)
+		if (flags & flag_names[i].flag) {
+			if (out[1] != '\0')
+				strcat(out, " ");
+			strcat(out, flag_names[i].name);
+		}
+	strcat(out, ")");
+}
+
+// Parsing
+//  arguments are taken from the command line in place, each one
+//  NUL-terminated as it is found
+// Take the next astring: an atom, "quoted" or {n} literal
+//  NULL if there is none, or it is malformed
+static char * next_string(char ** p)
+{
+	char * s = *p, * start, * end;
+
+	if (*s == '"') {
+		start = end = ++ s;
+		while (*s != '"') {
+			if (*s == '\0')
+				return NULL;
+			if (*s == '\\' && (s[1] == '"' || s[1] == '\\'))
+				s ++;
+			*end ++ = *s ++;
+		}
+		s ++;
+	} else if (*s == '{') {
+		char * e;
+		const unsigned long n = strtoul(s + 1, &e, 10);
+
+		if (e == s + 1 || strncmp(e, "}\r\n", 3) != 0 || strlen(e + 3) < n)
+			return NULL;
+		start = e + 3;
+		end = s = start + n;
+	} else {
+		start = s;
+		while (*s != '\0' && *s != ' ')
+			s ++;
+		if (s == start)
+			return NULL;
+		end = s;
+	}
+
+	if (*s != '\0' && *s != ' ')
+		return NULL;
+
+	*p = (*s == ' ') ? s + 1 : s;
+	*end = '\0';
+	return start;
+}
+
+// Check a sequence set, like "1:4,7,9:*"
+static int valid_set(const char * p)
+{
+	for (;;) {
+		for (int k = 0; k < 2; k ++) {
+			if (*p == '*')
+				p ++;
+			else if (*p >= '1' && *p <= '9')
+				while (isdigit((unsigned char)*p))
+					p ++;
+			else
+				return 0;
+
+			if (k == 1 || *p != ':')
+				break;
+			p ++;
+		}
+
+		if (*p == '\0')
+			return 1;
+		if (*p != ',')
+			return 0;
+		p ++;
+	}
+}
+
+static unsigned long set_number(const char ** p, unsigned long last)
+{
+	if (**p == '*') {
+		(*p) ++;
+		return last;
+	}
+	return strtoul(*p, (char **)p, 10);
+}
+
+// Whether n is in a (valid) sequence set, * being the last number
+static int in_set(const char * p, unsigned long n, unsigned long last)
+{
+	while (*p != '\0') {
+		const unsigned long a = set_number(&p, last);
+		unsigned long b = a;
+
+		if (*p == ':') {
+			p ++;
+			b = set_number(&p, last);
+		}
+		if ((a <= n && n <= b) || (b <= n && n <= a))
+			return 1;
+		if (*p == ',')
+			p ++;
+	}
+	return 0;
+}
+
+// LIST patterns: * matches anything, % anything but the hierarchy
+//  delimiter (there is none, with only INBOX)
+static int match(const char * pattern, const char * name)
+{
+	if (*pattern == '*' || *pattern == '%')
+		return match(pattern + 1, name) || (*name != '\0' && match(pattern, name + 1));
+	if (*pattern == '\0' || *name == '\0')
+		return *pattern == *name;
+	return toupper((unsigned char)*pattern) == toupper((unsigned char)*name) && match(pattern + 1, name + 1);
+}
+
+// IDLE
+static struct imap ** idle_chain(const char * mailbox)
+{
+	// FNV-1a
+	unsigned int h = 2166136261u;
+	for (; *mailbox != '\0'; mailbox ++)
+		h = (h ^ (unsigned char)*mailbox) * 16777619u;
+	return &idlers[h & (IDLE_BUCKETS - 1)];
+}
+
+static void start_idle(struct imap * s)
+{
+	struct imap ** chain = idle_chain(s->username);
+
+	s->idle_next = *chain;
+	if (*chain != NULL)
+		(*chain)->idle_prev = &s->idle_next;
+	s->idle_prev = chain;
+	*chain = s;
+	s->idle = 1;
+	idle_count ++;
+}
+
+static void stop_idle(struct imap * s)
+{
+	*s->idle_prev = s->idle_next;
+	if (s->idle_next != NULL)
+		s->idle_next->idle_prev = s->idle_prev;
+	s->idle = 0;
+	idle_count --;
+}
+
+// Bring the selected mailbox up to date, announcing what changed
+//  (RFC 3501 7.4.1: expunged messages are numbered as they go)
+static int refresh(struct imap * s)
+{
+	struct storage_msg * list;
+	size_t len;
+
+	if (storage_list_maildrop(s->username, &list, &len) == -1)
+		return 0;
+
+	unsigned char * flags = calloc(len + 1, 1);
+
+	if (flags == NULL) {
+		perror("calloc(flags)");
+		free(list);
+		return 0;
+	}
+
+	// both lists are in id order, and messages keep their flags and size
+	size_t kept = 0;
+	for (size_t j = 0, k = 0; j < s->store_len; j ++) {
+		while (k < len && list[k].id < s->store[j].id)
+			k ++;
+
+		if (k < len && list[k].id == s->store[j].id) {
+			list[k] = s->store[j];
+			flags[k] = s->flags[j];
+			kept ++;
+		} else
+			s->flags[j] |= FLAG_GONE;
+	}
+
+	int ret = 0;
+	for (size_t j = s->store_len; j > 0 && ret == 0; j --)
+		if (s->flags[j - 1] & FLAG_GONE)
+			ret = respond(s, "* %zu EXPUNGE\r\n", j);
+
+	free(s->store);
+	free(s->flags);
+	s->store = list;
+	s->flags = flags;
+	s->store_len = len;
+
+	if (ret == 0 && len > kept)
+		ret = respond(s, "* %zu EXISTS\r\n", len);
+	return ret;
+}
+
+// storage_watch(): tell idle sessions on the mailbox what changed
+static void imap_changed(const char * mailbox)
+{
+	for (struct imap * s = *idle_chain(mailbox); s != NULL; s = s->idle_next)
+		if (s->state == SELECTED && strcmp(s->username, mailbox) == 0) {
+			updates ++;
+			// a client that went away is noticed by the event loop
+			if (refresh(s) == -1 || transport_flush(s->t) == -1)
+				fprintf(stderr, "Failed to update idle IMAP session of %s.\n", mailbox);
+		}
+}
+
+// Leave the selected state, keeping messages marked \Deleted
+static void deselect(struct imap * s)
+{
+	free(s->store);
+	free(s->flags);
+	s->store = NULL;
+	s->flags = NULL;
+	s->store_len = 0;
+	if (s->state == SELECTED)
+		s->state = AUTH;
+}
+
+// Remove the messages marked \Deleted, announcing each if asked
+//  returns 0 on success, 1 if storage failed and -1 if sending did
+static int expunge(struct imap * s, int announce)
+{
+	long long * ids = malloc((s->store_len + 1) * sizeof(long long));
+
+	if (ids == NULL) {
+		perror("malloc(ids)");
+		return 1;
+	}
+
+	size_t ids_len = 0;
+	for (size_t j = 0; j < s->store_len; j ++)
+		if (s->flags[j] & FLAG_DELETED)
+			ids[ids_len ++] = s->store[j].id;
+
+	const int stored = storage_delete_set(s->username, ids, ids_len);
+	free(ids);
+
+	if (stored == -1)
+		return 1;
+
+	int ret = 0;
+	for (size_t j = s->store_len; j > 0 && announce && ret == 0; j --)
+		if (s->flags[j - 1] & FLAG_DELETED)
+			ret = respond(s, "* %zu EXPUNGE\r\n", j);
+
+	size_t kept = 0;
+	for (size_t j = 0; j < s->store_len; j ++)
+		if (! (s->flags[j] & FLAG_DELETED)) {
+			s->store[kept] = s->store[j];
+			s->flags[kept ++] = s->flags[j];
+		}
+	s->store_len = kept;
+
+	return ret;
+}
+
+// FETCH
+struct fetch_item {
+	enum {
+		ITEM_UID,
+		ITEM_FLAGS,
+		ITEM_INTERNALDATE,
+		ITEM_SIZE,
+		ITEM_BODY
+	} type;
+
+	// for ITEM_BODY: which part, whether it leaves \Seen alone, and
+	//  a byte range of it <start.count>
+	enum {
+		PART_ALL,
+		PART_HEADER,
+		PART_TEXT,
+		PART_FIELDS,
+		PART_FIELDS_NOT
+	} part;
+	int peek;
+	int partial;
+	unsigned long start, count;
+
+	// how the reply names it: RFC822 and friends as they are, or
+	//  BODY[section] as the client wrote the section
+	const char * name;
+	const char * section;
+	int section_len;
+	// HEADER.FIELDS list, "(From To)"
+	const char * fields;
+	int fields_len;
+};
+
+static int is(const char * p, size_t len, const char * word)
+{
+	return strlen(word) == len && strncasecmp(p, word, len) == 0;
+}
+
+// Parse the data items of a FETCH, one or a list of them
+//  returns how many, -1 if any is malformed or not supported
+static int parse_fetch(char * p, struct fetch_item * items)
+{
+	int n = 0;
+	const int list = (*p == '(');
+
+	if (list)
+		p ++;
+
+	for (;;) {
+		const size_t len = strspn(p, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789.");
+		struct fetch_item * it = &items[n];
+		char * end = p + len;
+
+		if (n + 3 > FETCH_ITEMS_MAX)
+			return -1;
+		memset(it, 0, sizeof(struct fetch_item));
+
+		if (! list && is(p, len, "FAST")) {
+			// the only macro without ENVELOPE
+			it[0].type = ITEM_FLAGS;
+			it[1].type = ITEM_INTERNALDATE;
+			it[2].type = ITEM_SIZE;
+			n += 2;
+		} else if (is(p, len, "UID"))
+			it->type = ITEM_UID;
+		else if (is(p, len, "FLAGS"))
+			it->type = ITEM_FLAGS;
+		else if (is(p, len, "INTERNALDATE"))
+			it->type = ITEM_INTERNALDATE;
+		else if (is(p, len, "RFC822.SIZE"))
+			it->type = ITEM_SIZE;
+		else if (is(p, len, "RFC822")) {
+			it->type = ITEM_BODY;
+			it->name = "RFC822";
+		} else if (is(p, len, "RFC822.HEADER")) {
+			it->type = ITEM_BODY;
+			it->part = PART_HEADER;
+			it->peek = 1;
+			it->name = "RFC822.HEADER";
+		} else if (is(p, len, "RFC822.TEXT")) {
+			it->type = ITEM_BODY;
+			it->part = PART_TEXT;
+			it->name = "RFC822.TEXT";
+		} else if ((is(p, len, "BODY") || is(p, len, "BODY.PEEK")) && p[len] == '[') {
+			// BODY without a section is BODYSTRUCTURE, which is not
+			char * section = p + len + 1, * close = strchr(section, ']');
+
+			if (close == NULL)
+				return -1;
+
+			it->type = ITEM_BODY;
+			it->peek = (len == 9);
+			it->section = section;
+			it->section_len = close - section;
+
+			if (it->section_len == 0)
+				it->part = PART_ALL;
+			else if (is(section, it->section_len, "HEADER"))
+				it->part = PART_HEADER;
+			else if (is(section, it->section_len, "TEXT"))
+				it->part = PART_TEXT;
+			else if (strncasecmp(section, "HEADER.FIELDS.NOT (", 19) == 0) {
+				it->part = PART_FIELDS_NOT;
+				it->fields = section + 18;
+			} else if (strncasecmp(section, "HEADER.FIELDS (", 15) == 0) {
+				it->part = PART_FIELDS;
+				it->fields = section + 14;
+			} else
+				return -1;
+
+			if (it->fields != NULL) {
+				it->fields_len = close - it->fields;
+				if (close[-1] != ')')
+					return -1;
+			}
+
+			end = close + 1;
+			if (*end == '<') {
+				it->partial = 1;
+				it->start = strtoul(end + 1, &end, 10);
+				if (*end != '.')
+					return -1;
+				it->count = strtoul(end + 1, &end, 10);
+				if (*end != '>' || it->count == 0)
+					return -1;
+				end ++;
+			}
+		} else
+			return -1;
+
+		n ++;
+		p = end;
+
+		if (list && *p == ' ')
+			p ++;
+		else if ((list && *p == ')' && p[1] == '\0') || (! list && *p == '\0'))
+			return n;
+		else
+			return -1;
+	}
+}
+
+// Read message j whole into s->body, undoing the dot-stuffing it was
+//  stored with, and correct its size to match
+//  returns 0 on success, -1 if it could not be read
+static int load(struct imap * s, size_t j)
+{
+	struct storage_stream * m = storage_open_message(s->username, s->store[j].id);
+
+	if (m == NULL)
+		return -1;
+
+	const char * buf;
+	ssize_t n;
+	// whether the next byte starts a line
+	int bol = 1;
+
+	s->body_len = 0;
+	while ((n = storage_read_message(m, &buf)) > 0) {
+		if (s->body_len + n > s->body_cap) {
+			const size_t cap = s->body_len + n > s->store[j].size ? s->body_len + n : s->store[j].size;
+			char * body = realloc(s->body, cap);
+
+			if (body == NULL) {
+				perror("realloc(body)");
+				n = -1;
+				break;
+			}
+			s->body = body;
+			s->body_cap = cap;
+		}
+
+		for (ssize_t i = 0; i < n; i ++) {
+			// every line that starts with a dot was sent with another
+			if (! (bol && buf[i] == '.'))
+				s->body[s->body_len ++] = buf[i];
+			bol = (buf[i] == '\n');
+		}
+	}
+
+	storage_close_message(m);
+	if (n == -1)
+		return -1;
+
+	s->store[j].size = s->body_len;
+	s->flags[j] |= FLAG_SIZED;
+	return 0;
+}
+
+// Whether a header field is named in a HEADER.FIELDS list
+static int field_listed(const char * fields, int fields_len, const char * name, size_t name_len)
+{
+	for (int i = 0; i < fields_len; ) {
+		const char * p = fields + i;
+		const size_t len = strcspn(p, " ()\"");
+
+		if (len == 0)
+			i ++;
+		else {
+			if (len == name_len && strncasecmp(p, name, len) == 0)
+				return 1;
+			i += len;
+		}
+	}
+	return 0;
+}
+
+// The part of the loaded message a FETCH item asks for
+static int fetch_part(struct imap * s, const struct fetch_item * it, const char ** data, size_t * len)
+{
+	// the header ends with the first empty line, and includes it
+	size_t header_len = s->body_len;
+
+	if (s->body_len >= 2 && s->body[0] == '\r' && s->body[1] == '\n')
+		header_len = 2;
+	else
+		for (size_t i = 0; i + 4 <= s->body_len; i ++)
+			if (memcmp(s->body + i, "\r\n\r\n", 4) == 0) {
+				header_len = i + 4;
+				break;
+			}
+
+	*data = s->body;
+	*len = s->body_len;
+
+	if (it->part == PART_HEADER)
+		*len = header_len;
+	else if (it->part == PART_TEXT) {
+		*data = s->body + header_len;
+		*len = s->body_len - header_len;
+	} else if (it->part == PART_FIELDS || it->part == PART_FIELDS_NOT) {
+		if ((s->part = realloc(s->part, header_len + 2)) == NULL) {
+			perror("realloc(part)");
+			return -1;
+		}
+
+		size_t part_len = 0;
+		for (size_t i = 0; i < header_len; ) {
+			// a field goes on over lines that start with white space
+			size_t end = i;
+			do {
+				while (end < header_len && s->body[end] != '\n')
+					end ++;
+				if (end < header_len)
+					end ++;
+			} while (end < header_len && (s->body[end] == ' ' || s->body[end] == '\t'));
+
+			const char * colon = memchr(s->body + i, ':', end - i);
+
+			if (colon != NULL && field_listed(it->fields, it->fields_len, s->body + i, colon - (s->body + i)) == (it->part == PART_FIELDS)) {
+				memcpy(s->part + part_len, s->body + i, end - i);
+				part_len += end - i;
+			}
+			i = end;
+		}
+
+		memcpy(s->part + part_len, "\r\n", 2);
+		*data = s->part;
+		*len = part_len + 2;
+	}
+
+	if (it->partial) {
+		if (it->start >= *len)
+			*len = 0;
+		else {
+			*data += it->start;
+			*len -= it->start;
+			if (*len > it->count)
+				*len = it->count;
+		}
+	}
+
+	return 0;
+}
+
+// One FETCH response
+//  returns 0 on success, 1 if the message could not be read and -1
+//  if sending failed
+static int fetch_message(struct imap * s, size_t j, const struct fetch_item * items, int n)
+{
+	int need_body = 0, flags_item = 0, seen = 0;
+
+	for (int k = 0; k < n; k ++) {
+		if (items[k].type == ITEM_BODY || (items[k].type == ITEM_SIZE && ! (s->flags[j] & FLAG_SIZED)))
+			need_body = 1;
+		if (items[k].type == ITEM_FLAGS)
+			flags_item = 1;
+		if (items[k].type == ITEM_BODY && ! items[k].peek)
+			seen = 1;
+	}
+
+	if (need_body && load(s, j) == -1)
+		return 1;
+
+	// reading a message marks it \Seen, and the reply says so
+	int announce = 0;
+	if (seen && ! s->read_only && ! (s->flags[j] & FLAG_SEEN)) {
+		s->flags[j] |= FLAG_SEEN;
+		announce = ! flags_item;
+	}
+
+	char flags[64];
+	flag_list(s->flags[j], flags);
+
+	if (emit(s, "* %zu FETCH (", j + 1) == -1)
+		return -1;
+
+	for (int k = 0; k < n; k ++) {
+		const struct fetch_item * it = &items[k];
+		const char * sep = k > 0 ? " " : "";
+		int ret = 0;
+
+		if (it->type == ITEM_UID)
+			ret = emit(s, "%sUID %lu", sep, UID(s->store[j].id));
+		else if (it->type == ITEM_FLAGS)
+			ret = emit(s, "%sFLAGS %s", sep, flags);
+		else if (it->type == ITEM_INTERNALDATE) {
+			char date[INTERNALDATE_MAX];
+			struct tm tm;
+
+			strftime(date, sizeof date, INTERNALDATE_FORMAT, gmtime_r(&s->store[j].delivered, &tm));
+			ret = emit(s, "%sINTERNALDATE %s", sep, date);
+		}
+		else if (it->type == ITEM_SIZE)
+			ret = emit(s, "%sRFC822.SIZE %zu", sep, s->store[j].size);
+		else {
+			const char * data;
+			size_t len;
+
+			if (fetch_part(s, it, &data, &len) == -1)
+				return -1;
+
+			if (it->name != NULL)
+				ret = emit(s, "%s%s {%zu}\r\n", sep, it->name, len);
+			else if (emit(s, "%sBODY[", sep) == -1 || transport_write(s->t, it->section, it->section_len) == -1)
+				ret = -1;
+			else if (it->partial)
+				ret = emit(s, "]<%lu> {%zu}\r\n", it->start, len);
+			else
+				ret = emit(s, "] {%zu}\r\n", len);
+
+			if (ret == 0 && transport_write(s->t, data, len) == -1)
+				ret = -1;
+		}
+
+		if (ret == -1)
+			return -1;
+	}
+
+	if (announce && emit(s, " FLAGS %s", flags) == -1)
+		return -1;
+	return emit(s, ")\r\n");
+}
+
+// FETCH and UID FETCH
+static int fetch(struct imap * s, char * arg, int uid)
+{
+	char * set = arg, * p = strchr(arg, ' ');
+	struct fetch_item items[FETCH_ITEMS_MAX];
+	int n;
+
+	if (p == NULL)
+		return tagged(s, "BAD Expected sequence set and data items");
+	*p ++ = '\0';
+
+	if (! valid_set(set) || (n = parse_fetch(p, items)) == -1)
+		return tagged(s, "BAD Malformed or unsupported FETCH");
+
+	// UID FETCH always says which UID each message has
+	int has_uid = 0;
+	for (int k = 0; k < n; k ++)
+		has_uid |= (items[k].type == ITEM_UID);
+	if (uid && ! has_uid)
+		items[n ++].type = ITEM_UID;
+
+	const unsigned long last = uid ? (s->store_len ? UID(s->store[s->store_len - 1].id) : 0) : s->store_len;
+	int failed = 0, ret = 0;
+
+	for (size_t j = 0; j < s->store_len && ret != -1; j ++)
+		if (in_set(set, uid ? UID(s->store[j].id) : j + 1, last))
+			failed |= ((ret = fetch_message(s, j, items, n)) == 1);
+
+	// the next FETCH is likely a while off, or IDLE
+	free(s->body);
+	free(s->part);
+	s->body = s->part = NULL;
+	s->body_len = s->body_cap = 0;
+
+	if (ret == -1)
+		return -1;
+	return tagged(s, failed ? "NO Some messages could not be read" : "OK FETCH completed");
+}
+
+// STORE and UID STORE: [+-]FLAGS[.SILENT] (flag ...)
+static int store(struct imap * s, char * arg, int uid)
+{
+	char * set = next_string(&arg), * item = next_string(&arg);
+
+	if (set == NULL || item == NULL || *arg == '\0' || ! valid_set(set))
+		return tagged(s, "BAD Expected sequence set, data item and flags");
+
+	const char mode = (*item == '+' || *item == '-') ? *item ++ : '=';
+	int silent = 0;
+
+	if (strcasecmp(item, "FLAGS.SILENT") == 0)
+		silent = 1;
+	else if (strcasecmp(item, "FLAGS") != 0)
+		return tagged(s, "BAD Unknown data item");
+
+	if (s->read_only)
+		return tagged(s, "NO Mailbox is read-only");
+
+	// keywords are not kept at all
+	unsigned char mask = 0;
+	for (char * p = arg; *p != '\0'; ) {
+		const size_t len = strcspn(p, " ()");
+
+		for (size_t i = 0; i < sizeof(flag_names) / sizeof(flag_names[0]); i ++)
+			if (is(p, len, flag_names[i].name))
+				mask |= flag_names[i].flag;
+		p += len ? len : 1;
+	}
+
+	const unsigned long last = uid ? (s->store_len ? UID(s->store[s->store_len - 1].id) : 0) : s->store_len;
+
+	for (size_t j = 0; j < s->store_len; j ++) {
+		if (! in_set(set, uid ? UID(s->store[j].id) : j + 1, last))
+			continue;
+
+		const unsigned char kept = s->flags[j] & (FLAG_SIZED | FLAG_GONE);
+
+		if (mode == '+')
+			s->flags[j] |= mask;
+		else if (mode == '-')
+			s->flags[j] &= ~mask;
+		else
+			s->flags[j] = kept | mask;
+
+		char flags[64];
+		flag_list(s->flags[j], flags);
+
+		if (silent)
+			continue;
+		if (uid ? emit(s, "* %zu FETCH (FLAGS %s UID %lu)\r\n", j + 1, flags, UID(s->store[j].id)) :
+			emit(s, "* %zu FETCH (FLAGS %s)\r\n", j + 1, flags))
+			return -1;
+	}
+
+	return tagged(s, "OK STORE completed");
+}
+
+// SEARCH and UID SEARCH, for the criteria that flags and numbers can
+//  answer, all of which must match
+static int search(struct imap * s, char * arg, int uid)
+{
+	struct {
+		// a flag that must be set or clear, a set of numbers or UIDs,
+		//  or nothing matches (NEW, RECENT)
+		unsigned char flag;
+		int set;
+		const char * numbers;
+		int by_uid;
+		int none;
+	} keys[SEARCH_KEYS_MAX];
+	size_t n = 0;
+	char * word;
+
+	// a CHARSET does not matter to any criterion here
+	if (strncasecmp(arg, "CHARSET ", 8) == 0) {
+		arg += 8;
+		if (next_string(&arg) == NULL)
+			return tagged(s, "BAD Expected charset");
+	}
+
+	while ((word = next_string(&arg)) != NULL) {
+		static const struct {
+			const char * name;
+			unsigned char flag;
+			int set;
+		} flag_keys[] = {
+			{ "SEEN", FLAG_SEEN, 1 }, { "UNSEEN", FLAG_SEEN, 0 },
+			{ "DELETED", FLAG_DELETED, 1 }, { "UNDELETED", FLAG_DELETED, 0 },
+			{ "ANSWERED", FLAG_ANSWERED, 1 }, { "UNANSWERED", FLAG_ANSWERED, 0 },
+			{ "FLAGGED", FLAG_FLAGGED, 1 }, { "UNFLAGGED", FLAG_FLAGGED, 0 },
+			{ "DRAFT", FLAG_DRAFT, 1 }, { "UNDRAFT", FLAG_DRAFT, 0 }
+		};
+
+		if (n == SEARCH_KEYS_MAX)
+			return tagged(s, "BAD Too many search criteria");
+		memset(&keys[n], 0, sizeof(keys[n]));
+
+		if (strcasecmp(word, "ALL") == 0 || strcasecmp(word, "OLD") == 0)
+			continue;
+		else if (strcasecmp(word, "NEW") == 0 || strcasecmp(word, "RECENT") == 0)
+			keys[n].none = 1;
+		else if (strcasecmp(word, "UID") == 0) {
+			keys[n].by_uid = 1;
+			if ((keys[n].numbers = next_string(&arg)) == NULL || ! valid_set(keys[n].numbers))
+				return tagged(s, "BAD Expected UID set");
+		} else if (valid_set(word))
+			keys[n].numbers = word;
+		else {
+			size_t i = 0;
+			while (i < sizeof(flag_keys) / sizeof(flag_keys[0]) && strcasecmp(word, flag_keys[i].name) != 0)
+				i ++;
+			if (i == sizeof(flag_keys) / sizeof(flag_keys[0]))
+				return tagged(s, "BAD Unsupported search criterion");
+			keys[n].flag = flag_keys[i].flag;
+			keys[n].set = flag_keys[i].set;
+		}
+		n ++;
+	}
+
+	if (*arg != '\0')
+		return tagged(s, "BAD Malformed search criteria");
+
+	const unsigned long last_uid = s->store_len ? UID(s->store[s->store_len - 1].id) : 0;
+
+	if (emit(s, "* SEARCH") == -1)
+		return -1;
+
+	for (size_t j = 0; j < s->store_len; j ++) {
+		size_t k = 0;
+
+		for (; k < n; k ++) {
+			if (keys[k].none)
+				break;
+			if (keys[k].numbers != NULL) {
+				if (! (keys[k].by_uid ? in_set(keys[k].numbers, UID(s->store[j].id), last_uid) : in_set(keys[k].numbers, j + 1, s->store_len)))
+					break;
+			} else if (!! (s->flags[j] & keys[k].flag) != keys[k].set)
+				break;
+		}
+
+		if (k == n && emit(s, " %lu", uid ? UID(s->store[j].id) : (unsigned long)j + 1) == -1)
+			return -1;
+	}
+
+	if (emit(s, "\r\n") == -1)
+		return -1;
+	return tagged(s, "OK SEARCH completed");
+}
+
+// Command handlers
+//  the command table has already checked the argument and state rules
+static int imap_capability(void * session, char * arg, struct transport * t)
+{
+	struct imap * s = session;
+	(void)arg;
+
+	if (respond(s, "* CAPABILITY IMAP4rev1 IDLE%s\r\n", s->state == INIT && ! s->tls && transport_can_starttls(t) ? " STARTTLS" : "") == -1)
+		return -1;
+	return tagged(s, "OK CAPABILITY completed");
+}
+
+static int imap_noop(void * session, char * arg, struct transport * t)
+{
+	struct imap * s = session;
+	(void)arg;
+	(void)t;
+
+	// clients poll with NOOP or CHECK, where they won't IDLE
+	if (s->state == SELECTED && refresh(s) == -1)
+		return -1;
+	return tagged(s, "OK NOOP completed");
+}
+
+static int imap_logout(void * session, char * arg, struct transport * t)
+{
+	struct imap * s = session;
+	(void)arg;
+	(void)t;
+
+	if (respond(s, "* BYE Logging out\r\n") == -1)
+		return -1;
+	tagged(s, "OK LOGOUT completed");
+	return -1;
+}
+
+// RFC 3501 6.2.1: TLS before LOGIN, after which the session starts over
+static int imap_starttls(void * session, char * arg, struct transport * t)
+{
+	struct imap * s = session;
+	(void)arg;
+
+	if (s->tls || ! transport_can_starttls(t))
+		return tagged(s, "BAD STARTTLS not available");
+
+	if (tagged(s, "OK Begin TLS negotiation now") == -1 || transport_starttls(t) == -1)
+		return -1;
+	s->tls = 1;
+	return 0;
+}
+
+// Answer a LOGIN, for the user in username, see imap_login()
+static int login(struct imap * s, const char * pass, int check)
+{
+	// Check password against DB
+	if (! check || storage_authenticate(s->username, pass) != 1) {
+		throttle_failed(s->peer[0] ? s->peer : NULL, s->username);
+		s->username[0] = '\0';
+		return tagged(s, "NO LOGIN failed");
+	}
+
+	s->state = AUTH;
+	return tagged(s, "OK LOGIN completed");
+}
+
+static int imap_login(void * session, char * arg, struct transport * t)
+{
+	struct imap * s = session;
+	char * user = next_string(&arg), * pass = user ? next_string(&arg) : NULL;
+	(void)t;
+
+	if (user == NULL || pass == NULL || *arg != '\0')
+		return tagged(s, "BAD Expected user name and password");
+
+	// no account has names or passwords longer than that
+	if (strlen(user) > 40 || strlen(pass) > 40)
+		return tagged(s, "NO LOGIN failed");
+
+	// after too many failures, the answer waits, see throttle.c
+	strcpy(s->username, user);
+	if ((s->wake_ms = throttle_login(s->peer[0] ? s->peer : NULL, user, &s->check)) != 0) {
+		strcpy(s->password, pass);
+		return 0;
+	}
+
+	return login(s, pass, 1);
+}
+
+// SELECT and EXAMINE
+static int select_inbox(struct imap * s, char * arg, int read_only)
+{
+	char * name = next_string(&arg);
+
+	// selecting another mailbox closes this one, without EXPUNGE
+	deselect(s);
+
+	if (name == NULL || *arg != '\0')
+		return tagged(s, "BAD Expected mailbox name");
+	if (strcasecmp(name, "INBOX") != 0)
+		return tagged(s, "NO Mailbox does not exist");
+
+	if (storage_list_maildrop(s->username, &s->store, &s->store_len) == -1)
+		return tagged(s, "NO [UNAVAILABLE] Mailbox unavailable, try again later");
+
+	if ((s->flags = calloc(s->store_len + 1, 1)) == NULL) {
+		perror("calloc(flags)");
+		deselect(s);
+		return tagged(s, "NO [UNAVAILABLE] Mailbox unavailable, try again later");
+	}
+
+	s->state = SELECTED;
+	s->read_only = read_only;
+
+	const unsigned long uidnext = s->store_len ? UID(s->store[s->store_len - 1].id) + 1 : 1;
+
+	if (respond(s, "* FLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)\r\n") == -1 ||
+		respond(s, "* %zu EXISTS\r\n* 0 RECENT\r\n", s->store_len) == -1 ||
+		(s->store_len > 0 && respond(s, "* OK [UNSEEN 1] First unseen\r\n") == -1) ||
+		respond(s, "* OK [PERMANENTFLAGS ()] Flags last for this session only\r\n") == -1 ||
+		respond(s, "* OK [UIDVALIDITY %d] UIDs valid\r\n* OK [UIDNEXT %lu] Predicted next UID\r\n", UIDVALIDITY, uidnext) == -1)
+		return -1;
+
+	return tagged(s, read_only ? "OK [READ-ONLY] EXAMINE completed" : "OK [READ-WRITE] SELECT completed");
+}
+
+static int imap_select(void * session, char * arg, struct transport * t)
+{
+	(void)t;
+
+	return select_inbox(session, arg, 0);
+}
+
+static int imap_examine(void * session, char * arg, struct transport * t)
+{
+	(void)t;
+
+	return select_inbox(session, arg, 1);
+}
+
+// LIST and LSUB: INBOX is all there is, and always subscribed
+static int list_inbox(struct imap * s, char * arg, const char * verb)
+{
+	char * ref = next_string(&arg), * pattern = ref ? next_string(&arg) : NULL;
+
+	if (ref == NULL || pattern == NULL || *arg != '\0')
+		return tagged(s, "BAD Expected reference and mailbox name");
+
+	char name[128];
+	snprintf(name, sizeof name, "%s%s", ref, pattern);
+
+	if (*pattern == '\0') {
+		// RFC 3501 6.3.8: the hierarchy delimiter, of which there is none
+		if (strcmp(verb, "LIST") == 0 && respond(s, "* LIST (\\Noselect) NIL \"\"\r\n") == -1)
+			return -1;
+	} else if (match(name, "INBOX") && respond(s, "* %s (\\HasNoChildren) NIL INBOX\r\n", verb) == -1)
+		return -1;
+
+	return respond(s, "%s OK %s completed\r\n", s->tag, verb);
+}
+
+static int imap_list(void * session, char * arg, struct transport * t)
+{
+	(void)t;
+
+	return list_inbox(session, arg, "LIST");
+}
+
+static int imap_lsub(void * session, char * arg, struct transport * t)
+{
+	(void)t;
+
+	return list_inbox(session, arg, "LSUB");
+}
+
+static int imap_subscribe(void * session, char * arg, struct transport * t)
+{
+	struct imap * s = session;
+	char * name = next_string(&arg);
+	(void)t;
+
+	if (name == NULL || *arg != '\0')
+		return tagged(s, "BAD Expected mailbox name");
+	return tagged(s, strcasecmp(name, "INBOX") == 0 ? "OK Done" : "NO Mailbox does not exist");
+}
+
+// CREATE, DELETE, RENAME and COPY
+static int imap_no_mailboxes(void * session, char * arg, struct transport * t)
+{
+	(void)arg;
+	(void)t;
+
+	return tagged(session, "NO Only INBOX is available");
+}
+
+static int imap_status(void * session, char * arg, struct transport * t)
+{
+	struct imap * s = session;
+	char * name = next_string(&arg);
+	(void)t;
+
+	if (name == NULL || *arg != '(')
+		return tagged(s, "BAD Expected mailbox name and status items");
+	if (strcasecmp(name, "INBOX") != 0)
+		return tagged(s, "NO Mailbox does not exist");
+
+	struct storage_msg * list;
+	size_t len;
+
+	if (storage_list_maildrop(s->username, &list, &len) == -1)
+		return tagged(s, "NO [UNAVAILABLE] Mailbox unavailable, try again later");
+
+	const unsigned long uidnext = len ? UID(list[len - 1].id) + 1 : 1;
+	free(list);
+
+	// no message is \Seen at the start of a session
+	char response[256] = "";
+	for (char * p = arg + 1; *p != ')'; ) {
+		const size_t item_len = strcspn(p, " )");
+		const size_t used = strlen(response);
+
+		if (p[item_len] == '\0' || used > sizeof response - 32)
+			return tagged(s, "BAD Malformed status items");
+
+		if (is(p, item_len, "MESSAGES"))
+			sprintf(response + used, " MESSAGES %zu", len);
+		else if (is(p, item_len, "RECENT"))
+			strcat(response, " RECENT 0");
+		else if (is(p, item_len, "UIDNEXT"))
+			sprintf(response + used, " UIDNEXT %lu", uidnext);
+		else if (is(p, item_len, "UIDVALIDITY"))
+			sprintf(response + used, " UIDVALIDITY %d", UIDVALIDITY);
+		else if (is(p, item_len, "UNSEEN"))
+			sprintf(response + used, " UNSEEN %zu", len);
+		else
+			return tagged(s, "BAD Unknown status item");
+
+		p += item_len;
+		if (*p == ' ')
+			p ++;
+	}
+
+	if (respond(s, "* STATUS INBOX (%s)\r\n", response + (response[0] == ' ')) == -1)
+		return -1;
+	return tagged(s, "OK STATUS completed");
+}
+
+static int imap_close(void * session, char * arg, struct transport * t)
+{
+	struct imap * s = session;
+	(void)arg;
+	(void)t;
+
+	// the messages marked \Deleted go quietly
+	if (! s->read_only && expunge(s, 0) == 1)
+		return tagged(s, "NO Messages could not be removed");
+
+	deselect(s);
+	return tagged(s, "OK CLOSE completed");
+}
+
+static int imap_expunge(void * session, char * arg, struct transport * t)
+{
+	struct imap * s = session;
+	(void)arg;
+	(void)t;
+
+	if (s->read_only)
+		return tagged(s, "NO Mailbox is read-only");
+
+	const int ret = expunge(s, 1);
+
+	if (ret == -1)
+		return -1;
+	return tagged(s, ret ? "NO Messages could not be removed" : "OK EXPUNGE completed");
+}
+
+static int imap_fetch(void * session, char * arg, struct transport * t)
+{
+	(void)t;
+
+	return fetch(session, arg, 0);
+}
+
+static int imap_store(void * session, char * arg, struct transport * t)
+{
+	(void)t;
+
+	return store(session, arg, 0);
+}
+
+static int imap_search(void * session, char * arg, struct transport * t)
+{
+	(void)t;
+
+	return search(session, arg, 0);
+}
+
+static int imap_uid(void * session, char * arg, struct transport * t)
+{
+	struct imap * s = session;
+	char * command = next_string(&arg);
+	(void)t;
+
+	if (command == NULL || *arg == '\0')
+		return tagged(s, "BAD Expected command and arguments");
+	if (strcasecmp(command, "FETCH") == 0)
+		return fetch(s, arg, 1);
+	if (strcasecmp(command, "STORE") == 0)
+		return store(s, arg, 1);
+	if (strcasecmp(command, "SEARCH") == 0)
+		return search(s, arg, 1);
+	return tagged(s, "BAD Unknown UID command");
+}
+
+// RFC 2177: wait for DONE, telling the client about new mail meanwhile
+static int imap_idle(void * session, char * arg, struct transport * t)
+{
+	struct imap * s = session;
+	(void)arg;
+	(void)t;
+
+	if (respond(s, "+ idling\r\n") == -1)
+		return -1;
+
+	start_idle(s);
+	// anything that came in since the last command
+	return s->state == SELECTED ? refresh(s) : 0;
+}
+
+#define IN(x) (1u << (x))
+
+static const struct command imap_command_list[] = {
+	// valid in any state
+	{ "CAPABILITY", IN(INIT) | IN(AUTH) | IN(SELECTED), ARGS_NONE, imap_capability },
+	{ "NOOP", IN(INIT) | IN(AUTH) | IN(SELECTED), ARGS_NONE, imap_noop },
+	{ "LOGOUT", IN(INIT) | IN(AUTH) | IN(SELECTED), ARGS_NONE, imap_logout },
+
+	// valid in the not authenticated state
+	{ "STARTTLS", IN(INIT), ARGS_NONE, imap_starttls },
+	{ "LOGIN", IN(INIT), ARGS_REQUIRED, imap_login },
+
+	// valid in the authenticated state, and so also with INBOX selected
+	{ "SELECT", IN(AUTH) | IN(SELECTED), ARGS_REQUIRED, imap_select },
+	{ "EXAMINE", IN(AUTH) | IN(SELECTED), ARGS_REQUIRED, imap_examine },
+	{ "LIST", IN(AUTH) | IN(SELECTED), ARGS_REQUIRED, imap_list },
+	{ "LSUB", IN(AUTH) | IN(SELECTED), ARGS_REQUIRED, imap_lsub },
+	{ "SUBSCRIBE", IN(AUTH) | IN(SELECTED), ARGS_REQUIRED, imap_subscribe },
+	{ "UNSUBSCRIBE", IN(AUTH) | IN(SELECTED), ARGS_REQUIRED, imap_subscribe },
+	{ "STATUS", IN(AUTH) | IN(SELECTED), ARGS_REQUIRED, imap_status },
+	{ "CREATE", IN(AUTH) | IN(SELECTED), ARGS_REQUIRED, imap_no_mailboxes },
+	{ "DELETE", IN(AUTH) | IN(SELECTED), ARGS_REQUIRED, imap_no_mailboxes },
+	{ "RENAME", IN(AUTH) | IN(SELECTED), ARGS_REQUIRED, imap_no_mailboxes },
+	{ "IDLE", IN(AUTH) | IN(SELECTED), ARGS_NONE, imap_idle },
+
+	// valid with INBOX selected
+	{ "CHECK", IN(SELECTED), ARGS_NONE, imap_noop },
+	{ "CLOSE", IN(SELECTED), ARGS_NONE, imap_close },
+	{ "EXPUNGE", IN(SELECTED), ARGS_NONE, imap_expunge },
+	{ "SEARCH", IN(SELECTED), ARGS_REQUIRED, imap_search },
+	{ "FETCH", IN(SELECTED), ARGS_REQUIRED, imap_fetch },
+	{ "STORE", IN(SELECTED), ARGS_REQUIRED, imap_store },
+	{ "COPY", IN(SELECTED), ARGS_REQUIRED, imap_no_mailboxes },
+	{ "UID", IN(SELECTED), ARGS_REQUIRED, imap_uid }
+};
+
+static struct command_table imap_commands = {
+	.commands = imap_command_list,
+	.len = sizeof(imap_command_list) / sizeof(imap_command_list[0]),
+	.unknown = "BAD Unknown command\r\n",
+	.bad_args = "BAD Missing or unexpected arguments\r\n",
+	.bad_state = "BAD Command not allowed now\r\n",
+	.reject = imap_reject
+};
+
+// Handle one complete command line (CRLF already removed)
+static int command_line(struct imap * s)
+{
+	char * line = s->line;
+
+	if (s->idle) {
+		stop_idle(s);
+		return tagged(s, strcasecmp(line, "DONE") == 0 ? "OK IDLE terminated" : "BAD Expected DONE");
+	}
+
+	// tag, space, command
+	const size_t tag_len = strcspn(line, " ");
+
+	if (tag_len == 0 || tag_len > TAG_MAX || strcspn(line, "(){%*\"\\+") < tag_len) {
+		strcpy(s->tag, "*");
+		return tagged(s, "BAD Invalid tag");
+	}
+
+	memcpy(s->tag, line, tag_len);
+	s->tag[tag_len] = '\0';
+
+	if (line[tag_len] != ' ' || line[tag_len + 1] == '\0')
+		return tagged(s, "BAD Missing command");
+
+	return command_dispatch(&imap_commands, s, s->state, line + tag_len + 1, s->t);
+}
+
+// Size of the literal the (NUL-terminated) line ends with, "{n}",
+//  or -1 if it does not end with one
+static long literal_size(const struct imap * s)
+{
+	size_t i = s->line_len;
+
+	if (i < 3 || s->line[i - 1] != '}')
+		return -1;
+
+	i --;
+	while (i > s->literal_end && isdigit((unsigned char)s->line[i - 1]))
+		i --;
+
+	if (i == s->line_len - 1 || i == s->literal_end || s->line[i - 1] != '{')
+		return -1;
+	return strtol(s->line + i, NULL, 10);
+}
+
+// Add a byte to the line, which grows as needed up to LINE_MAX
+//  past which the end of it is kept, to find where it stops
+static int append(struct imap * s, char c)
+{
+	if (s->line_len + 1 >= s->line_cap) {
+		if (s->line_cap == LINE_MAX) {
+			s->line_overflow = 1;
+			s->line[s->line_len - 2] = s->line[s->line_len - 1];
+			s->line[s->line_len - 1] = c;
+			return 0;
+		}
+
+		const size_t cap = s->line_cap ? s->line_cap * 2 : 256;
+		char * line = realloc(s->line, cap < LINE_MAX ? cap : LINE_MAX);
+
+		if (line == NULL) {
+			perror("realloc(line)");
+			return -1;
+		}
+		s->line = line;
+		s->line_cap = cap < LINE_MAX ? cap : LINE_MAX;
+	}
+
+	s->line[s->line_len ++] = c;
+	return 0;
+}
+
+int imap_process(struct imap * s, const char * buffer, int len, struct transport * t)
+{
+	// process incoming chars
+	for (int i = 0; i < len; i ++) {
+		if (append(s, buffer[i]) == -1)
+			return -1;
+
+		// a literal is taken as it is, CRLFs and all
+		if (s->literal > 0) {
+			if (-- s->literal == 0)
+				s->literal_end = s->line_len;
+			continue;
+		}
+
+		if (s->line_len < s->literal_end + 2 || s->line[s->line_len - 2] != '\r' || s->line[s->line_len - 1] != '\n')
+			continue;
+
+		// replace CRLF with nul
+		s->line_len -= 2;
+		s->line[s->line_len] = '\0';
+
+		const long literal = s->line_overflow ? -1 : literal_size(s);
+
+		if (s->line_overflow) {
+			if (respond(s, "* BAD Command line too long\r\n") == -1)
+				return -1;
+		} else if (literal >= 0 && s->line_len + 2 + literal < LINE_MAX) {
+			// RFC 3501 7.5: ask for the literal, which goes on the line
+			s->line[s->line_len] = '\r';
+			s->line_len += 2;
+			s->literal = literal;
+			s->literal_end = s->line_len;
+			if (respond(s, "+ Ready for literal data\r\n") == -1 || transport_flush(t) == -1)
+				return -1;
+			continue;
+		} else if (literal >= 0) {
+			// refused, so the client won't send it
+			s->line[strcspn(s->line, " ")] = '\0';
+			snprintf(s->tag, sizeof s->tag, "%s", s->line);
+			if (tagged(s, "BAD Literal too long") == -1)
+				return -1;
+		} else {
+			const int tls = s->tls;
+
+			if (command_line(s) == -1)
+				return -1;
+
+			// RFC 3501 6.2.1: anything pipelined behind STARTTLS was
+			//  sent in the clear, and must not be acted on
+			if (s->tls != tls) {
+				s->line_overflow = s->line_len = s->literal_end = 0;
+				return 0;
+			}
+
+			// the rest waits along with the LOGIN, see imap_resume()
+			if (s->wake_ms != 0) {
+				s->line_overflow = s->line_len = s->literal_end = 0;
+				if (i + 1 < len) {
+					if ((s->held = malloc(len - i - 1)) == NULL) {
+						perror("malloc(held)");
+						return -1;
+					}
+					memcpy(s->held, buffer + i + 1, len - i - 1);
+					s->held_len = len - i - 1;
+				}
+				return transport_flush(t);
+			}
+		}
+
+		// reset line to empty
+		s->line_overflow = s->line_len = s->literal_end = 0;
+	}
+
+	// everything this piece of input needed answering goes out together
+	return transport_flush(t);
+}
+
+// When a held back LOGIN is due to be answered, 0 if there is none
+long imap_tarpit(const struct imap * s)
+{
+	return s->wake_ms;
+}
+
+// Answer it, and go on with the input that came after it
+int imap_resume(struct imap * s, struct transport * t)
+{
+	char * held = s->held;
+	const int held_len = s->held_len;
+
+	s->wake_ms = 0;
+	s->held = NULL;
+	s->held_len = 0;
+
+	int ret = login(s, s->password, s->check);
+	memset(s->password, 0, sizeof s->password);
+
+	if (ret != -1)
+		ret = held != NULL ? imap_process(s, held, held_len, t) : transport_flush(t);
+
+	free(held);
+	return ret;
+}
+
+void imap_free(struct imap * s)
+{
+	free(s->held);
+	if (s->idle)
+		stop_idle(s);
+	free(s->line);
+	free(s->store);
+	free(s->flags);
+	free(s->body);
+	free(s->part);
+	free(s);
+}
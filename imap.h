@@ -0,0 +1,22 @@
+#ifndef IMAP_H_
+#define IMAP_H_
+
+#include <stdio.h>
+
+struct imap;
+struct transport;
+
+int imap_setup();
+void imap_teardown();
+void imap_report(FILE * out);
+int imap_refuse(struct transport * t);
+int imap_restart(struct transport * t);
+
+struct imap * imap_init(struct transport * t, const char * peer);
+int imap_process(struct imap * s, const char * buffer, int len, struct transport * t);
+void imap_free(struct imap * s);
+
+long imap_tarpit(const struct imap * s);
+int imap_resume(struct imap * s, struct transport * t);
+
+#endif
@@ -0,0 +1,491 @@
+/*
+** bridgemail-import - bulk load mbox files and maildirs into a BridgeMail database
+*  Messages are stored exactly as if they had been delivered over SMTP
+*  (CRLF line ends, dot-stuffed), many thousands to a transaction, with
+*  syncing off and the secondary indexes built once at the end.  Run it
+*  with the server stopped.
+*/
+
+#include "schema.h"
+#include "spool.h"
+#include "shard.h"
+
+#include <sqlite3.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// default messages per transaction, and a cap on body bytes per transaction
+#define BATCH_MESSAGES 10000
+#define BATCH_BYTES (256 * 1024 * 1024)
+
+// load-time tuning: nothing is synced until the final checkpoint,
+//  and a 256 MiB page cache keeps the b-tree pages being appended to hot
+#define IMPORT_TUNING "PRAGMA synchronous = OFF; PRAGMA cache_size = -262144; PRAGMA temp_store = MEMORY"
+
+// a message being assembled
+struct buffer {
+	char * data;
+	size_t len, max;
+};
+
+// the directory (shard 0, and the whole database if it isn't sharded),
+//  and the shard being imported into, see shard.c
+static sqlite3 * directory;
+static sqlite3 * db;
+static int shard;
+static sqlite3_stmt * stmt_find;
+static sqlite3_stmt * stmt_insert_body;
+static sqlite3_stmt * stmt_insert_recipient;
+
+static unsigned long batch_size = BATCH_MESSAGES;
+
+// totals, and the current batch
+static unsigned long messages, batch_messages;
+static unsigned long long bytes, batch_bytes;
+static long long start_ms;
+
+// set by SIGINT / SIGTERM: finish the current batch and stop
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static long long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int reserve(struct buffer * b, size_t len)
+{
+	if (b->len + len <= b->max)
+		return 0;
+
+	size_t max = b->max ? b->max : 65536;
+	while (max < b->len + len)
+		max *= 2;
+
+	char * data = realloc(b->data, max);
+	if (data == NULL) {
+		perror("realloc(message)");
+		return -1;
+	}
+
+	b->data = data;
+	b->max = max;
+	return 0;
+}
+
+// Append one line of a message as it would have arrived over SMTP:
+//  CRLF line end whatever the input used, and a leading '.' doubled
+static int append_line(struct buffer * b, const char * line, size_t len)
+{
+	if (len > 0 && line[len - 1] == '\n') len --;
+	if (len > 0 && line[len - 1] == '\r') len --;
+
+	if (reserve(b, len + 3) == -1)
+		return -1;
+
+	if (len > 0 && line[0] == '.')
+		b->data[b->len ++] = '.';
+	memcpy(b->data + b->len, line, len);
+	b->len += len;
+	b->data[b->len ++] = '\r';
+	b->data[b->len ++] = '\n';
+	return 0;
+}
+
+// Commit the current batch and start the next one
+static int next_batch()
+{
+	if (sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Failed to commit: %s\n", sqlite3_errmsg(db));
+		return -1;
+	}
+
+	const long long ms = now_ms() - start_ms;
+	printf(" . %lu messages, %.1f MiB, %.0f messages/s\n", messages, bytes / 1048576.0, ms ? messages * 1000.0 / ms : 0);
+	fflush(stdout);
+
+	batch_messages = 0;
+	batch_bytes = 0;
+
+	if (sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Failed to begin: %s\n", sqlite3_errmsg(db));
+		return -1;
+	}
+
+	return 0;
+}
+
+// Add a message to mailbox, in the current batch
+static int store(const char * mailbox, const struct buffer * b)
+{
+	const int spooled = spool_enabled();
+	char tmp[SPOOL_NAME_MAX];
+
+	if (spooled && spool_write(b->data, b->len, tmp) == -1)
+		return -1;
+
+	if (spooled)
+		sqlite3_bind_zeroblob(stmt_insert_body, 1, 0);
+	else
+		sqlite3_bind_blob(stmt_insert_body, 1, b->data, b->len, NULL);
+	sqlite3_bind_int64(stmt_insert_body, 2, b->len);
+	sqlite3_bind_int(stmt_insert_body, 3, spooled);
+	// delivered now, as far as retention goes, however old the message
+	sqlite3_bind_int64(stmt_insert_body, 4, time(NULL));
+	int rv = sqlite3_step(stmt_insert_body);
+	sqlite3_reset(stmt_insert_body);
+
+	if (rv != SQLITE_DONE) {
+		fprintf(stderr, "Failed to insert message: %s\n", sqlite3_errmsg(db));
+		if (spooled)
+			spool_abort(tmp);
+		return -1;
+	}
+
+	const sqlite3_int64 rowid = sqlite3_last_insert_rowid(db);
+
+	if (spooled && spool_commit(tmp, SHARD_ID(shard, rowid)) == -1)
+		return -1;
+
+	sqlite3_bind_text(stmt_insert_recipient, 1, mailbox, -1, NULL);
+	sqlite3_bind_int64(stmt_insert_recipient, 2, rowid);
+	rv = sqlite3_step(stmt_insert_recipient);
+	sqlite3_reset(stmt_insert_recipient);
+
+	if (rv != SQLITE_DONE) {
+		fprintf(stderr, "Failed to insert recipient: %s\n", sqlite3_errmsg(db));
+		return -1;
+	}
+
+	messages ++;
+	bytes += b->len;
+	batch_messages ++;
+	batch_bytes += b->len;
+
+	if (batch_messages >= batch_size || batch_bytes >= BATCH_BYTES)
+		return next_batch();
+
+	return 0;
+}
+
+// An mbox file: messages start with a "From " line at the beginning of
+//  the file or after an empty line, which is dropped along with it.
+//  Body lines that were quoted as ">From " (or ">>From ", mboxrd) lose one '>'.
+static int import_mbox(const char * mailbox, const char * path)
+{
+	FILE * f = fopen(path, "rb");
+
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	struct buffer b = { 0 };
+	char * line = NULL;
+	size_t line_max = 0;
+	ssize_t n;
+	int ret = 0, in_message = 0, blank = 1;
+
+	while (ret == 0 && ! stop && (n = getline(&line, &line_max, f)) != -1) {
+		if (blank && n >= 5 && memcmp(line, "From ", 5) == 0) {
+			if (in_message)
+				ret = store(mailbox, &b);
+			b.len = 0;
+			in_message = 1;
+			blank = 0;
+			continue;
+		}
+
+		// anything before the first separator isn't a message
+		if (! in_message)
+			continue;
+
+		// an empty line is held back until we know it isn't a separator
+		if (blank)
+			ret = append_line(&b, "", 0);
+
+		blank = (n == 1 && line[0] == '\n') || (n == 2 && line[0] == '\r' && line[1] == '\n');
+		if (blank)
+			continue;
+
+		const char * p = line;
+		while (*p == '>')
+			p ++;
+
+		if (p > line && strncmp(p, "From ", 5) == 0)
+			ret = append_line(&b, line + 1, n - 1);
+		else
+			ret = append_line(&b, line, n);
+	}
+
+	if (ret == 0 && ! stop && in_message)
+		ret = store(mailbox, &b);
+
+	if (ferror(f)) {
+		perror(path);
+		ret = -1;
+	}
+
+	free(line);
+	free(b.data);
+	fclose(f);
+	return ret;
+}
+
+// One message file out of a maildir
+static int import_file(const char * mailbox, const char * path, struct buffer * b)
+{
+	FILE * f = fopen(path, "rb");
+
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	char * line = NULL;
+	size_t line_max = 0;
+	ssize_t n;
+	int ret = 0;
+
+	b->len = 0;
+	while (ret == 0 && (n = getline(&line, &line_max, f)) != -1)
+		ret = append_line(b, line, n);
+
+	if (ferror(f)) {
+		perror(path);
+		ret = -1;
+	}
+
+	if (ret == 0)
+		ret = store(mailbox, b);
+
+	free(line);
+	fclose(f);
+	return ret;
+}
+
+static int visible(const struct dirent * e)
+{
+	return e->d_name[0] != '.';
+}
+
+// A maildir: every file in new/, then in cur/, each in name order
+//  (which is delivery order, as names start with the delivery time)
+static int import_maildir(const char * mailbox, const char * path)
+{
+	static const char * const subdirs[] = { "new", "cur" };
+
+	struct buffer b = { 0 };
+	int ret = 0;
+
+	for (size_t i = 0; ret == 0 && i < sizeof(subdirs) / sizeof(subdirs[0]); i ++) {
+		char dir[4096];
+		snprintf(dir, sizeof dir, "%s/%s", path, subdirs[i]);
+
+		struct dirent ** names;
+		int count = scandir(dir, &names, visible, alphasort);
+
+		if (count == -1) {
+			perror(dir);
+			ret = -1;
+			break;
+		}
+
+		for (int j = 0; j < count; j ++) {
+			if (ret == 0 && ! stop) {
+				char file[4096 + 256];
+				snprintf(file, sizeof file, "%s/%s", dir, names[j]->d_name);
+				ret = import_file(mailbox, file, &b);
+			}
+			free(names[j]);
+		}
+		free(names);
+	}
+
+	free(b.data);
+	return ret;
+}
+
+// Split a user=path argument, check both halves, and find the mailbox's shard
+static const char * parse_source(char * arg, int * maildir, int * shard)
+{
+	char * path = strchr(arg, '=');
+
+	if (path == NULL || path == arg || path[1] == '\0') {
+		fprintf(stderr, "Expected mailbox=path, got `%s'.\n", arg);
+		return NULL;
+	}
+	*path ++ = '\0';
+
+	if (shard_find(stmt_find, arg, shard) != 1) {
+		fprintf(stderr, "No mailbox `%s' in the database (add it with bridgemail-manage adduser first).\n", arg);
+		return NULL;
+	}
+
+	struct stat st;
+	if (stat(path, &st) == -1) {
+		perror(path);
+		return NULL;
+	}
+
+	*maildir = S_ISDIR(st.st_mode);
+	return path;
+}
+
+// Import every source whose mailbox is on the current shard
+static int import_shard(char * const * mailboxes, const char * const * paths, const int * maildirs, const int * shards, int sources)
+{
+	// foreign keys stay off (the default): mailboxes are checked once, up front
+	if (sqlite3_exec(db, IMPORT_TUNING, NULL, NULL, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, "INSERT INTO message(data, size, spool, delivered) VALUES(?, ?, ?, ?)", -1, &stmt_insert_body, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO mailbox_message(mailbox_id, message_id) VALUES(?, ?)", -1, &stmt_insert_recipient, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Failed to prepare statements: %s\n", sqlite3_errmsg(db));
+		return -1;
+	}
+
+	// the indexes go in the first batch, and come back if it's rolled back
+	int ret = sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) == SQLITE_OK ? schema_drop_indexes(db) : -1;
+
+	for (int i = 0; ret == 0 && ! stop && i < sources; i ++) {
+		if (shards[i] != shard)
+			continue;
+
+		printf(" . Importing %s %s into %s\n", maildirs[i] ? "maildir" : "mbox", paths[i], mailboxes[i]);
+		ret = maildirs[i] ? import_maildir(mailboxes[i], paths[i]) : import_mbox(mailboxes[i], paths[i]);
+	}
+
+	// keep every complete batch, even after a failure
+	if (ret == 0)
+		ret = next_batch();
+	sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+
+	printf(" . Building indexes\n");
+	if (schema_create_indexes(db) == -1 ||
+		sqlite3_exec(db, "PRAGMA wal_checkpoint(TRUNCATE)", NULL, NULL, NULL) != SQLITE_OK)
+		ret = -1;
+
+	sqlite3_finalize(stmt_insert_body);
+	sqlite3_finalize(stmt_insert_recipient);
+	stmt_insert_body = NULL;
+	stmt_insert_recipient = NULL;
+
+	return ret;
+}
+
+int main(int argc, char * argv[])
+{
+	const char * spool = NULL;
+	int c;
+
+	while ((c = getopt(argc, argv, "S:B:")) != -1)
+		switch (c) {
+		case 'S': spool = optarg; break;
+		case 'B': batch_size = strtoul(optarg, NULL, 10); break;
+		default:
+			return EXIT_FAILURE;
+		}
+
+	if (argc - optind < 2 || batch_size == 0) {
+		printf("Usage: bridgemail-import [-S spool_dir] [-B batch_messages] /path/to/mail.db mailbox=mbox_or_maildir...\n");
+		return EXIT_FAILURE;
+	}
+
+	const char * path = argv[optind ++];
+
+	// the database must already exist, set up by bridgemail-manage createdb
+	if (sqlite3_open_v2(path, &directory, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, sqlite3_errmsg(directory));
+		return EXIT_FAILURE;
+	}
+
+	int shard_len;
+	if (schema_upgrade(directory) == -1 || (shard_len = shard_count(directory)) == -1) {
+		fputs("Failed to set up the database.\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	// spooled files aren't synced either, the final checkpoint is what counts
+	if (spool != NULL && spool_setup(spool, 0) == -1)
+		return EXIT_FAILURE;
+
+	// without a directory, every mailbox is on shard 0
+	if (sqlite3_prepare_v2(directory, shard_len == 1 ? "SELECT 0 FROM mailbox WHERE id = ?" : SHARD_FIND_SQL, -1, &stmt_find, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Failed to prepare statements: %s\n", sqlite3_errmsg(directory));
+		return EXIT_FAILURE;
+	}
+
+	const int sources = argc - optind;
+	const char ** paths = calloc(sources, sizeof(const char *));
+	int * maildirs = calloc(sources, sizeof(int));
+	int * shards = calloc(sources, sizeof(int));
+
+	if (paths == NULL || maildirs == NULL || shards == NULL) {
+		perror("calloc(sources)");
+		return EXIT_FAILURE;
+	}
+
+	for (int i = 0; i < sources; i ++)
+		if ((paths[i] = parse_source(argv[optind + i], &maildirs[i], &shards[i])) == NULL)
+			return EXIT_FAILURE;
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	start_ms = now_ms();
+	int ret = 0;
+
+	// one shard after another, each with its own batches and indexes
+	for (shard = 0; ret == 0 && ! stop && shard < shard_len; shard ++) {
+		int used = 0;
+		for (int i = 0; i < sources; i ++)
+			used |= shards[i] == shard;
+		if (! used)
+			continue;
+
+		if (shard == 0)
+			db = directory;
+		else {
+			char * name = shard_path(path, shard);
+
+			if (name == NULL || sqlite3_open_v2(name, &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK || schema_upgrade(db) == -1) {
+				fprintf(stderr, "Failed to open shard %d: %s\n", shard, sqlite3_errmsg(db));
+				ret = -1;
+			}
+			free(name);
+		}
+
+		if (ret == 0)
+			ret = import_shard(&argv[optind], paths, maildirs, shards, sources);
+
+		if (db != directory)
+			sqlite3_close(db);
+		db = NULL;
+	}
+
+	const long long ms = now_ms() - start_ms;
+	printf("%s %lu messages (%.1f MiB) in %.1f s\n", stop ? "Interrupted after" : (ret == 0 ? "Imported" : "Failed after"),
+		messages - batch_messages, (bytes - batch_bytes) / 1048576.0, ms / 1000.0);
+
+	sqlite3_finalize(stmt_find);
+	sqlite3_close(directory);
+	spool_teardown();
+	free(paths);
+	free(maildirs);
+	free(shards);
+
+	return ret == 0 && ! stop ? EXIT_SUCCESS : EXIT_FAILURE;
+}
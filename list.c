@@ -0,0 +1,185 @@
+#include "list.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Lists live in the list_member table, one row per member, kept on the
+//  shard of the member's mailbox so a delivery links each member with
+//  one INSERT ... SELECT on its own shard.  The server keeps a copy of
+//  the whole table here, so RCPT of a list never touches the database;
+//  bridgemail-manage changes take effect on the admin socket's reload.
+
+// open-addressed hash table of lists, size is a power of two
+static struct list * lists;
+static size_t lists_size;
+// for list_report()
+static size_t list_count;
+static size_t member_count;
+
+// FNV-1a
+static uint32_t hash(const char * s)
+{
+	uint32_t h = 2166136261u;
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+// Find the slot for a list id: either its entry, or the empty slot it would go in
+static struct list * find_slot(struct list * table, size_t size, const char * id)
+{
+	size_t i = hash(id) & (size - 1);
+
+	while (table[i].id != NULL && strcmp(table[i].id, id) != 0)
+		i = (i + 1) & (size - 1);
+
+	return &table[i];
+}
+
+static void free_lists(struct list * table, size_t size)
+{
+	for (size_t i = 0; i < size; i ++) {
+		for (size_t j = 0; j < table[i].len; j ++)
+			free(table[i].members[j].mailbox);
+		free(table[i].members);
+		free(table[i].id);
+	}
+
+	free(table);
+}
+
+void list_teardown()
+{
+	free_lists(lists, lists_size);
+	lists = NULL;
+	lists_size = 0;
+	list_count = 0;
+	member_count = 0;
+}
+
+// Add a member to the list in its slot, which is created if empty
+static int add_member(struct list * l, const char * id, const char * mailbox, int shard)
+{
+	if (l->id == NULL && (l->id = strdup(id)) == NULL) {
+		perror("strdup(list)");
+		return -1;
+	}
+
+	if (l->len == l->max) {
+		size_t new_max = l->max * 2 + 4;
+		struct list_member * new_members = realloc(l->members, new_max * sizeof(struct list_member));
+
+		if (new_members == NULL) {
+			perror("realloc(list members)");
+			return -1;
+		}
+
+		l->members = new_members;
+		l->max = new_max;
+	}
+
+	if ((l->members[l->len].mailbox = strdup(mailbox)) == NULL) {
+		perror("strdup(list member)");
+		return -1;
+	}
+
+	l->members[l->len ++].shard = shard;
+	l->shards[shard / 64] |= 1ull << (shard % 64);
+	return 0;
+}
+
+// Read the lists of every shard of the layout into a new table, which
+//  replaces the current one only if all of it could be read
+//  returns 0 on success, -1 on error
+int list_load(sqlite3 * const * dbs, int len)
+{
+	size_t count = 0;
+	int ret = 0;
+
+	for (int i = 0; i < len && ret == 0; i ++) {
+		sqlite3_stmt * stmt;
+
+		// databases from before lists have no list_member table
+		if (sqlite3_prepare_v2(dbs[i], "SELECT COUNT(DISTINCT list_id) FROM list_member", -1, &stmt, NULL) != SQLITE_OK)
+			continue;
+
+		if (sqlite3_step(stmt) == SQLITE_ROW)
+			count += sqlite3_column_int64(stmt, 0);
+		else
+			ret = -1;
+		sqlite3_finalize(stmt);
+	}
+
+	// keep the table at most half full
+	size_t size = 16;
+	while (size < count * 2)
+		size *= 2;
+
+	struct list * table = ret == 0 ? calloc(size, sizeof(struct list)) : NULL;
+
+	if (ret == 0 && table == NULL) {
+		perror("calloc(lists)");
+		ret = -1;
+	}
+
+	size_t lists_loaded = 0, members_loaded = 0;
+
+	for (int i = 0; i < len && ret == 0; i ++) {
+		sqlite3_stmt * stmt;
+
+		if (sqlite3_prepare_v2(dbs[i], "SELECT list_id, mailbox_id FROM list_member", -1, &stmt, NULL) != SQLITE_OK)
+			continue;
+
+		int rv = SQLITE_DONE;
+		while (ret == 0 && (rv = sqlite3_step(stmt)) == SQLITE_ROW) {
+			const char * id = (const char *)sqlite3_column_text(stmt, 0);
+			struct list * l = find_slot(table, size, id);
+
+			if (l->id == NULL)
+				lists_loaded ++;
+
+			if (add_member(l, id, (const char *)sqlite3_column_text(stmt, 1), i) == -1)
+				ret = -1;
+			else
+				members_loaded ++;
+		}
+
+		if (ret == 0 && rv != SQLITE_DONE)
+			ret = -1;
+		sqlite3_finalize(stmt);
+	}
+
+	if (ret == -1) {
+		fputs("Failed to read lists from database.\n", stderr);
+		if (table != NULL)
+			free_lists(table, size);
+		return -1;
+	}
+
+	list_teardown();
+	lists = table;
+	lists_size = size;
+	list_count = lists_loaded;
+	member_count = members_loaded;
+
+	if (list_count > 0)
+		printf(" . Loaded %zu lists with %zu members\n", list_count, member_count);
+	return 0;
+}
+
+// The list of that id, NULL if there is none
+const struct list * list_find(const char * id)
+{
+	if (lists == NULL)
+		return NULL;
+
+	const struct list * l = find_slot(lists, lists_size, id);
+	return l->id == NULL ? NULL : l;
+}
+
+void list_report(FILE * out)
+{
+	fprintf(out, " . Lists: %zu lists, %zu members\n", list_count, member_count);
+}
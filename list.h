@@ -0,0 +1,36 @@
+#ifndef LIST_H_
+#define LIST_H_
+
+#include "shard.h"
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// one mailbox on a list, and the shard it lives on
+struct list_member {
+	char * mailbox;
+	int shard;
+};
+
+// A distribution list (or alias, a list of one): mail to its id goes
+//  to every member instead
+struct list {
+	char * id;
+	struct list_member * members;
+	size_t len;
+	size_t max;
+	// bit n set if any member is on shard n
+	uint64_t shards[SHARD_MAX / 64];
+};
+
+#define LIST_ON_SHARD(l, shard) (((l)->shards[(shard) / 64] >> ((shard) % 64)) & 1)
+
+int list_load(sqlite3 * const * dbs, int len);
+void list_teardown();
+
+const struct list * list_find(const char * id);
+
+void list_report(FILE * out);
+
+#endif
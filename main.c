@@ -1,14 +1,25 @@
 /*
-** BridgeMail - a local-only SMTP / POP3 mail service
+** BridgeMail - a local-only SMTP / POP3 / IMAP mail service
 *  Greg Kennedy 2021
 */
 
-// handlers for SMTP and POP3 protocols
+// handlers for SMTP, POP3 and IMAP protocols
 #include "smtp.h"
 #include "pop3.h"
-
-// for our storage db
-#include <sqlite3.h>
+#include "imap.h"
+// mail and account storage
+#include "storage.h"
+// output side of client connections
+#include "transport.h"
+#include "transcript.h"
+// STARTTLS
+#include "tls.h"
+// admin commands over a UNIX socket
+#include "admin.h"
+// failed login throttling
+#include "throttle.h"
+// tracepoints
+#include "probes.h"
 
 // system includes
 #include <stdio.h>
@@ -17,35 +28,77 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <poll.h>
 #include <signal.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+extern char ** environ;
 
 enum sock_type {
 	SOCK_NONE = 0,
 	SOCK_LISTEN_SMTP = 1,
 	SOCK_LISTEN_POP3 = 2,
 	SOCK_XFER_SMTP = 3,
-	SOCK_XFER_POP3 = 4
+	SOCK_XFER_POP3 = 4,
+	SOCK_LISTEN_ADMIN = 5,
+	SOCK_XFER_ADMIN = 6,
+	SOCK_LISTEN_IMAP = 7,
+	SOCK_XFER_IMAP = 8,
+	SOCK_HANDOFF = 9
+};
+
+// names of the listeners when they are passed to another process, see
+//  adoptListeners() and restart()
+static const char * const listener_names[] = {
+	[SOCK_LISTEN_SMTP] = "smtp",
+	[SOCK_LISTEN_POP3] = "pop3",
+	[SOCK_LISTEN_ADMIN] = "admin",
+	[SOCK_LISTEN_IMAP] = "imap"
 };
 
 static struct socket_detail {
 	enum sock_type type;
 	void * data;
+	struct transport * transport;
+	// a session held back by the throttle reads nothing until then, 0 if not
+	long wake_ms;
 } * socket_details = NULL;
 
+// quiet time before background work runs, and how long it may run for
+#define MAINT_IDLE_MS 250
+#define MAINT_BUDGET_MS 20
+// default size of the message cache, in MiB
+#define CACHE_MB 32
+// default recipients per message, also the least RFC 5321 allows
+#define MAX_RCPT 100
+// a backup copies this many pages every tick, by default
+#define BACKUP_PAGES 128
+#define TICK_MS 10
+// failed logins before the throttle holds them back, by default
+#define LOGIN_BURST 5
+// passed listening sockets start here, as in systemd's sd_listen_fds()
+#define LISTEN_FDS_START 3
+// after a restart, how long sessions get to finish before they are cut off
+#define DRAIN_MS (10 * 60 * 1000)
+
 static struct pollfd * socket_fds = NULL;
 static int socket_count = 0;
 static int socket_max = 0;
 
-// Error callback for SQLite errors - simply print to stderr
-static void errorLogCallback(const void * pArg, int iErrCode, const char * zMsg)
-{
-	fprintf(stderr, "SQLite Error (%d): %s\n", iErrCode, zMsg);
-}
+// sockets of each type, for the session limit, and the sessions it turned away
+static int type_count[SOCK_HANDOFF + 1];
+static unsigned long refused;
+// sessions with a wake_ms
+static int tarpitted;
 
 // Get printable address info
 static const char * get_addr_detail(const struct sockaddr * sa)
@@ -90,7 +143,7 @@ static int addSocket(int fd, enum sock_type type)
 		if (new_socket_fds == NULL) {
 			perror("realloc(socket_fds)");
 			// be nice and try to resize new_socket_details back down
-			new_socket_details = realloc(socket_details, socket_max * sizeof(enum sock_type));
+			new_socket_details = realloc(socket_details, socket_max * sizeof(struct socket_detail));
 
 			if (new_socket_details == NULL)
 				perror("realloc(socket_details)");
@@ -107,24 +160,50 @@ static int addSocket(int fd, enum sock_type type)
 
 	// add our new socket at the end of the list
 	socket_details[socket_count].type = type;
+	socket_details[socket_count].data = NULL;
+	socket_details[socket_count].transport = NULL;
+	socket_details[socket_count].wake_ms = 0;
 	socket_fds[socket_count].fd = fd;
 	socket_fds[socket_count].events = POLLIN; // | POLLPRI;
+	type_count[type] ++;
 	//socket_count ++;
 	return (socket_count ++);
 }
 
 static void delSocket(int index)
 {
+	if (socket_details[index].type == SOCK_XFER_SMTP || socket_details[index].type == SOCK_XFER_POP3 || socket_details[index].type == SOCK_XFER_IMAP)
+		PROBE2(conn_close, socket_fds[index].fd, socket_details[index].type);
+
+	type_count[socket_details[index].type] --;
+	if (socket_details[index].wake_ms != 0)
+		tarpitted --;
+
+	// move the last socket into the hole
+	socket_count --;
 	socket_fds[index] = socket_fds[socket_count];
 	socket_details[index] = socket_details[socket_count];
 	socket_fds[socket_count].fd = -1;
 	socket_fds[socket_count].events = 0;
 	socket_details[socket_count].type = SOCK_NONE;
 	socket_details[socket_count].data = NULL;
-	socket_count --;
+	socket_details[socket_count].transport = NULL;
+	socket_details[socket_count].wake_ms = 0;
 }
 
-static int acceptSocket(const int listener)
+// Stop reading from a session until wake_ms, if it is not 0
+static void tarpitSocket(int index, long wake_ms)
+{
+	if (wake_ms == 0)
+		return;
+
+	socket_details[index].wake_ms = wake_ms;
+	socket_fds[index].events = 0;
+	tarpitted ++;
+}
+
+// also copies the client's address to addr, which has room for THROTTLE_ADDR_MAX
+static int acceptSocket(const int listener, char * addr)
 {
 	// handle new connections
 	struct sockaddr_storage remoteaddr; // client address
@@ -133,12 +212,16 @@ static int acceptSocket(const int listener)
 
 	if (fd == -1) {
 		// an error occurred trying to accept the new connection - maybe they disconnected in the meantime or something
-		perror("accept");
+		//  (or during a restart, the other server sharing the listener got it first)
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			perror("accept");
 		return -1;
 	}
 
 	// success!  print some helpful info
-	printf(" . Received connection from %s on socket %d -> new socket %d\n", get_addr_detail((struct sockaddr *)&remoteaddr), listener, fd);
+	snprintf(addr, THROTTLE_ADDR_MAX, "%s", get_addr_detail((struct sockaddr *)&remoteaddr));
+	printf(" . Received connection from %s on socket %d -> new socket %d\n", addr, listener, fd);
+	PROBE2(conn_accept, fd, addr);
 	return fd;
 }
 
@@ -179,6 +262,10 @@ int get_listener_socket(const char * const port, const enum sock_type type)
 			perror("setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, 1)");
 		}
 
+		// it may be shared with another server later, see restart()
+		if (fcntl(listener, F_SETFL, O_NONBLOCK) == -1)
+			perror("fcntl(listener, O_NONBLOCK)");
+
 		if (bind(listener, p->ai_addr, p->ai_addrlen) == -1) {
 			perror("bind()");
 			close(listener);
@@ -207,6 +294,281 @@ int get_listener_socket(const char * const port, const enum sock_type type)
 	return sockets_added;
 }
 
+// Create the admin socket, readable and writable by our user only
+//  returns 0 on success, -1 on failure
+static int get_admin_socket(const char * const path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Admin socket path %s is too long.\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (listener == -1) {
+		perror("socket(AF_UNIX)");
+		return -1;
+	}
+
+	// a socket left behind by a previous run is in the way
+	unlink(path);
+
+	const mode_t mask = umask(0077);
+	const int bound = bind(listener, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+
+	if (bound == -1 || listen(listener, 8) == -1) {
+		perror("bind(admin)");
+		close(listener);
+		return -1;
+	}
+
+	if (addSocket(listener, SOCK_LISTEN_ADMIN) == -1) {
+		fprintf(stderr, "Failed to addSocket(%d, %d).\n", listener, SOCK_LISTEN_ADMIN);
+		close(listener);
+		unlink(path);
+		return -1;
+	}
+
+	printf(" . Admin interface on %s, socket %d\n", path, listener);
+	return 0;
+}
+
+// Which listener a passed socket is: by its name, or else by its port
+//  wanted[type] is the port (or admin socket path) of each listener we
+//  need, NULL if none
+static enum sock_type listener_type(int fd, const char * name, const char * const * wanted)
+{
+	static const enum sock_type types[] = { SOCK_LISTEN_SMTP, SOCK_LISTEN_POP3, SOCK_LISTEN_IMAP, SOCK_LISTEN_ADMIN };
+
+	for (size_t i = 0; name != NULL && i < sizeof types / sizeof types[0]; i ++)
+		if (wanted[types[i]] != NULL && strcmp(name, listener_names[types[i]]) == 0)
+			return types[i];
+
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof addr;
+
+	if (getsockname(fd, (struct sockaddr *)&addr, &addrlen) == -1) {
+		perror("getsockname");
+		return SOCK_NONE;
+	}
+
+	int port;
+	if (addr.ss_family == AF_UNIX)
+		return wanted[SOCK_LISTEN_ADMIN] != NULL ? SOCK_LISTEN_ADMIN : SOCK_NONE;
+	else if (addr.ss_family == AF_INET)
+		port = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+	else if (addr.ss_family == AF_INET6)
+		port = ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+	else
+		return SOCK_NONE;
+
+	for (size_t i = 0; i < sizeof types / sizeof types[0]; i ++)
+		if (types[i] != SOCK_LISTEN_ADMIN && wanted[types[i]] != NULL && atoi(wanted[types[i]]) == port)
+			return types[i];
+
+	return SOCK_NONE;
+}
+
+// Take over the listening sockets we were started with, by systemd
+//  socket activation or by the server we replace (see restart()):
+//  LISTEN_FDS of them from fd 3 on, if LISTEN_PID is us, named in
+//  LISTEN_FDNAMES.  Listeners of a type found here are not opened again.
+// returns 0 on success, -1 on failure
+static int adoptListeners(const char * const * wanted)
+{
+	const char * pid = getenv("LISTEN_PID"), * fds = getenv("LISTEN_FDS");
+
+	if (pid == NULL || fds == NULL || atol(pid) != getpid())
+		return 0;
+
+	const char * fdnames = getenv("LISTEN_FDNAMES");
+	char * names = fdnames != NULL ? strdup(fdnames) : NULL;
+	char * next = names;
+	int ret = 0;
+
+	for (int fd = LISTEN_FDS_START; fd < LISTEN_FDS_START + atoi(fds); fd ++) {
+		const char * name = next != NULL ? strsep(&next, ":") : NULL;
+		const enum sock_type type = listener_type(fd, name, wanted);
+
+		if (type == SOCK_NONE) {
+			fprintf(stderr, "Closing passed socket %d, nothing is to listen on it.\n", fd);
+			close(fd);
+			continue;
+		}
+
+		// not passed on to anything we start, except on purpose
+		if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 || fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+			perror("fcntl(passed socket)");
+
+		if (addSocket(fd, type) == -1) {
+			fprintf(stderr, "Failed to addSocket(%d, %d).\n", fd, type);
+			close(fd);
+			ret = -1;
+			continue;
+		}
+
+		printf(" . Listening on passed socket %d (type %d)\n", fd, type);
+	}
+
+	free(names);
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+	return ret;
+}
+
+// Tell the server we replace that we are listening, see restart()
+static void handoffReady()
+{
+	const char * handoff = getenv("BRIDGEMAIL_HANDOFF_FD");
+
+	if (handoff == NULL)
+		return;
+
+	const int fd = atoi(handoff);
+	if (write(fd, "", 1) != 1)
+		perror("write(handoff)");
+	close(fd);
+	unsetenv("BRIDGEMAIL_HANDOFF_FD");
+}
+
+// a new server started by restart(), until it is ready or gone
+static pid_t successor;
+
+// Start a new server from our binary (a newer one, after an upgrade)
+//  on our listening sockets, which it takes over with adoptListeners().
+//  Both accept connections until it is ready, then we stop, see drain().
+//  The listeners stay open throughout, so no connection is refused.
+// returns 0 on success, -1 on failure
+static int restart(char * const argv[])
+{
+	int pipefd[2];
+
+	if (pipe(pipefd) == -1) {
+		perror("pipe(handoff)");
+		return -1;
+	}
+
+	// it is read from the event loop, which learns so when it is ready
+	const int j = addSocket(pipefd[0], SOCK_HANDOFF);
+
+	if (j == -1) {
+		fputs("Failed to store handoff pipe.\n", stderr);
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return -1;
+	}
+
+	// the new server's environment is made up front: between fork()
+	//  and exec only async-signal-safe calls are allowed (there may be
+	//  storage threads)
+	int n = 0, env_len = 0, top = pipefd[1] + 1;
+	for (int i = 0; i < socket_count; i ++) {
+		if (socket_details[i].type == SOCK_LISTEN_SMTP || socket_details[i].type == SOCK_LISTEN_POP3 ||
+			socket_details[i].type == SOCK_LISTEN_IMAP || socket_details[i].type == SOCK_LISTEN_ADMIN)
+			n ++;
+		if (socket_fds[i].fd >= top)
+			top = socket_fds[i].fd + 1;
+	}
+	while (environ[env_len] != NULL)
+		env_len ++;
+
+	int * fds = malloc((n + 1) * sizeof(int));
+	char ** envp = malloc((env_len + 5) * sizeof(char *));
+	char * names = malloc(n * 7 + sizeof "LISTEN_FDNAMES=");
+	char listen_fds[32], listen_pid[32] = "LISTEN_PID=", handoff[48];
+
+	if (fds == NULL || envp == NULL || names == NULL) {
+		perror("malloc(restart)");
+		free(fds);
+		free(envp);
+		free(names);
+		close(pipefd[1]);
+		close(pipefd[0]);
+		delSocket(j);
+		return -1;
+	}
+
+	strcpy(names, "LISTEN_FDNAMES=");
+	n = 0;
+	for (int i = 0; i < socket_count; i ++)
+		if (socket_details[i].type == SOCK_LISTEN_SMTP || socket_details[i].type == SOCK_LISTEN_POP3 ||
+			socket_details[i].type == SOCK_LISTEN_IMAP || socket_details[i].type == SOCK_LISTEN_ADMIN) {
+			if (n > 0)
+				strcat(names, ":");
+			strcat(names, listener_names[socket_details[i].type]);
+			fds[n ++] = socket_fds[i].fd;
+		}
+	fds[n] = pipefd[1];
+
+	snprintf(listen_fds, sizeof listen_fds, "LISTEN_FDS=%d", n);
+	snprintf(handoff, sizeof handoff, "BRIDGEMAIL_HANDOFF_FD=%d", LISTEN_FDS_START + n);
+
+	int k = 0;
+	for (int i = 0; i < env_len; i ++)
+		if (strncmp(environ[i], "LISTEN_", 7) != 0 && strncmp(environ[i], "BRIDGEMAIL_HANDOFF_FD=", 22) != 0)
+			envp[k ++] = environ[i];
+	envp[k ++] = listen_fds;
+	envp[k ++] = listen_pid;
+	envp[k ++] = names;
+	envp[k ++] = handoff;
+	envp[k] = NULL;
+
+	const long open_max = sysconf(_SC_OPEN_MAX);
+	fflush(stdout);
+	fflush(stderr);
+
+	const pid_t pid = fork();
+
+	if (pid == 0) {
+		// the sockets go to 3, 4, ... and the pipe after them: first
+		//  out of the way of everything, then down into place
+		for (int i = 0; i <= n; i ++)
+			if ((fds[i] = fcntl(fds[i], F_DUPFD, top)) == -1)
+				_exit(127);
+		for (int i = 0; i <= n; i ++)
+			if (dup2(fds[i], LISTEN_FDS_START + i) == -1)
+				_exit(127);
+		// and nothing else: our sessions must not outlive us in it
+		for (long fd = LISTEN_FDS_START + n + 1; fd < open_max; fd ++)
+			close(fd);
+
+		// LISTEN_PID is the new server's, which is ours from here
+		char digits[16];
+		int len = 0;
+		for (pid_t p = getpid(); p > 0; p /= 10)
+			digits[len ++] = '0' + p % 10;
+		char * end = listen_pid + sizeof "LISTEN_PID=" - 1;
+		while (len > 0)
+			*end ++ = digits[-- len];
+		*end = '\0';
+
+		environ = envp;
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+
+	free(fds);
+	free(envp);
+	free(names);
+	close(pipefd[1]);
+
+	if (pid == -1) {
+		perror("fork");
+		close(pipefd[0]);
+		delSocket(j);
+		return -1;
+	}
+
+	printf(" . Started new server %d\n", pid);
+	successor = pid;
+	return 0;
+}
+
 // Flag to indicate whether we should keep working
 //  Set to 0 to close the program
 static int running;
@@ -217,15 +579,113 @@ static void sig_handler(int signum)
 	running = 0;
 }
 
+// Set by SIGUSR1 to print diagnostics from the main loop
+static volatile sig_atomic_t report;
+static void report_handler(int signum)
+{
+	(void)signum;
+	report = 1;
+}
+
+// Set by SIGUSR2 to restart() from the main loop
+static volatile sig_atomic_t restarting;
+static void restart_handler(int signum)
+{
+	(void)signum;
+	restarting = 1;
+}
+
+static long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// when the server started, and the time the event loop has spent waiting in poll()
+static long start_ms, idle_ms;
+
+// Print server diagnostics
+static void print_report(FILE * out)
+{
+	const long uptime_ms = now_ms() - start_ms;
+
+	fprintf(out, " . Uptime: %ld ms, event loop idle %ld ms (%ld%%), %d sockets\n",
+		uptime_ms, idle_ms, uptime_ms ? idle_ms * 100 / uptime_ms : 100, socket_count);
+	fprintf(out, " . Sessions: %d SMTP, %d POP3, %d IMAP, %lu refused\n",
+		type_count[SOCK_XFER_SMTP], type_count[SOCK_XFER_POP3], type_count[SOCK_XFER_IMAP], refused);
+	storage_report(out);
+	smtp_report(out);
+	imap_report(out);
+	throttle_report(out);
+	tls_report(out);
+	fflush(out);
+}
+
+// when the sessions left after a restart are cut off, 0 if not draining
+static long drain_until;
+
+// Our successor is ready: stop accepting, and let the sessions we have
+//  finish.  IMAP sessions may sit in IDLE for ever, not hearing of mail
+//  the new server delivers, so they are told to reconnect right away.
+static void drain()
+{
+	int i = 0;
+
+	while (i < socket_count)
+		switch (socket_details[i].type) {
+		case SOCK_LISTEN_SMTP:
+		case SOCK_LISTEN_POP3:
+		case SOCK_LISTEN_IMAP:
+		case SOCK_LISTEN_ADMIN:
+			close(socket_fds[i].fd);
+			delSocket(i);
+			break;
+
+		case SOCK_XFER_IMAP:
+			imap_restart(socket_details[i].transport);
+			imap_free(socket_details[i].data);
+			transport_close(socket_details[i].transport);
+			delSocket(i);
+			break;
+
+		case SOCK_XFER_ADMIN:
+			admin_free(socket_details[i].data);
+			transport_close(socket_details[i].transport);
+			delSocket(i);
+			break;
+
+		default:
+			i ++;
+			break;
+		}
+
+	drain_until = now_ms() + DRAIN_MS;
+	printf(" . Draining %d SMTP and %d POP3 sessions\n", type_count[SOCK_XFER_SMTP], type_count[SOCK_XFER_POP3]);
+}
+
 // Main
 int main(int argc, char * argv[])
 {
 	printf("BridgeMail - Greg Kennedy 2023\nStarting up...\n");
 	// parse options
-	const char * port_smtp = "25", * port_pop3 = "110";
+	const char * port_smtp = "25", * port_pop3 = "110", * port_imap = NULL;
+	const char * backend = NULL;
+	struct storage_options options = { .cache_mb = CACHE_MB, .backup_pages = BACKUP_PAGES };
 	int c;
 
-	while ((c = getopt(argc, argv, "s:p:")) != -1)
+	unsigned long max_rcpt = MAX_RCPT;
+	// admission limits, 0 for none
+	int max_sessions = 0;
+	unsigned long long max_buffered = 0;
+	unsigned long max_receiving = 0;
+	unsigned int login_burst = LOGIN_BURST;
+	const char * transcripts = NULL;
+	int anonymize = 0;
+	const char * admin_path = NULL;
+	const char * tls_cert = NULL, * tls_key = NULL;
+
+	while ((c = getopt(argc, argv, "s:p:i:b:d:S:c:R:q:Q:T:Aa:B:C:K:n:M:P:L:E:")) != -1)
 		switch (c) {
 		case 's':
 			port_smtp = optarg;
@@ -235,8 +695,84 @@ int main(int argc, char * argv[])
 			port_pop3 = optarg;
 			break;
 
+		case 'i':
+			port_imap = optarg;
+			break;
+
+		case 'b':
+			backend = optarg;
+			break;
+
+		case 'd':
+			options.profile = optarg;
+			break;
+
+		case 'S':
+			options.spool = optarg;
+			break;
+
+		case 'c':
+			options.cache_mb = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'R':
+			max_rcpt = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'q':
+			options.quota_messages = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'Q':
+			options.quota_bytes = strtoull(optarg, NULL, 10) * 1024 * 1024;
+			break;
+
+		case 'T':
+			transcripts = optarg;
+			break;
+
+		case 'A':
+			anonymize = 1;
+			break;
+
+		case 'a':
+			admin_path = optarg;
+			break;
+
+		case 'B':
+			options.backup_pages = atoi(optarg);
+			break;
+
+		case 'C':
+			tls_cert = optarg;
+			break;
+
+		case 'K':
+			tls_key = optarg;
+			break;
+
+		case 'n':
+			max_sessions = atoi(optarg);
+			break;
+
+		case 'M':
+			max_buffered = strtoull(optarg, NULL, 10) * 1024 * 1024;
+			break;
+
+		case 'P':
+			max_receiving = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'L':
+			login_burst = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'E':
+			options.retention_days = strtoul(optarg, NULL, 10);
+			break;
+
 		case '?':
-			if (optopt == 's' || optopt == 'p')
+			if (optopt == 's' || optopt == 'p' || optopt == 'i' || optopt == 'b' || optopt == 'd' || optopt == 'S' || optopt == 'c' || optopt == 'R' || optopt == 'q' || optopt == 'Q' || optopt == 'T' || optopt == 'a' || optopt == 'B' || optopt == 'C' || optopt == 'K' || optopt == 'n' || optopt == 'M' || optopt == 'P' || optopt == 'L' || optopt == 'E')
 				fprintf(stderr, "Option -%c requires an argument.\n", optopt);
 			else if (isprint(optopt))
 				fprintf(stderr, "Unknown option `-%c'.\n", optopt);
@@ -250,56 +786,105 @@ int main(int argc, char * argv[])
 		}
 
 	if (optind != argc - 1) {
-		printf("Error: incorrect number of arguments.\nUsage: BridgeMail /path/to/mail.db\n");
+		printf("Error: incorrect number of arguments.\nUsage: BridgeMail [-s smtp_port] [-p pop3_port] [-i imap_port] [-b sqlite|memory] [-d strict|balanced|fast] [-S spool_dir] [-c cache_mb] [-R max_rcpt] [-q quota_messages] [-Q quota_mb] [-T transcript_dir [-A]] [-a admin_socket [-B backup_pages]] [-C tls_cert [-K tls_key]] [-n max_sessions] [-M buffer_mb] [-P max_receiving] [-L login_failures] [-E retention_days] /path/to/mail.db\n");
 		return EXIT_FAILURE;
 	}
 
-	// connect to the initial DB
-	// turn on error printing for the sqlite3 interface
-	sqlite3_config(SQLITE_CONFIG_LOG, errorLogCallback, NULL);
-	sqlite3 * db;
-	int rv = sqlite3_open_v2(argv[optind], &db, SQLITE_OPEN_READWRITE, NULL);
-
-	if (rv != SQLITE_OK) {
-		fputs("Failed to open database.\n", stderr);
-		sqlite3_close(db);
+	// RFC 5321 4.5.3.1.8: servers must take at least 100 recipients
+	if (max_rcpt < MAX_RCPT) {
+		fprintf(stderr, "Error: max_rcpt must be at least %d.\n", MAX_RCPT);
 		return EXIT_FAILURE;
 	}
 
-	if (sqlite3_exec(db, "PRAGMA foreign_keys = ON", NULL, NULL, NULL) != SQLITE_OK) {
-		fputs("Failed to enable foreign keys.\n", stderr);
-		sqlite3_close(db);
+	if (transcripts != NULL)
+		transcript_setup(transcripts, anonymize);
+
+	throttle_setup(login_burst);
+
+	if (tls_cert != NULL && tls_setup(tls_cert, tls_key) == -1) {
+		fputs("Failed to setup TLS.\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	// connect to the initial DB
+	if (storage_setup(backend, argv[optind], &options) == -1) {
+		fputs("Failed to setup storage.\n", stderr);
 		return EXIT_FAILURE;
 	}
 
 	// modules do any global setup
-	if (smtp_setup(db) == -1) {
+	if (smtp_setup(max_rcpt, max_buffered, max_receiving) == -1) {
 		fputs("Failed to setup SMTP module.\n", stderr);
-		sqlite3_close(db);
+		storage_teardown();
 		return EXIT_FAILURE;
 	}
 
-	if (pop3_setup(db) == -1) {
+	if (pop3_setup() == -1) {
 		fputs("Failed to setup POP3 module.\n", stderr);
 		smtp_teardown();
-		sqlite3_close(db);
+		storage_teardown();
+		return EXIT_FAILURE;
+	}
+
+	if (port_imap != NULL && imap_setup() == -1) {
+		fputs("Failed to setup IMAP module.\n", stderr);
+		pop3_teardown();
+		smtp_teardown();
+		storage_teardown();
+		return EXIT_FAILURE;
+	}
+
+	// listeners handed to us come first, the rest are opened below
+	const char * wanted[SOCK_HANDOFF + 1] = {
+		[SOCK_LISTEN_SMTP] = port_smtp,
+		[SOCK_LISTEN_POP3] = port_pop3,
+		[SOCK_LISTEN_IMAP] = port_imap,
+		[SOCK_LISTEN_ADMIN] = admin_path
+	};
+
+	if (adoptListeners(wanted) == -1) {
+		fputs("Failed to take over passed sockets.\n", stderr);
+		imap_teardown();
+		pop3_teardown();
+		smtp_teardown();
+		storage_teardown();
+		return EXIT_FAILURE;
+	}
+
+	if (admin_path != NULL && (admin_setup(print_report) == -1 || (type_count[SOCK_LISTEN_ADMIN] == 0 && get_admin_socket(admin_path) == -1))) {
+		fputs("Failed to setup admin interface.\n", stderr);
+		imap_teardown();
+		pop3_teardown();
+		smtp_teardown();
+		storage_teardown();
 		return EXIT_FAILURE;
 	}
 
 	// Great, now we are ready to open the ports and accept messages
-	if (! get_listener_socket(port_smtp, SOCK_LISTEN_SMTP)) {
+	if (type_count[SOCK_LISTEN_SMTP] == 0 && ! get_listener_socket(port_smtp, SOCK_LISTEN_SMTP)) {
 		fputs("Failed to open SMTP socket.\n", stderr);
+		imap_teardown();
 		pop3_teardown();
 		smtp_teardown();
-		sqlite3_close(db);
+		storage_teardown();
 		return EXIT_FAILURE;
 	}
 
-	if (! get_listener_socket(port_pop3, SOCK_LISTEN_POP3)) {
+	if (type_count[SOCK_LISTEN_POP3] == 0 && ! get_listener_socket(port_pop3, SOCK_LISTEN_POP3)) {
 		fputs("Failed to open POP3 socket.\n", stderr);
+		imap_teardown();
 		pop3_teardown();
 		smtp_teardown();
-		sqlite3_close(db);
+		storage_teardown();
+		return EXIT_FAILURE;
+	}
+
+	if (port_imap != NULL && type_count[SOCK_LISTEN_IMAP] == 0 && ! get_listener_socket(port_imap, SOCK_LISTEN_IMAP)) {
+		fputs("Failed to open IMAP socket.\n", stderr);
+		imap_teardown();
+		pop3_teardown();
+		smtp_teardown();
+		storage_teardown();
 		return EXIT_FAILURE;
 	}
 
@@ -310,49 +895,162 @@ int main(int argc, char * argv[])
 	signal(SIGINT, sig_handler);
 	signal(SIGQUIT, sig_handler);
 	signal(SIGHUP, sig_handler);
+	signal(SIGUSR1, report_handler);
+	signal(SIGUSR2, restart_handler);
+
+	handoffReady();
+
+	start_ms = now_ms();
+	long active_ms = start_ms, tick_ms = start_ms;
 
 	while (running) {
+		// the last of the sessions after a restart is gone, or out of time
+		if (drain_until != 0 && (type_count[SOCK_XFER_SMTP] + type_count[SOCK_XFER_POP3] == 0 || now_ms() >= drain_until)) {
+			puts(" . Drained, exiting.");
+			break;
+		}
+
 		// TODO: timeout as min(all sockets), or -1 if none connected, etc
 		// SMTP RFC specifies 5 minutes for server timeout
 		// POP3 RFC specifies 10 minutes for server timeout
-		int rv = poll(socket_fds, socket_max, -1);
+		// when background work is queued, wake up once the sockets go quiet
+		//  and while a backup runs, every tick whatever the sockets do
+		const int ticking = storage_ticking();
+		const long poll_ms = now_ms();
+		long timeout = ticking ? TICK_MS : (storage_pending() ? MAINT_IDLE_MS : -1);
+
+		if (drain_until != 0 && (timeout == -1 || drain_until - poll_ms < timeout))
+			timeout = drain_until > poll_ms ? drain_until - poll_ms : 0;
+
+		// and when the first held back login is due
+		for (int i = 0; tarpitted > 0 && i < socket_count; i ++) {
+			const long wake_ms = socket_details[i].wake_ms;
+
+			if (wake_ms != 0 && (timeout == -1 || wake_ms - poll_ms < timeout))
+				timeout = wake_ms > poll_ms ? wake_ms - poll_ms : 0;
+		}
+
+		int rv = poll(socket_fds, socket_count, timeout);
+		idle_ms += now_ms() - poll_ms;
+
+		// answer the held back logins that are due (or drop their
+		//  sessions, if the client gave up waiting)
+		if (tarpitted > 0) {
+			const long wake_ms = now_ms();
+			int i = 0;
+
+			while (i < socket_count) {
+				if (socket_details[i].wake_ms == 0 || (socket_details[i].wake_ms > wake_ms && ! (socket_fds[i].revents & (POLLHUP | POLLERR)))) {
+					i ++;
+					continue;
+				}
+
+				const int hung_up = socket_details[i].wake_ms > wake_ms;
+				socket_details[i].wake_ms = 0;
+				socket_fds[i].events = POLLIN;
+				tarpitted --;
+
+				if (socket_details[i].type == SOCK_XFER_POP3) {
+					if (hung_up || pop3_resume(socket_details[i].data, socket_details[i].transport) == -1) {
+						printf("- POP3 socket %d (%d) disconnected\n", i, socket_fds[i].fd);
+						pop3_free(socket_details[i].data);
+						transport_close(socket_details[i].transport);
+						delSocket(i);
+					} else {
+						tarpitSocket(i, pop3_tarpit(socket_details[i].data));
+						i ++;
+					}
+				} else {
+					if (hung_up || imap_resume(socket_details[i].data, socket_details[i].transport) == -1) {
+						printf("- IMAP socket %d (%d) disconnected\n", i, socket_fds[i].fd);
+						imap_free(socket_details[i].data);
+						transport_close(socket_details[i].transport);
+						delSocket(i);
+					} else {
+						tarpitSocket(i, imap_tarpit(socket_details[i].data));
+						i ++;
+					}
+				}
+			}
+		}
+
+		if (report) {
+			report = 0;
+			print_report(stdout);
+		}
+
+		if (restarting) {
+			restarting = 0;
+			if (successor != 0 || drain_until != 0)
+				fputs("Already restarting.\n", stderr);
+			else if (restart(argv) == -1)
+				fputs("Failed to restart.\n", stderr);
+		}
+
+		if (ticking && now_ms() - tick_ms >= TICK_MS) {
+			storage_tick();
+			tick_ms = now_ms();
+		}
 
 		if (rv == -1) {
-			perror("poll"); // error occurred in poll()
-		} else if (rv == 0)
-			perror("timeout");
-		else {
+			if (errno != EINTR)
+				perror("poll"); // error occurred in poll()
+		} else if (rv == 0) {
+			// idle: spend a little time on database upkeep
+			if (now_ms() - active_ms >= MAINT_IDLE_MS)
+				storage_idle(MAINT_BUDGET_MS);
+		} else {
+			active_ms = now_ms();
+
 			// search for anything needing attention
 			int i = 0;
 
 			while (rv > 0 && i < socket_count) {
-				if (socket_fds[i].revents & POLLIN) {
-					char buffer[1460];
+				// (a pipe has only POLLHUP when its writer is gone)
+				if (socket_fds[i].revents & (POLLIN | POLLHUP)) {
+					// room for a whole TLS record, see tls.c
+					char buffer[TLS_RECORD_MAX];
+					char peer[THROTTLE_ADDR_MAX];
 					int nbytes;
 					int fd;
+					struct transport * t;
 
 					switch (socket_details[i].type) {
 					case SOCK_LISTEN_SMTP:
-						fd = acceptSocket(socket_fds[i].fd);
+						fd = acceptSocket(socket_fds[i].fd, peer);
+						t = (fd == -1) ? NULL : transport_socket(fd);
 
 						if (fd == -1)
 							fputs("Failed to accept incoming SMTP connection.\n", stderr);
-						else {
-							struct smtp * s = smtp_init(fd);
+						else if (t == NULL) {
+							fputs("Failed to create SMTP transport.\n", stderr);
+							close(fd);
+						} else if (max_sessions != 0 && type_count[SOCK_XFER_SMTP] >= max_sessions) {
+							// too busy: say so and hang up, the client tries again later
+							smtp_refuse(t);
+							transport_close(t);
+							refused ++;
+						} else {
+							if (transcript_enabled())
+								t = transport_capture(t, TRANSCRIPT_SMTP);
+
+							struct smtp * s = smtp_init(t);
 
 							if (s == NULL) {
 								fputs("Failed to initialize SMTP connection.\n", stderr);
-								close(fd);
+								transport_close(t);
 							} else {
 								// need to create another socket_fds
 								int j = addSocket(fd, SOCK_XFER_SMTP);
 
 								if (j == -1) {
 									fputs("Failed to store SMTP connection.\n", stderr);
-									close(fd);
+									smtp_free(s);
+									transport_close(t);
 								} else {
 									puts("Created SMTP connection.\n");
 									socket_details[j].data = s;
+									socket_details[j].transport = t;
 								}
 							}
 						}
@@ -361,26 +1059,40 @@ int main(int argc, char * argv[])
 						break;
 
 					case SOCK_LISTEN_POP3:
-						fd = acceptSocket(socket_fds[i].fd);
+						fd = acceptSocket(socket_fds[i].fd, peer);
+						t = (fd == -1) ? NULL : transport_socket(fd);
 
 						if (fd == -1)
 							fputs("Failed to accept incoming POP3 connection.\n", stderr);
-						else {
-							struct pop3 * p = pop3_init(fd);
+						else if (t == NULL) {
+							fputs("Failed to create POP3 transport.\n", stderr);
+							close(fd);
+						} else if (max_sessions != 0 && type_count[SOCK_XFER_POP3] >= max_sessions) {
+							// too busy: say so and hang up, the client tries again later
+							pop3_refuse(t);
+							transport_close(t);
+							refused ++;
+						} else {
+							if (transcript_enabled())
+								t = transport_capture(t, TRANSCRIPT_POP3);
+
+							struct pop3 * p = pop3_init(t, peer);
 
 							if (p == NULL) {
 								fputs("Failed to initialize POP3 connection.\n", stderr);
-								close(fd);
+								transport_close(t);
 							} else {
 								// need to create another socket_fds
 								int j = addSocket(fd, SOCK_XFER_POP3);
 
 								if (j == -1) {
 									fputs("Failed to store POP3 connection.\n", stderr);
-									close(fd);
+									pop3_free(p);
+									transport_close(t);
 								} else {
 									puts("Created POP3 connection.\n");
 									socket_details[j].data = p;
+									socket_details[j].transport = t;
 								}
 							}
 						}
@@ -389,9 +1101,12 @@ int main(int argc, char * argv[])
 						break;
 
 					case SOCK_XFER_SMTP:
-						nbytes = recv(socket_fds[i].fd, buffer, sizeof buffer, 0);
+						nbytes = transport_read(socket_details[i].transport, buffer, sizeof buffer);
 
-						if (nbytes <= 0) {
+						if (nbytes == -1 && errno == EAGAIN)
+							// TLS handshake still going
+							i ++;
+						else if (nbytes <= 0) {
 							// got error or connection closed by client
 							if (nbytes == 0)
 								printf("- SMTP socket %d (%d) hung up\n", i, socket_fds[i].fd);
@@ -399,13 +1114,15 @@ int main(int argc, char * argv[])
 								perror("recv");
 
 							smtp_free(socket_details[i].data);
-							close(socket_fds[i].fd);
+							transport_close(socket_details[i].transport);
 							delSocket(i);
 						} else {
-							if (smtp_process(socket_details[i].data, buffer, nbytes, socket_fds[i].fd) == -1) {
+							transcript_recv(socket_details[i].transport, buffer, nbytes);
+
+							if (smtp_process(socket_details[i].data, buffer, nbytes, socket_details[i].transport) == -1) {
 								printf("- SMTP socket %d (%d) disconnected\n", i, socket_fds[i].fd);
 								smtp_free(socket_details[i].data);
-								close(socket_fds[i].fd);
+								transport_close(socket_details[i].transport);
 								delSocket(i);
 							} else
 								i ++;
@@ -414,9 +1131,12 @@ int main(int argc, char * argv[])
 						break;
 
 					case SOCK_XFER_POP3:
-						nbytes = recv(socket_fds[i].fd, buffer, sizeof buffer, 0);
+						nbytes = transport_read(socket_details[i].transport, buffer, sizeof buffer);
 
-						if (nbytes <= 0) {
+						if (nbytes == -1 && errno == EAGAIN)
+							// TLS handshake still going
+							i ++;
+						else if (nbytes <= 0) {
 							// got error or connection closed by client
 							if (nbytes == 0)
 								printf("- POP3 socket %d (%d) hung up\n", i, socket_fds[i].fd);
@@ -424,20 +1144,147 @@ int main(int argc, char * argv[])
 								perror("recv");
 
 							pop3_free(socket_details[i].data);
-							close(socket_fds[i].fd);
+							transport_close(socket_details[i].transport);
 							delSocket(i);
 						} else {
-							if (pop3_process(socket_details[i].data, buffer, nbytes, socket_fds[i].fd) == -1) {
+							transcript_recv(socket_details[i].transport, buffer, nbytes);
+
+							if (pop3_process(socket_details[i].data, buffer, nbytes, socket_details[i].transport) == -1) {
 								printf("- POP3 socket %d (%d) disconnected\n", i, socket_fds[i].fd);
 								pop3_free(socket_details[i].data);
-								close(socket_fds[i].fd);
+								transport_close(socket_details[i].transport);
 								delSocket(i);
-							} else
+							} else {
+								tarpitSocket(i, pop3_tarpit(socket_details[i].data));
 								i ++;
+							}
 						}
 
 						break;
 
+					case SOCK_LISTEN_IMAP:
+						fd = acceptSocket(socket_fds[i].fd, peer);
+						t = (fd == -1) ? NULL : transport_socket(fd);
+
+						if (fd == -1)
+							fputs("Failed to accept incoming IMAP connection.\n", stderr);
+						else if (t == NULL) {
+							fputs("Failed to create IMAP transport.\n", stderr);
+							close(fd);
+						} else if (max_sessions != 0 && type_count[SOCK_XFER_IMAP] >= max_sessions) {
+							imap_refuse(t);
+							transport_close(t);
+							refused ++;
+						} else {
+							// not recorded: bridgemail-replay speaks SMTP and POP3 only
+							struct imap * m = imap_init(t, peer);
+
+							if (m == NULL) {
+								fputs("Failed to initialize IMAP connection.\n", stderr);
+								transport_close(t);
+							} else {
+								// need to create another socket_fds
+								int j = addSocket(fd, SOCK_XFER_IMAP);
+
+								if (j == -1) {
+									fputs("Failed to store IMAP connection.\n", stderr);
+									imap_free(m);
+									transport_close(t);
+								} else {
+									puts("Created IMAP connection.\n");
+									socket_details[j].data = m;
+									socket_details[j].transport = t;
+								}
+							}
+						}
+
+						i ++;
+						break;
+
+					case SOCK_XFER_IMAP:
+						nbytes = transport_read(socket_details[i].transport, buffer, sizeof buffer);
+
+						if (nbytes == -1 && errno == EAGAIN)
+							// TLS handshake still going
+							i ++;
+						else if (nbytes <= 0) {
+							// got error or connection closed by client
+							if (nbytes == 0)
+								printf("- IMAP socket %d (%d) hung up\n", i, socket_fds[i].fd);
+							else
+								perror("recv");
+
+							imap_free(socket_details[i].data);
+							transport_close(socket_details[i].transport);
+							delSocket(i);
+						} else if (imap_process(socket_details[i].data, buffer, nbytes, socket_details[i].transport) == -1) {
+							printf("- IMAP socket %d (%d) disconnected\n", i, socket_fds[i].fd);
+							imap_free(socket_details[i].data);
+							transport_close(socket_details[i].transport);
+							delSocket(i);
+						} else {
+							tarpitSocket(i, imap_tarpit(socket_details[i].data));
+							i ++;
+						}
+
+						break;
+
+					case SOCK_LISTEN_ADMIN:
+						fd = accept(socket_fds[i].fd, NULL, NULL);
+						t = (fd == -1) ? NULL : transport_socket(fd);
+
+						if (fd == -1)
+							perror("accept(admin)");
+						else if (t == NULL) {
+							fputs("Failed to create admin transport.\n", stderr);
+							close(fd);
+						} else {
+							struct admin * a = admin_init(t);
+							int j = (a == NULL) ? -1 : addSocket(fd, SOCK_XFER_ADMIN);
+
+							if (j == -1) {
+								fputs("Failed to store admin connection.\n", stderr);
+								if (a != NULL)
+									admin_free(a);
+								transport_close(t);
+							} else {
+								socket_details[j].data = a;
+								socket_details[j].transport = t;
+							}
+						}
+
+						i ++;
+						break;
+
+					case SOCK_XFER_ADMIN:
+						nbytes = transport_read(socket_details[i].transport, buffer, sizeof buffer);
+
+						if (nbytes <= 0 || admin_process(socket_details[i].data, buffer, nbytes, socket_details[i].transport) == -1) {
+							admin_free(socket_details[i].data);
+							transport_close(socket_details[i].transport);
+							delSocket(i);
+						} else
+							i ++;
+
+						break;
+
+					case SOCK_HANDOFF:
+						// one byte from the new server when it is ready,
+						//  or nothing if it failed to start
+						nbytes = read(socket_fds[i].fd, buffer, 1);
+						close(socket_fds[i].fd);
+						delSocket(i);
+
+						if (nbytes == 1) {
+							printf(" . New server %d is ready\n", successor);
+							drain();
+						} else {
+							fprintf(stderr, "New server %d failed to start, carrying on.\n", successor);
+							waitpid(successor, NULL, 0);
+						}
+						successor = 0;
+						break;
+
 					default:
 						fprintf(stderr, "socket %d has unknown socket type %d\n", i, socket_details[i].type);
 						i ++;
@@ -458,15 +1305,39 @@ int main(int argc, char * argv[])
 	signal(SIGINT, SIG_DFL);
 	signal(SIGQUIT, SIG_DFL);
 	signal(SIGHUP, SIG_DFL);
+	signal(SIGUSR1, SIG_DFL);
+	signal(SIGUSR2, SIG_DFL);
 
 	// Shut down
-	for (int i = 0; i < socket_count; i ++)
-		close(socket_fds[i].fd);
+	for (int i = 0; i < socket_count; i ++) {
+		if (socket_details[i].type == SOCK_XFER_SMTP)
+			smtp_free(socket_details[i].data);
+		else if (socket_details[i].type == SOCK_XFER_POP3)
+			pop3_free(socket_details[i].data);
+		else if (socket_details[i].type == SOCK_XFER_IMAP)
+			imap_free(socket_details[i].data);
+		else if (socket_details[i].type == SOCK_XFER_ADMIN)
+			admin_free(socket_details[i].data);
+
+		if (socket_details[i].transport != NULL)
+			transport_close(socket_details[i].transport);
+		else
+			close(socket_fds[i].fd);
+	}
 
 	free(socket_fds);
 	free(socket_details);
+	if (admin_path != NULL) {
+		admin_teardown();
+		// after a restart, it is the new server's
+		if (drain_until == 0)
+			unlink(admin_path);
+	}
+	imap_teardown();
 	pop3_teardown();
 	smtp_teardown();
-	sqlite3_close(db);
+	storage_teardown();
+	transcript_teardown();
+	tls_teardown();
 	return 0;
 }
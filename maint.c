@@ -0,0 +1,451 @@
+#include "maint.h"
+#include "spool.h"
+#include "cache.h"
+#include "shard.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Expiry: mail older than its mailbox's retention is unlinked a batch
+//  at a time, one mailbox after another, and the bodies nothing links to
+//  any more are then swept by the garbage collection as usual.  A pass
+//  over all mailboxes starts every EXPIRE_INTERVAL seconds.
+//  Message ids only grow with the delivery time (a new id is one past
+//  the largest), so what a mailbox has to lose is every link below the
+//  first message delivered since the cutoff: a range of its primary key.
+#define EXPIRE_BATCH 64
+#define EXPIRE_INTERVAL 600
+
+// messages examined per garbage collection transaction
+#define GC_BATCH 64
+// free pages returned to the filesystem per incremental vacuum step
+#define VACUUM_BATCH 64
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+// one database file (shard) being looked after
+struct maint_db {
+	sqlite3 * db;
+	int shard;
+
+	// tx handlers
+	sqlite3_stmt * stmt_begin;
+	sqlite3_stmt * stmt_commit;
+	sqlite3_stmt * stmt_rollback;
+	// expiry
+	sqlite3_stmt * stmt_expire_next;
+	sqlite3_stmt * stmt_expire;
+	// garbage collection
+	sqlite3_stmt * stmt_gc_pending;
+	sqlite3_stmt * stmt_gc_message;
+	sqlite3_stmt * stmt_gc_queue;
+	// free page reclamation
+	sqlite3_stmt * stmt_freelist_count;
+	sqlite3_stmt * stmt_page_count;
+	sqlite3_stmt * stmt_vacuum;
+
+	// mailbox the expiry pass is at, NULL between passes, and when the next starts
+	char * expire_cursor;
+	time_t expire_next;
+	// set when the gc queue may have entries
+	int gc_pending;
+	// set when the file has free pages to give back, 0 if auto_vacuum is off
+	int vacuum_enabled, vacuum_pending;
+	int page_size;
+};
+
+static struct maint_db * dbs;
+static int dbs_len;
+// where the next idle period starts, so every shard gets its turn
+static int next_db;
+
+// days mail is kept in mailboxes which do not set their own, 0 for ever
+static unsigned int default_retention;
+
+// counters for maint_report()
+static unsigned long expired_links;
+static unsigned long gc_messages;
+static unsigned long long vacuum_bytes;
+static long idle_ms;
+
+// run a one-off pragma that returns a single integer
+static int pragma_int(sqlite3 * db, const char * sql)
+{
+	sqlite3_stmt * stmt;
+	int ret = -1;
+
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW)
+		ret = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	return ret;
+}
+
+// step a prepared single-integer pragma and reset it
+static int stmt_int(sqlite3_stmt * stmt)
+{
+	int ret = -1;
+
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		ret = sqlite3_column_int(stmt, 0);
+	sqlite3_reset(stmt);
+
+	return ret;
+}
+
+// see if there are free pages worth giving back
+static void vacuum_check(struct maint_db * m)
+{
+	m->vacuum_pending = m->vacuum_enabled && stmt_int(m->stmt_freelist_count) > 0;
+}
+
+static int maint_open(struct maint_db * m, sqlite3 * db, int shard)
+{
+	m->db = db;
+	m->shard = shard;
+
+	if (sqlite3_prepare_v2(db, "BEGIN", -1, &m->stmt_begin, NULL) != SQLITE_OK) return -1;
+	if (sqlite3_prepare_v2(db, "COMMIT", -1, &m->stmt_commit, NULL) != SQLITE_OK) return -1;
+	if (sqlite3_prepare_v2(db, "ROLLBACK", -1, &m->stmt_rollback, NULL) != SQLITE_OK) return -1;
+
+	// the next mailbox with a retention, and its expired links
+	//  ids only bound the search cheaply, delivered decides, so mail
+	//  delivered out of id order is expired late, never early
+	if (sqlite3_prepare_v2(db, "SELECT id, IFNULL(retention, ?2) AS days FROM mailbox WHERE id > ?1 AND days > 0 ORDER BY id LIMIT 1", -1, &m->stmt_expire_next, NULL) != SQLITE_OK) return -1;
+	if (sqlite3_prepare_v2(db, "DELETE FROM mailbox_message WHERE mailbox_id = ?1 AND message_id IN (SELECT message_id FROM mailbox_message WHERE mailbox_id = ?1"
+		" AND message_id < IFNULL((SELECT id FROM message WHERE delivered >= ?2 ORDER BY delivered LIMIT 1), 9223372036854775807)"
+		" AND EXISTS (SELECT 1 FROM message WHERE id = message_id AND delivered < ?2) ORDER BY message_id LIMIT ?3)", -1, &m->stmt_expire, NULL) != SQLITE_OK) return -1;
+
+	if (sqlite3_prepare_v2(db, "SELECT EXISTS (SELECT 1 FROM message_gc)", -1, &m->stmt_gc_pending, NULL) != SQLITE_OK) return -1;
+	if (sqlite3_prepare_v2(db, "DELETE FROM message WHERE id IN (SELECT message_id FROM message_gc ORDER BY message_id LIMIT ?) AND NOT EXISTS (SELECT 1 FROM mailbox_message WHERE message_id = message.id) RETURNING id, spool", -1, &m->stmt_gc_message, NULL) != SQLITE_OK) return -1;
+	if (sqlite3_prepare_v2(db, "DELETE FROM message_gc WHERE message_id IN (SELECT message_id FROM message_gc ORDER BY message_id LIMIT ?)", -1, &m->stmt_gc_queue, NULL) != SQLITE_OK) return -1;
+
+	if (sqlite3_prepare_v2(db, "PRAGMA freelist_count", -1, &m->stmt_freelist_count, NULL) != SQLITE_OK) return -1;
+	if (sqlite3_prepare_v2(db, "PRAGMA page_count", -1, &m->stmt_page_count, NULL) != SQLITE_OK) return -1;
+	if (sqlite3_prepare_v2(db, "PRAGMA incremental_vacuum(" XSTR(VACUUM_BATCH) ")", -1, &m->stmt_vacuum, NULL) != SQLITE_OK) return -1;
+
+	m->page_size = pragma_int(db, "PRAGMA page_size");
+
+	// incremental vacuum only works if the file was created (or VACUUMed) with it
+	//  2 = INCREMENTAL
+	m->vacuum_enabled = (pragma_int(db, "PRAGMA auto_vacuum") == 2);
+	if (! m->vacuum_enabled)
+		fprintf(stderr, "Database%s is not in auto_vacuum=INCREMENTAL mode, free pages will not be reclaimed.\n"
+			"  Run `bridgemail-manage <db> compact` while the server is stopped to convert it.\n", shard ? " shard" : "");
+
+	// pick up anything left queued by a previous run
+	maint_gc_notify(shard);
+	vacuum_check(m);
+	// and the first expiry pass at the first chance
+	m->expire_next = time(NULL);
+
+	return 0;
+}
+
+// Look after the database files of every shard, dbs[i] being shard i
+int maint_setup(sqlite3 * const * db, int len, unsigned int retention_days)
+{
+	default_retention = retention_days;
+
+	dbs = calloc(len, sizeof(struct maint_db));
+
+	if (dbs == NULL) {
+		perror("calloc(maint)");
+		return -1;
+	}
+
+	dbs_len = len;
+	next_db = 0;
+
+	for (int i = 0; i < len; i ++)
+		if (maint_open(&dbs[i], db[i], i) == -1)
+			return -1;
+
+	return 0;
+}
+
+void maint_teardown()
+{
+	for (int i = 0; i < dbs_len; i ++) {
+		sqlite3_finalize(dbs[i].stmt_begin);
+		sqlite3_finalize(dbs[i].stmt_commit);
+		sqlite3_finalize(dbs[i].stmt_rollback);
+
+		sqlite3_finalize(dbs[i].stmt_expire_next);
+		sqlite3_finalize(dbs[i].stmt_expire);
+		free(dbs[i].expire_cursor);
+
+		sqlite3_finalize(dbs[i].stmt_gc_pending);
+		sqlite3_finalize(dbs[i].stmt_gc_message);
+		sqlite3_finalize(dbs[i].stmt_gc_queue);
+
+		sqlite3_finalize(dbs[i].stmt_freelist_count);
+		sqlite3_finalize(dbs[i].stmt_page_count);
+		sqlite3_finalize(dbs[i].stmt_vacuum);
+	}
+
+	free(dbs);
+	dbs = NULL;
+	dbs_len = 0;
+}
+
+// Called after links are removed from mailbox_message in a shard, so the
+//  sweeper knows to look at its gc queue again
+void maint_gc_notify(int shard)
+{
+	struct maint_db * m = &dbs[shard];
+
+	if (sqlite3_step(m->stmt_gc_pending) == SQLITE_ROW)
+		m->gc_pending = sqlite3_column_int(m->stmt_gc_pending, 0);
+	sqlite3_reset(m->stmt_gc_pending);
+}
+
+// An expiry pass is under way, or due to start
+static int expire_pending(const struct maint_db * m)
+{
+	return m->expire_cursor != NULL || time(NULL) >= m->expire_next;
+}
+
+// Nonzero if there is background work waiting for idle time
+//  (an expiry pass that falls due is only noticed when the event loop
+//  next wakes up)
+int maint_pending()
+{
+	for (int i = 0; i < dbs_len; i ++)
+		if (dbs[i].gc_pending || dbs[i].vacuum_pending || expire_pending(&dbs[i]))
+			return 1;
+
+	return 0;
+}
+
+// Unlink one batch of expired mail from the mailbox the pass is at, and
+//  move on to the next mailbox once it has none left
+//  returns the number of links removed, or -1 on error
+static int expire_step(struct maint_db * m)
+{
+	sqlite3_bind_text(m->stmt_expire_next, 1, m->expire_cursor != NULL ? m->expire_cursor : "", -1, SQLITE_STATIC);
+	sqlite3_bind_int64(m->stmt_expire_next, 2, default_retention);
+
+	int rv = sqlite3_step(m->stmt_expire_next);
+
+	if (rv != SQLITE_ROW) {
+		sqlite3_reset(m->stmt_expire_next);
+
+		// that was the last one
+		free(m->expire_cursor);
+		m->expire_cursor = NULL;
+		m->expire_next = time(NULL) + EXPIRE_INTERVAL;
+		return rv == SQLITE_DONE ? 0 : -1;
+	}
+
+	char * mailbox = strdup((const char *)sqlite3_column_text(m->stmt_expire_next, 0));
+	const sqlite3_int64 days = sqlite3_column_int64(m->stmt_expire_next, 1);
+	sqlite3_reset(m->stmt_expire_next);
+
+	if (mailbox == NULL) {
+		perror("strdup(expire)");
+		return -1;
+	}
+
+	sqlite3_step(m->stmt_begin);
+	sqlite3_reset(m->stmt_begin);
+
+	sqlite3_bind_text(m->stmt_expire, 1, mailbox, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(m->stmt_expire, 2, time(NULL) - days * 86400);
+	sqlite3_bind_int(m->stmt_expire, 3, EXPIRE_BATCH);
+
+	int removed = -1;
+	if (sqlite3_step(m->stmt_expire) == SQLITE_DONE) {
+		removed = sqlite3_changes(m->db);
+
+		if (sqlite3_step(m->stmt_commit) != SQLITE_DONE)
+			removed = -1;
+		sqlite3_reset(m->stmt_commit);
+	}
+	sqlite3_reset(m->stmt_expire);
+	sqlite3_clear_bindings(m->stmt_expire);
+
+	if (removed == -1) {
+		sqlite3_step(m->stmt_rollback);
+		sqlite3_reset(m->stmt_rollback);
+		free(mailbox);
+		return -1;
+	}
+
+	expired_links += removed;
+	if (removed > 0)
+		m->gc_pending = 1;
+
+	// a full batch may have left more behind
+	if (removed < EXPIRE_BATCH) {
+		free(m->expire_cursor);
+		m->expire_cursor = mailbox;
+	} else
+		free(mailbox);
+
+	return removed;
+}
+
+// Sweep one batch of queued message ids, deleting the message bodies
+//  which no mailbox links to any more
+//  returns the number of queue entries consumed, or -1 on error
+static int gc_step(struct maint_db * m)
+{
+	sqlite3_step(m->stmt_begin);
+	sqlite3_reset(m->stmt_begin);
+
+	sqlite3_bind_int(m->stmt_gc_message, 1, GC_BATCH);
+	sqlite3_bind_int(m->stmt_gc_queue, 1, GC_BATCH);
+
+	// cached copies and spooled files can only be dropped once the delete commits
+	long long ids[GC_BATCH];
+	int spooled[GC_BATCH];
+	int deleted = 0, spooled_len = 0;
+
+	int rv;
+	while ((rv = sqlite3_step(m->stmt_gc_message)) == SQLITE_ROW) {
+		ids[deleted] = SHARD_ID(m->shard, sqlite3_column_int64(m->stmt_gc_message, 0));
+		spooled[deleted] = sqlite3_column_int(m->stmt_gc_message, 1);
+		spooled_len += spooled[deleted];
+		deleted ++;
+	}
+
+	int consumed = -1;
+	if (rv == SQLITE_DONE && sqlite3_step(m->stmt_gc_queue) == SQLITE_DONE) {
+		consumed = sqlite3_changes(m->db);
+
+		if (sqlite3_step(m->stmt_commit) != SQLITE_DONE)
+			consumed = -1;
+		sqlite3_reset(m->stmt_commit);
+	}
+
+	sqlite3_reset(m->stmt_gc_message);
+	sqlite3_reset(m->stmt_gc_queue);
+
+	if (consumed == -1) {
+		sqlite3_step(m->stmt_rollback);
+		sqlite3_reset(m->stmt_rollback);
+	} else {
+		gc_messages += deleted;
+
+		if (spooled_len > 0 && ! spool_enabled())
+			fprintf(stderr, "Spool is not configured, %d message files were not removed.\n", spooled_len);
+
+		for (int i = 0; i < deleted; i ++) {
+			cache_invalidate(ids[i]);
+			if (spooled[i] && spool_enabled())
+				spool_remove(ids[i]);
+		}
+	}
+
+	return consumed;
+}
+
+// Return up to VACUUM_BATCH free pages to the filesystem
+//  returns the number of pages reclaimed, or -1 on error
+static int vacuum_step(struct maint_db * m)
+{
+	const int before = stmt_int(m->stmt_freelist_count);
+
+	// incremental_vacuum does its work as the statement is stepped
+	int rv;
+	while ((rv = sqlite3_step(m->stmt_vacuum)) == SQLITE_ROW)
+		;
+	sqlite3_reset(m->stmt_vacuum);
+
+	if (rv != SQLITE_DONE || before < 0)
+		return -1;
+
+	const int after = stmt_int(m->stmt_freelist_count);
+	if (after < 0)
+		return -1;
+
+	vacuum_bytes += (unsigned long long)(before - after) * m->page_size;
+	return before - after;
+}
+
+static long elapsed_ms(const struct timespec * start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// Background work on one shard, until the budget runs out
+static void maint_db_step(struct maint_db * m, const struct timespec * start, int budget_ms)
+{
+	// expiry first, as it makes work for the rest
+	while (expire_pending(m) && elapsed_ms(start) < budget_ms)
+		if (expire_step(m) == -1) {
+			// try again on the next pass
+			fputs("Message expiry failed.\n", stderr);
+			free(m->expire_cursor);
+			m->expire_cursor = NULL;
+			m->expire_next = time(NULL) + EXPIRE_INTERVAL;
+			break;
+		}
+	// deletes first, since they free the pages vacuum gives back
+	while (m->gc_pending && elapsed_ms(start) < budget_ms) {
+		int consumed = gc_step(m);
+
+		if (consumed == -1) {
+			// try again on the next idle period
+			fputs("Message garbage collection failed.\n", stderr);
+			break;
+		} else if (consumed < GC_BATCH) {
+			m->gc_pending = 0;
+			vacuum_check(m);
+		}
+	}
+
+	while (! m->gc_pending && m->vacuum_pending && elapsed_ms(start) < budget_ms) {
+		int reclaimed = vacuum_step(m);
+
+		if (reclaimed == -1) {
+			// wait until more pages are freed before trying again
+			fputs("Incremental vacuum failed.\n", stderr);
+			m->vacuum_pending = 0;
+		} else if (reclaimed < VACUUM_BATCH)
+			m->vacuum_pending = 0;
+	}
+}
+
+// Do background work in small transactions until budget_ms has passed
+//  or nothing is left to do
+void maint_step(int budget_ms)
+{
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// each idle period starts on the next shard, so a busy one can't starve the rest
+	for (int i = 0; i < dbs_len && elapsed_ms(&start) < budget_ms; i ++)
+		maint_db_step(&dbs[(next_db + i) % dbs_len], &start, budget_ms);
+	next_db = (next_db + 1) % dbs_len;
+
+	idle_ms += elapsed_ms(&start);
+}
+
+// Print storage diagnostics
+void maint_report(FILE * out)
+{
+	int vacuum_enabled = 1;
+
+	for (int i = 0; i < dbs_len; i ++) {
+		const int page_count = stmt_int(dbs[i].stmt_page_count);
+		const int freelist_count = stmt_int(dbs[i].stmt_freelist_count);
+
+		if (dbs_len > 1)
+			fprintf(out, " . Database shard %d: ", i);
+		else
+			fputs(" . Database: ", out);
+		fprintf(out, "%lld bytes (%d pages of %d, %d free)\n",
+			(long long)page_count * dbs[i].page_size, page_count, dbs[i].page_size, freelist_count);
+
+		vacuum_enabled &= dbs[i].vacuum_enabled;
+	}
+
+	fprintf(out, " . Maintenance: %lu expired, %lu messages collected, %llu bytes reclaimed, %ld ms of idle time used%s\n",
+		expired_links, gc_messages, vacuum_bytes, idle_ms, vacuum_enabled ? "" : " (auto_vacuum off)");
+}
@@ -0,0 +1,17 @@
+#ifndef MAINT_H_
+#define MAINT_H_
+
+// for our storage db
+#include <sqlite3.h>
+
+#include <stdio.h>
+
+int maint_setup(sqlite3 * const * db, int len, unsigned int retention_days);
+void maint_teardown();
+
+void maint_gc_notify(int shard);
+int maint_pending();
+void maint_step(int budget_ms);
+void maint_report(FILE * out);
+
+#endif
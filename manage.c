@@ -0,0 +1,961 @@
+/*
+** bridgemail-manage - create a BridgeMail database and manage its accounts
+*  The schema comes from schema.c, the same definitions the server uses.
+*  Account changes can be announced to a running server through its
+*  admin socket, so they take effect right away.
+*/
+
+#include "schema.h"
+// databases split by mailbox
+#include "shard.h"
+
+#include <sqlite3.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// longest username and password POP3 USER / PASS accept
+#define FIELD_MAX 40
+
+// the database named on the command line, which is also shard 0 and
+//  the directory of a sharded layout (see shard.c)
+static sqlite3 * db;
+static sqlite3 * shard_db[SHARD_MAX];
+static int shards = 1;
+
+// a growing CSV field
+struct field {
+	char * data;
+	size_t len, max;
+};
+
+static int field_put(struct field * f, char c)
+{
+	if (f->len + 1 >= f->max) {
+		size_t max = f->max ? f->max * 2 : 64;
+		char * data = realloc(f->data, max);
+
+		if (data == NULL) {
+			perror("realloc(field)");
+			return -1;
+		}
+
+		f->data = data;
+		f->max = max;
+	}
+
+	f->data[f->len ++] = c;
+	return 0;
+}
+
+// Read one CSV record (RFC 4180: quoted fields may hold commas, newlines
+//  and doubled quotes) into at most max fields, NUL-terminated
+//  returns the number of fields, 0 at end of input, -1 if malformed
+static int csv_record(FILE * in, struct field * fields, int max, unsigned long * line)
+{
+	int n = 0, quoted = 0, any = 0, c;
+
+	for (int i = 0; i < max; i ++)
+		fields[i].len = 0;
+
+	while ((c = getc(in)) != EOF) {
+		any = 1;
+
+		if (quoted) {
+			if (c == '"') {
+				const int next = getc(in);
+				if (next != '"') {
+					quoted = 0;
+					if (next != EOF)
+						ungetc(next, in);
+					continue;
+				}
+			} else if (c == '\n')
+				(*line) ++;
+		} else if (c == '"') {
+			quoted = 1;
+			continue;
+		} else if (c == ',') {
+			if (++ n == max)
+				return -1;
+			continue;
+		} else if (c == '\n') {
+			(*line) ++;
+			break;
+		} else if (c == '\r')
+			continue;
+
+		if (field_put(&fields[n], c) == -1)
+			return -1;
+	}
+
+	if (! any)
+		return 0;
+	if (quoted)
+		return -1;
+
+	for (int i = 0; i <= n; i ++)
+		if (field_put(&fields[i], '\0') == -1)
+			return -1;
+
+	return n + 1;
+}
+
+// Tell a running server to pick up account changes
+static int notify(const char * path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Admin socket path %s is too long.\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	char reply[256];
+	ssize_t n = -1;
+
+	if (fd != -1 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+		write(fd, "reload\n", 7) == 7)
+		n = read(fd, reply, sizeof reply - 1);
+
+	if (fd != -1)
+		close(fd);
+
+	if (n <= 0) {
+		perror("admin socket");
+		return -1;
+	}
+
+	reply[n] = '\0';
+	if (strncmp(reply, "OK", 2) != 0) {
+		fprintf(stderr, "Server did not reload: %s", reply);
+		return -1;
+	}
+
+	puts("Server reloaded accounts.");
+	return 0;
+}
+
+// run a statement on a shard with up to two text parameters
+//  returns the number of rows changed, or -1 on error
+static int run(int shard, const char * sql, const char * a, const char * b)
+{
+	sqlite3 * const db = shard_db[shard];
+	sqlite3_stmt * stmt;
+
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+		return -1;
+	}
+
+	sqlite3_bind_text(stmt, 1, a, -1, NULL);
+	sqlite3_bind_text(stmt, 2, b, -1, NULL);
+
+	int rv = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+
+	if (rv != SQLITE_DONE) {
+		fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+		return -1;
+	}
+
+	return sqlite3_changes(db);
+}
+
+// run BEGIN, COMMIT or ROLLBACK on every shard, the directory (shard 0)
+//  last, so it never names a mailbox its shard does not have
+static int run_all(const char * sql)
+{
+	int ret = 0;
+
+	for (int i = shards - 1; i >= 0; i --)
+		if (sqlite3_exec(shard_db[i], sql, NULL, NULL, NULL) != SQLITE_OK) {
+			fprintf(stderr, "%s\n", sqlite3_errmsg(shard_db[i]));
+			ret = -1;
+		}
+
+	return ret;
+}
+
+// 1 if a query with one text parameter returns a row on a shard, 0 if not
+//  returns -1 on error
+static int exists(int shard, const char * sql, const char * a)
+{
+	sqlite3 * const db = shard_db[shard];
+	sqlite3_stmt * stmt;
+
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+		return -1;
+	}
+
+	sqlite3_bind_text(stmt, 1, a, -1, NULL);
+
+	int rv = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+
+	if (rv != SQLITE_ROW && rv != SQLITE_DONE) {
+		fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+		return -1;
+	}
+
+	return rv == SQLITE_ROW;
+}
+
+// 1 if a list of that name has members on any shard, 0 if not, -1 on error
+static int is_list(const char * name)
+{
+	for (int i = 0; i < shards; i ++) {
+		const int rv = exists(i, "SELECT 1 FROM list_member WHERE list_id = ?", name);
+		if (rv != 0)
+			return rv;
+	}
+
+	return 0;
+}
+
+// Find the shard of a user, see shard_find()
+//  an unsharded database has everyone on shard 0, without looking
+static int find_user(const char * user, int * shard)
+{
+	*shard = 0;
+	if (shards == 1)
+		return 1;
+
+	sqlite3_stmt * stmt;
+
+	if (sqlite3_prepare_v2(db, SHARD_FIND_SQL, -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+		return -1;
+	}
+
+	int ret = shard_find(stmt, user, shard);
+	sqlite3_finalize(stmt);
+
+	if (ret == 1 && (*shard < 0 || *shard >= shards)) {
+		fprintf(stderr, "User `%s' is on shard %d, which does not exist.\n", user, *shard);
+		ret = -1;
+	} else if (ret == 0)
+		fprintf(stderr, "No such user `%s'.\n", user);
+
+	return ret;
+}
+
+// Put a new user in the directory
+//  returns 1 if added, 0 if the user is already there, -1 on error
+static int map_user(sqlite3_stmt * stmt, const char * user, int shard)
+{
+	sqlite3_bind_text(stmt, 1, user, -1, NULL);
+	sqlite3_bind_int(stmt, 2, shard);
+	const int rv = sqlite3_step(stmt);
+	sqlite3_reset(stmt);
+
+	if (rv != SQLITE_DONE) {
+		fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+		return -1;
+	}
+
+	return sqlite3_changes(db);
+}
+
+static int check_fields(const char * user, const char * pass)
+{
+	if (user[0] == '\0' || strlen(user) > FIELD_MAX || strchr(user, ' ') != NULL) {
+		fprintf(stderr, "Username `%s' must be 1 to %d characters, without spaces.\n", user, FIELD_MAX);
+		return -1;
+	}
+
+	if (pass != NULL && strlen(pass) > FIELD_MAX) {
+		fprintf(stderr, "Password for `%s' is longer than %d characters.\n", user, FIELD_MAX);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Open (or create) one database of the layout, with its schema up to date
+static sqlite3 * open_db(const char * path, int create)
+{
+	sqlite3 * d;
+
+	if (sqlite3_open_v2(path, &d, SQLITE_OPEN_READWRITE | (create ? SQLITE_OPEN_CREATE : 0), NULL) != SQLITE_OK) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, sqlite3_errmsg(d));
+		sqlite3_close(d);
+		return NULL;
+	}
+
+	// the server may be writing, wait for it rather than failing
+	sqlite3_busy_timeout(d, 5000);
+	sqlite3_exec(d, "PRAGMA foreign_keys = ON", NULL, NULL, NULL);
+
+	// incremental vacuum must be chosen before the first table is created
+	if ((create && sqlite3_exec(d, "PRAGMA auto_vacuum = INCREMENTAL", NULL, NULL, NULL) != SQLITE_OK) ||
+		schema_upgrade(d) == -1) {
+		fprintf(stderr, "Failed to upgrade database schema of %s: %s\n", path, sqlite3_errmsg(d));
+		sqlite3_close(d);
+		return NULL;
+	}
+
+	return d;
+}
+
+// Open the database and the rest of its shards, if it has any
+static int open_layout(const char * path)
+{
+	if ((db = shard_db[0] = open_db(path, 0)) == NULL || (shards = shard_count(db)) == -1)
+		return -1;
+
+	for (int i = 1; i < shards; i ++) {
+		char * name = shard_path(path, i);
+
+		if (name == NULL || (shard_db[i] = open_db(name, 0)) == NULL) {
+			free(name);
+			return -1;
+		}
+		free(name);
+	}
+
+	return 0;
+}
+
+static int createdb(const char * path)
+{
+	// incremental vacuum must be chosen before the first table is created
+	if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK ||
+		sqlite3_exec(db, "PRAGMA auto_vacuum = INCREMENTAL", NULL, NULL, NULL) != SQLITE_OK ||
+		schema_upgrade(db) == -1) {
+		fprintf(stderr, "Failed to create %s: %s\n", path, sqlite3_errmsg(db));
+		return -1;
+	}
+
+	return 0;
+}
+
+// Split the database into n shards, or more of them if it already is
+//  existing mailboxes stay where they are, new ones are spread over all
+static int reshard(const char * path, const char * arg)
+{
+	const int n = atoi(arg);
+
+	if (n <= shards || n > SHARD_MAX) {
+		fprintf(stderr, "Shard count must be more than %d and at most %d.\n", shards, SHARD_MAX);
+		return -1;
+	}
+
+	// new shards hold no mailboxes of their own until the directory says so
+	for (int i = shards; i < n; i ++) {
+		char * name = shard_path(path, i);
+
+		if (name == NULL || (shard_db[i] = open_db(name, 1)) == NULL ||
+			sqlite3_exec(shard_db[i], "DELETE FROM mailbox WHERE NOT EXISTS (SELECT 1 FROM mailbox_message WHERE mailbox_id = mailbox.id)", NULL, NULL, NULL) != SQLITE_OK) {
+			free(name);
+			return -1;
+		}
+
+		free(name);
+	}
+
+	sqlite3_stmt * stmt;
+
+	if (sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO shard(id) VALUES(?)", -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+		sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+		return -1;
+	}
+
+	int rv = SQLITE_DONE;
+	for (int i = 0; i < n && rv == SQLITE_DONE; i ++) {
+		sqlite3_bind_int(stmt, 1, i);
+		rv = sqlite3_step(stmt);
+		sqlite3_reset(stmt);
+	}
+	sqlite3_finalize(stmt);
+
+	// the mailboxes of an unsharded database are all on shard 0
+	if (rv != SQLITE_DONE ||
+		sqlite3_exec(db, "INSERT OR IGNORE INTO shard_map(mailbox_id, shard) SELECT id, 0 FROM mailbox", NULL, NULL, NULL) != SQLITE_OK ||
+		sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+		sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+		return -1;
+	}
+
+	printf("Database is split into %d shards, restart the server to use them.\n", n);
+	shards = n;
+	return 0;
+}
+
+// A new user goes on the shard its name hashes to
+static int adduser(const char * user, const char * pass)
+{
+	if (check_fields(user, pass) == -1)
+		return -1;
+
+	// mail to a list's name goes to the list
+	const int listed = is_list(user);
+	if (listed != 0) {
+		if (listed == 1)
+			fprintf(stderr, "There is already a list named `%s'.\n", user);
+		return -1;
+	}
+
+	if (shards == 1) {
+		int ret = run(0, "INSERT OR IGNORE INTO mailbox(id, auth) VALUES(?, ?)", user, pass);
+		if (ret == 0) {
+			fprintf(stderr, "User `%s' already exists.\n", user);
+			ret = -1;
+		}
+		return ret;
+	}
+
+	const int shard = shard_hash(user, shards);
+	sqlite3_stmt * stmt;
+
+	if (sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO shard_map(mailbox_id, shard) VALUES(?, ?)", -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+		sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+		return -1;
+	}
+
+	int ret = map_user(stmt, user, shard);
+	sqlite3_finalize(stmt);
+
+	if (ret == 0)
+		fprintf(stderr, "User `%s' already exists.\n", user);
+
+	// the directory decides who exists, so a leftover row on the shard is taken over
+	if (ret == 1)
+		ret = run(shard, "INSERT INTO mailbox(id, auth) VALUES(?, ?) ON CONFLICT(id) DO UPDATE SET auth = excluded.auth", user, pass);
+
+	if (ret <= 0 || sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+		sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int changepassword(const char * user, const char * pass)
+{
+	int shard;
+
+	if (check_fields(user, pass) == -1 || find_user(user, &shard) != 1)
+		return -1;
+
+	int ret = run(shard, "UPDATE mailbox SET auth = ?2 WHERE id = ?1", user, pass);
+	if (ret == 0) {
+		fprintf(stderr, "No such user `%s'.\n", user);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+static int listusers()
+{
+	sqlite3_stmt * stmt;
+
+	// the directory has everyone, shard 0 only its own share
+	if (sqlite3_prepare_v2(db, shards == 1 ? "SELECT id FROM mailbox ORDER BY id" : "SELECT mailbox_id FROM shard_map ORDER BY mailbox_id", -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+		return -1;
+	}
+
+	while (sqlite3_step(stmt) == SQLITE_ROW)
+		puts((const char *)sqlite3_column_text(stmt, 0));
+
+	sqlite3_finalize(stmt);
+	return 0;
+}
+
+// Set a user's quota from a message count and a size in MiB,
+//  "-" for either puts it back to the server's default
+static int setquota(const char * user, const char * messages, const char * mb)
+{
+	int shard;
+
+	if (find_user(user, &shard) != 1)
+		return -1;
+
+	sqlite3 * const db = shard_db[shard];
+	sqlite3_stmt * stmt;
+
+	if (sqlite3_prepare_v2(db, "UPDATE mailbox SET quota_messages = ?2, quota_bytes = ?3 WHERE id = ?1", -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+		return -1;
+	}
+
+	sqlite3_bind_text(stmt, 1, user, -1, NULL);
+	if (strcmp(messages, "-") != 0)
+		sqlite3_bind_int64(stmt, 2, strtoull(messages, NULL, 10));
+	if (strcmp(mb, "-") != 0)
+		sqlite3_bind_int64(stmt, 3, strtoull(mb, NULL, 10) * 1024 * 1024);
+
+	const int rv = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+
+	if (rv != SQLITE_DONE) {
+		fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+		return -1;
+	}
+
+	if (sqlite3_changes(db) == 0) {
+		fprintf(stderr, "No such user `%s'.\n", user);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Set how many days a user's mail is kept, 0 for ever,
+//  "-" puts it back to the server's default
+//  (the server looks at it on its next expiry pass)
+static int setretention(const char * user, const char * days)
+{
+	int shard;
+
+	if (find_user(user, &shard) != 1)
+		return -1;
+
+	sqlite3 * const db = shard_db[shard];
+	sqlite3_stmt * stmt;
+
+	if (sqlite3_prepare_v2(db, "UPDATE mailbox SET retention = ?2 WHERE id = ?1", -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+		return -1;
+	}
+
+	sqlite3_bind_text(stmt, 1, user, -1, NULL);
+	if (strcmp(days, "-") != 0)
+		sqlite3_bind_int64(stmt, 2, strtoull(days, NULL, 10));
+
+	const int rv = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+
+	if (rv != SQLITE_DONE) {
+		fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+		return -1;
+	}
+
+	if (sqlite3_changes(db) == 0) {
+		fprintf(stderr, "No such user `%s'.\n", user);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Print the usage and quota of every user, or just one
+//  an unset quota prints as "-", meaning the server's default
+//  a sharded database lists users shard by shard
+static int showquota(const char * user)
+{
+	int first = 0, last = shards - 1;
+
+	if (user != NULL) {
+		if (find_user(user, &first) != 1)
+			return -1;
+		last = first;
+	}
+
+	printf("%-40s %10s %14s %10s %14s %6s\n", "user", "messages", "bytes", "quota", "quota bytes", "days");
+
+	for (int i = first; i <= last; i ++) {
+		sqlite3 * const db = shard_db[i];
+		sqlite3_stmt * stmt;
+
+		if (sqlite3_prepare_v2(db, "SELECT id, messages, bytes, quota_messages, quota_bytes, retention FROM mailbox WHERE ?1 IS NULL OR id = ?1 ORDER BY id", -1, &stmt, NULL) != SQLITE_OK) {
+			fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+			return -1;
+		}
+
+		sqlite3_bind_text(stmt, 1, user, -1, NULL);
+
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			printf("%-40s %10lld %14lld %10s %14s %6s\n",
+				(const char *)sqlite3_column_text(stmt, 0),
+				sqlite3_column_int64(stmt, 1),
+				sqlite3_column_int64(stmt, 2),
+				sqlite3_column_type(stmt, 3) == SQLITE_NULL ? "-" : (const char *)sqlite3_column_text(stmt, 3),
+				sqlite3_column_type(stmt, 4) == SQLITE_NULL ? "-" : (const char *)sqlite3_column_text(stmt, 4),
+				sqlite3_column_type(stmt, 5) == SQLITE_NULL ? "-" : (const char *)sqlite3_column_text(stmt, 5));
+		}
+
+		sqlite3_finalize(stmt);
+	}
+
+	return 0;
+}
+
+// The user's mail and list memberships go with the account, in one transaction
+//  (message bodies are swept by the server once nothing links to them)
+//  then the user leaves the directory
+static int deleteuser(const char * user)
+{
+	int shard;
+
+	if (find_user(user, &shard) != 1)
+		return -1;
+
+	sqlite3 * const db = shard_db[shard];
+
+	if (sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK)
+		return -1;
+
+	int rv = run(shard, "DELETE FROM mailbox_message WHERE mailbox_id = ?", user, NULL);
+	if (rv != -1)
+		rv = run(shard, "DELETE FROM list_member WHERE mailbox_id = ?", user, NULL);
+	if (rv != -1)
+		rv = run(shard, "DELETE FROM mailbox WHERE id = ?", user, NULL);
+
+	if (rv == 0)
+		fprintf(stderr, "No such user `%s'.\n", user);
+
+	if (rv <= 0 || sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+		sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+		return -1;
+	}
+
+	if (shards > 1 && run(0, "DELETE FROM shard_map WHERE mailbox_id = ?", user, NULL) == -1)
+		return -1;
+
+	return 0;
+}
+
+// Add users to a list, which is created if it has no members yet
+//  each member's row goes on that member's shard, all in one transaction
+static int addlist(const char * list, char * const * members, int len)
+{
+	if (check_fields(list, NULL) == -1)
+		return -1;
+
+	const int taken = shards == 1 ?
+		exists(0, "SELECT 1 FROM mailbox WHERE id = ?", list) :
+		exists(0, "SELECT 1 FROM shard_map WHERE mailbox_id = ?", list);
+	if (taken != 0) {
+		if (taken == 1)
+			fprintf(stderr, "There is already a user named `%s'.\n", list);
+		return -1;
+	}
+
+	if (run_all("BEGIN") == -1) {
+		run_all("ROLLBACK");
+		return -1;
+	}
+
+	int ret = 0;
+	for (int i = 0; i < len && ret == 0; i ++) {
+		int shard, rv;
+
+		if (find_user(members[i], &shard) != 1 ||
+			(rv = exists(shard, "SELECT 1 FROM mailbox WHERE id = ?", members[i])) == -1)
+			ret = -1;
+		else if (rv == 0) {
+			fprintf(stderr, "No such user `%s'.\n", members[i]);
+			ret = -1;
+		} else if (run(shard, "INSERT OR IGNORE INTO list_member(list_id, mailbox_id) VALUES(?, ?)", list, members[i]) == -1)
+			ret = -1;
+	}
+
+	if (ret == 0 && run_all("COMMIT") == -1)
+		ret = -1;
+	if (ret == -1)
+		run_all("ROLLBACK");
+
+	return ret;
+}
+
+// Take users off a list, or remove the whole list if none are given
+static int dellist(const char * list, char * const * members, int len)
+{
+	if (run_all("BEGIN") == -1) {
+		run_all("ROLLBACK");
+		return -1;
+	}
+
+	int ret = 0, removed = 0;
+	for (int i = 0; i < shards && ret == 0 && len == 0; i ++) {
+		const int rv = run(i, "DELETE FROM list_member WHERE list_id = ?", list, NULL);
+		if (rv == -1)
+			ret = -1;
+		else
+			removed += rv;
+	}
+
+	if (ret == 0 && len == 0 && removed == 0) {
+		fprintf(stderr, "No such list `%s'.\n", list);
+		ret = -1;
+	}
+
+	for (int i = 0; i < len && ret == 0; i ++) {
+		int shard, rv = -1;
+
+		if (find_user(members[i], &shard) == 1)
+			rv = run(shard, "DELETE FROM list_member WHERE list_id = ? AND mailbox_id = ?", list, members[i]);
+		if (rv == 0)
+			fprintf(stderr, "User `%s' is not on list `%s'.\n", members[i], list);
+		if (rv <= 0)
+			ret = -1;
+	}
+
+	if (ret == 0 && run_all("COMMIT") == -1)
+		ret = -1;
+	if (ret == -1)
+		run_all("ROLLBACK");
+
+	return ret;
+}
+
+// Print every list member as a "list user" line
+//  a sharded database lists members shard by shard
+static int listlists()
+{
+	for (int i = 0; i < shards; i ++) {
+		sqlite3 * const db = shard_db[i];
+		sqlite3_stmt * stmt;
+
+		if (sqlite3_prepare_v2(db, "SELECT list_id, mailbox_id FROM list_member ORDER BY list_id, mailbox_id", -1, &stmt, NULL) != SQLITE_OK) {
+			fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+			return -1;
+		}
+
+		while (sqlite3_step(stmt) == SQLITE_ROW)
+			printf("%s %s\n", (const char *)sqlite3_column_text(stmt, 0), (const char *)sqlite3_column_text(stmt, 1));
+
+		sqlite3_finalize(stmt);
+	}
+
+	return 0;
+}
+
+// Add or update every user in a CSV file of username,password lines,
+//  all in one transaction (per shard): one bad line and nothing is changed
+static int importusers(const char * path)
+{
+	FILE * in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+
+	if (in == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	sqlite3_stmt * stmt_exists[SHARD_MAX] = { NULL }, * stmt_upsert[SHARD_MAX] = { NULL };
+	sqlite3_stmt * stmt_find = NULL, * stmt_map = NULL;
+	int ret = 0, n = 0;
+
+	for (int i = 0; i < shards && ret == 0; i ++)
+		if (sqlite3_prepare_v2(shard_db[i], "SELECT auth IS ? FROM mailbox WHERE id = ?", -1, &stmt_exists[i], NULL) != SQLITE_OK ||
+			sqlite3_prepare_v2(shard_db[i], "INSERT INTO mailbox(id, auth) VALUES(?, ?) ON CONFLICT(id) DO UPDATE SET auth = excluded.auth", -1, &stmt_upsert[i], NULL) != SQLITE_OK) {
+			fprintf(stderr, "%s\n", sqlite3_errmsg(shard_db[i]));
+			ret = -1;
+		}
+
+	if (ret == 0 && shards > 1 &&
+		(sqlite3_prepare_v2(db, SHARD_FIND_SQL, -1, &stmt_find, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, "INSERT INTO shard_map(mailbox_id, shard) VALUES(?, ?)", -1, &stmt_map, NULL) != SQLITE_OK)) {
+		fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+		ret = -1;
+	}
+
+	if (ret == 0 && run_all("BEGIN") == -1) {
+		run_all("ROLLBACK");
+		ret = -1;
+	}
+
+	struct field fields[2] = { { 0 } };
+	unsigned long line = 1, added = 0, changed = 0, unchanged = 0;
+
+	while (ret == 0 && (n = csv_record(in, fields, 2, &line)) != 0) {
+		// blank lines are skipped
+		if (n == 1 && fields[0].len == 1)
+			continue;
+
+		if (n != 2) {
+			if (n != -1)
+				fprintf(stderr, "%s:%lu: expected username,password\n", path, line - 1);
+			ret = -1;
+			break;
+		}
+
+		const char * user = fields[0].data, * pass = fields[1].data;
+
+		if (check_fields(user, pass) == -1) {
+			fprintf(stderr, "%s:%lu: bad account\n", path, line - 1);
+			ret = -1;
+			break;
+		}
+
+		// new users are placed by hash, and join the directory
+		int shard = 0, rv = 1;
+		if (shards > 1 && (rv = shard_find(stmt_find, user, &shard)) == 0)
+			rv = map_user(stmt_map, user, shard = shard_hash(user, shards));
+
+		if (rv == -1 || shard < 0 || shard >= shards) {
+			fprintf(stderr, "%s:%lu: cannot place `%s' on a shard\n", path, line - 1, user);
+			ret = -1;
+			break;
+		}
+
+		sqlite3_bind_text(stmt_exists[shard], 1, pass, -1, NULL);
+		sqlite3_bind_text(stmt_exists[shard], 2, user, -1, NULL);
+		rv = sqlite3_step(stmt_exists[shard]);
+
+		if (rv == SQLITE_DONE)
+			added ++;
+		else if (rv == SQLITE_ROW && sqlite3_column_int(stmt_exists[shard], 0))
+			unchanged ++;
+		else
+			changed ++;
+		sqlite3_reset(stmt_exists[shard]);
+
+		sqlite3_bind_text(stmt_upsert[shard], 1, user, -1, NULL);
+		sqlite3_bind_text(stmt_upsert[shard], 2, pass, -1, NULL);
+		rv = sqlite3_step(stmt_upsert[shard]);
+		sqlite3_reset(stmt_upsert[shard]);
+
+		if (rv != SQLITE_DONE) {
+			fprintf(stderr, "%s:%lu: %s\n", path, line - 1, sqlite3_errmsg(shard_db[shard]));
+			ret = -1;
+			break;
+		}
+	}
+
+	if (n == -1)
+		fprintf(stderr, "%s:%lu: malformed CSV\n", path, line);
+
+	if (ret == 0 && run_all("COMMIT") == -1)
+		ret = -1;
+
+	if (ret == 0)
+		printf("%lu users added, %lu passwords changed, %lu unchanged.\n", added, changed, unchanged);
+	else {
+		run_all("ROLLBACK");
+		fputs("No users were imported.\n", stderr);
+	}
+
+	for (int i = 0; i < shards; i ++) {
+		sqlite3_finalize(stmt_exists[i]);
+		sqlite3_finalize(stmt_upsert[i]);
+	}
+	sqlite3_finalize(stmt_find);
+	sqlite3_finalize(stmt_map);
+	free(fields[0].data);
+	free(fields[1].data);
+	if (in != stdin)
+		fclose(in);
+	return ret;
+}
+
+static void usage()
+{
+	printf("Usage: bridgemail-manage [-a admin_socket] /path/to/mail.db <command>\n"
+		"  createdb\n"
+		"  compact                      (with the server stopped)\n"
+		"  shard <count>                (with the server stopped)\n"
+		"  adduser <username> <password>\n"
+		"  changepassword <username> <password>\n"
+		"  deleteuser <username>\n"
+		"  listusers\n"
+		"  setquota <username> <messages> <MiB>        0 for no limit, - for the server's default\n"
+		"  setretention <username> <days>              0 to keep mail for ever, - for the server's default\n"
+		"  showquota [username]\n"
+		"  importusers <file.csv|->     username,password per line\n"
+		"  addlist <list> <username>...\n"
+		"  dellist <list> [username...]   the whole list if no users are given\n"
+		"  listlists\n");
+}
+
+int main(int argc, char * argv[])
+{
+	const char * admin = NULL;
+	int c;
+
+	while ((c = getopt(argc, argv, "a:")) != -1)
+		switch (c) {
+		case 'a': admin = optarg; break;
+		default:
+			return EXIT_FAILURE;
+		}
+
+	if (argc - optind < 2) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	const char * path = argv[optind];
+	const char * cmd = argv[optind + 1];
+	char * const * args = &argv[optind + 2];
+	const int args_len = argc - optind - 2;
+
+	if (strcmp(cmd, "createdb") == 0 && args_len == 0) {
+		int ret = createdb(path);
+		sqlite3_close(db);
+		return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	// 1 if accounts changed, so a running server should hear about it
+	int ret, changed = 0;
+
+	if (open_layout(path) == -1)
+		ret = -1;
+	else if (strcmp(cmd, "compact") == 0 && args_len == 0) {
+		// rebuilds the database in auto_vacuum=INCREMENTAL mode, so the
+		//  server can give freed space back while running
+		ret = 0;
+		for (int i = 0; i < shards && ret == 0; i ++)
+			if (sqlite3_exec(shard_db[i], "PRAGMA auto_vacuum = INCREMENTAL; VACUUM", NULL, NULL, NULL) != SQLITE_OK) {
+				fprintf(stderr, "%s\n", sqlite3_errmsg(shard_db[i]));
+				ret = -1;
+			}
+	} else if (strcmp(cmd, "shard") == 0 && args_len == 1)
+		ret = reshard(path, args[0]);
+	else if (strcmp(cmd, "adduser") == 0 && args_len == 2) {
+		ret = adduser(args[0], args[1]);
+		changed = 1;
+	} else if (strcmp(cmd, "changepassword") == 0 && args_len == 2) {
+		ret = changepassword(args[0], args[1]);
+		changed = 1;
+	} else if (strcmp(cmd, "deleteuser") == 0 && args_len == 1) {
+		ret = deleteuser(args[0]);
+		changed = 1;
+	} else if (strcmp(cmd, "listusers") == 0 && args_len == 0)
+		ret = listusers();
+	else if (strcmp(cmd, "setquota") == 0 && args_len == 3) {
+		ret = setquota(args[0], args[1], args[2]);
+		changed = 1;
+	} else if (strcmp(cmd, "setretention") == 0 && args_len == 2)
+		ret = setretention(args[0], args[1]);
+	else if (strcmp(cmd, "showquota") == 0 && args_len <= 1)
+		ret = showquota(args_len == 1 ? args[0] : NULL);
+	else if (strcmp(cmd, "importusers") == 0 && args_len == 1) {
+		ret = importusers(args[0]);
+		changed = 1;
+	} else if (strcmp(cmd, "addlist") == 0 && args_len >= 2) {
+		ret = addlist(args[0], &args[1], args_len - 1);
+		changed = 1;
+	} else if (strcmp(cmd, "dellist") == 0 && args_len >= 1) {
+		ret = dellist(args[0], &args[1], args_len - 1);
+		changed = 1;
+	} else if (strcmp(cmd, "listlists") == 0 && args_len == 0)
+		ret = listlists();
+	else {
+		usage();
+		ret = -1;
+	}
+
+	for (int i = 0; i < SHARD_MAX; i ++)
+		sqlite3_close(shard_db[i]);
+
+	if (ret != -1 && changed && admin != NULL && notify(admin) == -1)
+		ret = -1;
+
+	return ret == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
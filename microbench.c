@@ -0,0 +1,368 @@
+/*
+** bridgemail-microbench - time the protocol handlers and storage calls
+*  Feeds prepared command buffers straight into smtp_process() and
+*  pop3_process(), with replies going to a loopback transport, on a
+*  throwaway database.  Reports ns per command and per byte.
+*/
+
+#include "smtp.h"
+#include "pop3.h"
+#include "storage.h"
+#include "schema.h"
+#include "transport.h"
+#include "arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+// same as the receive buffer in main.c
+#define CHUNK 1460
+// mailboxes in the scratch database
+#define USERS 1000
+// recipient limit, high enough for the fan-out cases
+#define RCPT_MAX 100000
+
+// where results go, since the handlers write their logs to stdout / stderr
+static FILE * out;
+// replies are counted and thrown away
+static struct transport * sink;
+// iteration count multiplier
+static unsigned long scale = 1;
+
+static long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void report(const char * name, unsigned long ops, size_t bytes, long long ns)
+{
+	fprintf(out, "%-26s %9lu ops %12.1f ns/op", name, ops, (double)ns / ops);
+	if (bytes)
+		fprintf(out, " %10.3f ns/byte", (double)ns / bytes);
+	fputc('\n', out);
+	fflush(out);
+}
+
+// a growable buffer of protocol input
+struct buffer {
+	char * data;
+	size_t len, max;
+	unsigned long lines;
+};
+
+static void append(struct buffer * b, const char * fmt, ...)
+{
+	va_list ap;
+
+	for (;;) {
+		va_start(ap, fmt);
+		int n = vsnprintf(b->data + b->len, b->max - b->len, fmt, ap);
+		va_end(ap);
+
+		if (n >= 0 && (size_t)n < b->max - b->len) {
+			b->len += n;
+			b->lines ++;
+			return;
+		}
+
+		b->max = b->max * 2 + 4096;
+		b->data = realloc(b->data, b->max);
+		if (b->data == NULL) {
+			perror("realloc(buffer)");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+// message body lines, 78 characters each
+static void append_body(struct buffer * b, size_t size)
+{
+	for (size_t i = 0; i < size; i += 80)
+		append(b, "%.78s\r\n", "abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz");
+}
+
+// run a whole SMTP session from a buffer, in receive-sized pieces
+static long long run_smtp(const struct buffer * b)
+{
+	struct smtp * s = smtp_init(sink);
+	if (s == NULL)
+		exit(EXIT_FAILURE);
+
+	const long long start = now_ns();
+	for (size_t i = 0; i < b->len; i += CHUNK) {
+		const int len = (b->len - i < CHUNK) ? b->len - i : CHUNK;
+		if (smtp_process(s, b->data + i, len, sink) == -1)
+			break;
+	}
+	const long long ns = now_ns() - start;
+
+	smtp_free(s);
+	return ns;
+}
+
+static long long run_pop3(const struct buffer * b)
+{
+	struct pop3 * s = pop3_init(sink, NULL);
+	if (s == NULL)
+		exit(EXIT_FAILURE);
+
+	const long long start = now_ns();
+	for (size_t i = 0; i < b->len; i += CHUNK) {
+		const int len = (b->len - i < CHUNK) ? b->len - i : CHUNK;
+		if (pop3_process(s, b->data + i, len, sink) == -1)
+			break;
+	}
+	const long long ns = now_ns() - start;
+
+	pop3_free(s);
+	return ns;
+}
+
+static void bench_get_address()
+{
+	const unsigned long n = 1000000 * scale;
+	struct arena a;
+	arena_init(&a);
+
+	const long long start = now_ns();
+	for (unsigned long i = 0; i < n; i ++) {
+		get_address(&a, "TO", "TO:<user123@example.com>");
+		arena_reset(&a);
+	}
+	report("get_address", n, 0, now_ns() - start);
+	arena_free(&a);
+}
+
+// the line framer and command dispatch, with no storage behind them
+static void bench_smtp_flood()
+{
+	struct buffer b = { 0 };
+	append(&b, "HELO bench\r\n");
+	for (unsigned long i = 0; i < 100000 * scale; i ++)
+		append(&b, "NOOP\r\n");
+	append(&b, "QUIT\r\n");
+
+	report("smtp NOOP flood", b.lines, b.len, run_smtp(&b));
+	free(b.data);
+}
+
+static void bench_smtp_rcpt(unsigned long rcpts)
+{
+	struct buffer b = { 0 };
+	append(&b, "HELO bench\r\nMAIL FROM:<user0@localhost>\r\n");
+	for (unsigned long i = 0; i < rcpts; i ++)
+		append(&b, "RCPT TO:<user%lu@localhost>\r\n", i % USERS);
+	append(&b, "DATA\r\n");
+	append_body(&b, 1024);
+	append(&b, ".\r\nQUIT\r\n");
+
+	char name[64];
+	snprintf(name, sizeof name, "smtp %lu RCPT", rcpts);
+	report(name, b.lines, b.len, run_smtp(&b));
+	free(b.data);
+}
+
+static void bench_smtp_data(size_t size)
+{
+	struct buffer b = { 0 };
+	append(&b, "HELO bench\r\nMAIL FROM:<user0@localhost>\r\nRCPT TO:<user1@localhost>\r\nDATA\r\n");
+	append_body(&b, size);
+	append(&b, ".\r\nQUIT\r\n");
+
+	char name[64];
+	snprintf(name, sizeof name, "smtp DATA %zu KiB", size / 1024);
+	report(name, b.lines, b.len, run_smtp(&b));
+	free(b.data);
+}
+
+// fill user2's maildrop, then time STAT and a full download
+static void bench_pop3(unsigned long messages, size_t size)
+{
+	struct buffer b = { 0 };
+	append_body(&b, size);
+	char * rcpt[] = { "user2" };
+	for (unsigned long i = 0; i < messages; i ++)
+		if (storage_store_message(b.data, b.len, rcpt, 1) == -1) {
+			fputs("Failed to store message.\n", out);
+			exit(EXIT_FAILURE);
+		}
+
+	b.len = b.lines = 0;
+	append(&b, "USER user2\r\nPASS pw\r\n");
+	for (unsigned long i = 0; i < 100000 * scale; i ++)
+		append(&b, "STAT\r\n");
+	append(&b, "QUIT\r\n");
+	report("pop3 STAT flood", b.lines, b.len, run_pop3(&b));
+
+	b.len = b.lines = 0;
+	append(&b, "USER user2\r\nPASS pw\r\nLIST\r\n");
+	for (unsigned long i = 1; i <= messages; i ++)
+		append(&b, "RETR %lu\r\n", i);
+	append(&b, "QUIT\r\n");
+
+	// per byte of replies, headers and all
+	char name[64];
+	snprintf(name, sizeof name, "pop3 RETR %zu KiB", size / 1024);
+	const unsigned long long before = transport_loopback_total(sink);
+	const long long ns = run_pop3(&b);
+	report(name, b.lines, transport_loopback_total(sink) - before, ns);
+
+	free(b.data);
+}
+
+// raw SQLite costs of the statements the handlers use
+static void bench_sqlite(const char * path)
+{
+	sqlite3 * db;
+	sqlite3_stmt * stmt;
+	const char * sql = "SELECT EXISTS(SELECT 1 FROM mailbox WHERE id=? AND auth=?)";
+	const unsigned long n = 100000 * scale;
+
+	if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+		fputs("Failed to open database.\n", out);
+		exit(EXIT_FAILURE);
+	}
+
+	long long start = now_ns();
+	for (unsigned long i = 0; i < n; i ++) {
+		sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+		sqlite3_finalize(stmt);
+	}
+	report("sqlite prepare+finalize", n, 0, now_ns() - start);
+
+	sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	start = now_ns();
+	for (unsigned long i = 0; i < n; i ++) {
+		sqlite3_bind_text(stmt, 1, "user500", -1, NULL);
+		sqlite3_bind_text(stmt, 2, "pw", -1, NULL);
+		sqlite3_step(stmt);
+		sqlite3_reset(stmt);
+	}
+	report("sqlite bind+step+reset", n, 0, now_ns() - start);
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+
+	start = now_ns();
+	for (unsigned long i = 0; i < n; i ++)
+		storage_check_mailbox("user500", NULL);
+	report("storage_check_mailbox", n, 0, now_ns() - start);
+}
+
+// create the scratch database with the server's own schema
+static int create_db(const char * path)
+{
+	sqlite3 * db;
+	sqlite3_stmt * stmt;
+
+	if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK ||
+		sqlite3_exec(db, "PRAGMA auto_vacuum = INCREMENTAL", NULL, NULL, NULL) != SQLITE_OK ||
+		schema_upgrade(db) == -1 ||
+		sqlite3_prepare_v2(db, "INSERT INTO mailbox(id, auth) VALUES(?, 'pw')", -1, &stmt, NULL) != SQLITE_OK) {
+		sqlite3_close(db);
+		return -1;
+	}
+
+	sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+	for (int i = 0; i < USERS; i ++) {
+		char user[16];
+		sprintf(user, "user%d", i);
+		sqlite3_bind_text(stmt, 1, user, -1, SQLITE_TRANSIENT);
+		sqlite3_step(stmt);
+		sqlite3_reset(stmt);
+	}
+	sqlite3_finalize(stmt);
+	sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+
+	sqlite3_close(db);
+	return 0;
+}
+
+int main(int argc, char * argv[])
+{
+	const char * backend = NULL;
+	struct storage_options options = { 0 };
+	int verbose = 0, c;
+
+	while ((c = getopt(argc, argv, "b:d:S:c:n:v")) != -1)
+		switch (c) {
+		case 'b': backend = optarg; break;
+		case 'd': options.profile = optarg; break;
+		case 'S': options.spool = optarg; break;
+		case 'c': options.cache_mb = strtoul(optarg, NULL, 10); break;
+		case 'n': scale = strtoul(optarg, NULL, 10); break;
+		case 'v': verbose = 1; break;
+		default:
+			printf("Usage: bridgemail-microbench [-b sqlite|memory] [-d strict|balanced|fast] [-S spool_dir] [-c cache_mb] [-n scale] [-v]\n");
+			return EXIT_FAILURE;
+		}
+
+	if (scale == 0)
+		scale = 1;
+
+	// results on the real stdout, handler chatter thrown away unless -v
+	out = fdopen(dup(STDOUT_FILENO), "w");
+	if (out == NULL) {
+		perror("fdopen");
+		return EXIT_FAILURE;
+	}
+
+	if (! verbose) {
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		close(null);
+	}
+
+	char dir[] = "/tmp/bridgemail-microbench.XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+
+	char path[sizeof dir + 16];
+	sprintf(path, "%s/mail.db", dir);
+
+	if (create_db(path) == -1 || storage_setup(backend, path, &options) == -1 ||
+		smtp_setup(RCPT_MAX, 0, 0) == -1 || pop3_setup() == -1) {
+		fputs("Setup failed (run with -v for details).\n", out);
+		return EXIT_FAILURE;
+	}
+
+	sink = transport_loopback(0);
+	if (sink == NULL)
+		return EXIT_FAILURE;
+
+	bench_get_address();
+	bench_smtp_flood();
+	bench_smtp_rcpt(10);
+	bench_smtp_rcpt(1000);
+	bench_smtp_data(4 * 1024);
+	bench_smtp_data(64 * 1024);
+	bench_smtp_data(1024 * 1024);
+	bench_pop3(100 * scale, 64 * 1024);
+	bench_sqlite(path);
+
+	transport_close(sink);
+
+	pop3_teardown();
+	smtp_teardown();
+	storage_teardown();
+
+	// the spool is the caller's, only the scratch database is ours
+	static const char * const suffix[] = { "", "-wal", "-shm" };
+	for (size_t i = 0; i < sizeof(suffix) / sizeof(suffix[0]); i ++) {
+		sprintf(path, "%s/mail.db%s", dir, suffix[i]);
+		unlink(path);
+	}
+	rmdir(dir);
+
+	fclose(out);
+	return 0;
+}
@@ -1,9 +1,13 @@
 #include "pop3.h"
+#include "storage.h"
+#include "transport.h"
+#include "command.h"
+#include "throttle.h"
+#include "probes.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#include <sys/socket.h>
 #include <unistd.h>
 #include <ctype.h>
 
@@ -13,6 +17,9 @@
 
 static const char * eOK = "+OK\r\n";
 static const char * eERR = "-ERR\r\n";
+// RFC 3206: the client should try again later
+static const char * eERR_temp = "-ERR [SYS/TEMP] Unable to reach the maildrop, try again later\r\n";
+static const char * eERR_busy = "-ERR [SYS/TEMP] Too many connections, try again later\r\n";
 
 // calculations
 // 4 bytes command + 2x(space + 40char args) + CR
@@ -32,53 +39,53 @@ struct pop3 {
 
 	char username[41];
 
-	struct msg {
-		unsigned int id;
-		unsigned int size;
-		unsigned char deleted;
-	} * store;
+	// the client's address, and a PASS held back by the throttle until
+	//  wake_ms, with the input that came after it
+	char peer[THROTTLE_ADDR_MAX];
+	char password[41];
+	long wake_ms;
+	int check;
+	char * held;
+	int held_len;
+
+	// STLS was accepted, everything since is encrypted
+	int tls;
+
+	// the maildrop, and a DELE mark for each message in it
+	struct storage_msg * store;
+	unsigned char * deleted;
 	size_t store_len;
-};
-
-// prep the sqlite3 statements for use later
-static sqlite3 * db;
-//static sqlite3_stmt * stmt_begin;
-static sqlite3_stmt * stmt_check_login;
-static sqlite3_stmt * stmt_store;
-static sqlite3_stmt * stmt_retr;
-static sqlite3_stmt * stmt_dele;
-//static sqlite3_stmt * stmt_commit;
-//static sqlite3_stmt * stmt_rollback;
-
-int pop3_setup(sqlite3 * parent_db)
-{
-	db = parent_db;
-
-	//if (sqlite3_prepare_v2(db, "BEGIN", -1, &stmt_begin, NULL) != SQLITE_OK) return -1;
-
-	if (sqlite3_prepare_v2(db, "SELECT EXISTS(SELECT 1 FROM mailbox WHERE id=? AND auth=?)", -1, &stmt_check_login, NULL) != SQLITE_OK) return -1;
 
-	if (sqlite3_prepare_v2(db, "SELECT b.id, LENGTH(b.data) FROM mailbox_message a INNER JOIN message b ON a.message_id = b.id WHERE a.mailbox_id = ?", -1, &stmt_store, NULL) != SQLITE_OK) return -1;
+	// what STAT reports: the messages not marked by DELE, and their size
+	size_t stat_len;
+	unsigned long long stat_size;
+};
 
-	if (sqlite3_prepare_v2(db, "SELECT b.data FROM mailbox_message a INNER JOIN message b ON a.message_id = b.id WHERE a.mailbox_id = ? AND a.message_id = ?", -1, &stmt_retr, NULL) != SQLITE_OK) return -1;
-	if (sqlite3_prepare_v2(db, "DELETE FROM mailbox_message WHERE mailbox_id = ? AND message_id = ?", -1, &stmt_dele, NULL) != SQLITE_OK) return -1;
+// defined below, with the command handlers
+static struct command_table pop3_commands;
 
-	//if (sqlite3_prepare_v2(db, "INSERT INTO mailbox_message(mailbox_id, message_id) VALUES(?, ?)", -1, &stmt_insert_recipient, NULL) != SQLITE_OK) return -1;
-	//if (sqlite3_prepare_v2(db, "COMMIT", -1, &stmt_commit, NULL) != SQLITE_OK) return -1;
-	//if (sqlite3_prepare_v2(db, "ROLLBACK", -1, &stmt_rollback, NULL) != SQLITE_OK) return -1;
-	return 0;
+int pop3_setup()
+{
+	return command_table_init(&pop3_commands);
 }
 
 void pop3_teardown()
 {
-	// sqlite3_finalize(stmt_rollback);
-	// sqlite3_finalize(stmt_commit);
-	//sqlite3_finalize(stmt_stat);
-	sqlite3_finalize(stmt_check_login);
-	// sqlite3_finalize(stmt_begin);
 }
 
-struct pop3 * pop3_init(int fd)
+// Turn a new connection away, when there are too many already
+int pop3_refuse(struct transport * t)
+{
+	puts(eERR_busy);
+	if (transport_puts(t, eERR_busy) == -1) {
+		perror("send(ERR_busy)");
+		return -1;
+	}
+
+	return 0;
+}
+
+struct pop3 * pop3_init(struct transport * t, const char * peer)
 {
 	// Send initial "+OK <domain>" to announce connection start
 	char response[23 + HOST_NAME_MAX + 3 + 1] = "+OK POP3 server ready <";
@@ -88,7 +95,7 @@ struct pop3 * pop3_init(int fd)
 
 	strcat(response, ">\r\n");
 
-	if (send(fd, response, strlen(response), 0) == -1) {
+	if (transport_puts(t, response) == -1 || transport_flush(t) == -1) {
 		perror("send");
 		return NULL;
 	}
@@ -102,31 +109,337 @@ struct pop3 * pop3_init(int fd)
 	}
 
 	s->state = INIT;
+	if (peer != NULL)
+		snprintf(s->peer, sizeof s->peer, "%s", peer);
 	return s;
 }
 
-/*
-         USER name               valid in the AUTHORIZATION state
-         PASS string
-         QUIT
+// UPDATE state: remove all messages marked by DELE in one transaction
+//  returns 0 on success, -1 on failure
+static int commit_deletes(const struct pop3 * s)
+{
+	long long * ids = malloc(s->store_len * sizeof(long long));
+
+	if (ids == NULL) {
+		perror("malloc(ids)");
+		return -1;
+	}
+
+	size_t ids_len = 0;
+	for (size_t j = 0; j < s->store_len; j ++) {
+		if (s->deleted[j])
+			ids[ids_len ++] = s->store[j].id;
+	}
+
+	int ret = storage_delete_set(s->username, ids, ids_len);
+
+	free(ids);
+	return ret;
+}
+
+#define RESPONSE(x) { puts( x ); if (transport_puts(t, x) == -1) { perror("send(" #x ")"); return -1; } }
+#define POP3_RESPONSE(x) { puts( e ## x ); if (transport_puts(t, e ## x) == -1) { perror("send(" #x ")"); return -1; } }
+
+// Command handlers
+//  the command table has already checked the argument and state rules
+// RFC 2449: what this server does beyond RFC 1939, STLS only while
+//  it can be used
+static int pop3_capa(void * session, char * arg, struct transport * t)
+{
+	struct pop3 * s = session;
+	(void)arg;
+
+	RESPONSE("+OK Capability list follows\r\nUSER\r\nRESP-CODES\r\n")
+	if (s->state == INIT && ! s->tls && transport_can_starttls(t))
+		RESPONSE("STLS\r\n")
+	RESPONSE(".\r\n")
+	return 0;
+}
+
+// RFC 2595: TLS before USER, after which the session starts over
+static int pop3_stls(void * session, char * arg, struct transport * t)
+{
+	struct pop3 * s = session;
+	(void)arg;
+
+	if (s->tls || ! transport_can_starttls(t))
+		POP3_RESPONSE(ERR)
+	else {
+		RESPONSE("+OK Begin TLS negotiation\r\n")
+		if (transport_starttls(t) == -1)
+			return -1;
+		s->tls = 1;
+	}
+
+	return 0;
+}
+
+static int pop3_quit(void * session, char * arg, struct transport * t)
+{
+	struct pop3 * s = session;
+	(void)arg;
+
+	// enter UPDATE state and remove deleted messages, if any
+	if (s->state == TRANSACTION && commit_deletes(s) == -1) {
+		POP3_RESPONSE(ERR_temp)
+		return -1;
+	}
+	POP3_RESPONSE(OK)
+	return -1;
+}
+
+static int pop3_user(void * session, char * arg, struct transport * t)
+{
+	struct pop3 * s = session;
+
+	if (strlen(arg) > 40)
+		POP3_RESPONSE(ERR)
+	else {
+		// accepted USER, awaiting PASSWORD
+		strcpy(s->username, arg);
+		s->state = AUTH;
+		POP3_RESPONSE(OK)
+	}
+	return 0;
+}
+
+// Answer a PASS, see pop3_pass()
+static int login(struct pop3 * s, const char * pass, int check, struct transport * t)
+{
+	// Check password against DB
+	if (! check || storage_authenticate(s->username, pass) != 1) {
+		throttle_failed(s->peer[0] ? s->peer : NULL, s->username);
+		POP3_RESPONSE(ERR)
+		return 0;
+	}
+
+	// and retrieve the message store
+	PROBE2(pop3_maildrop_start, s, (const char *)s->username);
+	const int rv = storage_list_maildrop(s->username, &s->store, &s->store_len);
+	PROBE4(pop3_maildrop_end, s, (const char *)s->username, s->store_len, rv);
+
+	if (rv == -1) {
+		POP3_RESPONSE(ERR_temp)
+	} else if (s->store_len > 0 && (s->deleted = calloc(s->store_len, 1)) == NULL) {
+		perror("calloc(deleted)");
+		free(s->store);
+		s->store = NULL;
+		s->store_len = 0;
+		POP3_RESPONSE(ERR_temp)
+	} else {
+		s->stat_len = s->store_len;
+		s->stat_size = 0;
+		for (size_t j = 0; j < s->store_len; j ++)
+			s->stat_size += s->store[j].size;
+
+		POP3_RESPONSE(OK)
+		s->state = TRANSACTION;
+	}
+	return 0;
+}
+
+static int pop3_pass(void * session, char * arg, struct transport * t)
+{
+	struct pop3 * s = session;
+
+	if (strlen(arg) > 40) {
+		POP3_RESPONSE(ERR)
+		return 0;
+	}
+
+	// after too many failures, the answer waits, see throttle.c
+	int check;
+	if ((s->wake_ms = throttle_login(s->peer[0] ? s->peer : NULL, s->username, &check)) != 0) {
+		strcpy(s->password, arg);
+		s->check = check;
+		return 0;
+	}
+
+	return login(s, arg, 1, t);
+}
+
+static int pop3_noop(void * session, char * arg, struct transport * t)
+{
+	(void)session;
+	(void)arg;
+
+	POP3_RESPONSE(OK)
+	return 0;
+}
+
+static int pop3_stat(void * session, char * arg, struct transport * t)
+{
+	struct pop3 * s = session;
+	(void)arg;
+
+	char response[1024];
+	sprintf(response, "+OK %zu %llu\r\n", s->stat_len, s->stat_size);
+	RESPONSE(response);
+	return 0;
+}
+
+static int pop3_list(void * session, char * arg, struct transport * t)
+{
+	struct pop3 * s = session;
+
+	if (arg == NULL) {
+		POP3_RESPONSE(OK)
+		for (size_t j = 0; j < s->store_len; j ++) {
+			char response[1024];
+			sprintf(response, "%zu %zu\r\n", j + 1, s->store[j].size);
+			RESPONSE(response);
+		}
+		RESPONSE(".\r\n");
+	} else {
+		int j = atoi(arg);
+		if (j < 1 || (size_t)j > s->store_len)
+			POP3_RESPONSE(ERR)
+		else {
+			char response[1024];
+			sprintf(response, "+OK %d %zu\r\n", j, s->store[j - 1].size);
+			RESPONSE(response);
+		}
+	}
+	return 0;
+}
+
+static int pop3_retr(void * session, char * arg, struct transport * t)
+{
+	struct pop3 * s = session;
+
+	int j = atoi(arg) - 1;
+	if (j < 0 || (size_t)j >= s->store_len) {
+		POP3_RESPONSE(ERR)
+		return 0;
+	}
+
+	PROBE3(pop3_retr_start, s, s->store[j].id, s->store[j].size);
+	struct storage_stream * m = storage_open_message(s->username, s->store[j].id);
+
+	if (m == NULL) {
+		POP3_RESPONSE(ERR)
+		return 0;
+	}
+
+	// stored messages are already dot-stuffed, send them as-is
+	const char * buf;
+	ssize_t n = 0;
+
+	if (transport_puts(t, eOK) == -1) {
+		storage_close_message(m);
+		perror("send(OK)");
+		return -1;
+	}
+
+	// a file-backed body goes to the socket without a copy through user space
+	off_t offset;
+	size_t remain;
+	int in_fd = storage_message_fd(m, &offset, &remain);
+
+	if (in_fd != -1 && transport_sendfile(t, in_fd, &offset, remain) == -1) {
+		storage_close_message(m);
+		perror("sendfile(RETR)");
+		return -1;
+	}
+
+	while (in_fd == -1 && (n = storage_read_message(m, &buf)) > 0) {
+		if (transport_write(t, buf, n) == -1) {
+			storage_close_message(m);
+			perror("send(RETR)");
+			return -1;
+		}
+	}
+
+	storage_close_message(m);
+	PROBE4(pop3_retr_end, s, s->store[j].id, s->store[j].size, (int)n);
+	if (n == -1) {
+		// can't take back the +OK, so drop the connection
+		fputs("Failed to read message.\n", stderr);
+		return -1;
+	}
+
+	RESPONSE(".\r\n");
+	return 0;
+}
+
+static int pop3_dele(void * session, char * arg, struct transport * t)
+{
+	struct pop3 * s = session;
+
+	int j = atoi(arg) - 1;
+	if (j < 0 || (size_t)j >= s->store_len) {
+		POP3_RESPONSE(ERR)
+	} else if (s->deleted[j]) {
+		POP3_RESPONSE(ERR)
+	} else {
+		s->deleted[j] = 1;
+		s->stat_len --;
+		s->stat_size -= s->store[j].size;
+		POP3_RESPONSE(OK)
+	}
+	return 0;
+}
 
-         STAT                    valid in the TRANSACTION state
-         LIST [msg]
-         RETR msg
-         DELE msg
-         NOOP
-         RSET
-         QUIT
+static int pop3_rset(void * session, char * arg, struct transport * t)
+{
+	struct pop3 * s = session;
+	(void)arg;
+
+	for (size_t j = 0; j < s->store_len; j ++) {
+		if (s->deleted[j]) {
+			s->deleted[j] = 0;
+			s->stat_len ++;
+			s->stat_size += s->store[j].size;
+		}
+	}
 
-	TOP
-	UIDL
-*/
+	POP3_RESPONSE(OK)
+	return 0;
+}
 
-int pop3_process(struct pop3 * s, const char * buffer, int len, int fd)
+// TOP and UIDL are accepted but not implemented yet
+static int pop3_stub(void * session, char * arg, struct transport * t)
 {
-#define RESPONSE(x) { puts( x ); if (send(fd, x, strlen(x), 0) == -1) { perror("send(" #x ")"); return -1; } }
-#define POP3_RESPONSE(x) { puts( e ## x ); if (send(fd, e ## x, strlen(e ## x), 0) == -1) { perror("send(" #x ")"); return -1; } }
+	(void)session;
+	(void)arg;
 
+	POP3_RESPONSE(OK)
+	return 0;
+}
+
+#define IN(x) (1u << (x))
+
+static const struct command pop3_command_list[] = {
+	// QUIT and CAPA work at any point
+	{ "QUIT", IN(INIT) | IN(AUTH) | IN(TRANSACTION), ARGS_NONE, pop3_quit },
+	{ "CAPA", IN(INIT) | IN(AUTH) | IN(TRANSACTION), ARGS_NONE, pop3_capa },
+
+	// valid in the AUTHORIZATION state
+	{ "STLS", IN(INIT), ARGS_NONE, pop3_stls },
+	{ "USER", IN(INIT), ARGS_REQUIRED, pop3_user },
+	{ "PASS", IN(AUTH), ARGS_REQUIRED, pop3_pass },
+
+	// valid in the TRANSACTION state
+	{ "STAT", IN(TRANSACTION), ARGS_NONE, pop3_stat },
+	{ "LIST", IN(TRANSACTION), ARGS_OPTIONAL, pop3_list },
+	{ "RETR", IN(TRANSACTION), ARGS_REQUIRED, pop3_retr },
+	{ "DELE", IN(TRANSACTION), ARGS_REQUIRED, pop3_dele },
+	{ "NOOP", IN(TRANSACTION), ARGS_NONE, pop3_noop },
+	{ "RSET", IN(TRANSACTION), ARGS_NONE, pop3_rset },
+	{ "TOP", IN(TRANSACTION), ARGS_REQUIRED, pop3_stub },
+	{ "UIDL", IN(TRANSACTION), ARGS_OPTIONAL, pop3_stub }
+};
+
+static struct command_table pop3_commands = {
+	.commands = pop3_command_list,
+	.len = sizeof(pop3_command_list) / sizeof(pop3_command_list[0]),
+	.unknown = "-ERR\r\n",
+	.bad_args = "-ERR\r\n",
+	.bad_state = "-ERR\r\n"
+};
+
+int pop3_process(struct pop3 * s, const char * buffer, int len, struct transport * t)
+{
 	// process incoming chars
 	for (int i = 0; i < len; i ++) {
 		if (s->line_len > 0 && s->line[s->line_len - 1] == '\r' && buffer[i] == '\n') {
@@ -142,245 +455,35 @@ int pop3_process(struct pop3 * s, const char * buffer, int len, int fd)
 				// debug
 				fprintf(stderr, "Got command: [%s]\n", s->line);
 
-				// tokenize the first bit
-				char * cmd = strtok(s->line, " ");
-
-				// switch action based on cmd
-				if (cmd == NULL) {
-					// empty line
-					POP3_RESPONSE(ERR)
-				} else if (strcasecmp(cmd, "QUIT") == 0) {
-					// QUIT should not have params, and also it works at any point
-					if (strtok(NULL, "") != NULL)
-						POP3_RESPONSE(ERR)
-					else {
-						for (int j = 0; j < s->store_len; j ++) {
-							if (s->store[j].deleted) {
-								sqlite3_bind_text(stmt_dele, 1, s->username, -1, NULL);
-								sqlite3_bind_int(stmt_dele, 2, s->store[j].id);
-								if (sqlite3_step(stmt_dele) != SQLITE_DONE)
-        								printf("Some error encountered\n");
-								sqlite3_reset(stmt_dele);
-							}
-						}
-						// 250 OK
-						POP3_RESPONSE(OK)
-						return -1;
-					}
-				} else if (strcasecmp(cmd, "USER") == 0) {
-					// USER should have one param, the NAME
-					if (s->state != INIT) {
-						// must be issued before anything else
-						POP3_RESPONSE(ERR);
-					} else {
-						char * arg = strtok(NULL, "");
-
-						if (arg == NULL)
-							POP3_RESPONSE(ERR)
-						else if (strlen(arg) > 40)
-							POP3_RESPONSE(ERR)
-						else {
-							// accepted USER, awaiting PASSWORD
-							strcpy(s->username, arg);
-							s->state = AUTH;
-							POP3_RESPONSE(OK)
-						}
-					}
-				} else if (strcasecmp(cmd, "PASS") == 0) {
-					// PASS should have one param, the PASSWORD
-					if (s->state != AUTH) {
-						// must be issued only after sending USER
-						POP3_RESPONSE(ERR)
-					} else {
-						char * arg = strtok(NULL, "");
-
-						if (arg == NULL)
-							POP3_RESPONSE(ERR)
-						else if (strlen(arg) > 40)
-							POP3_RESPONSE(ERR)
-						else {
-							// Check password against DB
-							sqlite3_bind_text(stmt_check_login, 1, s->username, -1, NULL);
-							sqlite3_bind_text(stmt_check_login, 2, arg, -1, NULL);
-                      					if (sqlite3_step(stmt_check_login) != SQLITE_ROW) {
-								POP3_RESPONSE(ERR)
-							} else if (! sqlite3_column_int(stmt_check_login, 0)) {
-								POP3_RESPONSE(ERR)
-							} else {
-								POP3_RESPONSE(OK)
-								s->state = TRANSACTION;
-
-								// and retrieve the message store
-								sqlite3_bind_text(stmt_store, 1, s->username, -1, NULL);
-                      						int retval = sqlite3_step(stmt_store);
-								while (retval == SQLITE_ROW) {
-									s->store = realloc(s->store, (s->store_len + 1) * sizeof(struct msg));
-									if (s->store == NULL) {
-										perror("realloc");
-										exit(1);
-									}
-									s->store[s->store_len].id = sqlite3_column_int(stmt_store, 0);
-									s->store[s->store_len].size = sqlite3_column_int(stmt_store, 1);
-									s->store[s->store_len].deleted = 0;
-									s->store_len ++;
-
-                      							 retval = sqlite3_step(stmt_store);
-								}
-								if (retval != SQLITE_DONE) {
-        								printf("Some error encountered\n");
-								}
-								sqlite3_reset(stmt_store);
-							}
-
-							sqlite3_reset(stmt_check_login);
-						}
-					}
-				} else if (strcasecmp(cmd, "NOOP") == 0) {
-					// NOOP should not have params, and only in state TRANSACTION
-					if (s->state != TRANSACTION)
-						POP3_RESPONSE(ERR)
-					else {
-						if (strtok(NULL, "") != NULL)
-							POP3_RESPONSE(ERR)
-						else
-							POP3_RESPONSE(OK)
-					}
-				} else if (strcasecmp(cmd, "STAT") == 0) {
-					// no args, transaction only
-					if (s->state != TRANSACTION)
-						POP3_RESPONSE(ERR)
-					else {
-						if (strtok(NULL, "") != NULL)
-							POP3_RESPONSE(ERR)
-						else {
-							int store_size = 0;
-							for (int j = 0; j < s->store_len; j ++)
-								store_size += s->store[j].size;
-
-							char response[1024];
-							sprintf(response, "+OK %d %d\r\n", s->store_len, store_size);
-							RESPONSE(response);
-						}
-					}
-                               } else if (strcasecmp(cmd, "LIST") == 0) {
-                                       // arg optional, transaction only
-                                       if (s->state != TRANSACTION)
-                                               POP3_RESPONSE(ERR)
-                                       else {
-                                               char * arg = strtok(NULL, " ");
-
-                                               if (arg == NULL) {
-							POP3_RESPONSE(OK)
-							for (int j = 0; j < s->store_len; j ++) {
-							        char response[1024];
-							        sprintf(response, "%d %d\r\n", j + 1, s->store[i].size);
-							    	RESPONSE(response);
-							}
-							RESPONSE(".\r\n");
-						}
- 
-						else {
-							int j = atoi(arg);
-							if (j < 1 || j > s->store_len)
-								POP3_RESPONSE(ERR)
-							else {
-							        char response[1024];
-							        sprintf(response, "+OK %d %d\r\n", j, s->store[j - 1].size);
-							    	RESPONSE(response);
-							}
-						}
-					}
-				} else if (strcasecmp(cmd, "RETR") == 0) {
-					// message-number, transaction reqd
-					if (s->state != TRANSACTION)
-						POP3_RESPONSE(ERR)
-					else {
-						char * arg = strtok(NULL, " ");
-
-						if (arg == NULL)
-							POP3_RESPONSE(ERR)
-						else {
-							int j = atoi(arg) - 1;
-							if (j < 0 || j >= s->store_len) {
-								POP3_RESPONSE(ERR)
-							} else {
-								POP3_RESPONSE(OK)
-								sqlite3_bind_text(stmt_retr, 1, s->username, -1, NULL);
-								sqlite3_bind_int(stmt_retr, 2, s->store[j].id);
-                      						int retval = sqlite3_step(stmt_retr);
-								while (retval == SQLITE_ROW) {
-								     	RESPONSE(sqlite3_column_text(stmt_retr, 0));
-                      							retval = sqlite3_step(stmt_retr);
-								}
-								if (retval != SQLITE_DONE) {
-        								printf("Some error encountered\n");
-								}
-								RESPONSE(".\r\n");
-        							sqlite3_reset(stmt_retr);
-							}
-						}
-					}
-				} else if (strcasecmp(cmd, "DELE") == 0) {
-					// message-number, transaction reqd
-					if (s->state != TRANSACTION)
-						POP3_RESPONSE(ERR)
-					else {
-						char * arg = strtok(NULL, " ");
-
-						if (arg == NULL)
-							POP3_RESPONSE(ERR)
-						else {
-							int j = atoi(arg) - 1;
-							if (j < 0 || j >= s->store_len) {
-								POP3_RESPONSE(ERR)
-							} else if (s->store[j].deleted) {
-								POP3_RESPONSE(ERR)
-							} else {
-								s->store[j].deleted = 1;
-								POP3_RESPONSE(OK)
-							}
-						}
-					}
-				} else if (strcasecmp(cmd, "RSET") == 0) {
-					// NO arguments, transaction reqd
-					if (s->state != TRANSACTION)
-						POP3_RESPONSE(ERR)
-					else {
-						if (strtok(NULL, "") != NULL)
-							POP3_RESPONSE(ERR)
-						else {
-							for (int j = 0; j < s->store_len; j ++)
-								s->store[j].deleted = 0;
-						
-							POP3_RESPONSE(OK)
+				const int tls = s->tls;
+
+				PROBE2(pop3_command_start, s, s->state);
+				const int rv = command_dispatch(&pop3_commands, s, s->state, s->line, t);
+				// the line has been cut down to the verb
+				PROBE3(pop3_command_end, s, (const char *)s->line, s->state);
+
+				if (rv == -1)
+					return -1;
+
+				// RFC 2595 4: anything pipelined behind STLS was sent
+				//  in the clear, and must not be acted on
+				if (s->tls != tls) {
+					s->line_overflow = s->line_len = 0;
+					return 0;
+				}
+
+				// the rest waits along with the PASS, see pop3_resume()
+				if (s->wake_ms != 0) {
+					s->line_overflow = s->line_len = 0;
+					if (i + 1 < len) {
+						if ((s->held = malloc(len - i - 1)) == NULL) {
+							perror("malloc(held)");
+							return -1;
 						}
+						memcpy(s->held, buffer + i + 1, len - i - 1);
+						s->held_len = len - i - 1;
 					}
-				} else if (strcasecmp(cmd, "TOP") == 0) {
-					// message-number, transaction reqd
-					if (s->state != TRANSACTION)
-						POP3_RESPONSE(ERR)
-					else {
-						char * arg = strtok(NULL, " ");
-
-						if (arg == NULL)
-							POP3_RESPONSE(ERR)
-						else
-							POP3_RESPONSE(OK)
-					}
-				} else if (strcasecmp(s->line, "UIDL") == 0) {
-					if (s->state != TRANSACTION)
-						POP3_RESPONSE(ERR)
-					else {
-						char * arg = strtok(NULL, " ");
-
-						if (arg == NULL)
-							POP3_RESPONSE(OK)
-						else
-							POP3_RESPONSE(OK)
-					}
-				} else {
-					// command error of some sort - unrecognized
-					POP3_RESPONSE(ERR)
+					return transport_flush(t);
 				}
 			}
 
@@ -404,11 +507,40 @@ int pop3_process(struct pop3 * s, const char * buffer, int len, int fd)
 		}
 	}
 
-	return 0;
+	// everything this piece of input needed answering goes out together
+	return transport_flush(t);
+}
+
+// When a held back PASS is due to be answered, 0 if there is none
+long pop3_tarpit(const struct pop3 * s)
+{
+	return s->wake_ms;
+}
+
+// Answer it, and go on with the input that came after it
+int pop3_resume(struct pop3 * s, struct transport * t)
+{
+	char * held = s->held;
+	const int held_len = s->held_len;
+
+	s->wake_ms = 0;
+	s->held = NULL;
+	s->held_len = 0;
+
+	int ret = login(s, s->password, s->check, t);
+	memset(s->password, 0, sizeof s->password);
+
+	if (ret != -1)
+		ret = held != NULL ? pop3_process(s, held, held_len, t) : transport_flush(t);
+
+	free(held);
+	return ret;
 }
 
 void pop3_free(struct pop3 * s)
 {
+	free(s->held);
+	free(s->deleted);
 	free(s->store);
 	free(s);
 }
@@ -1,16 +1,18 @@
 #ifndef POP3_H_
 #define POP3_H_
 
-// for our storage db
-#include <sqlite3.h>
-
 struct pop3;
+struct transport;
 
-int pop3_setup(sqlite3 * db);
+int pop3_setup();
 void pop3_teardown();
+int pop3_refuse(struct transport * t);
 
-struct pop3 * pop3_init(int fd);
-int pop3_process(struct pop3 * s, const char * buffer, int len, int fd);
+struct pop3 * pop3_init(struct transport * t, const char * peer);
+int pop3_process(struct pop3 * s, const char * buffer, int len, struct transport * t);
 void pop3_free(struct pop3 * s);
 
+long pop3_tarpit(const struct pop3 * s);
+int pop3_resume(struct pop3 * s, struct transport * t);
+
 #endif
@@ -0,0 +1,41 @@
+#ifndef PROBES_H_
+#define PROBES_H_
+
+// Static tracepoints (USDT) in the server, for bpftrace and other tracers
+//  that can attach to a running process, see the scripts in probes/
+//  Where <sys/sdt.h> is installed (systemtap-sdt-dev, systemtap-sdt-devel)
+//  each is a single nop in the code until something attaches to it;
+//  without it they compile to nothing.
+//
+// Probes of provider "bridgemail", with their arguments:
+//  conn_accept(int fd, char * addr)         a client connected
+//  conn_close(int fd, int type)             and is gone (type: see main.c)
+//  smtp_command_start(void * session, int state)
+//  smtp_command_end(void * session, char * verb, int state)
+//  pop3_command_start(void * session, int state)
+//  pop3_command_end(void * session, char * verb, int state)
+//                                           a command line, verb and the
+//                                           state after it at the end
+//  smtp_commit_start(void * session, size_t bytes, size_t rcpt)
+//  smtp_commit_end(void * session, size_t bytes, size_t rcpt, int result)
+//                                           storing a message after DATA
+//  pop3_maildrop_start(void * session, char * mailbox)
+//  pop3_maildrop_end(void * session, char * mailbox, size_t messages, int result)
+//                                           the message list, at login
+//  pop3_retr_start(void * session, long long id, size_t bytes)
+//  pop3_retr_end(void * session, long long id, size_t bytes, int result)
+//                                           sending a message
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE2(name, a, b) DTRACE_PROBE2(bridgemail, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(bridgemail, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(bridgemail, name, a, b, c, d)
+#else
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#define PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,573 @@
+/*
+** bridgemail-replay - drive recorded sessions against a running BridgeMail
+*  Reads transcripts written by the server's -T option and plays the
+*  client side of each one back, at the recorded pace, faster, or as fast
+*  as the server answers, with many copies running in parallel.
+*/
+
+#include "transcript.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+// longest reply line we keep, the rest is skipped
+#define REPLY_MAX 512
+
+// one client record of a transcript
+struct chunk {
+	// when it was sent, in microseconds from the start of the session
+	unsigned long long at_us;
+	const char * data;
+	size_t len;
+};
+
+struct transcript {
+	const char * path;
+	char protocol;
+	char * file;
+	struct chunk * chunks;
+	size_t chunks_len;
+	// recorded session length, and bytes the server sent back then
+	unsigned long long duration_us, server_bytes;
+};
+
+// one playback of a transcript
+struct replay {
+	const struct transcript * tr;
+	int fd;
+	int connecting;
+	long long start_us;
+
+	// position in the transcript
+	size_t chunk, offset;
+	// what is being sent right now
+	const char * out;
+	size_t out_len;
+
+	// the current line sent, enough to recognise commands
+	char cmd[16];
+	size_t cmd_len;
+	// a reply is awaited, and whether it is a POP3 multi-line one
+	int waiting, multi_expected;
+	long long waiting_since;
+	// the last command was DATA, so a 354 starts the body
+	int data_cmd, in_body;
+
+	// reply being read
+	char line[REPLY_MAX];
+	size_t line_len;
+	int multi, match;
+};
+
+// settings
+static const char * host = "127.0.0.1";
+static const char * port_smtp = "25", * port_pop3 = "110";
+// playback speed, 0 for as fast as possible
+static double speed = 1;
+static int copies = 1;
+static long timeout_ms = 10000;
+
+static struct addrinfo * addr_smtp, * addr_pop3;
+
+// totals
+static unsigned long sessions_ok, sessions_failed, commands;
+static unsigned long long bytes_sent, bytes_received;
+
+static long long now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int get_varint(const char ** p, const char * end, unsigned long long * v)
+{
+	*v = 0;
+	for (int shift = 0; *p < end && shift < 64; shift += 7) {
+		const unsigned char b = *(*p) ++;
+		*v |= (unsigned long long)(b & 0x7F) << shift;
+		if (! (b & 0x80))
+			return 0;
+	}
+	return -1;
+}
+
+// Read a whole transcript file and index its client records
+static int load(struct transcript * tr, const char * path)
+{
+	FILE * f = fopen(path, "rb");
+
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	fseek(f, 0, SEEK_END);
+	const long size = ftell(f);
+	rewind(f);
+
+	memset(tr, 0, sizeof(struct transcript));
+	tr->path = path;
+	tr->file = malloc(size > 0 ? size : 1);
+
+	if (tr->file == NULL || fread(tr->file, 1, size, f) != (size_t)size) {
+		fprintf(stderr, "%s: read failed\n", path);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	const char * p = tr->file, * end = tr->file + size;
+	const size_t magic_len = strlen(TRANSCRIPT_MAGIC);
+
+	if (size < (long)magic_len + 1 || memcmp(p, TRANSCRIPT_MAGIC, magic_len) != 0 ||
+		(p[magic_len] != TRANSCRIPT_SMTP && p[magic_len] != TRANSCRIPT_POP3)) {
+		fprintf(stderr, "%s: not a transcript\n", path);
+		return -1;
+	}
+	tr->protocol = p[magic_len];
+	p += magic_len + 1;
+
+	size_t max = 0;
+	while (p < end) {
+		const char type = *p ++;
+		unsigned long long delay, len;
+
+		if (get_varint(&p, end, &delay) == -1 || get_varint(&p, end, &len) == -1) {
+			fprintf(stderr, "%s: truncated\n", path);
+			return -1;
+		}
+		tr->duration_us += delay;
+
+		if (type == TRANSCRIPT_SERVER) {
+			tr->server_bytes += len;
+			continue;
+		}
+
+		if (type != TRANSCRIPT_CLIENT || len > (unsigned long long)(end - p)) {
+			fprintf(stderr, "%s: bad record\n", path);
+			return -1;
+		}
+
+		if (tr->chunks_len == max) {
+			max = max * 2 + 64;
+			struct chunk * new_chunks = realloc(tr->chunks, max * sizeof(struct chunk));
+
+			if (new_chunks == NULL) {
+				perror("realloc(chunks)");
+				return -1;
+			}
+			tr->chunks = new_chunks;
+		}
+
+		tr->chunks[tr->chunks_len].at_us = tr->duration_us;
+		tr->chunks[tr->chunks_len].data = p;
+		tr->chunks[tr->chunks_len].len = len;
+		tr->chunks_len ++;
+		p += len;
+	}
+
+	return 0;
+}
+
+static struct addrinfo * resolve(const char * port)
+{
+	const struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_NUMERICSERV
+	};
+	struct addrinfo * ai;
+	int rv = getaddrinfo(host, port, &hints, &ai);
+
+	if (rv != 0) {
+		fprintf(stderr, "getaddrinfo(%s:%s) (%d): %s\n", host, port, rv, gai_strerror(rv));
+		return NULL;
+	}
+
+	return ai;
+}
+
+static int replay_open(struct replay * r, const struct transcript * tr)
+{
+	const struct addrinfo * ai = (tr->protocol == TRANSCRIPT_SMTP) ? addr_smtp : addr_pop3;
+
+	memset(r, 0, sizeof(struct replay));
+	r->tr = tr;
+	r->start_us = now_us();
+	// the greeting
+	r->waiting = 1;
+	r->waiting_since = r->start_us;
+
+	r->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK, ai->ai_protocol);
+	if (r->fd == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	if (connect(r->fd, ai->ai_addr, ai->ai_addrlen) == -1 && errno != EINPROGRESS) {
+		perror("connect");
+		close(r->fd);
+		r->fd = -1;
+		return -1;
+	}
+
+	r->connecting = 1;
+	return 0;
+}
+
+static void replay_close(struct replay * r, int ok)
+{
+	close(r->fd);
+	r->fd = -1;
+
+	if (ok)
+		sessions_ok ++;
+	else
+		sessions_failed ++;
+}
+
+// POP3 commands answered with a multi-line reply when they succeed
+static int pop3_multiline(const char * cmd, size_t len)
+{
+	// LIST and UIDL only without an argument
+	if (len == 6 && (strncasecmp(cmd, "LIST", 4) == 0 || strncasecmp(cmd, "UIDL", 4) == 0))
+		return 1;
+	return len > 4 && (strncasecmp(cmd, "RETR", 4) == 0 || strncasecmp(cmd, "TOP ", 4) == 0);
+}
+
+// Pick the next piece of the transcript to send: up to and including the
+//  next line the server answers, so the replay waits for each reply like
+//  the original client did
+//  returns the time to wait until, 0 to go on, or -1 when the session is over
+static long long replay_next(struct replay * r)
+{
+	const struct transcript * tr = r->tr;
+
+	while (! r->waiting && r->out_len == 0) {
+		if (r->chunk == tr->chunks_len)
+			return -1;
+
+		const struct chunk * c = &tr->chunks[r->chunk];
+
+		// keep to the recorded pace
+		if (speed > 0 && r->offset == 0) {
+			const long long due = r->start_us + (long long)(c->at_us / speed);
+			if (due > now_us())
+				return due;
+		}
+
+		const char * p = c->data + r->offset;
+		size_t n = 0;
+
+		while (r->offset + n < c->len && ! r->waiting) {
+			const char ch = p[n ++];
+
+			if (r->cmd_len < sizeof r->cmd)
+				r->cmd[r->cmd_len] = ch;
+			r->cmd_len ++;
+
+			if (ch != '\n')
+				continue;
+
+			if (tr->protocol == TRANSCRIPT_SMTP && r->in_body) {
+				// only the terminating "." is answered
+				if (r->cmd_len == 3 && r->cmd[0] == '.') {
+					r->in_body = 0;
+					r->waiting = 1;
+				}
+			} else {
+				r->waiting = 1;
+				if (tr->protocol == TRANSCRIPT_SMTP)
+					r->data_cmd = (r->cmd_len == 6 && strncasecmp(r->cmd, "DATA", 4) == 0);
+				else
+					r->multi_expected = pop3_multiline(r->cmd, r->cmd_len);
+				commands ++;
+			}
+			r->cmd_len = 0;
+		}
+
+		r->out = p;
+		r->out_len = n;
+		r->offset += n;
+		if (r->waiting)
+			r->waiting_since = now_us();
+
+		if (r->offset == c->len) {
+			r->chunk ++;
+			r->offset = 0;
+		}
+	}
+
+	return 0;
+}
+
+// a complete reply arrived
+static void replay_reply(struct replay * r)
+{
+	r->waiting = 0;
+	r->multi = 0;
+
+	if (r->tr->protocol == TRANSCRIPT_SMTP && r->data_cmd) {
+		r->in_body = (strncmp(r->line, "354", 3) == 0);
+		r->data_cmd = 0;
+	}
+}
+
+static void replay_input(struct replay * r, const char * buf, size_t len)
+{
+	bytes_received += len;
+
+	for (size_t i = 0; i < len; i ++) {
+		const char c = buf[i];
+
+		if (r->multi) {
+			// look for "\r\n.\r\n"
+			if (c == "\r\n.\r\n"[r->match])
+				r->match ++;
+			else
+				r->match = (c == '\r');
+
+			if (r->match == 5)
+				replay_reply(r);
+			continue;
+		}
+
+		if (r->line_len < REPLY_MAX - 1)
+			r->line[r->line_len ++] = c;
+		if (c != '\n')
+			continue;
+		r->line[r->line_len] = '\0';
+		r->line_len = 0;
+
+		if (r->tr->protocol == TRANSCRIPT_SMTP) {
+			// "250-" continues a multi-line reply
+			if (r->line[3] != '-')
+				replay_reply(r);
+		} else if (r->multi_expected && strncmp(r->line, "+OK", 3) == 0) {
+			r->multi = 1;
+			r->match = 2;
+			r->multi_expected = 0;
+		} else {
+			r->multi_expected = 0;
+			replay_reply(r);
+		}
+	}
+}
+
+static int replay_output(struct replay * r)
+{
+	while (r->out_len > 0) {
+		ssize_t n = send(r->fd, r->out, r->out_len, MSG_NOSIGNAL);
+
+		if (n == -1)
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+		bytes_sent += n;
+		r->out += n;
+		r->out_len -= n;
+	}
+
+	return 0;
+}
+
+static void run(const struct transcript * trs, int trs_len)
+{
+	const int count = trs_len * copies;
+	struct replay * replays = calloc(count, sizeof(struct replay));
+	struct pollfd * fds = calloc(count, sizeof(struct pollfd));
+
+	if (replays == NULL || fds == NULL) {
+		perror("calloc(replays)");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < count; i ++)
+		if (replay_open(&replays[i], &trs[i % trs_len]) == -1)
+			sessions_failed ++;
+
+	for (;;) {
+		int active = 0;
+		long long wake = -1;
+		const long long now = now_us();
+
+		for (int i = 0; i < count; i ++) {
+			struct replay * r = &replays[i];
+
+			fds[i].fd = r->fd;
+			fds[i].events = 0;
+			if (r->fd == -1)
+				continue;
+
+			if (r->waiting && now - r->waiting_since > timeout_ms * 1000) {
+				fprintf(stderr, "%s: no reply after %ld ms, giving up\n", r->tr->path, timeout_ms);
+				replay_close(r, 0);
+				fds[i].fd = -1;
+				continue;
+			}
+
+			long long due = 0;
+			if (! r->connecting)
+				due = replay_next(r);
+
+			if (due == -1) {
+				replay_close(r, 1);
+				fds[i].fd = -1;
+				continue;
+			}
+
+			if (due > 0 && (wake == -1 || due < wake))
+				wake = due;
+
+			active ++;
+			fds[i].events = POLLIN | ((r->connecting || r->out_len) ? POLLOUT : 0);
+
+			// wake up to check for a stalled server too
+			if (r->waiting && (wake == -1 || r->waiting_since + timeout_ms * 1000 < wake))
+				wake = r->waiting_since + timeout_ms * 1000;
+		}
+
+		if (active == 0)
+			break;
+
+		int timeout = -1;
+		if (wake != -1)
+			timeout = (wake > now) ? (wake - now + 999) / 1000 : 0;
+
+		if (poll(fds, count, timeout) == -1) {
+			if (errno != EINTR) {
+				perror("poll");
+				exit(EXIT_FAILURE);
+			}
+			continue;
+		}
+
+		for (int i = 0; i < count; i ++) {
+			struct replay * r = &replays[i];
+
+			if (r->fd == -1 || fds[i].revents == 0)
+				continue;
+
+			if (r->connecting) {
+				int err = 0;
+				socklen_t err_len = sizeof err;
+				getsockopt(r->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+
+				if (err != 0) {
+					fprintf(stderr, "connect: %s\n", strerror(err));
+					replay_close(r, 0);
+					continue;
+				}
+				r->connecting = 0;
+			}
+
+			if ((fds[i].revents & POLLOUT) && replay_output(r) == -1) {
+				replay_close(r, 0);
+				continue;
+			}
+
+			if (fds[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+				char buf[65536];
+				ssize_t n = recv(r->fd, buf, sizeof buf, 0);
+
+				if (n > 0)
+					replay_input(r, buf, n);
+				else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+					// the server hanging up after the last reply is the normal end
+					replay_close(r, ! r->waiting && r->chunk == r->tr->chunks_len);
+			}
+		}
+	}
+
+	free(fds);
+	free(replays);
+}
+
+int main(int argc, char * argv[])
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "H:s:p:x:j:w:")) != -1)
+		switch (c) {
+		case 'H': host = optarg; break;
+		case 's': port_smtp = optarg; break;
+		case 'p': port_pop3 = optarg; break;
+		case 'x': speed = (strcmp(optarg, "max") == 0) ? 0 : atof(optarg); break;
+		case 'j': copies = atoi(optarg); break;
+		case 'w': timeout_ms = atol(optarg); break;
+		default:
+			return EXIT_FAILURE;
+		}
+
+	if (optind == argc || copies < 1 || speed < 0) {
+		printf("Usage: bridgemail-replay [-H host] [-s smtp_port] [-p pop3_port] [-x speed|max] [-j copies] [-w timeout_ms] transcript...\n");
+		return EXIT_FAILURE;
+	}
+
+	const int trs_len = argc - optind;
+	struct transcript * trs = calloc(trs_len, sizeof(struct transcript));
+
+	if (trs == NULL) {
+		perror("calloc(transcripts)");
+		return EXIT_FAILURE;
+	}
+
+	unsigned long long recorded_us = 0, client_bytes = 0, server_bytes = 0;
+	for (int i = 0; i < trs_len; i ++) {
+		if (load(&trs[i], argv[optind + i]) == -1)
+			return EXIT_FAILURE;
+
+		if (trs[i].duration_us > recorded_us)
+			recorded_us = trs[i].duration_us;
+		for (size_t j = 0; j < trs[i].chunks_len; j ++)
+			client_bytes += trs[i].chunks[j].len;
+		server_bytes += trs[i].server_bytes;
+	}
+
+	// each copy of each transcript is a connection
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	addr_smtp = resolve(port_smtp);
+	addr_pop3 = resolve(port_pop3);
+	if (addr_smtp == NULL || addr_pop3 == NULL)
+		return EXIT_FAILURE;
+
+	printf("Replaying %d transcripts x %d (%llu bytes in, %llu out as recorded, over %.2f s) ",
+		trs_len, copies, client_bytes * copies, server_bytes * copies, recorded_us / 1e6);
+	if (speed > 0)
+		printf("at %gx speed\n", speed);
+	else
+		printf("at maximum speed\n");
+
+	const long long start = now_us();
+	run(trs, trs_len);
+	const double elapsed = (now_us() - start) / 1e6;
+
+	printf("%lu sessions ok, %lu failed, %lu commands in %.2f s: %.1f sessions/s, %.1f commands/s\n",
+		sessions_ok, sessions_failed, commands, elapsed, (sessions_ok + sessions_failed) / elapsed, commands / elapsed);
+	printf("%llu bytes sent, %llu bytes received\n", bytes_sent, bytes_received);
+
+	freeaddrinfo(addr_smtp);
+	freeaddrinfo(addr_pop3);
+	for (int i = 0; i < trs_len; i ++) {
+		free(trs[i].file);
+		free(trs[i].chunks);
+	}
+	free(trs);
+
+	return sessions_failed ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,195 @@
+#include "schema.h"
+
+#include <stdio.h>
+
+// Each entry brings the database from version N to N+1, where the
+//  version is kept in PRAGMA user_version.  Databases made by older
+//  manage.sh have version 0 and already contain the version 1 tables.
+static const char * const migrations[] = {
+	// 1: initial schema
+	//  a user account on the system
+	"CREATE TABLE IF NOT EXISTS mailbox (id TEXT PRIMARY KEY, auth TEXT) WITHOUT ROWID, STRICT;"
+	//  a message in the db
+	"CREATE TABLE IF NOT EXISTS message (id INTEGER PRIMARY KEY, data BLOB NOT NULL) STRICT;"
+	//  link a message to a recipient
+	"CREATE TABLE IF NOT EXISTS mailbox_message (mailbox_id TEXT NOT NULL, message_id INTEGER NOT NULL, PRIMARY KEY(mailbox_id, message_id), FOREIGN KEY(mailbox_id) REFERENCES mailbox(id), FOREIGN KEY(message_id) REFERENCES message(id)) WITHOUT ROWID, STRICT;"
+	//  postmaster
+	"INSERT OR IGNORE INTO mailbox(id, auth) VALUES('postmaster', null);",
+
+	// 2: message garbage collection moves out of the delete path
+	//  the old trigger ran a NOT EXISTS scan for every deleted link,
+	//  now unlinked ids are only queued and swept later by maint.c
+	"DROP TRIGGER IF EXISTS message_trigger;"
+	"CREATE TABLE IF NOT EXISTS message_gc (message_id INTEGER PRIMARY KEY) STRICT;"
+	"CREATE TRIGGER IF NOT EXISTS message_gc_trigger AFTER DELETE ON mailbox_message BEGIN INSERT OR IGNORE INTO message_gc(message_id) VALUES(OLD.message_id); END;"
+	//  lets the sweeper check for remaining links without a table scan
+	"CREATE INDEX IF NOT EXISTS mailbox_message_message_id ON mailbox_message(message_id);"
+	//  anything orphaned before the upgrade
+	"INSERT OR IGNORE INTO message_gc(message_id) SELECT id FROM message WHERE NOT EXISTS (SELECT 1 FROM mailbox_message WHERE message_id = message.id);",
+
+	// 3: message bodies may live in a spool directory instead
+	//  size is kept so listing a maildrop never touches the body,
+	//  spool=1 means data is empty and the body is the file <spool>/<id>
+	"ALTER TABLE message ADD COLUMN size INTEGER NOT NULL DEFAULT 0;"
+	"ALTER TABLE message ADD COLUMN spool INTEGER NOT NULL DEFAULT 0;"
+	"UPDATE message SET size = LENGTH(data);",
+
+	// 4: mailbox usage and quotas
+	//  messages and bytes are kept up to date by triggers on the links,
+	//  so checking a mailbox never has to add up its maildrop
+	//  a NULL quota means the server's default applies
+	"ALTER TABLE mailbox ADD COLUMN messages INTEGER NOT NULL DEFAULT 0;"
+	"ALTER TABLE mailbox ADD COLUMN bytes INTEGER NOT NULL DEFAULT 0;"
+	"ALTER TABLE mailbox ADD COLUMN quota_messages INTEGER;"
+	"ALTER TABLE mailbox ADD COLUMN quota_bytes INTEGER;"
+	"CREATE TRIGGER IF NOT EXISTS mailbox_usage_insert AFTER INSERT ON mailbox_message BEGIN UPDATE mailbox SET messages = messages + 1, bytes = bytes + (SELECT size FROM message WHERE id = NEW.message_id) WHERE id = NEW.mailbox_id; END;"
+	"CREATE TRIGGER IF NOT EXISTS mailbox_usage_delete AFTER DELETE ON mailbox_message BEGIN UPDATE mailbox SET messages = messages - 1, bytes = bytes - (SELECT size FROM message WHERE id = OLD.message_id) WHERE id = OLD.mailbox_id; END;"
+	//  count up what is already there
+	"UPDATE mailbox SET messages = (SELECT COUNT(*) FROM mailbox_message WHERE mailbox_id = mailbox.id),"
+	" bytes = (SELECT IFNULL(SUM(b.size), 0) FROM mailbox_message a INNER JOIN message b ON a.message_id = b.id WHERE a.mailbox_id = mailbox.id);",
+
+	// 5: shard directory, see shard.c
+	//  only used in shard 0 of a sharded layout, empty everywhere else
+	"CREATE TABLE IF NOT EXISTS shard (id INTEGER PRIMARY KEY) STRICT;"
+	"CREATE TABLE IF NOT EXISTS shard_map (mailbox_id TEXT PRIMARY KEY, shard INTEGER NOT NULL REFERENCES shard(id)) WITHOUT ROWID, STRICT;",
+
+	// 6: distribution lists, see list.c
+	//  each member's row is on the shard of its mailbox, an alias is a list of one
+	"CREATE TABLE IF NOT EXISTS list_member (list_id TEXT NOT NULL, mailbox_id TEXT NOT NULL REFERENCES mailbox(id), PRIMARY KEY(list_id, mailbox_id)) WITHOUT ROWID, STRICT;",
+
+	// 7: delivery time and retention, see maint.c
+	//  delivered is in seconds since the epoch, and mail from before
+	//  this version counts as delivered at the upgrade
+	//  retention is in days, NULL for the server's default, 0 to keep mail for ever
+	"ALTER TABLE message ADD COLUMN delivered INTEGER NOT NULL DEFAULT 0;"
+	"UPDATE message SET delivered = CAST(strftime('%s', 'now') AS INTEGER);"
+	"ALTER TABLE mailbox ADD COLUMN retention INTEGER;"
+	"CREATE INDEX IF NOT EXISTS message_delivered ON message(delivered);",
+
+	// 8: message ids are never handed out again, see UIDVALIDITY in imap.c
+	//  without AUTOINCREMENT, the id of the newest message came back once
+	//  it was collected, and an IMAP client saw a new message under an old UID;
+	//  the table is copied over, so the upgrade needs room for a second copy,
+	//  and the usage triggers, which read it, are set up again afterwards
+	"DROP TRIGGER IF EXISTS mailbox_usage_insert;"
+	"DROP TRIGGER IF EXISTS mailbox_usage_delete;"
+	"CREATE TABLE message_new (id INTEGER PRIMARY KEY AUTOINCREMENT, data BLOB NOT NULL, size INTEGER NOT NULL DEFAULT 0, spool INTEGER NOT NULL DEFAULT 0, delivered INTEGER NOT NULL DEFAULT 0) STRICT;"
+	"INSERT INTO message_new(id, data, size, spool, delivered) SELECT id, data, size, spool, delivered FROM message;"
+	"DROP TABLE message;"
+	"ALTER TABLE message_new RENAME TO message;"
+	"CREATE INDEX IF NOT EXISTS message_delivered ON message(delivered);"
+	"CREATE TRIGGER IF NOT EXISTS mailbox_usage_insert AFTER INSERT ON mailbox_message BEGIN UPDATE mailbox SET messages = messages + 1, bytes = bytes + (SELECT size FROM message WHERE id = NEW.message_id) WHERE id = NEW.mailbox_id; END;"
+	"CREATE TRIGGER IF NOT EXISTS mailbox_usage_delete AFTER DELETE ON mailbox_message BEGIN UPDATE mailbox SET messages = messages - 1, bytes = bytes - (SELECT size FROM message WHERE id = OLD.message_id) WHERE id = OLD.mailbox_id; END;",
+};
+
+#define SCHEMA_VERSION (int)(sizeof(migrations) / sizeof(migrations[0]))
+
+// Secondary indexes of the current schema, which bulk loads drop and
+//  build again afterwards instead of updating them row by row
+static const struct {
+	const char * name;
+	const char * on;
+} indexes[] = {
+	{ "mailbox_message_message_id", "mailbox_message(message_id)" },
+	{ "message_delivered", "message(delivered)" }
+};
+
+#define INDEX_COUNT (sizeof(indexes) / sizeof(indexes[0]))
+
+// Bring the database schema up to the current version
+//  returns 0 on success, -1 on failure
+int schema_upgrade(sqlite3 * db)
+{
+	sqlite3_stmt * stmt;
+
+	if (sqlite3_prepare_v2(db, "PRAGMA user_version", -1, &stmt, NULL) != SQLITE_OK) return -1;
+
+	int version = -1;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		version = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	if (version < 0) return -1;
+
+	if (version > SCHEMA_VERSION) {
+		fprintf(stderr, "Database schema version %d is newer than this server (%d).\n", version, SCHEMA_VERSION);
+		return -1;
+	}
+
+	if (version == SCHEMA_VERSION)
+		return 0;
+
+	// a migration that rebuilds a table drops the old one, which foreign
+	//  keys would refuse; the pragma can't change inside a transaction,
+	//  so it is off around all of them and put back afterwards
+	int foreign_keys = 0;
+	if (sqlite3_prepare_v2(db, "PRAGMA foreign_keys", -1, &stmt, NULL) != SQLITE_OK) return -1;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		foreign_keys = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	if (foreign_keys && sqlite3_exec(db, "PRAGMA foreign_keys = OFF", NULL, NULL, NULL) != SQLITE_OK) return -1;
+
+	int ret = 0;
+	while (ret == 0 && version < SCHEMA_VERSION) {
+		// each step is applied in its own transaction along with the version bump
+		char pragma[32];
+		sprintf(pragma, "PRAGMA user_version = %d", version + 1);
+
+		if (sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+			ret = -1;
+			break;
+		}
+
+		if (sqlite3_exec(db, migrations[version], NULL, NULL, NULL) != SQLITE_OK ||
+			sqlite3_exec(db, pragma, NULL, NULL, NULL) != SQLITE_OK ||
+			sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+			fprintf(stderr, "Failed to upgrade database schema to version %d.\n", version + 1);
+			sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+			ret = -1;
+			break;
+		}
+
+		printf(" . Upgraded database schema to version %d\n", version + 1);
+		version ++;
+	}
+
+	if (foreign_keys && sqlite3_exec(db, "PRAGMA foreign_keys = ON", NULL, NULL, NULL) != SQLITE_OK)
+		ret = -1;
+
+	return ret;
+}
+
+// Drop the secondary indexes before a bulk load
+//  returns 0 on success, -1 on failure
+int schema_drop_indexes(sqlite3 * db)
+{
+	for (size_t i = 0; i < INDEX_COUNT; i ++) {
+		char sql[256];
+		snprintf(sql, sizeof sql, "DROP INDEX IF EXISTS %s", indexes[i].name);
+
+		if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+			fprintf(stderr, "Failed to drop index %s: %s\n", indexes[i].name, sqlite3_errmsg(db));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Build any missing secondary indexes
+//  returns 0 on success, -1 on failure
+int schema_create_indexes(sqlite3 * db)
+{
+	for (size_t i = 0; i < INDEX_COUNT; i ++) {
+		char sql[256];
+		snprintf(sql, sizeof sql, "CREATE INDEX IF NOT EXISTS %s ON %s", indexes[i].name, indexes[i].on);
+
+		if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+			fprintf(stderr, "Failed to create index %s: %s\n", indexes[i].name, sqlite3_errmsg(db));
+			return -1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef SCHEMA_H_
+#define SCHEMA_H_
+
+// for our storage db
+#include <sqlite3.h>
+
+int schema_upgrade(sqlite3 * db);
+int schema_drop_indexes(sqlite3 * db);
+int schema_create_indexes(sqlite3 * db);
+
+#endif
@@ -0,0 +1,75 @@
+#include "shard.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// A sharded layout is N databases with the same schema: the one named on
+//  the command line is shard 0, and <path>.1 to <path>.N-1 the rest.
+//  Shard 0 also holds the directory: the shard table lists the shards,
+//  and shard_map says which one each mailbox lives on.  New mailboxes are
+//  placed by shard_hash(), but the directory has the last word, so
+//  mailboxes stay put when shards are added.  An empty shard table means
+//  the database is not sharded.
+
+// Number of shards in the layout db is the first of, 1 if it isn't sharded
+//  returns -1 on error
+int shard_count(sqlite3 * db)
+{
+	sqlite3_stmt * stmt;
+	int ret = -1;
+
+	if (sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM shard", -1, &stmt, NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW)
+		ret = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	return ret == 0 ? 1 : ret;
+}
+
+// File name of a shard, to be freed by the caller (NULL on error)
+char * shard_path(const char * path, int shard)
+{
+	char * name = malloc(strlen(path) + 12);
+
+	if (name == NULL)
+		perror("malloc(shard path)");
+	else if (shard == 0)
+		strcpy(name, path);
+	else
+		sprintf(name, "%s.%d", path, shard);
+
+	return name;
+}
+
+// The shard a new mailbox goes on, by FNV-1a of its name
+int shard_hash(const char * mailbox, int shards)
+{
+	uint32_t h = 2166136261u;
+	while (*mailbox) {
+		h ^= (unsigned char)*mailbox++;
+		h *= 16777619u;
+	}
+	return h % shards;
+}
+
+// Look a mailbox up in the directory, with a statement prepared from SHARD_FIND_SQL
+//  returns 1 and sets *shard if found, 0 if not, -1 on error
+int shard_find(sqlite3_stmt * stmt, const char * mailbox, int * shard)
+{
+	sqlite3_bind_text(stmt, 1, mailbox, -1, NULL);
+
+	int ret = -1;
+	switch (sqlite3_step(stmt)) {
+	case SQLITE_ROW:
+		*shard = sqlite3_column_int(stmt, 0);
+		ret = 1;
+		break;
+	case SQLITE_DONE:
+		ret = 0;
+		break;
+	}
+	sqlite3_reset(stmt);
+
+	return ret;
+}
@@ -0,0 +1,26 @@
+#ifndef SHARD_H_
+#define SHARD_H_
+
+// for our storage db
+#include <sqlite3.h>
+
+// most database files a layout can be split into
+#define SHARD_MAX 256
+
+// Message ids outside the storage engine carry their shard in the top
+//  bits, above the rowid in that shard.  Shard 0 ids are the plain rowid,
+//  so an unsharded database (and its spool) keeps the ids it always had.
+#define SHARD_ID_BITS 48
+#define SHARD_ID(shard, rowid) (((long long)(shard) << SHARD_ID_BITS) | (rowid))
+#define SHARD_OF(id) ((int)((id) >> SHARD_ID_BITS))
+#define SHARD_ROWID(id) ((id) & ((1LL << SHARD_ID_BITS) - 1))
+
+// finds a mailbox in the directory, see shard_find()
+#define SHARD_FIND_SQL "SELECT shard FROM shard_map WHERE mailbox_id = ?"
+
+int shard_count(sqlite3 * db);
+char * shard_path(const char * path, int shard);
+int shard_hash(const char * mailbox, int shards);
+int shard_find(sqlite3_stmt * stmt, const char * mailbox, int * shard);
+
+#endif
@@ -1,25 +1,40 @@
 #include "smtp.h"
+#include "storage.h"
+#include "transport.h"
+#include "command.h"
+#include "probes.h"
+#include "arena.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#include <sys/socket.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <time.h>
 
 #ifndef HOST_NAME_MAX
 #define HOST_NAME_MAX 255
 #endif
 
 static char e220[4 + HOST_NAME_MAX + 2 + 1] = "220 ";
+static char e421[4 + HOST_NAME_MAX + 54 + 1] = "421 ";
+static const char * e220_tls = "220 Ready to start TLS\r\n";
 static const char * e221 = "221 Service closing transmission channel\r\n";
 static const char * e250 = "250 OK\r\n";
+// EHLO reply when STARTTLS is on offer
+static const char * e250_tls = "250-OK\r\n250 STARTTLS\r\n";
 static const char * e252 = "252 Cannot VRFY user, but will accept message and attempt delivery\r\n";
 static const char * e354 = "354 Start mail input; end with <CRLF>.<CRLF>\r\n";
-static const char * e500 = "500 Syntax error, command unrecognized\r\n";
+static const char * e451 = "451 Requested action aborted: local error in processing\r\n";
+static const char * e451_busy = "451 Requested action aborted: insufficient system resources, try again later\r\n";
+static const char * e452 = "452 Too many recipients\r\n";
+static const char * e452_full = "452 Mailbox full\r\n";
+static const char * e454 = "454 TLS not available due to temporary reason\r\n";
+static const char * e500_long = "500 Line too long\r\n";
 static const char * e501 = "501 Syntax error in parameters or arguments\r\n";
-static const char * e503 = "503 Bad sequence of commands\r\n";
 static const char * e550 = "550 Mailbox not found\r\n";
+static const char * e552 = "552 Requested mail action aborted: exceeded storage allocation\r\n";
+static const char * e503 = "503 Bad sequence of commands\r\n";
 
 struct smtp {
 	enum {
@@ -32,61 +47,87 @@ struct smtp {
 
 	time_t timestamp;
 
+	// STARTTLS was accepted, everything since is encrypted
+	int tls;
+
+	// RFC 5321 4.5.3.1.6: a text line is at most 1000 bytes, CRLF included
 	char line[1001];
 	unsigned short line_len;
+	unsigned char line_overflow;
 
+	// envelope of the current transaction, all in the arena
+	struct arena arena;
 	char ** rcpt;
 	unsigned long rcpt_len;
+	unsigned long rcpt_cap;
+	// smallest byte quota of the recipients, 0 if none has one
+	unsigned long long max_size;
 
 	char * msg;
 	unsigned long msg_len;
+	unsigned long msg_cap;
+	// the message outgrew max_size and is being thrown away
+	int oversize;
+	// or there was no room for it in the server's message buffers
+	int busy;
 };
 
-// prep the sqlite3 statements for use later
-static sqlite3 * db;
-// tx handlers
-static sqlite3_stmt * stmt_begin = NULL;
-static sqlite3_stmt * stmt_commit = NULL;
-static sqlite3_stmt * stmt_rollback = NULL;
-// specific db manip statements
-static sqlite3_stmt * stmt_check_mailbox;
-static sqlite3_stmt * stmt_insert_body;
-static sqlite3_stmt * stmt_insert_recipient;
-
-int smtp_setup(sqlite3 * parent_db)
-{
-	db = parent_db;
+// defined below, with the command handlers
+static struct command_table smtp_commands;
 
-	if (sqlite3_prepare_v2(db, "BEGIN", -1, &stmt_begin, NULL) != SQLITE_OK) return -1;
-	if (sqlite3_prepare_v2(db, "COMMIT", -1, &stmt_commit, NULL) != SQLITE_OK) return -1;
-	if (sqlite3_prepare_v2(db, "ROLLBACK", -1, &stmt_rollback, NULL) != SQLITE_OK) return -1;
+// recipients accepted per message
+static unsigned long smtp_max_rcpt;
+// bytes of message bodies all sessions may hold in memory while they
+//  are being received, and how many may be received at once (0 for no limit)
+static unsigned long long smtp_max_buffered;
+static unsigned long smtp_max_receiving;
 
-	if (sqlite3_prepare_v2(db, "SELECT EXISTS (SELECT 1 FROM mailbox WHERE id = ?)", -1, &stmt_check_mailbox, NULL) != SQLITE_OK) return -1;
-	if (sqlite3_prepare_v2(db, "INSERT INTO message(data) VALUES(?)", -1, &stmt_insert_body, NULL) != SQLITE_OK) return -1;
-	if (sqlite3_prepare_v2(db, "INSERT INTO mailbox_message(mailbox_id, message_id) VALUES(?, ?)", -1, &stmt_insert_recipient, NULL) != SQLITE_OK) return -1;
+// what they are now, and the messages turned away for lack of room
+static unsigned long long buffered;
+static unsigned long receiving;
+static unsigned long refused;
 
-	// create initial "220 <domain>" sent at connection start
+int smtp_setup(unsigned long max_rcpt, unsigned long long max_buffered, unsigned long max_receiving)
+{
+	smtp_max_rcpt = max_rcpt;
+	smtp_max_buffered = max_buffered;
+	smtp_max_receiving = max_receiving;
+
+	// create initial "220 <domain>" sent at connection start, and the
+	//  "421 <domain>" sent instead when the server is too busy
 	if (gethostname(& e220[4], HOST_NAME_MAX + 1) == -1)
 		perror("gethostname");
+	strcpy(& e421[4], & e220[4]);
 	strcat(e220, "\r\n");
+	strcat(e421, " Service not available, closing transmission channel\r\n");
 
-	return 0;
+	return command_table_init(&smtp_commands);
 }
 
 void smtp_teardown()
 {
-	sqlite3_finalize(stmt_begin);
-	sqlite3_finalize(stmt_commit);
-	sqlite3_finalize(stmt_rollback);
+}
+
+void smtp_report(FILE * out)
+{
+	fprintf(out, " . SMTP: %lu messages being received, %llu bytes buffered, %lu refused while busy\n", receiving, buffered, refused);
+}
+
+// Turn a new connection away, when there are too many already
+int smtp_refuse(struct transport * t)
+{
+	puts(e421);
+	if (transport_puts(t, e421) == -1) {
+		perror("send(421)");
+		return -1;
+	}
 
-	sqlite3_finalize(stmt_check_mailbox);
-	sqlite3_finalize(stmt_insert_body);
-	sqlite3_finalize(stmt_insert_recipient);
+	return 0;
 }
 
-struct smtp * smtp_init(int fd)
+struct smtp * smtp_init(struct transport * t)
 {
-	if (send(fd, e220, strlen(e220), 0) == -1) {
+	if (transport_puts(t, e220) == -1 || transport_flush(t) == -1) {
 		perror("send");
 		return NULL;
 	}
@@ -101,17 +142,93 @@ struct smtp * smtp_init(int fd)
 
 	s->state = INIT;
 	s->timestamp = time(NULL);
+	s->tls = 0;
 	s->line_len = 0;
+	s->line_overflow = 0;
+	arena_init(&s->arena);
 	s->rcpt = NULL;
 	s->rcpt_len = 0;
+	s->rcpt_cap = 0;
+	s->max_size = 0;
 	s->msg = NULL;
 	s->msg_len = 0;
+	s->msg_cap = 0;
+	s->oversize = 0;
+	s->busy = 0;
 	return s;
 }
 
+// Drop what was received of the message
+static void discard(struct smtp * s)
+{
+	free(s->msg);
+	buffered -= s->msg_cap;
+	s->msg = NULL;
+	s->msg_len = 0;
+	s->msg_cap = 0;
+}
+
+// end of a mail transaction: drop the envelope and the message
+static void reset_transaction(struct smtp * s)
+{
+	arena_reset(&s->arena);
+	s->rcpt = NULL;
+	s->rcpt_len = 0;
+	s->rcpt_cap = 0;
+	s->max_size = 0;
+	discard(s);
+	s->oversize = 0;
+	s->busy = 0;
+}
+
+// Add a piece of the message, unless it is already being thrown away
+//  once it can't be kept, the rest is read without keeping any of it
+static void append(struct smtp * s, const char * data, size_t len)
+{
+	if (s->oversize || s->busy)
+		return;
+
+	if (s->max_size != 0 && s->msg_len + len > s->max_size) {
+		discard(s);
+		s->oversize = 1;
+		return;
+	}
+
+	if (s->msg_len + len > s->msg_cap) {
+		unsigned long cap = s->msg_cap ? s->msg_cap * 2 : 4096;
+		while (cap < s->msg_len + len)
+			cap *= 2;
+
+		// near the limit, a message gets no more than it needs
+		if (smtp_max_buffered != 0 && buffered - s->msg_cap + cap > smtp_max_buffered)
+			cap = s->msg_len + len;
+
+		char * msg = NULL;
+		if (smtp_max_buffered != 0 && buffered - s->msg_cap + cap > smtp_max_buffered)
+			fputs("Message buffers are full, refusing message.\n", stderr);
+		else if ((msg = realloc(s->msg, cap)) == NULL)
+			perror("realloc(msg)");
+
+		if (msg == NULL) {
+			discard(s);
+			s->busy = 1;
+			refused ++;
+			return;
+		}
+
+		buffered += cap - s->msg_cap;
+		s->msg = msg;
+		s->msg_cap = cap;
+	}
+
+	memcpy(s->msg + s->msg_len, data, len);
+	s->msg_len += len;
+}
+
 // helper function: extract an address from a FROM: <*> or TO: <*> line
+//  the address is allocated in arena a
 //  TODO: this could be RFC-whatever compliant and also parse the domain - for triggers!
-static const char * get_address(const char * type, const char * line)
+char * get_address(struct arena * a, const char * type, const char * line)
 {
 	// the first bytes must match
 	const char * t = type, * p = line;
@@ -120,11 +237,13 @@ static const char * get_address(const char * type, const char * line)
 		t ++; p ++;
 	}
 	// colon
-	if (*p != ':') return NULL; p++;
+	if (*p != ':') return NULL;
+	p ++;
 	// whitespace
 	//while (*p == ' ') p ++;
 	// open bracket
-	if (*p != '<') return NULL; p++;
+	if (*p != '<') return NULL;
+	p ++;
 	// validate closing bracket
 	if (line[strlen(line) - 1] != '>') return NULL;
 
@@ -133,19 +252,254 @@ static const char * get_address(const char * type, const char * line)
 	while (*t != '@' && *t != '>' && *t != '\0') t ++;
 
 	// duplicate and return
-	char * address = malloc(t - p + 1);
-	memcpy(address, p, t - p);
-	address[t - p] = '\0';
+	return arena_strndup(a, p, t - p);
+}
+
+#define SMTP_RESPONSE(x) { puts( e ## x ); if (transport_puts(t, e ## x) == -1) { perror("send(" #x ")"); return -1; } }
+
+// Command handlers
+//  the command table has already checked the argument and state rules
+static int smtp_rset(void * session, char * arg, struct transport * t)
+{
+	struct smtp * s = session;
+	(void)arg;
+
+	if (s->state != INIT) s->state = HELO;
+	reset_transaction(s);
+
+	SMTP_RESPONSE(250)
+	return 0;
+}
+
+static int smtp_noop(void * session, char * arg, struct transport * t)
+{
+	(void)session;
+	(void)arg;
 
-	return address;
+	SMTP_RESPONSE(250)
+	return 0;
+}
+
+static int smtp_vrfy(void * session, char * arg, struct transport * t)
+{
+	(void)session;
+	(void)arg;
+
+	// TODO: it might be nice to support VRFY
+	SMTP_RESPONSE(252)
+	return 0;
 }
 
-int smtp_process(struct smtp * s, const char * buffer, int len, int fd)
+static int smtp_helo(void * session, char * arg, struct transport * t)
 {
-#define SMTP_RESPONSE(x) { puts( e ## x ); if (send(fd, e ## x, strlen(e ## x), 0) == -1) { perror("send(" #x ")"); return -1; } }
+	struct smtp * s = session;
+	(void)arg;
 
+	SMTP_RESPONSE(250)
+	// change to post-HELO state
+	s->state = HELO;
+	return 0;
+}
+
+// as HELO, but with the extensions on offer
+static int smtp_ehlo(void * session, char * arg, struct transport * t)
+{
+	struct smtp * s = session;
+	(void)arg;
+
+	if (! s->tls && transport_can_starttls(t))
+		SMTP_RESPONSE(250_tls)
+	else
+		SMTP_RESPONSE(250)
+	s->state = HELO;
+	return 0;
+}
+
+// RFC 3207: the client starts over after the handshake, and knows
+//  nothing from before it, not even its own EHLO
+static int smtp_starttls(void * session, char * arg, struct transport * t)
+{
+	struct smtp * s = session;
+	(void)arg;
+
+	if (s->tls)
+		SMTP_RESPONSE(503)
+	else if (! transport_can_starttls(t))
+		SMTP_RESPONSE(454)
+	else {
+		SMTP_RESPONSE(220_tls)
+		if (transport_starttls(t) == -1)
+			return -1;
+
+		s->tls = 1;
+		s->state = INIT;
+		reset_transaction(s);
+	}
+
+	return 0;
+}
+
+static int smtp_quit(void * session, char * arg, struct transport * t)
+{
+	(void)session;
+	(void)arg;
+
+	// Respond 221 and close connection in all cases
+	SMTP_RESPONSE(221)
+	return -1;
+}
+
+static int smtp_mail(void * session, char * arg, struct transport * t)
+{
+	struct smtp * s = session;
+
+	// try to get FROM address
+	//  it is only checked, never kept, so the arena goes back to where it was
+	struct arena_mark mark = arena_mark(&s->arena);
+	char * address = get_address(&s->arena, "FROM", arg);
+	int found = address == NULL ? -1 : storage_check_mailbox(address, NULL);
+	arena_rollback(&s->arena, mark);
+
+	if (address == NULL)
+		// failed to parse address
+		SMTP_RESPONSE(501)
+	// verify sender
+	else if (found == 1) {
+		SMTP_RESPONSE(250)
+		s->state = MAIL;
+	} else
+		SMTP_RESPONSE(550)
+
+	return 0;
+}
+
+static int smtp_rcpt(void * session, char * arg, struct transport * t)
+{
+	struct smtp * s = session;
+
+	// RFC 5321 4.5.3.1.10: the client sends the rest in another transaction
+	if (s->rcpt_len >= smtp_max_rcpt) {
+		SMTP_RESPONSE(452)
+		return 0;
+	}
+
+	// the recipient list doubles in the arena, the old copy goes at reset
+	if (s->rcpt_len == s->rcpt_cap) {
+		unsigned long cap = s->rcpt_cap ? s->rcpt_cap * 2 : 16;
+		if (cap > smtp_max_rcpt)
+			cap = smtp_max_rcpt;
+
+		char ** rcpt = arena_alloc(&s->arena, cap * sizeof(char *));
+		if (rcpt == NULL) {
+			SMTP_RESPONSE(451)
+			return 0;
+		}
+		if (s->rcpt_len > 0)
+			memcpy(rcpt, s->rcpt, s->rcpt_len * sizeof(char *));
+		s->rcpt = rcpt;
+		s->rcpt_cap = cap;
+	}
+
+	// a refused address is dropped from the arena again below, or a
+	//  client could grow the session without bound with bad RCPTs
+	struct arena_mark mark = arena_mark(&s->arena);
+	struct storage_usage usage;
+	char * address = get_address(&s->arena, "TO", arg);
+	int found;
+	if (address == NULL)
+		// failed to parse address
+		SMTP_RESPONSE(501)
+	// verify recipient
+	else if ((found = storage_check_mailbox(address, &usage)) == -1)
+		SMTP_RESPONSE(451)
+	else if (found == 0)
+		SMTP_RESPONSE(550)
+	// refused before any of the body is sent, the mailbox may have
+	//  room again by the time the client retries
+	else if (storage_usage_full(&usage))
+		SMTP_RESPONSE(452_full)
+	else {
+		// looks good, add to the recipient list and keep it
+		s->rcpt[s->rcpt_len] = address;
+		s->rcpt_len ++;
+		mark = arena_mark(&s->arena);
+
+		// a message bigger than a whole quota could never be delivered
+		if (usage.quota_bytes != 0 && (s->max_size == 0 || usage.quota_bytes < s->max_size))
+			s->max_size = usage.quota_bytes;
+
+		SMTP_RESPONSE(250)
+		s->state = RCPT;
+	}
+
+	arena_rollback(&s->arena, mark);
+	return 0;
+}
+
+static int smtp_data(void * session, char * arg, struct transport * t)
+{
+	struct smtp * s = session;
+	(void)arg;
+
+	// the client may try DATA again later, or give up with RSET / QUIT
+	if ((smtp_max_receiving != 0 && receiving >= smtp_max_receiving) ||
+		(smtp_max_buffered != 0 && buffered >= smtp_max_buffered)) {
+		refused ++;
+		SMTP_RESPONSE(451_busy)
+		return 0;
+	}
+
+	SMTP_RESPONSE(354)
+	s->state = DATA;
+	receiving ++;
+	return 0;
+}
+
+#define IN(x) (1u << (x))
+#define ANY (IN(INIT) | IN(HELO) | IN(MAIL) | IN(RCPT))
+
+static const struct command smtp_command_list[] = {
+	{ "RSET", ANY, ARGS_NONE, smtp_rset },
+	{ "NOOP", ANY, ARGS_OPTIONAL, smtp_noop },
+	{ "VRFY", ANY, ARGS_REQUIRED, smtp_vrfy },
+	// HELO only accepted at start-of-connection
+	{ "HELO", IN(INIT), ARGS_REQUIRED, smtp_helo },
+	{ "EHLO", IN(INIT), ARGS_REQUIRED, smtp_ehlo },
+	// STARTTLS outside of a mail transaction
+	{ "STARTTLS", IN(INIT) | IN(HELO), ARGS_NONE, smtp_starttls },
+	// QUIT only accepted after HELO or later
+	{ "QUIT", ANY & ~IN(INIT), ARGS_NONE, smtp_quit },
+	// MAIL only accepted after HELO, RCPT after MAIL, DATA after RCPT
+	{ "MAIL", IN(HELO), ARGS_REQUIRED, smtp_mail },
+	{ "RCPT", IN(MAIL) | IN(RCPT), ARGS_REQUIRED, smtp_rcpt },
+	{ "DATA", IN(RCPT), ARGS_NONE, smtp_data }
+};
+
+static struct command_table smtp_commands = {
+	.commands = smtp_command_list,
+	.len = sizeof(smtp_command_list) / sizeof(smtp_command_list[0]),
+	.unknown = "500 Syntax error, command unrecognized\r\n",
+	.bad_args = "501 Syntax error in parameters or arguments\r\n",
+	.bad_state = "503 Bad sequence of commands\r\n"
+};
+
+int smtp_process(struct smtp * s, const char * buffer, int len, struct transport * t)
+{
 	// process incoming chars
 	for (int i = 0; i < len; i ++) {
+		// the line is too long for the buffer: a command is thrown away,
+		//  and message text is kept a piece at a time (but for a CR,
+		//  which may be the start of the line's CRLF)
+		if (s->line_len == sizeof(s->line) - 1) {
+			const int cr = s->line[s->line_len - 1] == '\r';
+
+			if (s->state == DATA)
+				append(s, s->line, s->line_len - cr);
+			s->line[0] = '\r';
+			s->line_len = cr;
+			s->line_overflow = 1;
+		}
+
 		// copy next char into linebuf
 		s->line[s->line_len] = buffer[i];
 		s->line_len ++;
@@ -156,7 +510,9 @@ int smtp_process(struct smtp * s, const char * buffer, int len, int fd)
 			s->timestamp = time(NULL);
 
 			// regular commands outside DATA (email upload)
-			if (s->state != DATA) {
+			if (s->state != DATA && s->line_overflow)
+				SMTP_RESPONSE(500_long)
+			else if (s->state != DATA) {
 				// rtrim CRLF and any trailing spaces
 				s->line_len -= 2;
 
@@ -166,226 +522,69 @@ int smtp_process(struct smtp * s, const char * buffer, int len, int fd)
 				s->line[s->line_len] = '\0';
 				fprintf(stderr, "Got command: [%s]\n", s->line);
 
-				// tokenize the first bit
-				char * cmd = strtok(s->line, " ");
-
-				// switch action based on cmd
-				if (cmd == NULL) {
-					// empty line
-					SMTP_RESPONSE(500)
-				} else if (strcasecmp(cmd, "RSET") == 0) {
-					// RSET should not have params
-					if (strtok(NULL, "") != NULL)
-						SMTP_RESPONSE(501)
-					else {
-						// 250 OK
-						if (s->state != INIT) s->state = HELO;
+				const int tls = s->tls;
 
-						SMTP_RESPONSE(250)
-					}
-				} else if (strcasecmp(s->line, "NOOP") == 0) {
-					// NOOP
-					SMTP_RESPONSE(250)
-				} else if (strcasecmp(s->line, "VRFY") == 0) {
-					// VRFY should have a parameter (address to check)
-					char * arg = strtok(NULL, "");
-					if (arg == NULL)
-						SMTP_RESPONSE(501)
-					else
-						// TODO: it might be nice to support VRFY
-						SMTP_RESPONSE(252)
-				} else if (strcasecmp(s->line, "HELO") == 0 || strcasecmp(s->line, "EHLO") == 0) {
-					// HELO / EHLO should have a parameter (client domain)
-					char * arg = strtok(NULL, "");
-					if (arg == NULL)
-						SMTP_RESPONSE(501)
-					else if (s->state != INIT)
-						// HELO only accepted at start-of-connection
-						SMTP_RESPONSE(503)
-					else {
-						// Send initial "220 <domain>" to announce connection start
-						SMTP_RESPONSE(250)
-						// change to post-HELO state
-						s->state = HELO;
-					}
-				} else if (strcasecmp(s->line, "QUIT") == 0) {
-					// QUIT should not have a parameter
-					if (strtok(NULL, "") != NULL)
-						SMTP_RESPONSE(501)
-					else if (s->state == INIT)
-						// QUIT only accepted after HELO or later
-						SMTP_RESPONSE(503)
-					else {
-						// Respond 221 and close connection in all cases
-						SMTP_RESPONSE(221)
-						return -1;
-					}
-				} else if (strcasecmp(s->line, "MAIL") == 0) {
-					// MAIL command.  Line must be at least MAIL FROM:<*>
-					char * arg = strtok(NULL, "");
-					if (arg == NULL)
-						SMTP_RESPONSE(500)
-					else if (s->state != HELO)
-						// MAIL only accepted after HELO
-						SMTP_RESPONSE(503)
-					else {
-						// try to get FROM address
-						const char * address = get_address("FROM", arg);
-						if (address == NULL)
-							// failed to parse address
-							SMTP_RESPONSE(501)
-						else {
-							// verify sender
-							sqlite3_bind_text(stmt_check_mailbox, 1, address, -1, NULL);
-							if (sqlite3_step(stmt_check_mailbox) == SQLITE_ROW) {
-								if (sqlite3_column_int(stmt_check_mailbox, 0)) {
-									SMTP_RESPONSE(250)
-									s->state = MAIL;
-								} else
-									SMTP_RESPONSE(550)
-							} else
-								SMTP_RESPONSE(550)
-
-							sqlite3_reset(stmt_check_mailbox);
-
-							free(address);
-						}
-					}
-				} else if (strcasecmp(s->line, "RCPT") == 0) {
-					// RCPT command.  Line must be at least RCPT TO:<*>
-					char * arg = strtok(NULL, "");
-					if (arg == NULL)
-						SMTP_RESPONSE(501)
-					else if (s->state != MAIL && s->state != RCPT)
-						// RCPT only accepted after MAIL
-						SMTP_RESPONSE(503)
-					else {
-						const char * address = get_address("TO", arg);
-						if (address == NULL)
-							// failed to parse address
-							SMTP_RESPONSE(501)
-						else {
-							// verify recipient
-							sqlite3_bind_text(stmt_check_mailbox, 1, address, -1, NULL);
-							if (sqlite3_step(stmt_check_mailbox) == SQLITE_ROW) {
-								if (sqlite3_column_int(stmt_check_mailbox, 0)) {
-									// looks good, add to the recipient list
-									s->rcpt = realloc(s->rcpt, (s->rcpt_len + 1) * sizeof(const char *));
-									if (s->rcpt == NULL) {
-										perror("realloc");
-										exit(1);
-									}
-									s->rcpt[s->rcpt_len] = address;
-									s->rcpt_len ++;
-
-									SMTP_RESPONSE(250)
-									s->state = RCPT;
-								} else {
-									SMTP_RESPONSE(550)
-									free(address);
-								}
-							} else {
-								SMTP_RESPONSE(550)
-								free(address);
-							}
-
-							sqlite3_reset(stmt_check_mailbox);
-						}
-					}
-				} else if (strcasecmp(s->line, "DATA") == 0) {
-					// DATA command - only follows RCPT!
-					if (strtok(NULL, "") != NULL)
-						// DATA should not have a parameter
-						SMTP_RESPONSE(501)
-					else if (s->state != RCPT)
-						// RCPT only accepted after MAIL
-						SMTP_RESPONSE(503)
-					else {
-						// Get the FROM address
-						SMTP_RESPONSE(354)
-						s->state = DATA;
-					}
-				} else
-					// bad command
-					SMTP_RESPONSE(500)
+				PROBE2(smtp_command_start, s, s->state);
+				const int rv = command_dispatch(&smtp_commands, s, s->state, s->line, t);
+				// the line has been cut down to the verb
+				PROBE3(smtp_command_end, s, (const char *)s->line, s->state);
+
+				if (rv == -1)
+					return -1;
+
+				// RFC 3207 5: anything pipelined behind STARTTLS was sent
+				//  in the clear, and must not be acted on
+				if (s->tls != tls) {
+					s->line_len = 0;
+					s->line_overflow = 0;
+					return 0;
+				}
 			} else {
 				// terminate line at line_len
 				s->line[s->line_len] = '\0';
 				fprintf(stderr, "Got data: [%s]\n", s->line);
 
-				if (s->msg != NULL && strcmp(s->line, ".\r\n") == 0) {
+				if (! s->line_overflow && (s->msg != NULL || s->oversize || s->busy) && strcmp(s->line, ".\r\n") == 0) {
+					const int oversize = s->oversize, busy = s->busy;
+					int stored = 0;
+
 					// put message into message store db
-					sqlite3_step(stmt_begin);
-					sqlite3_reset(stmt_begin);
-					//
-					sqlite3_bind_blob(stmt_insert_body, 1, s->msg, strlen(s->msg), NULL);
-
-					if (sqlite3_step(stmt_insert_body) != SQLITE_DONE) {
-						sqlite3_step(stmt_rollback);
-						sqlite3_reset(stmt_rollback);
-					} else {
-						// recipients
-						sqlite3_int64 rowid = sqlite3_last_insert_rowid(db);
-
-						for (unsigned long i = 0; i < s->rcpt_len; i ++) {
-							sqlite3_bind_text(stmt_insert_recipient, 1, s->rcpt[i], -1, NULL);
-							sqlite3_bind_int64(stmt_insert_recipient, 2, rowid);
-
-							if (sqlite3_step(stmt_insert_recipient) != SQLITE_DONE) {
-								sqlite3_step(stmt_rollback);
-								sqlite3_reset(stmt_rollback);
-							} else {
-								sqlite3_step(stmt_commit);
-								sqlite3_reset(stmt_commit);
-							}
-
-							free(s->rcpt[i]);
-
-							sqlite3_reset(stmt_insert_recipient);
-						}
+					if (! oversize && ! busy) {
+						PROBE3(smtp_commit_start, s, s->msg_len, s->rcpt_len);
+						stored = storage_store_message(s->msg, s->msg_len, s->rcpt, s->rcpt_len);
+						PROBE4(smtp_commit_end, s, s->msg_len, s->rcpt_len, stored);
 					}
 
-					sqlite3_reset(stmt_insert_body);
-					SMTP_RESPONSE(250)
 					s->state = HELO;
-					free(s->rcpt);
-					s->rcpt = NULL;
-					s->rcpt_len = 0;
-					free(s->msg);
-					s->msg = NULL;
-					s->msg_len = 0;
-				} else {
-					// append
-					if (s->msg == NULL) {
-						s->msg = strdup(s->line);
-						s->msg_len = s->line_len;
-					} else {
-						// TODO
-						s->msg = realloc(s->msg, s->msg_len + s->line_len + 1);
-
-						if (s->msg == NULL) {
-							perror("realloc");
-							exit(1);
-						}
-
-						strcat(s->msg, s->line);
-						s->msg_len += s->line_len;
-					}
-				}
+					receiving --;
+					reset_transaction(s);
+
+					if (oversize)
+						SMTP_RESPONSE(552)
+					else if (busy)
+						SMTP_RESPONSE(451_busy)
+					else if (stored == -1)
+						SMTP_RESPONSE(451)
+					else
+						SMTP_RESPONSE(250)
+				} else
+					append(s, s->line, s->line_len);
 			}
 
 			s->line_len = 0;
+			s->line_overflow = 0;
 		}
 	}
 
-	return 0;
+	// everything this piece of input needed answering goes out together
+	return transport_flush(t);
 }
 
 void smtp_free(struct smtp * s)
 {
-	for (unsigned long i = 0; i < s->rcpt_len; i ++)
-		free(s->rcpt[i]);
-	free(s->rcpt);
-	free(s->msg);
+	if (s->state == DATA)
+		receiving --;
+	discard(s);
+	arena_free(&s->arena);
 	free(s);
 }
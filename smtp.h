@@ -1,16 +1,22 @@
 #ifndef SMTP_H_
 #define SMTP_H_
 
-// for our storage db
-#include <sqlite3.h>
+#include <stdio.h>
 
 struct smtp;
+struct transport;
+struct arena;
 
-int smtp_setup(sqlite3 * db);
+int smtp_setup(unsigned long max_rcpt, unsigned long long max_buffered, unsigned long max_receiving);
 void smtp_teardown();
+void smtp_report(FILE * out);
+int smtp_refuse(struct transport * t);
 
-struct smtp * smtp_init(int fd);
-int smtp_process(struct smtp * s, const char * buffer, int len, int fd);
+struct smtp * smtp_init(struct transport * t);
+int smtp_process(struct smtp * s, const char * buffer, int len, struct transport * t);
 void smtp_free(struct smtp * s);
 
+// exposed for bridgemail-microbench
+char * get_address(struct arena * a, const char * type, const char * line);
+
 #endif
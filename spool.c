@@ -0,0 +1,161 @@
+#include "spool.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+
+// Message bodies as plain files, one per message.id, in a spool directory.
+//  A body is written to a temporary name and fsynced first, then renamed
+//  to its id inside the delivery transaction.  All access goes through
+//  the open directory, so the spool can't move underneath us.
+static int spool_dir = -1;
+// fsync files and the directory (off for the "fast" durability profile)
+static int spool_sync;
+// unique temporary names
+static unsigned long tmp_counter;
+
+// Remove temporary files left by a crash mid-delivery
+static void spool_clean()
+{
+	int fd = dup(spool_dir);
+	DIR * d = fd == -1 ? NULL : fdopendir(fd);
+
+	if (d == NULL) {
+		perror("fdopendir(spool)");
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+
+	const struct dirent * e;
+	while ((e = readdir(d)) != NULL) {
+		if (strncmp(e->d_name, "tmp.", 4) == 0 && unlinkat(spool_dir, e->d_name, 0) == -1)
+			perror("unlinkat(spool)");
+	}
+
+	closedir(d);
+}
+
+int spool_setup(const char * dir, int sync)
+{
+	spool_dir = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (spool_dir == -1) {
+		perror("open(spool)");
+		return -1;
+	}
+
+	spool_sync = sync;
+	spool_clean();
+
+	printf(" . Spooling message bodies to %s\n", dir);
+	return 0;
+}
+
+void spool_teardown()
+{
+	if (spool_dir != -1)
+		close(spool_dir);
+	spool_dir = -1;
+}
+
+// Nonzero if new message bodies go to the spool
+int spool_enabled()
+{
+	return spool_dir != -1;
+}
+
+// Write a body to a new temporary file, whose name is put in tmp
+//  (at least SPOOL_NAME_MAX bytes)
+int spool_write(const char * data, size_t len, char * tmp)
+{
+	snprintf(tmp, SPOOL_NAME_MAX, "tmp.%ld.%lu", (long)getpid(), tmp_counter ++);
+
+	int fd = openat(spool_dir, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+
+	if (fd == -1) {
+		perror("openat(spool)");
+		return -1;
+	}
+
+	while (len > 0) {
+		ssize_t written = write(fd, data, len);
+
+		if (written == -1) {
+			perror("write(spool)");
+			close(fd);
+			unlinkat(spool_dir, tmp, 0);
+			return -1;
+		}
+
+		data += written;
+		len -= written;
+	}
+
+	if (spool_sync && fdatasync(fd) == -1) {
+		perror("fdatasync(spool)");
+		close(fd);
+		unlinkat(spool_dir, tmp, 0);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+// Give a temporary file its final name, once the message has an id
+//  on failure the file is gone, under either name
+int spool_commit(const char * tmp, long long id)
+{
+	char name[SPOOL_NAME_MAX];
+	snprintf(name, sizeof name, "%lld", id);
+
+	if (renameat(spool_dir, tmp, spool_dir, name) == -1) {
+		perror("renameat(spool)");
+		spool_abort(tmp);
+		return -1;
+	}
+
+	// make the rename itself durable
+	if (spool_sync && fsync(spool_dir) == -1) {
+		perror("fsync(spool)");
+		unlinkat(spool_dir, name, 0);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Throw away a temporary file from a failed delivery
+void spool_abort(const char * tmp)
+{
+	if (unlinkat(spool_dir, tmp, 0) == -1)
+		perror("unlinkat(spool)");
+}
+
+// Open a message body for reading, -1 on error
+int spool_open(long long id)
+{
+	char name[SPOOL_NAME_MAX];
+	snprintf(name, sizeof name, "%lld", id);
+
+	int fd = openat(spool_dir, name, O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1)
+		perror("openat(spool)");
+
+	return fd;
+}
+
+// Delete a message body
+void spool_remove(long long id)
+{
+	char name[SPOOL_NAME_MAX];
+	snprintf(name, sizeof name, "%lld", id);
+
+	if (unlinkat(spool_dir, name, 0) == -1)
+		perror("unlinkat(spool)");
+}
@@ -0,0 +1,20 @@
+#ifndef SPOOL_H_
+#define SPOOL_H_
+
+#include <stddef.h>
+
+// longest name spool_write() hands back
+#define SPOOL_NAME_MAX 64
+
+int spool_setup(const char * dir, int sync);
+void spool_teardown();
+int spool_enabled();
+
+int spool_write(const char * data, size_t len, char * tmp);
+int spool_commit(const char * tmp, long long id);
+void spool_abort(const char * tmp);
+
+int spool_open(long long id);
+void spool_remove(long long id);
+
+#endif
@@ -0,0 +1,187 @@
+#include "storage.h"
+// distribution lists
+#include "list.h"
+
+#include <string.h>
+
+// all the engines we know about, the first is the default
+static const struct storage_backend * const backends[] = {
+	&storage_sqlite,
+	&storage_memory
+};
+
+// the one in use
+static const struct storage_backend * backend;
+
+// told about each mailbox that gains or loses messages, see storage_watch()
+static void (*watcher)(const char * mailbox);
+
+// Pick a storage engine by name (NULL for the default) and set it up
+//  path is the mail database
+int storage_setup(const char * name, const char * path, const struct storage_options * options)
+{
+	backend = NULL;
+	for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i ++)
+		if (name == NULL || strcmp(name, backends[i]->name) == 0) {
+			backend = backends[i];
+			break;
+		}
+
+	if (backend == NULL) {
+		fprintf(stderr, "Unknown storage backend `%s'.\n", name);
+		return -1;
+	}
+
+	printf(" . Using storage backend %s\n", backend->name);
+	return backend->setup(path, options);
+}
+
+void storage_teardown()
+{
+	if (backend != NULL)
+		backend->teardown();
+	backend = NULL;
+}
+
+// 1 if the mailbox (or a list of that name) exists, 0 if not
+//  usage (may be NULL) gets its current size and quota
+int storage_check_mailbox(const char * mailbox, struct storage_usage * usage)
+{
+	return backend->check_mailbox(mailbox, usage);
+}
+
+// Nonzero if a mailbox is at or over its quota
+//  the check is made before delivery, so a mailbox may end up over
+//  its quota by the last message it accepted
+int storage_usage_full(const struct storage_usage * usage)
+{
+	return (usage->quota_messages != 0 && usage->messages >= usage->quota_messages) ||
+		(usage->quota_bytes != 0 && usage->bytes >= usage->quota_bytes);
+}
+
+// 1 if the password matches the mailbox, 0 if not
+int storage_authenticate(const char * mailbox, const char * auth)
+{
+	return backend->authenticate(mailbox, auth);
+}
+
+// Deliver one message to all recipients, atomically
+//  a recipient may be a list, which stands for all of its members
+int storage_store_message(const char * data, size_t len, char * const * rcpt, size_t rcpt_len)
+{
+	const int ret = backend->store_message(data, len, rcpt, rcpt_len);
+
+	if (ret != -1 && watcher != NULL)
+		for (size_t i = 0; i < rcpt_len; i ++) {
+			const struct list * l = list_find(rcpt[i]);
+
+			if (l == NULL)
+				watcher(rcpt[i]);
+			else
+				for (size_t j = 0; j < l->len; j ++)
+					watcher(l->members[j].mailbox);
+		}
+
+	return ret;
+}
+
+// Get the messages in a maildrop, oldest (lowest id) first
+//  *list is allocated here and must be freed by the caller
+int storage_list_maildrop(const char * mailbox, struct storage_msg ** list, size_t * len)
+{
+	return backend->list_maildrop(mailbox, list, len);
+}
+
+// Open a message for reading, NULL if it is not in the maildrop
+struct storage_stream * storage_open_message(const char * mailbox, long long id)
+{
+	return backend->open_message(mailbox, id);
+}
+
+// Get the next chunk of an open message
+//  *buf stays valid until the next call, returns 0 at the end
+ssize_t storage_read_message(struct storage_stream * m, const char ** buf)
+{
+	return backend->read_message(m, buf);
+}
+
+// If the message is a plain file, get its descriptor and the byte range
+//  still to be sent, so it can go straight to the socket with sendfile()
+//  returns -1 if the message must be read with storage_read_message()
+int storage_message_fd(struct storage_stream * m, off_t * offset, size_t * len)
+{
+	return backend->message_fd != NULL ? backend->message_fd(m, offset, len) : -1;
+}
+
+void storage_close_message(struct storage_stream * m)
+{
+	backend->close_message(m);
+}
+
+// Remove a set of messages from a maildrop, atomically
+int storage_delete_set(const char * mailbox, const long long * ids, size_t len)
+{
+	const int ret = backend->delete_set(mailbox, ids, len);
+
+	if (ret != -1 && len > 0 && watcher != NULL)
+		watcher(mailbox);
+
+	return ret;
+}
+
+// Have changed() called with each mailbox that messages are delivered
+//  to or deleted from, once the change is committed (NULL to stop)
+void storage_watch(void (*changed)(const char * mailbox))
+{
+	watcher = changed;
+}
+
+// Nonzero if the engine has work to do when the server is idle
+int storage_pending()
+{
+	return backend->pending != NULL && backend->pending();
+}
+
+// Give the engine up to budget_ms of idle time
+void storage_idle(int budget_ms)
+{
+	if (backend->idle != NULL)
+		backend->idle(budget_ms);
+}
+
+// Print engine diagnostics
+void storage_report(FILE * out)
+{
+	if (backend->report != NULL)
+		backend->report(out);
+}
+
+// Start an online backup of the storage to path, made by storage_tick()
+int storage_backup(const char * path)
+{
+	if (backend->backup == NULL) {
+		fprintf(stderr, "Storage backend %s does not support backups.\n", backend->name);
+		return -1;
+	}
+
+	return backend->backup(path);
+}
+
+// Nonzero if the engine has work which storage_tick() should be called for
+int storage_ticking()
+{
+	return backend->ticking != NULL && backend->ticking();
+}
+
+// Do one slice of that work
+void storage_tick()
+{
+	if (backend->tick != NULL)
+		backend->tick();
+}
+
+// Account changes made outside the server should take effect now
+int storage_reload()
+{
+	return backend->reload != NULL ? backend->reload() : 0;
+}
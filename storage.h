@@ -0,0 +1,107 @@
+#ifndef STORAGE_H_
+#define STORAGE_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// one message in a user's maildrop
+struct storage_msg {
+	long long id;
+	size_t size;
+	// when it was delivered
+	time_t delivered;
+};
+
+// how full a mailbox is, and how full it may get (0 for no limit)
+//  a mailbox at or over either limit takes no more mail
+struct storage_usage {
+	unsigned long messages;
+	unsigned long long bytes;
+	unsigned long quota_messages;
+	unsigned long long quota_bytes;
+};
+
+// a message opened for reading, see storage_read_message()
+struct storage_stream;
+
+// settings from the command line, any may be NULL / 0 for the default
+struct storage_options {
+	// durability profile
+	const char * profile;
+	// directory for message bodies, instead of keeping them in the database
+	const char * spool;
+	// MiB of recently read message bodies to keep in memory, 0 for none
+	size_t cache_mb;
+	// database pages copied per step of an online backup
+	int backup_pages;
+	// quota of mailboxes which do not set their own, 0 for no limit
+	unsigned long quota_messages;
+	unsigned long long quota_bytes;
+	// days mail is kept in mailboxes which do not set their own, 0 for ever
+	unsigned int retention_days;
+};
+
+// Interface each storage engine provides
+//  functions returning int give -1 on error, see storage.c for the rest
+struct storage_backend {
+	const char * name;
+
+	int (*setup)(const char * path, const struct storage_options * options);
+	void (*teardown)();
+
+	int (*check_mailbox)(const char * mailbox, struct storage_usage * usage);
+	int (*authenticate)(const char * mailbox, const char * auth);
+	int (*store_message)(const char * data, size_t len, char * const * rcpt, size_t rcpt_len);
+	int (*list_maildrop)(const char * mailbox, struct storage_msg ** list, size_t * len);
+	struct storage_stream * (*open_message)(const char * mailbox, long long id);
+	ssize_t (*read_message)(struct storage_stream * m, const char ** buf);
+	int (*message_fd)(struct storage_stream * m, off_t * offset, size_t * len);
+	void (*close_message)(struct storage_stream * m);
+	int (*delete_set)(const char * mailbox, const long long * ids, size_t len);
+
+	// message_fd, backup and background upkeep may be NULL
+	int (*pending)();
+	void (*idle)(int budget_ms);
+	void (*report)(FILE * out);
+
+	// online backup, carried out a slice per tick, which unlike idle
+	//  goes on while clients keep the server busy
+	int (*backup)(const char * path);
+	int (*ticking)();
+	void (*tick)();
+
+	// accounts or lists were changed in the database, for engines
+	//  which keep their own copy of them (may be NULL)
+	int (*reload)();
+};
+
+extern const struct storage_backend storage_sqlite;
+extern const struct storage_backend storage_memory;
+
+int storage_setup(const char * backend, const char * path, const struct storage_options * options);
+void storage_teardown();
+
+int storage_check_mailbox(const char * mailbox, struct storage_usage * usage);
+int storage_usage_full(const struct storage_usage * usage);
+int storage_authenticate(const char * mailbox, const char * auth);
+int storage_store_message(const char * data, size_t len, char * const * rcpt, size_t rcpt_len);
+int storage_list_maildrop(const char * mailbox, struct storage_msg ** list, size_t * len);
+struct storage_stream * storage_open_message(const char * mailbox, long long id);
+ssize_t storage_read_message(struct storage_stream * m, const char ** buf);
+int storage_message_fd(struct storage_stream * m, off_t * offset, size_t * len);
+void storage_close_message(struct storage_stream * m);
+int storage_delete_set(const char * mailbox, const long long * ids, size_t len);
+void storage_watch(void (*changed)(const char * mailbox));
+
+int storage_pending();
+void storage_idle(int budget_ms);
+void storage_report(FILE * out);
+
+int storage_backup(const char * path);
+int storage_ticking();
+void storage_tick();
+
+int storage_reload();
+
+#endif
@@ -0,0 +1,571 @@
+#include "storage.h"
+// databases split by mailbox
+#include "shard.h"
+// distribution lists
+#include "list.h"
+
+// accounts are copied out of the mail database at startup
+#include <sqlite3.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+// A message body, shared by every mailbox it was delivered to
+struct message {
+	long long id;
+	unsigned int refs;
+	time_t delivered;
+	size_t len;
+	char data[];
+};
+
+struct mailbox {
+	char * id;
+	char * auth;
+
+	struct message ** msgs;
+	size_t msgs_len;
+	size_t msgs_max;
+	// total length of msgs
+	unsigned long long bytes;
+
+	// -1 for the server's default
+	long long quota_messages;
+	long long quota_bytes;
+};
+
+struct storage_stream {
+	struct message * msg;
+	int done;
+};
+
+// open-addressed hash table of mailboxes, size is a power of two
+static struct mailbox * mailboxes;
+static size_t mailboxes_size;
+
+static long long next_id;
+// the mail database, accounts are read from it again on reload
+static char * db_path;
+// quota of mailboxes which do not set their own
+static unsigned long default_quota_messages;
+static unsigned long long default_quota_bytes;
+// for memory_report()
+static unsigned long message_count;
+static unsigned long long message_bytes;
+
+// FNV-1a
+static uint32_t hash(const char * s)
+{
+	uint32_t h = 2166136261u;
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+// Find the slot for a mailbox id: either its entry, or the empty slot it would go in
+static struct mailbox * find_slot(const char * id)
+{
+	size_t i = hash(id) & (mailboxes_size - 1);
+
+	while (mailboxes[i].id != NULL && strcmp(mailboxes[i].id, id) != 0)
+		i = (i + 1) & (mailboxes_size - 1);
+
+	return &mailboxes[i];
+}
+
+static struct mailbox * find_mailbox(const char * id)
+{
+	struct mailbox * m = find_slot(id);
+	return m->id == NULL ? NULL : m;
+}
+
+static void release(struct message * msg)
+{
+	msg->refs --;
+	if (msg->refs == 0) {
+		message_count --;
+		message_bytes -= msg->len;
+		free(msg);
+	}
+}
+
+// free a mailbox table and everything in it
+static void free_mailboxes(struct mailbox * table, size_t size)
+{
+	for (size_t i = 0; i < size; i ++) {
+		for (size_t j = 0; j < table[i].msgs_len; j ++)
+			release(table[i].msgs[j]);
+		free(table[i].msgs);
+		free(table[i].id);
+		free(table[i].auth);
+	}
+
+	free(table);
+}
+
+static void memory_teardown()
+{
+	free_mailboxes(mailboxes, mailboxes_size);
+	mailboxes = NULL;
+	mailboxes_size = 0;
+	free(db_path);
+	db_path = NULL;
+	list_teardown();
+}
+
+// Open one database of the layout for reading accounts, see shard.c
+static sqlite3 * open_shard(int shard)
+{
+	sqlite3 * db = NULL;
+	char * name = shard_path(db_path, shard);
+
+	if (name == NULL || sqlite3_open_v2(name, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+		fputs("Failed to read accounts from database.\n", stderr);
+		sqlite3_close(db);
+		db = NULL;
+	}
+
+	free(name);
+	return db;
+}
+
+// Count the accounts of one database, -1 on error
+static long long count_accounts(sqlite3 * db)
+{
+	sqlite3_stmt * stmt = NULL;
+	long long count = -1;
+
+	if (sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM mailbox", -1, &stmt, NULL) == SQLITE_OK &&
+		sqlite3_step(stmt) == SQLITE_ROW)
+		count = sqlite3_column_int64(stmt, 0);
+	else
+		fputs("Failed to read accounts from database.\n", stderr);
+	sqlite3_finalize(stmt);
+
+	return count;
+}
+
+// Copy at most max accounts of one database into the current table
+//  returns the number loaded, -1 on error
+static long long copy_accounts(sqlite3 * db, size_t max)
+{
+	sqlite3_stmt * stmt;
+
+	// databases from before quotas have no quota columns
+	if (sqlite3_prepare_v2(db, "SELECT id, auth, quota_messages, quota_bytes FROM mailbox", -1, &stmt, NULL) != SQLITE_OK &&
+		sqlite3_prepare_v2(db, "SELECT id, auth, NULL, NULL FROM mailbox", -1, &stmt, NULL) != SQLITE_OK)
+		return -1;
+
+	int rv = SQLITE_DONE;
+	size_t loaded = 0;
+	while (loaded < max && (rv = sqlite3_step(stmt)) == SQLITE_ROW) {
+		const char * id = (const char *)sqlite3_column_text(stmt, 0);
+		const char * auth = (const char *)sqlite3_column_text(stmt, 1);
+
+		struct mailbox * m = find_slot(id);
+		m->id = strdup(id);
+		m->auth = auth ? strdup(auth) : NULL;
+		m->quota_messages = sqlite3_column_type(stmt, 2) == SQLITE_NULL ? -1 : sqlite3_column_int64(stmt, 2);
+		m->quota_bytes = sqlite3_column_type(stmt, 3) == SQLITE_NULL ? -1 : sqlite3_column_int64(stmt, 3);
+
+		if (m->id == NULL || (auth != NULL && m->auth == NULL)) {
+			perror("strdup(mailbox)");
+			break;
+		}
+
+		loaded ++;
+	}
+
+	sqlite3_finalize(stmt);
+	return rv == SQLITE_DONE || rv == SQLITE_ROW ? (long long)loaded : -1;
+}
+
+// Build a new mailbox table from the accounts in the database (all of
+//  its shards): count them, then copy them in.  Maildrops of accounts
+//  already loaded move to the new table, those of accounts no longer
+//  there are dropped.  Lists are read again along with them.
+static int load_accounts()
+{
+	sqlite3 * db[SHARD_MAX] = { NULL };
+
+	if ((db[0] = open_shard(0)) == NULL)
+		return -1;
+
+	// databases from before sharding have no shard table
+	int shards = shard_count(db[0]);
+	if (shards == -1)
+		shards = 1;
+
+	int ret = 0;
+	size_t count = 0;
+	for (int i = 0; i < shards && ret == 0; i ++) {
+		long long n = -1;
+
+		if ((i == 0 || (db[i] = open_shard(i)) != NULL) && (n = count_accounts(db[i])) != -1)
+			count += n;
+		else
+			ret = -1;
+	}
+
+	// keep the table at most half full
+	size_t size = 16;
+	while (size < count * 2)
+		size *= 2;
+
+	struct mailbox * table = ret == 0 ? calloc(size, sizeof(struct mailbox)) : NULL;
+
+	if (ret == 0 && table == NULL) {
+		perror("calloc(mailboxes)");
+		ret = -1;
+	}
+
+	// find_slot() works on the current table, so swap the new one in while loading
+	struct mailbox * old = mailboxes;
+	const size_t old_size = mailboxes_size;
+	size_t loaded = 0;
+
+	if (ret == 0) {
+		mailboxes = table;
+		mailboxes_size = size;
+
+		for (int i = 0; i < shards && ret == 0; i ++) {
+			const long long n = copy_accounts(db[i], count - loaded);
+
+			if (n == -1)
+				ret = -1;
+			else
+				loaded += n;
+		}
+
+		if (ret == 0 && (loaded < count || list_load(db, shards) == -1))
+			ret = -1;
+
+		if (ret == -1) {
+			free_mailboxes(table, size);
+			mailboxes = old;
+			mailboxes_size = old_size;
+		}
+	}
+
+	for (int i = 0; i < shards; i ++)
+		sqlite3_close(db[i]);
+
+	if (ret == -1)
+		return -1;
+
+	for (size_t i = 0; i < old_size; i ++) {
+		if (old[i].id == NULL)
+			continue;
+
+		struct mailbox * m = find_mailbox(old[i].id);
+		if (m != NULL) {
+			m->msgs = old[i].msgs;
+			m->msgs_len = old[i].msgs_len;
+			m->msgs_max = old[i].msgs_max;
+			m->bytes = old[i].bytes;
+			old[i].msgs = NULL;
+			old[i].msgs_len = 0;
+		}
+	}
+	free_mailboxes(old, old_size);
+
+	printf(" . Loaded %zu mailboxes into memory\n", loaded);
+	return 0;
+}
+
+static int memory_setup(const char * path, const struct storage_options * options)
+{
+	db_path = strdup(path);
+
+	if (db_path == NULL) {
+		perror("strdup(path)");
+		return -1;
+	}
+
+	if (load_accounts() == -1) {
+		memory_teardown();
+		return -1;
+	}
+
+	default_quota_messages = options->quota_messages;
+	default_quota_bytes = options->quota_bytes;
+	next_id = 1;
+	return 0;
+}
+
+// Pick up accounts added, changed or removed in the database
+static int memory_reload()
+{
+	return load_accounts();
+}
+
+static int memory_check_mailbox(const char * mailbox, struct storage_usage * usage)
+{
+	// a list takes mail whenever it is sent, its members' quotas aside
+	if (list_find(mailbox) != NULL) {
+		if (usage != NULL)
+			memset(usage, 0, sizeof(struct storage_usage));
+		return 1;
+	}
+
+	const struct mailbox * m = find_mailbox(mailbox);
+	if (m == NULL)
+		return 0;
+
+	if (usage != NULL) {
+		usage->messages = m->msgs_len;
+		usage->bytes = m->bytes;
+		usage->quota_messages = m->quota_messages == -1 ? default_quota_messages : (unsigned long)m->quota_messages;
+		usage->quota_bytes = m->quota_bytes == -1 ? default_quota_bytes : (unsigned long long)m->quota_bytes;
+	}
+
+	return 1;
+}
+
+static int memory_authenticate(const char * mailbox, const char * auth)
+{
+	const struct mailbox * m = find_mailbox(mailbox);
+	return m != NULL && m->auth != NULL && strcmp(m->auth, auth) == 0;
+}
+
+// Make room for one more message in a maildrop
+static int grow(struct mailbox * m)
+{
+	if (m->msgs_len < m->msgs_max)
+		return 0;
+
+	size_t new_max = m->msgs_max * 2 + 16;
+	struct message ** new_msgs = realloc(m->msgs, new_max * sizeof(struct message *));
+
+	if (new_msgs == NULL) {
+		perror("realloc(msgs)");
+		return -1;
+	}
+
+	m->msgs = new_msgs;
+	m->msgs_max = new_max;
+	return 0;
+}
+
+static int memory_store_message(const char * data, size_t len, char * const * rcpt, size_t rcpt_len)
+{
+	// lists go out to all their members
+	size_t targets_len = 0;
+	for (size_t i = 0; i < rcpt_len; i ++) {
+		const struct list * l = list_find(rcpt[i]);
+		targets_len += l != NULL ? l->len : 1;
+	}
+
+	struct mailbox ** targets = malloc(targets_len * sizeof(struct mailbox *));
+
+	if (targets == NULL) {
+		perror("malloc(targets)");
+		return -1;
+	}
+
+	// check everything first, so delivery is all-or-nothing
+	size_t n = 0;
+	for (size_t i = 0; i < rcpt_len; i ++) {
+		const struct list * l = list_find(rcpt[i]);
+
+		if (l == NULL) {
+			if ((targets[n] = find_mailbox(rcpt[i])) == NULL || grow(targets[n]) == -1) {
+				free(targets);
+				return -1;
+			}
+			n ++;
+			continue;
+		}
+
+		// members removed since the lists were loaded are left out
+		for (size_t j = 0; j < l->len; j ++)
+			if ((targets[n] = find_mailbox(l->members[j].mailbox)) != NULL) {
+				if (grow(targets[n]) == -1) {
+					free(targets);
+					return -1;
+				}
+				n ++;
+			}
+	}
+
+	// nobody left on the lists to deliver to
+	if (n == 0) {
+		free(targets);
+		return 0;
+	}
+
+	struct message * msg = malloc(sizeof(struct message) + len);
+
+	if (msg == NULL) {
+		perror("malloc(struct message)");
+		free(targets);
+		return -1;
+	}
+
+	msg->id = next_id ++;
+	msg->refs = 0;
+	msg->delivered = time(NULL);
+	msg->len = len;
+	memcpy(msg->data, data, len);
+
+	for (size_t i = 0; i < n; i ++) {
+		// duplicate RCPT of the same mailbox is not an error
+		if (targets[i]->msgs_len > 0 && targets[i]->msgs[targets[i]->msgs_len - 1] == msg)
+			continue;
+
+		targets[i]->msgs[targets[i]->msgs_len ++] = msg;
+		targets[i]->bytes += len;
+		msg->refs ++;
+	}
+	free(targets);
+
+	message_count ++;
+	message_bytes += len;
+	return 0;
+}
+
+static int memory_list_maildrop(const char * mailbox, struct storage_msg ** list, size_t * len)
+{
+	*list = NULL;
+	*len = 0;
+
+	const struct mailbox * m = find_mailbox(mailbox);
+	if (m == NULL || m->msgs_len == 0)
+		return 0;
+
+	*list = malloc(m->msgs_len * sizeof(struct storage_msg));
+
+	if (*list == NULL) {
+		perror("malloc(maildrop)");
+		return -1;
+	}
+
+	for (size_t i = 0; i < m->msgs_len; i ++) {
+		(*list)[i].id = m->msgs[i]->id;
+		(*list)[i].size = m->msgs[i]->len;
+		(*list)[i].delivered = m->msgs[i]->delivered;
+	}
+	*len = m->msgs_len;
+
+	return 0;
+}
+
+static struct message * find_message(const struct mailbox * m, long long id)
+{
+	// ids are handed out in order, so each maildrop is sorted
+	size_t lo = 0, hi = m->msgs_len;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (m->msgs[mid]->id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo < m->msgs_len && m->msgs[lo]->id == id ? m->msgs[lo] : NULL;
+}
+
+static struct storage_stream * memory_open_message(const char * mailbox, long long id)
+{
+	const struct mailbox * m = find_mailbox(mailbox);
+	if (m == NULL)
+		return NULL;
+
+	struct message * msg = find_message(m, id);
+	if (msg == NULL)
+		return NULL;
+
+	struct storage_stream * s = malloc(sizeof(struct storage_stream));
+
+	if (s == NULL) {
+		perror("malloc(struct storage_stream)");
+		return NULL;
+	}
+
+	// hold a reference so the body outlives a concurrent delete
+	s->msg = msg;
+	s->msg->refs ++;
+	s->done = 0;
+	return s;
+}
+
+static ssize_t memory_read_message(struct storage_stream * s, const char ** buf)
+{
+	*buf = s->msg->data;
+
+	if (s->done)
+		return 0;
+
+	s->done = 1;
+	return s->msg->len;
+}
+
+static void memory_close_message(struct storage_stream * s)
+{
+	release(s->msg);
+	free(s);
+}
+
+static int compare_id(const void * a, const void * b)
+{
+	const long long x = *(const long long *)a, y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+static int memory_delete_set(const char * mailbox, const long long * ids, size_t len)
+{
+	struct mailbox * m = find_mailbox(mailbox);
+	if (m == NULL)
+		return -1;
+
+	long long * sorted = malloc(len * sizeof(long long));
+
+	if (sorted == NULL) {
+		perror("malloc(ids)");
+		return -1;
+	}
+
+	memcpy(sorted, ids, len * sizeof(long long));
+	qsort(sorted, len, sizeof(long long), compare_id);
+
+	// compact the maildrop in one pass, dropping anything in the set
+	size_t kept = 0;
+	for (size_t i = 0; i < m->msgs_len; i ++) {
+		if (bsearch(&m->msgs[i]->id, sorted, len, sizeof(long long), compare_id)) {
+			m->bytes -= m->msgs[i]->len;
+			release(m->msgs[i]);
+		} else
+			m->msgs[kept ++] = m->msgs[i];
+	}
+	m->msgs_len = kept;
+
+	free(sorted);
+	return 0;
+}
+
+static void memory_report(FILE * out)
+{
+	fprintf(out, " . Memory storage: %lu messages, %llu bytes\n", message_count, message_bytes);
+	list_report(out);
+}
+
+const struct storage_backend storage_memory = {
+	.name = "memory",
+	.setup = memory_setup,
+	.teardown = memory_teardown,
+	.check_mailbox = memory_check_mailbox,
+	.authenticate = memory_authenticate,
+	.store_message = memory_store_message,
+	.list_maildrop = memory_list_maildrop,
+	.open_message = memory_open_message,
+	.read_message = memory_read_message,
+	.close_message = memory_close_message,
+	.delete_set = memory_delete_set,
+	.report = memory_report,
+	.reload = memory_reload
+};
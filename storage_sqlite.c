@@ -0,0 +1,904 @@
+#include "storage.h"
+// schema and background upkeep of the storage db
+#include "schema.h"
+#include "maint.h"
+// message bodies as files
+#include "spool.h"
+// recently read message bodies
+#include "cache.h"
+// online copies of the db
+#include "backup.h"
+// databases split by mailbox
+#include "shard.h"
+// distribution lists
+#include "list.h"
+
+// for our storage db
+#include <sqlite3.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+// RETR reads message bodies in pieces of this size
+#define STREAM_CHUNK 65536
+
+// durability profiles, chosen with -d
+//  all use WAL so POP3 readers never wait on an SMTP commit, and
+//  differ in how often the WAL is synced to disk
+//  sync says whether spooled message files are fsynced too, and
+//  commit_sync whether every COMMIT waits for the disk
+static const struct profile {
+	const char * name;
+	const char * pragmas;
+	int sync;
+	int commit_sync;
+} profiles[] = {
+	// sync at checkpoints only: survives a crash, may lose the last commits on power loss
+	{ "balanced", "PRAGMA journal_mode = WAL; PRAGMA synchronous = NORMAL", 1, 0 },
+	// sync on every commit: survives power loss
+	{ "strict", "PRAGMA journal_mode = WAL; PRAGMA synchronous = FULL", 1, 1 },
+	// never sync: leave it to the OS
+	{ "fast", "PRAGMA journal_mode = WAL; PRAGMA synchronous = OFF", 0, 0 }
+};
+
+// per-connection tuning: 256 MiB of memory-mapped I/O, 16 MiB page cache
+#define DB_TUNING "PRAGMA mmap_size = 268435456; PRAGMA cache_size = -16384"
+// longest the event loop waits for another process's write lock
+#define BUSY_MS 100
+
+// a message body read from a blob, a spool file (fd != -1),
+//  or the message cache (cached != NULL)
+struct storage_stream {
+	sqlite3_blob * blob;
+	int fd;
+	struct cache_entry * cached;
+	off_t offset;
+	off_t size;
+	char buf[STREAM_CHUNK];
+};
+
+// One database file of the layout, see shard.c (an unsharded database is
+//  a layout of one).  db is for writes, ro_db for POP3 reads so in WAL
+//  mode they see the last committed state instead of waiting on the writer
+struct shard {
+	sqlite3 * db, * ro_db;
+	// tx handlers
+	sqlite3_stmt * stmt_begin;
+	sqlite3_stmt * stmt_commit;
+	sqlite3_stmt * stmt_rollback;
+	// SMTP
+	sqlite3_stmt * stmt_check_mailbox;
+	sqlite3_stmt * stmt_insert_body;
+	sqlite3_stmt * stmt_insert_recipient;
+	sqlite3_stmt * stmt_insert_list;
+	sqlite3_stmt * stmt_unlink;
+	// POP3
+	sqlite3_stmt * stmt_check_login;
+	sqlite3_stmt * stmt_store;
+	sqlite3_stmt * stmt_retr;
+	sqlite3_stmt * stmt_dele;
+
+	// a delivery in progress: the body's rowid here, and where it is
+	//  in the commit (see commit_shards())
+	sqlite3_int64 rowid;
+	int staged;
+	int committed;
+
+	// commit thread, see shard_open()
+	pthread_t thread;
+	int thread_started;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	// set by the event loop to ask for a COMMIT, cleared by the thread when done
+	int commit_job;
+	int commit_rv;
+	int quit;
+};
+
+static struct shard * shards;
+static int shard_len;
+// the writer connection of each shard, for maint and backup
+static sqlite3 ** shard_dbs;
+// finds a mailbox's shard in the directory, on shard 0
+static sqlite3_stmt * stmt_find;
+
+// Error callback for SQLite errors - simply print to stderr
+static void errorLogCallback(const void * pArg, int iErrCode, const char * zMsg)
+{
+	(void)pArg;
+	fprintf(stderr, "SQLite Error (%d): %s\n", iErrCode, zMsg);
+}
+
+// Commit thread of a shard: waits for commit_job, runs the COMMIT
+//  the event loop does not touch the shard's writer while a job is out
+static void * commit_thread(void * arg)
+{
+	struct shard * s = arg;
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		while (! s->commit_job && ! s->quit)
+			pthread_cond_wait(&s->cond, &s->lock);
+		if (s->quit)
+			break;
+		pthread_mutex_unlock(&s->lock);
+
+		const int rv = sqlite3_step(s->stmt_commit);
+		sqlite3_reset(s->stmt_commit);
+
+		pthread_mutex_lock(&s->lock);
+		s->commit_rv = rv;
+		s->commit_job = 0;
+		pthread_cond_signal(&s->cond);
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+static void shard_close(struct shard * s)
+{
+	if (s->thread_started) {
+		pthread_mutex_lock(&s->lock);
+		s->quit = 1;
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		pthread_join(s->thread, NULL);
+		pthread_cond_destroy(&s->cond);
+		pthread_mutex_destroy(&s->lock);
+	}
+
+	sqlite3_finalize(s->stmt_begin);
+	sqlite3_finalize(s->stmt_commit);
+	sqlite3_finalize(s->stmt_rollback);
+
+	sqlite3_finalize(s->stmt_check_mailbox);
+	sqlite3_finalize(s->stmt_insert_body);
+	sqlite3_finalize(s->stmt_insert_recipient);
+	sqlite3_finalize(s->stmt_insert_list);
+	sqlite3_finalize(s->stmt_unlink);
+
+	sqlite3_finalize(s->stmt_check_login);
+	sqlite3_finalize(s->stmt_store);
+	sqlite3_finalize(s->stmt_retr);
+	sqlite3_finalize(s->stmt_dele);
+
+	sqlite3_close(s->ro_db);
+	sqlite3_close(s->db);
+}
+
+static void sqlite_teardown()
+{
+	backup_teardown();
+	maint_teardown();
+	spool_teardown();
+	cache_teardown();
+	list_teardown();
+
+	sqlite3_finalize(stmt_find);
+	stmt_find = NULL;
+
+	for (int i = 0; i < shard_len; i ++)
+		shard_close(&shards[i]);
+
+	free(shards);
+	free(shard_dbs);
+	shards = NULL;
+	shard_dbs = NULL;
+	shard_len = 0;
+}
+
+// Open the writer connection of a shard, and bring its schema up to date
+static int shard_open_writer(struct shard * s, const char * path, const struct profile * profile)
+{
+	if (sqlite3_open_v2(path, &s->db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Failed to open database %s.\n", path);
+		return -1;
+	}
+
+	if (sqlite3_exec(s->db, "PRAGMA foreign_keys = ON", NULL, NULL, NULL) != SQLITE_OK) {
+		fputs("Failed to enable foreign keys.\n", stderr);
+		return -1;
+	}
+
+	// while a restarted server drains (see main.c), two of them write;
+	//  a short wait for the lock beats failing the delivery
+	sqlite3_busy_timeout(s->db, BUSY_MS);
+
+	if (sqlite3_exec(s->db, profile->pragmas, NULL, NULL, NULL) != SQLITE_OK ||
+		sqlite3_exec(s->db, DB_TUNING, NULL, NULL, NULL) != SQLITE_OK) {
+		fprintf(stderr, "Failed to apply durability profile %s.\n", profile->name);
+		return -1;
+	}
+
+	if (schema_upgrade(s->db) == -1) {
+		fputs("Failed to upgrade database schema.\n", stderr);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Open the reader connection of a shard, prepare its statements and
+//  start its commit thread if it needs one
+static int shard_open(struct shard * s, const char * path, const struct storage_options * options, const struct profile * profile)
+{
+	if (sqlite3_open_v2(path, &s->ro_db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK ||
+		sqlite3_exec(s->ro_db, DB_TUNING, NULL, NULL, NULL) != SQLITE_OK) {
+		fputs("Failed to open read-only database connection.\n", stderr);
+		return -1;
+	}
+
+	sqlite3 * db = s->db, * ro_db = s->ro_db;
+
+	if (sqlite3_prepare_v2(db, "BEGIN", -1, &s->stmt_begin, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, "COMMIT", -1, &s->stmt_commit, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, "ROLLBACK", -1, &s->stmt_rollback, NULL) != SQLITE_OK ||
+
+		// usage and quota, with the defaults bound below for mailboxes without their own
+		sqlite3_prepare_v2(ro_db, "SELECT messages, bytes, IFNULL(quota_messages, ?2), IFNULL(quota_bytes, ?3) FROM mailbox WHERE id = ?1", -1, &s->stmt_check_mailbox, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, "INSERT INTO message(data, size, spool, delivered) VALUES(?, ?, ?, ?)", -1, &s->stmt_insert_body, NULL) != SQLITE_OK ||
+		// duplicate RCPT of the same mailbox is not an error
+		sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO mailbox_message(mailbox_id, message_id) VALUES(?, ?)", -1, &s->stmt_insert_recipient, NULL) != SQLITE_OK ||
+		// every member of a list on this shard at once, however many there are
+		sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO mailbox_message(mailbox_id, message_id) SELECT mailbox_id, ?2 FROM list_member WHERE list_id = ?1", -1, &s->stmt_insert_list, NULL) != SQLITE_OK ||
+		// takes back a delivery another shard failed to commit
+		sqlite3_prepare_v2(db, "DELETE FROM mailbox_message WHERE message_id = ?", -1, &s->stmt_unlink, NULL) != SQLITE_OK ||
+
+		sqlite3_prepare_v2(ro_db, "SELECT EXISTS(SELECT 1 FROM mailbox WHERE id=? AND auth=?)", -1, &s->stmt_check_login, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(ro_db, "SELECT b.id, b.size, b.delivered FROM mailbox_message a INNER JOIN message b ON a.message_id = b.id WHERE a.mailbox_id = ? ORDER BY a.message_id", -1, &s->stmt_store, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(ro_db, "SELECT b.spool FROM mailbox_message a INNER JOIN message b ON a.message_id = b.id WHERE a.mailbox_id = ? AND a.message_id = ?", -1, &s->stmt_retr, NULL) != SQLITE_OK ||
+		// all of a session's deletions go in one statement, ids passed as a JSON array
+		sqlite3_prepare_v2(db, "DELETE FROM mailbox_message WHERE mailbox_id = ? AND message_id IN (SELECT value FROM json_each(?))", -1, &s->stmt_dele, NULL) != SQLITE_OK) {
+		fputs("Failed to prepare statements.\n", stderr);
+		return -1;
+	}
+
+	// bindings outlive sqlite3_reset(), so these are set once
+	sqlite3_bind_int64(s->stmt_check_mailbox, 2, options->quota_messages);
+	sqlite3_bind_int64(s->stmt_check_mailbox, 3, options->quota_bytes);
+
+	// a delivery to several shards waits for all their syncs at once
+	//  (without syncs a COMMIT is quicker than handing it to a thread),
+	//  which needs a library built to be used from more than one thread
+	if (shard_len > 1 && profile->commit_sync && sqlite3_threadsafe()) {
+		if (pthread_mutex_init(&s->lock, NULL) != 0 || pthread_cond_init(&s->cond, NULL) != 0 ||
+			pthread_create(&s->thread, NULL, commit_thread, s) != 0) {
+			fputs("Failed to start commit thread.\n", stderr);
+			return -1;
+		}
+		s->thread_started = 1;
+	}
+
+	return 0;
+}
+
+static int sqlite_setup(const char * path, const struct storage_options * options)
+{
+	const struct profile * profile = &profiles[0];
+
+	if (options->profile != NULL) {
+		profile = NULL;
+		for (size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i ++)
+			if (strcmp(options->profile, profiles[i].name) == 0)
+				profile = &profiles[i];
+
+		if (profile == NULL) {
+			fprintf(stderr, "Unknown durability profile `%s' (strict, balanced, fast).\n", options->profile);
+			return -1;
+		}
+	}
+
+	if (options->spool != NULL && spool_setup(options->spool, profile->sync) == -1) {
+		fputs("Failed to open spool directory.\n", stderr);
+		return -1;
+	}
+
+	// turn on error printing for the sqlite3 interface
+	sqlite3_config(SQLITE_CONFIG_LOG, errorLogCallback, NULL);
+
+	// shard 0 is the database on the command line, and says how many more there are
+	struct shard first = { 0 };
+
+	if (shard_open_writer(&first, path, profile) == -1 || (shard_len = shard_count(first.db)) == -1) {
+		shard_len = 0;
+		shard_close(&first);
+		sqlite_teardown();
+		return -1;
+	}
+
+	shards = calloc(shard_len, sizeof(struct shard));
+	shard_dbs = calloc(shard_len, sizeof(sqlite3 *));
+
+	if (shards == NULL || shard_dbs == NULL) {
+		perror("calloc(shards)");
+		shard_len = 0;
+		shard_close(&first);
+		sqlite_teardown();
+		return -1;
+	}
+
+	shards[0] = first;
+
+	for (int i = 0; i < shard_len; i ++) {
+		char * name = shard_path(path, i);
+
+		if (name == NULL || (i > 0 && shard_open_writer(&shards[i], name, profile) == -1) ||
+			shard_open(&shards[i], name, options, profile) == -1) {
+			free(name);
+			sqlite_teardown();
+			return -1;
+		}
+
+		shard_dbs[i] = shards[i].db;
+		free(name);
+	}
+
+	printf(" . Using durability profile %s\n", profile->name);
+	if (shard_len > 1)
+		printf(" . Database is split into %d shards\n", shard_len);
+
+	if (shard_len > 1 && sqlite3_prepare_v2(shards[0].ro_db, SHARD_FIND_SQL, -1, &stmt_find, NULL) != SQLITE_OK) {
+		fputs("Failed to prepare statements.\n", stderr);
+		sqlite_teardown();
+		return -1;
+	}
+
+	if (list_load(shard_dbs, shard_len) == -1) {
+		sqlite_teardown();
+		return -1;
+	}
+
+	if (cache_setup(options->cache_mb * 1024 * 1024) == -1) {
+		fputs("Failed to setup message cache.\n", stderr);
+		sqlite_teardown();
+		return -1;
+	}
+
+	if (maint_setup(shard_dbs, shard_len, options->retention_days) == -1) {
+		fputs("Failed to setup maintenance module.\n", stderr);
+		sqlite_teardown();
+		return -1;
+	}
+
+	if (backup_setup(shard_dbs, shard_len, options->backup_pages) == -1) {
+		fputs("Failed to setup backup module.\n", stderr);
+		sqlite_teardown();
+		return -1;
+	}
+
+	return 0;
+}
+
+// Find the shard a mailbox lives on
+//  returns 1 and sets *shard if found, 0 if not, -1 on error
+static int route(const char * mailbox, int * shard)
+{
+	if (shard_len == 1) {
+		*shard = 0;
+		return 1;
+	}
+
+	const int ret = shard_find(stmt_find, mailbox, shard);
+
+	if (ret == 1 && (*shard < 0 || *shard >= shard_len)) {
+		fprintf(stderr, "Mailbox `%s' is on shard %d, which does not exist.\n", mailbox, *shard);
+		return -1;
+	}
+
+	return ret;
+}
+
+// single-row, single-int query helper for the EXISTS checks
+static int step_exists(sqlite3_stmt * stmt)
+{
+	int ret = -1;
+
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		ret = sqlite3_column_int(stmt, 0) ? 1 : 0;
+	sqlite3_reset(stmt);
+
+	return ret;
+}
+
+static int sqlite_check_mailbox(const char * mailbox, struct storage_usage * usage)
+{
+	// a list takes mail whenever it is sent, its members' quotas aside
+	if (list_find(mailbox) != NULL) {
+		if (usage != NULL)
+			memset(usage, 0, sizeof(struct storage_usage));
+		return 1;
+	}
+
+	int shard;
+	int ret = route(mailbox, &shard);
+
+	if (ret != 1)
+		return ret;
+
+	sqlite3_stmt * stmt = shards[shard].stmt_check_mailbox;
+	sqlite3_bind_text(stmt, 1, mailbox, -1, NULL);
+
+	ret = -1;
+	switch (sqlite3_step(stmt)) {
+	case SQLITE_ROW:
+		if (usage != NULL) {
+			usage->messages = sqlite3_column_int64(stmt, 0);
+			usage->bytes = sqlite3_column_int64(stmt, 1);
+			usage->quota_messages = sqlite3_column_int64(stmt, 2);
+			usage->quota_bytes = sqlite3_column_int64(stmt, 3);
+		}
+		ret = 1;
+		break;
+	case SQLITE_DONE:
+		ret = 0;
+		break;
+	}
+	sqlite3_reset(stmt);
+
+	return ret;
+}
+
+static int sqlite_authenticate(const char * mailbox, const char * auth)
+{
+	int shard;
+	const int ret = route(mailbox, &shard);
+
+	if (ret != 1)
+		return ret;
+
+	sqlite3_stmt * stmt = shards[shard].stmt_check_login;
+	sqlite3_bind_text(stmt, 1, mailbox, -1, NULL);
+	sqlite3_bind_text(stmt, 2, auth, -1, NULL);
+	return step_exists(stmt);
+}
+
+static void rollback(struct shard * s)
+{
+	sqlite3_step(s->stmt_rollback);
+	sqlite3_reset(s->stmt_rollback);
+}
+
+// Begin the delivery on one shard: the body, and links for the recipients on it
+//  a list's members here are linked by one statement, see list.c
+//  a spooled body is on disk before the transaction starts,
+//  and gets its final name inside it
+//  returns 0 on success, -1 on failure (with nothing left behind)
+static int stage(int shard, const char * data, size_t len, char * const * rcpt, const int * rcpt_shard, const struct list * const * rcpt_list, size_t rcpt_len)
+{
+	struct shard * s = &shards[shard];
+	const int spooled = spool_enabled();
+	char tmp[SPOOL_NAME_MAX];
+
+	if (spooled && spool_write(data, len, tmp) == -1)
+		return -1;
+
+	// the body must not land in some other transaction left open
+	int rv = sqlite3_step(s->stmt_begin);
+	sqlite3_reset(s->stmt_begin);
+
+	if (rv != SQLITE_DONE) {
+		if (spooled)
+			spool_abort(tmp);
+		return -1;
+	}
+
+	if (spooled)
+		sqlite3_bind_zeroblob(s->stmt_insert_body, 1, 0);
+	else
+		sqlite3_bind_blob(s->stmt_insert_body, 1, data, len, NULL);
+	sqlite3_bind_int64(s->stmt_insert_body, 2, len);
+	sqlite3_bind_int(s->stmt_insert_body, 3, spooled);
+	sqlite3_bind_int64(s->stmt_insert_body, 4, time(NULL));
+	rv = sqlite3_step(s->stmt_insert_body);
+	sqlite3_reset(s->stmt_insert_body);
+
+	if (rv != SQLITE_DONE) {
+		rollback(s);
+		if (spooled)
+			spool_abort(tmp);
+		return -1;
+	}
+
+	s->rowid = sqlite3_last_insert_rowid(s->db);
+
+	if (spooled && spool_commit(tmp, SHARD_ID(shard, s->rowid)) == -1) {
+		rollback(s);
+		return -1;
+	}
+
+	for (size_t i = 0; i < rcpt_len && rv == SQLITE_DONE; i ++) {
+		sqlite3_stmt * stmt;
+
+		if (rcpt_list[i] != NULL && LIST_ON_SHARD(rcpt_list[i], shard))
+			stmt = s->stmt_insert_list;
+		else if (rcpt_list[i] == NULL && rcpt_shard[i] == shard)
+			stmt = s->stmt_insert_recipient;
+		else
+			continue;
+
+		sqlite3_bind_text(stmt, 1, rcpt[i], -1, NULL);
+		sqlite3_bind_int64(stmt, 2, s->rowid);
+		rv = sqlite3_step(stmt);
+		sqlite3_reset(stmt);
+	}
+
+	if (rv != SQLITE_DONE) {
+		rollback(s);
+		// the id may be handed out again, so the file must go
+		if (spooled)
+			spool_remove(SHARD_ID(shard, s->rowid));
+		return -1;
+	}
+
+	s->staged = 1;
+	return 0;
+}
+
+// Commit every staged shard, the others on their commit threads while
+//  the event loop does the first one itself
+//  sets committed on each shard that made it
+static void commit_shards()
+{
+	struct shard * inline_shard = NULL;
+
+	for (int i = 0; i < shard_len; i ++) {
+		struct shard * s = &shards[i];
+
+		if (! s->staged)
+			continue;
+
+		if (inline_shard == NULL || ! s->thread_started) {
+			if (inline_shard == NULL)
+				inline_shard = s;
+			else {
+				// no threads: one after the other
+				s->committed = sqlite3_step(s->stmt_commit) == SQLITE_DONE;
+				sqlite3_reset(s->stmt_commit);
+			}
+			continue;
+		}
+
+		pthread_mutex_lock(&s->lock);
+		s->commit_job = 1;
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	if (inline_shard != NULL) {
+		inline_shard->committed = sqlite3_step(inline_shard->stmt_commit) == SQLITE_DONE;
+		sqlite3_reset(inline_shard->stmt_commit);
+	}
+
+	for (int i = 0; i < shard_len; i ++) {
+		struct shard * s = &shards[i];
+
+		if (! s->staged || s == inline_shard || ! s->thread_started)
+			continue;
+
+		pthread_mutex_lock(&s->lock);
+		while (s->commit_job)
+			pthread_cond_wait(&s->cond, &s->lock);
+		s->committed = s->commit_rv == SQLITE_DONE;
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+// Body and all recipient links go in one transaction per shard: all of
+//  them commit, or the delivery is taken back from those that did
+static int sqlite_store_message(const char * data, size_t len, char * const * rcpt, size_t rcpt_len)
+{
+	int rcpt_shard[rcpt_len];
+	const struct list * rcpt_list[rcpt_len];
+	char needed[shard_len];
+
+	memset(needed, 0, shard_len);
+	for (size_t i = 0; i < rcpt_len; i ++) {
+		if ((rcpt_list[i] = list_find(rcpt[i])) != NULL) {
+			// a list needs the body on every shard it has members on
+			for (int j = 0; j < shard_len; j ++)
+				needed[j] |= LIST_ON_SHARD(rcpt_list[i], j);
+			continue;
+		}
+
+		if (route(rcpt[i], &rcpt_shard[i]) != 1)
+			return -1;
+		needed[rcpt_shard[i]] = 1;
+	}
+
+	int ret = 0;
+	for (int i = 0; i < shard_len && ret == 0; i ++)
+		if (needed[i])
+			ret = stage(i, data, len, rcpt, rcpt_shard, rcpt_list, rcpt_len);
+
+	if (ret == 0) {
+		commit_shards();
+
+		for (int i = 0; i < shard_len; i ++)
+			if (shards[i].staged && ! shards[i].committed)
+				ret = -1;
+	}
+
+	for (int i = 0; i < shard_len; i ++) {
+		struct shard * s = &shards[i];
+
+		if (! s->staged)
+			continue;
+
+		if (ret == -1 && s->committed) {
+			// the links go, and the body is swept as usual
+			sqlite3_bind_int64(s->stmt_unlink, 1, s->rowid);
+			if (sqlite3_step(s->stmt_unlink) != SQLITE_DONE)
+				fprintf(stderr, "Failed to take back message %lld from shard %d.\n", SHARD_ID(i, s->rowid), i);
+			sqlite3_reset(s->stmt_unlink);
+			maint_gc_notify(i);
+		} else if (! s->committed) {
+			rollback(s);
+			if (spool_enabled())
+				spool_remove(SHARD_ID(i, s->rowid));
+		}
+
+		s->staged = 0;
+		s->committed = 0;
+	}
+
+	return ret;
+}
+
+static int sqlite_list_maildrop(const char * mailbox, struct storage_msg ** list, size_t * len)
+{
+	*list = NULL;
+	*len = 0;
+	size_t max = 0;
+
+	int shard;
+	const int found = route(mailbox, &shard);
+
+	if (found != 1)
+		return found;
+
+	sqlite3_stmt * stmt_store = shards[shard].stmt_store;
+	sqlite3_bind_text(stmt_store, 1, mailbox, -1, NULL);
+	int rv;
+	while ((rv = sqlite3_step(stmt_store)) == SQLITE_ROW) {
+		if (*len == max) {
+			max = max * 2 + 16;
+			struct storage_msg * new_list = realloc(*list, max * sizeof(struct storage_msg));
+
+			if (new_list == NULL) {
+				perror("realloc(maildrop)");
+				break;
+			}
+			*list = new_list;
+		}
+
+		(*list)[*len].id = SHARD_ID(shard, sqlite3_column_int64(stmt_store, 0));
+		(*list)[*len].size = sqlite3_column_int64(stmt_store, 1);
+		(*list)[*len].delivered = sqlite3_column_int64(stmt_store, 2);
+		(*len) ++;
+	}
+	sqlite3_reset(stmt_store);
+
+	if (rv != SQLITE_DONE) {
+		free(*list);
+		*list = NULL;
+		*len = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct storage_stream * sqlite_open_message(const char * mailbox, long long id)
+{
+	int shard;
+
+	if (route(mailbox, &shard) != 1 || SHARD_OF(id) != shard)
+		return NULL;
+
+	// must be one of this user's messages
+	sqlite3_stmt * stmt_retr = shards[shard].stmt_retr;
+	sqlite3_bind_text(stmt_retr, 1, mailbox, -1, NULL);
+	sqlite3_bind_int64(stmt_retr, 2, SHARD_ROWID(id));
+	int spooled = -1;
+	if (sqlite3_step(stmt_retr) == SQLITE_ROW)
+		spooled = sqlite3_column_int(stmt_retr, 0);
+	sqlite3_reset(stmt_retr);
+
+	if (spooled == -1)
+		return NULL;
+
+	struct storage_stream * m = malloc(sizeof(struct storage_stream));
+
+	if (m == NULL) {
+		perror("malloc(struct storage_stream)");
+		return NULL;
+	}
+
+	m->blob = NULL;
+	m->fd = -1;
+	m->cached = NULL;
+	m->offset = 0;
+
+	if (spooled) {
+		struct stat st;
+
+		if (! spool_enabled() || (m->fd = spool_open(id)) == -1 || fstat(m->fd, &st) == -1) {
+			if (m->fd != -1)
+				close(m->fd);
+			free(m);
+			return NULL;
+		}
+
+		m->size = st.st_size;
+	} else if ((m->cached = cache_get(id)) != NULL) {
+		m->size = m->cached->len;
+	} else {
+		// incremental blob I/O, so huge messages are not held in memory at once
+		if (sqlite3_blob_open(shards[shard].ro_db, "main", "message", "data", SHARD_ROWID(id), 0, &m->blob) != SQLITE_OK) {
+			sqlite3_blob_close(m->blob);
+			free(m);
+			return NULL;
+		}
+
+		m->size = sqlite3_blob_bytes(m->blob);
+
+		// read small enough bodies whole, so the next RETR of the
+		//  same message (e.g. mail to many users) skips the database
+		struct cache_entry * e = cache_alloc(id, m->size);
+		if (e != NULL) {
+			if (sqlite3_blob_read(m->blob, e->data, m->size, 0) == SQLITE_OK) {
+				cache_insert(e);
+				m->cached = e;
+				sqlite3_blob_close(m->blob);
+				m->blob = NULL;
+			} else
+				cache_release(e);
+		}
+	}
+
+	return m;
+}
+
+static ssize_t sqlite_read_message(struct storage_stream * m, const char ** buf)
+{
+	// cached bodies are handed out in one piece, without a copy
+	if (m->cached != NULL) {
+		*buf = m->cached->data + m->offset;
+		ssize_t n = m->size - m->offset;
+		m->offset = m->size;
+		return n;
+	}
+
+	off_t n = m->size - m->offset;
+	if (n > STREAM_CHUNK)
+		n = STREAM_CHUNK;
+
+	if (n > 0) {
+		if (m->fd != -1)
+			n = pread(m->fd, m->buf, n, m->offset);
+		else if (sqlite3_blob_read(m->blob, m->buf, n, m->offset) != SQLITE_OK)
+			n = -1;
+
+		if (n == -1)
+			return -1;
+		m->offset += n;
+	}
+
+	*buf = m->buf;
+	return n;
+}
+
+// spooled bodies can be handed to sendfile() as they are
+static int sqlite_message_fd(struct storage_stream * m, off_t * offset, size_t * len)
+{
+	if (m->fd != -1) {
+		*offset = m->offset;
+		*len = m->size - m->offset;
+	}
+
+	return m->fd;
+}
+
+static void sqlite_close_message(struct storage_stream * m)
+{
+	if (m->fd != -1)
+		close(m->fd);
+	if (m->cached != NULL)
+		cache_release(m->cached);
+	sqlite3_blob_close(m->blob);
+	free(m);
+}
+
+static int sqlite_delete_set(const char * mailbox, const long long * ids, size_t len)
+{
+	if (len == 0)
+		return 0;
+
+	int shard;
+	if (route(mailbox, &shard) != 1)
+		return -1;
+
+	struct shard * s = &shards[shard];
+
+	// build a JSON array of the ids to remove
+	char * json = malloc(len * 21 + 2);
+
+	if (json == NULL) {
+		perror("malloc(json)");
+		return -1;
+	}
+
+	size_t json_len = 0;
+	json[json_len ++] = '[';
+	for (size_t i = 0; i < len; i ++)
+		json_len += sprintf(json + json_len, i ? ",%lld" : "%lld", SHARD_ROWID(ids[i]));
+	json[json_len ++] = ']';
+
+	// without a transaction of its own, the DELETE would land in whatever
+	//  is open (the error itself is logged by errorLogCallback)
+	const int begun = sqlite3_step(s->stmt_begin);
+	sqlite3_reset(s->stmt_begin);
+
+	if (begun != SQLITE_DONE) {
+		free(json);
+		return -1;
+	}
+
+	sqlite3_bind_text(s->stmt_dele, 1, mailbox, -1, NULL);
+	sqlite3_bind_text(s->stmt_dele, 2, json, json_len, NULL);
+
+	int ret = 0;
+	if (sqlite3_step(s->stmt_dele) != SQLITE_DONE || sqlite3_step(s->stmt_commit) != SQLITE_DONE) {
+		rollback(s);
+		ret = -1;
+	} else
+		// orphaned bodies are swept later, outside the session
+		maint_gc_notify(shard);
+
+	sqlite3_reset(s->stmt_commit);
+	sqlite3_reset(s->stmt_dele);
+
+	free(json);
+	return ret;
+}
+
+// Lists are the only thing the server keeps a copy of
+static int sqlite_reload()
+{
+	return list_load(shard_dbs, shard_len);
+}
+
+static void sqlite_report(FILE * out)
+{
+	maint_report(out);
+	cache_report(out);
+	backup_report(out);
+	list_report(out);
+}
+
+const struct storage_backend storage_sqlite = {
+	.name = "sqlite",
+	.setup = sqlite_setup,
+	.teardown = sqlite_teardown,
+	.check_mailbox = sqlite_check_mailbox,
+	.authenticate = sqlite_authenticate,
+	.store_message = sqlite_store_message,
+	.list_maildrop = sqlite_list_maildrop,
+	.open_message = sqlite_open_message,
+	.read_message = sqlite_read_message,
+	.message_fd = sqlite_message_fd,
+	.close_message = sqlite_close_message,
+	.delete_set = sqlite_delete_set,
+	.pending = maint_pending,
+	.idle = maint_step,
+	.report = sqlite_report,
+	.backup = backup_start,
+	.ticking = backup_running,
+	.tick = backup_step,
+	.reload = sqlite_reload
+};
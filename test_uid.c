@@ -0,0 +1,134 @@
+/*
+** bridgemail-test-uid - message ids must never be handed out twice
+*  IMAP UIDs are made from message ids, under a fixed UIDVALIDITY, so a
+*  message delivered after the newest one was expunged and collected must
+*  still get a new id, in the same run and after a restart.  Runs on a
+*  throwaway database, exits non-zero on failure.
+*/
+
+#include "storage.h"
+#include "schema.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char * path;
+
+static int create_db()
+{
+	sqlite3 * db;
+
+	if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK ||
+		schema_upgrade(db) == -1 ||
+		sqlite3_exec(db, "INSERT INTO mailbox(id, auth) VALUES('bob', 'pw')", NULL, NULL, NULL) != SQLITE_OK) {
+		sqlite3_close(db);
+		return -1;
+	}
+
+	sqlite3_close(db);
+	return 0;
+}
+
+static int deliver()
+{
+	static const char body[] = "Subject: test\r\n\r\nbody\r\n";
+	char * rcpt[] = { "bob" };
+
+	return storage_store_message(body, sizeof body - 1, rcpt, 1);
+}
+
+// the id of bob's newest message, 0 for none, -1 on error
+static long long newest()
+{
+	struct storage_msg * list;
+	size_t len;
+
+	if (storage_list_maildrop("bob", &list, &len) == -1)
+		return -1;
+
+	const long long id = len ? list[len - 1].id : 0;
+	free(list);
+	return id;
+}
+
+// expunge the newest message, and let maint collect its body
+static int expunge(long long id)
+{
+	if (storage_delete_set("bob", &id, 1) == -1)
+		return -1;
+
+	while (storage_pending())
+		storage_idle(100);
+	return 0;
+}
+
+static int check(const char * what, long long id, long long last)
+{
+	if (id > last)
+		return 0;
+
+	fprintf(stderr, "FAIL: %s: got id %lld, after %lld was used\n", what, id, last);
+	return -1;
+}
+
+// deliver, expunge and collect, deliver again: each id above the last
+//  returns 0 on success, -1 on failure
+static int run(const struct storage_options * options)
+{
+	long long first, second, third, fourth;
+
+	if (deliver() == -1 || (first = newest()) <= 0 ||
+		deliver() == -1 || (second = newest()) <= 0 || check("second delivery", second, first) == -1)
+		return -1;
+
+	// the newest message goes, and its id with it
+	if (expunge(second) == -1 || newest() != first ||
+		deliver() == -1 || (third = newest()) <= 0 || check("delivery after GC", third, second) == -1)
+		return -1;
+
+	// the same, with the server restarted in between
+	if (expunge(third) == -1)
+		return -1;
+	storage_teardown();
+	if (storage_setup("sqlite", path, options) == -1)
+		return -1;
+	if (deliver() == -1 || (fourth = newest()) <= 0 || check("delivery after restart", fourth, third) == -1)
+		return -1;
+
+	printf("PASS: ids %lld %lld %lld %lld\n", first, second, third, fourth);
+	return 0;
+}
+
+int main()
+{
+	struct storage_options options = { 0 };
+
+	char dir[] = "/tmp/bridgemail-test-uid.XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+
+	char db[sizeof dir + 16];
+	sprintf(db, "%s/mail.db", dir);
+	path = db;
+
+	int ret = -1;
+	if (create_db() == -1 || storage_setup("sqlite", path, &options) == -1)
+		fputs("FAIL: setup\n", stderr);
+	else {
+		ret = run(&options);
+		storage_teardown();
+	}
+
+	static const char * const suffix[] = { "", "-wal", "-shm" };
+	for (size_t i = 0; i < sizeof(suffix) / sizeof(suffix[0]); i ++) {
+		sprintf(db, "%s/mail.db%s", dir, suffix[i]);
+		unlink(db);
+	}
+	rmdir(dir);
+
+	return ret == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,165 @@
+#include "throttle.h"
+
+#include <stdint.h>
+#include <time.h>
+
+// Failed logins are counted in token buckets, one per client address and
+//  one per username: each failure takes a token, and tokens come back one
+//  every REFILL_MS up to the burst.  While a bucket is out of tokens, the
+//  logins it covers are held back before they are answered, for twice as
+//  long with every token it is short (the tarpit).  The event loop does
+//  the waiting, see main.c, so a held session costs nothing meanwhile.
+//  An address that is out of tokens is not even checked against the
+//  database; a user who is (someone else is guessing their password)
+//  still is, only slowly.  Successful logins take nothing, so whoever
+//  knows their password is never held back by their own logins.
+
+// the buckets live in one fixed table, a key may go in any of PROBES
+//  slots from where it hashes to
+#define SLOTS 4096
+#define PROBES 8
+#define REFILL_MS 30000
+
+// tarpit: TARPIT_MS, doubling up to TARPIT_MAX_MS, and the most tokens
+//  a bucket can be short (which bounds how long it takes to pay back)
+#define TARPIT_MS 250
+#define TARPIT_MAX_MS 30000
+#define DEBT_MAX 16
+
+struct bucket {
+	// 0 for an empty slot
+	uint64_t key;
+	float tokens;
+	long updated_ms;
+};
+
+static struct bucket buckets[SLOTS];
+// failures allowed before the tarpit, 0 to turn throttling off
+static unsigned int burst;
+
+// for the report
+static unsigned long held, unchecked;
+
+// the same clock as the event loop's, see main.c
+static long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a, of which kind of key it is and then the key, so an address
+//  and a username never share a bucket
+static uint64_t hash(char kind, const char * s)
+{
+	uint64_t h = (14695981039346656037u ^ (unsigned char)kind) * 1099511628211u;
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 1099511628211u;
+	}
+	return h | 1;
+}
+
+// Bring the tokens of a bucket up to date
+static void refill(struct bucket * b, long now)
+{
+	const float tokens = b->tokens + (float)(now - b->updated_ms) / REFILL_MS;
+	b->tokens = tokens < burst ? tokens : burst;
+	b->updated_ms = now;
+}
+
+// Find the bucket of a key, NULL if it has none (it would be full)
+//  with create, one is made: in an empty slot, or in place of the
+//  fullest one, which has the least to remember
+static struct bucket * find(uint64_t key, int create, long now)
+{
+	struct bucket * victim = NULL;
+
+	for (unsigned int i = 0; i < PROBES; i ++) {
+		struct bucket * b = &buckets[(key + i) & (SLOTS - 1)];
+
+		if (b->key == key) {
+			refill(b, now);
+			return b;
+		}
+
+		if (b->key != 0)
+			refill(b, now);
+		if (victim == NULL || (victim->key != 0 && (b->key == 0 || b->tokens > victim->tokens)))
+			victim = b;
+	}
+
+	if (! create)
+		return NULL;
+
+	victim->key = key;
+	victim->tokens = burst;
+	victim->updated_ms = now;
+	return victim;
+}
+
+static void take(struct bucket * b)
+{
+	if (b->tokens > -DEBT_MAX)
+		b->tokens -= 1;
+}
+
+void throttle_setup(unsigned int failures)
+{
+	burst = failures;
+}
+
+void throttle_report(FILE * out)
+{
+	if (burst != 0)
+		fprintf(out, " . Throttle: %lu logins held back, %lu of them refused unchecked\n", held, unchecked);
+}
+
+// Before checking a password: when may the login be answered, 0 for
+//  right away, or a time on the event loop's clock to hold it until
+//  *check is 0 if it should then be refused without looking
+//  addr may be NULL, for a client without one
+long throttle_login(const char * addr, const char * user, int * check)
+{
+	*check = 1;
+	if (burst == 0)
+		return 0;
+
+	const long now = now_ms();
+	const struct bucket * a = addr != NULL ? find(hash('a', addr), 0, now) : NULL;
+	const struct bucket * u = find(hash('u', user), 0, now);
+
+	// the emptier bucket of the two sets the delay
+	float tokens = burst;
+	if (a != NULL && a->tokens < tokens)
+		tokens = a->tokens;
+	if (u != NULL && u->tokens < tokens)
+		tokens = u->tokens;
+
+	if (tokens >= 1)
+		return 0;
+
+	held ++;
+	if (a != NULL && a->tokens < 1) {
+		*check = 0;
+		unchecked ++;
+	}
+
+	const int shift = 1 - tokens;
+	const long delay = shift < 8 ? (long)TARPIT_MS << shift : TARPIT_MAX_MS;
+	return now + (delay < TARPIT_MAX_MS ? delay : TARPIT_MAX_MS);
+}
+
+// A login failed, it costs the address and the user a token each
+void throttle_failed(const char * addr, const char * user)
+{
+	if (burst == 0)
+		return;
+
+	const long now = now_ms();
+
+	// one after the other, as making the second may take the first's slot
+	if (addr != NULL)
+		take(find(hash('a', addr), 1, now));
+	take(find(hash('u', user), 1, now));
+}
@@ -0,0 +1,15 @@
+#ifndef THROTTLE_H_
+#define THROTTLE_H_
+
+#include <stdio.h>
+
+// longest client address sessions keep, as text (INET6_ADDRSTRLEN)
+#define THROTTLE_ADDR_MAX 46
+
+void throttle_setup(unsigned int burst);
+void throttle_report(FILE * out);
+
+long throttle_login(const char * addr, const char * user, int * check);
+void throttle_failed(const char * addr, const char * user);
+
+#endif
@@ -0,0 +1,341 @@
+#include "tls.h"
+
+#include <stdlib.h>
+#include <errno.h>
+
+#ifdef HAVE_OPENSSL
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+// STARTTLS / STLS sessions.  The socket is non-blocking from the start
+//  of the handshake, so a slow client never holds up the event loop;
+//  writes wait for the socket the way a blocking send() would.
+//  Read-ahead stays off, so OpenSSL takes one record at a time from the
+//  socket, and a read buffer of TLS_RECORD_MAX never leaves decrypted
+//  input behind where poll() can't see it.
+
+// sessions kept for resumption by id (TLS 1.2), TLS 1.3 clients resume
+//  from tickets instead, which keep nothing on the server
+#define SESSION_CACHE 4096
+
+struct tls {
+	SSL * ssl;
+	int fd;
+	// handshake done, and whether the kernel took over sending
+	int ready;
+	int ktls_send;
+};
+
+static SSL_CTX * ctx;
+
+// counters for the report
+static unsigned long handshakes, resumed, failed, ktls_sends, ktls_recvs;
+
+static void print_errors(const char * what)
+{
+	unsigned long e;
+
+	fprintf(stderr, "%s failed\n", what);
+	while ((e = ERR_get_error()) != 0)
+		fprintf(stderr, "  %s\n", ERR_error_string(e, NULL));
+}
+
+// Load the certificate (with its chain) and key, key may be NULL if
+//  it is in the certificate file
+int tls_setup(const char * cert, const char * key)
+{
+	if ((ctx = SSL_CTX_new(TLS_server_method())) == NULL) {
+		print_errors("SSL_CTX_new");
+		return -1;
+	}
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	// kernel TLS: after the handshake OpenSSL hands the session keys to
+	//  the socket (setsockopt TCP_ULP "tls"), so records are built by the
+	//  kernel and RETR of a spooled message stays a sendfile()
+	//  clients that just hang up count as closing cleanly
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+	SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"bridgemail", 10);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ctx, SESSION_CACHE);
+
+	if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+		SSL_CTX_use_PrivateKey_file(ctx, key != NULL ? key : cert, SSL_FILETYPE_PEM) != 1 ||
+		SSL_CTX_check_private_key(ctx) != 1) {
+		print_errors("Loading TLS certificate");
+		SSL_CTX_free(ctx);
+		ctx = NULL;
+		return -1;
+	}
+
+	printf(" . Offering STARTTLS with certificate %s\n", cert);
+	return 0;
+}
+
+void tls_teardown()
+{
+	SSL_CTX_free(ctx);
+	ctx = NULL;
+}
+
+int tls_enabled()
+{
+	return ctx != NULL;
+}
+
+void tls_report(FILE * out)
+{
+	if (ctx == NULL)
+		return;
+
+	fprintf(out, " . TLS: %lu handshakes (%lu resumed), %lu failed, kernel TLS on %lu sends and %lu receives, %ld sessions cached\n",
+		handshakes, resumed, failed, ktls_sends, ktls_recvs, SSL_CTX_sess_number(ctx));
+}
+
+// Start a server-side handshake on a connected socket, which is left
+//  non-blocking, to be driven by tls_read() as the client's data arrives
+struct tls * tls_new(int fd)
+{
+	const int flags = fcntl(fd, F_GETFL);
+
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		perror("fcntl(O_NONBLOCK)");
+		return NULL;
+	}
+
+	struct tls * s = malloc(sizeof(struct tls));
+
+	if (s == NULL) {
+		perror("malloc(struct tls)");
+		return NULL;
+	}
+
+	if ((s->ssl = SSL_new(ctx)) == NULL || SSL_set_fd(s->ssl, fd) != 1) {
+		print_errors("SSL_new");
+		SSL_free(s->ssl);
+		free(s);
+		return NULL;
+	}
+
+	SSL_set_accept_state(s->ssl);
+	s->fd = fd;
+	s->ready = 0;
+	s->ktls_send = 0;
+	return s;
+}
+
+// wait for the socket, as a blocking call would have
+static int wait_for(int fd, short events)
+{
+	struct pollfd p = { .fd = fd, .events = events };
+
+	while (poll(&p, 1, -1) == -1)
+		if (errno != EINTR) {
+			perror("poll(tls)");
+			return -1;
+		}
+
+	return 0;
+}
+
+// After a failed SSL call: waits if it only needs to write, and
+//  returns 1 to make the call again, otherwise what tls_read() returns
+static int retry(struct tls * s, int rv)
+{
+	switch (SSL_get_error(s->ssl, rv)) {
+	case SSL_ERROR_WANT_READ:
+		// back when the client sends more
+		errno = EAGAIN;
+		return -1;
+	case SSL_ERROR_WANT_WRITE:
+		return wait_for(s->fd, POLLOUT) == -1 ? -1 : 1;
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;
+	default:
+		if (! s->ready)
+			failed ++;
+		print_errors(s->ready ? "TLS" : "TLS handshake");
+		errno = EPROTO;
+		return -1;
+	}
+}
+
+// Read decrypted input, finishing the handshake first
+//  returns as recv() does, -1 with errno EAGAIN if there is nothing yet
+ssize_t tls_read(struct tls * s, char * buf, size_t len)
+{
+	for (;;) {
+		int rv;
+
+		if (! s->ready) {
+			if ((rv = SSL_do_handshake(s->ssl)) == 1) {
+				s->ready = 1;
+				handshakes ++;
+				if (SSL_session_reused(s->ssl))
+					resumed ++;
+				if ((s->ktls_send = BIO_get_ktls_send(SSL_get_wbio(s->ssl))))
+					ktls_sends ++;
+				if (BIO_get_ktls_recv(SSL_get_rbio(s->ssl)))
+					ktls_recvs ++;
+				continue;
+			}
+		} else if ((rv = SSL_read(s->ssl, buf, len > INT_MAX ? INT_MAX : len)) > 0)
+			return rv;
+
+		const int ret = retry(s, rv);
+		if (ret != 1)
+			return ret;
+	}
+}
+
+// Write all of buf, waiting for the socket as needed
+int tls_write(struct tls * s, const char * buf, size_t len)
+{
+	while (len > 0) {
+		const int rv = SSL_write(s->ssl, buf, len > INT_MAX ? INT_MAX : len);
+
+		if (rv > 0) {
+			buf += rv;
+			len -= rv;
+			continue;
+		}
+
+		const int e = SSL_get_error(s->ssl, rv);
+
+		if (e != SSL_ERROR_WANT_WRITE && e != SSL_ERROR_WANT_READ) {
+			print_errors("SSL_write");
+			return -1;
+		}
+
+		if (wait_for(s->fd, e == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+// Send part of a file: straight from the page cache with kernel TLS,
+//  otherwise read in and encrypted here
+int tls_sendfile(struct tls * s, int in_fd, off_t * offset, size_t len)
+{
+	char buf[65536];
+
+	while (len > 0) {
+		if (s->ktls_send) {
+			const ossl_ssize_t sent = SSL_sendfile(s->ssl, in_fd, *offset, len, 0);
+
+			if (sent > 0) {
+				*offset += sent;
+				len -= sent;
+			} else if (SSL_get_error(s->ssl, sent) != SSL_ERROR_WANT_WRITE) {
+				print_errors("SSL_sendfile");
+				return -1;
+			} else if (wait_for(s->fd, POLLOUT) == -1)
+				return -1;
+
+			continue;
+		}
+
+		const ssize_t n = pread(in_fd, buf, len < sizeof buf ? len : sizeof buf, *offset);
+
+		if (n <= 0) {
+			perror("pread");
+			return -1;
+		}
+
+		if (tls_write(s, buf, n) == -1)
+			return -1;
+
+		*offset += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// End the session, the socket stays open for its owner to close
+void tls_free(struct tls * s)
+{
+	// best effort, without waiting for the client's reply
+	if (s->ready)
+		SSL_shutdown(s->ssl);
+	SSL_free(s->ssl);
+	free(s);
+}
+
+#else
+
+// built without OpenSSL: STARTTLS is never offered
+
+int tls_setup(const char * cert, const char * key)
+{
+	(void)cert;
+	(void)key;
+
+	fputs("BridgeMail was built without TLS support.\n", stderr);
+	return -1;
+}
+
+void tls_teardown()
+{
+}
+
+int tls_enabled()
+{
+	return 0;
+}
+
+void tls_report(FILE * out)
+{
+	(void)out;
+}
+
+struct tls * tls_new(int fd)
+{
+	(void)fd;
+
+	errno = ENOTSUP;
+	return NULL;
+}
+
+ssize_t tls_read(struct tls * s, char * buf, size_t len)
+{
+	(void)s;
+	(void)buf;
+	(void)len;
+
+	errno = ENOTSUP;
+	return -1;
+}
+
+int tls_write(struct tls * s, const char * buf, size_t len)
+{
+	(void)s;
+	(void)buf;
+	(void)len;
+
+	return -1;
+}
+
+int tls_sendfile(struct tls * s, int in_fd, off_t * offset, size_t len)
+{
+	(void)s;
+	(void)in_fd;
+	(void)offset;
+	(void)len;
+
+	return -1;
+}
+
+void tls_free(struct tls * s)
+{
+	(void)s;
+}
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef TLS_H_
+#define TLS_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// most plaintext a TLS record carries, see tls.c
+#define TLS_RECORD_MAX 16384
+
+// a TLS session on a connected socket, see tls.c
+struct tls;
+
+int tls_setup(const char * cert, const char * key);
+void tls_teardown();
+int tls_enabled();
+void tls_report(FILE * out);
+
+struct tls * tls_new(int fd);
+ssize_t tls_read(struct tls * s, char * buf, size_t len);
+int tls_write(struct tls * s, const char * buf, size_t len);
+int tls_sendfile(struct tls * s, int in_fd, off_t * offset, size_t len);
+void tls_free(struct tls * s);
+
+#endif
@@ -0,0 +1,215 @@
+#include "transcript.h"
+#include "transport.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+// A transport that passes everything through to the real one, and logs
+//  the session to a transcript file on the way
+struct capture_transport {
+	struct transport base;
+	struct transport * inner;
+	FILE * file;
+	char protocol;
+
+	// time of the previous record
+	long long last_us;
+	// server output not written out yet, and when it started
+	unsigned long long out_len;
+	long long out_us;
+
+	// SMTP message body tracking, for anonymizing
+	int in_data;
+	size_t line_len;
+	char line_first;
+};
+
+// directory for transcript files, NULL when capture is off
+static const char * transcript_dir;
+static int transcript_anonymize;
+static unsigned long transcript_counter;
+
+static long long now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void put_varint(FILE * f, unsigned long long v)
+{
+	while (v >= 0x80) {
+		fputc((v & 0x7F) | 0x80, f);
+		v >>= 7;
+	}
+	fputc(v, f);
+}
+
+static void put_record(struct capture_transport * c, char type, long long when, unsigned long long len)
+{
+	fputc(type, c->file);
+	put_varint(c->file, when > c->last_us ? when - c->last_us : 0);
+	put_varint(c->file, len);
+	c->last_us = when;
+}
+
+// write out the server output gathered since the last client data
+static void put_output(struct capture_transport * c)
+{
+	if (c->out_len > 0) {
+		put_record(c, TRANSCRIPT_SERVER, c->out_us, c->out_len);
+		c->out_len = 0;
+	}
+}
+
+// Start capturing sessions to files in dir
+//  with anonymize set, SMTP message bodies are replaced by x's of the same shape
+int transcript_setup(const char * dir, int anonymize)
+{
+	transcript_dir = dir;
+	transcript_anonymize = anonymize;
+	printf(" . Writing session transcripts to %s%s\n", dir, anonymize ? " (anonymized)" : "");
+	return 0;
+}
+
+void transcript_teardown()
+{
+	transcript_dir = NULL;
+}
+
+int transcript_enabled()
+{
+	return transcript_dir != NULL;
+}
+
+static int capture_write(struct transport * t, const char * buf, size_t len)
+{
+	struct capture_transport * c = (struct capture_transport *)t;
+
+	if (c->out_len == 0)
+		c->out_us = now_us();
+	c->out_len += len;
+
+	// 354 starts the message body (clients wait for it, so it comes
+	//  before any of the body is received)
+	if (c->protocol == TRANSCRIPT_SMTP && len >= 3 && memcmp(buf, "354", 3) == 0)
+		c->in_data = 1;
+
+	return transport_write(c->inner, buf, len);
+}
+
+static int capture_flush(struct transport * t)
+{
+	return transport_flush(((struct capture_transport *)t)->inner);
+}
+
+static int capture_sendfile(struct transport * t, int in_fd, off_t * offset, size_t len)
+{
+	struct capture_transport * c = (struct capture_transport *)t;
+
+	if (c->out_len == 0)
+		c->out_us = now_us();
+	c->out_len += len;
+
+	return transport_sendfile(c->inner, in_fd, offset, len);
+}
+
+static void capture_close(struct transport * t)
+{
+	struct capture_transport * c = (struct capture_transport *)t;
+
+	put_output(c);
+	fclose(c->file);
+	transport_close(c->inner);
+	free(c);
+}
+
+static ssize_t capture_read(struct transport * t, char * buf, size_t len)
+{
+	struct capture_transport * c = (struct capture_transport *)t;
+
+	return transport_read(c->inner, buf, len);
+}
+
+// no starttls: bridgemail-replay only speaks plaintext, so sessions
+//  being recorded are not offered STARTTLS
+static const struct transport_ops capture_ops = {
+	.name = "capture",
+	.write = capture_write,
+	.flush = capture_flush,
+	.sendfile = capture_sendfile,
+	.close = capture_close,
+	.read = capture_read
+};
+
+// Wrap a transport so its session is captured
+//  if the transcript can't be created, the session goes on without one
+struct transport * transport_capture(struct transport * inner, char protocol)
+{
+	char path[4096];
+	snprintf(path, sizeof path, "%s/%ld-%ld-%lu.%s", transcript_dir, (long)time(NULL), (long)getpid(),
+		transcript_counter ++, protocol == TRANSCRIPT_SMTP ? "smtp" : "pop3");
+
+	struct capture_transport * c = calloc(1, sizeof(struct capture_transport));
+
+	if (c == NULL) {
+		perror("calloc(struct capture_transport)");
+		return inner;
+	}
+
+	c->file = fopen(path, "wb");
+
+	if (c->file == NULL) {
+		perror("fopen(transcript)");
+		free(c);
+		return inner;
+	}
+
+	fputs(TRANSCRIPT_MAGIC, c->file);
+	fputc(protocol, c->file);
+
+	c->base.ops = &capture_ops;
+	c->inner = inner;
+	c->protocol = protocol;
+	c->last_us = now_us();
+	return &c->base;
+}
+
+// Record data received from the client, if t is capturing
+void transcript_recv(struct transport * t, const char * buf, size_t len)
+{
+	if (t->ops != &capture_ops)
+		return;
+
+	struct capture_transport * c = (struct capture_transport *)t;
+
+	put_output(c);
+	put_record(c, TRANSCRIPT_CLIENT, now_us(), len);
+
+	if (! transcript_anonymize || c->protocol != TRANSCRIPT_SMTP) {
+		fwrite(buf, 1, len, c->file);
+		return;
+	}
+
+	// inside a message body, keep line breaks, line lengths and the
+	//  terminating "." but nothing else
+	for (size_t i = 0; i < len; i ++) {
+		char ch = buf[i];
+
+		if (c->line_len == 0)
+			c->line_first = ch;
+		c->line_len ++;
+
+		if (ch == '\n') {
+			if (c->in_data && c->line_len == 3 && c->line_first == '.')
+				c->in_data = 0;
+			c->line_len = 0;
+		} else if (c->in_data && ch != '\r' && ! (c->line_len == 1 && ch == '.'))
+			ch = 'x';
+
+		fputc(ch, c->file);
+	}
+}
@@ -0,0 +1,27 @@
+#ifndef TRANSCRIPT_H_
+#define TRANSCRIPT_H_
+
+#include <stddef.h>
+
+struct transport;
+
+// Session transcripts, one file per client connection, for bridgemail-replay
+//  "BMT1", then the protocol: 'S' (SMTP) or 'P' (POP3), then records
+//   'C' <delay> <len> <len bytes>   data received from the client
+//   'S' <delay> <len>               bytes sent by the server (not kept)
+//  numbers are unsigned LEB128 varints, delay is in microseconds since
+//  the previous record
+#define TRANSCRIPT_MAGIC "BMT1"
+#define TRANSCRIPT_SMTP 'S'
+#define TRANSCRIPT_POP3 'P'
+#define TRANSCRIPT_CLIENT 'C'
+#define TRANSCRIPT_SERVER 'S'
+
+int transcript_setup(const char * dir, int anonymize);
+void transcript_teardown();
+int transcript_enabled();
+
+struct transport * transport_capture(struct transport * inner, char protocol);
+void transcript_recv(struct transport * t, const char * buf, size_t len);
+
+#endif
@@ -0,0 +1,89 @@
+#include "transport.h"
+#include "tls.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+// Queue output, which may not be sent until transport_flush()
+int transport_write(struct transport * t, const char * buf, size_t len)
+{
+	return t->ops->write(t, buf, len);
+}
+
+int transport_puts(struct transport * t, const char * str)
+{
+	return t->ops->write(t, str, strlen(str));
+}
+
+// Send everything queued so far
+int transport_flush(struct transport * t)
+{
+	return t->ops->flush(t);
+}
+
+// Send part of a file, without a copy through user space if the
+//  transport can manage it
+int transport_sendfile(struct transport * t, int in_fd, off_t * offset, size_t len)
+{
+	if (t->ops->sendfile != NULL)
+		return t->ops->sendfile(t, in_fd, offset, len);
+
+	// generic fallback: read it in and write it out
+	char buf[65536];
+
+	while (len > 0) {
+		ssize_t n = pread(in_fd, buf, len < sizeof buf ? len : sizeof buf, *offset);
+
+		if (n <= 0) {
+			perror("pread");
+			return -1;
+		}
+
+		if (t->ops->write(t, buf, n) == -1)
+			return -1;
+
+		*offset += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// Flush, then release the transport and whatever is underneath it
+void transport_close(struct transport * t)
+{
+	t->ops->flush(t);
+	t->ops->close(t);
+}
+
+// Read what the client sent, as recv() would: bytes read, 0 at hangup,
+//  -1 on error, or -1 with errno EAGAIN if there is nothing to read yet
+//  (a TLS handshake in progress)
+ssize_t transport_read(struct transport * t, char * buf, size_t len)
+{
+	if (t->ops->read == NULL) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	return t->ops->read(t, buf, len);
+}
+
+// Whether STARTTLS can be offered on this connection
+int transport_can_starttls(const struct transport * t)
+{
+	return t->ops->starttls != NULL && tls_enabled();
+}
+
+// Switch the connection to TLS: output queued so far (the go-ahead)
+//  is sent in the clear, the handshake follows as the client's data
+//  comes in, then everything is encrypted both ways
+int transport_starttls(struct transport * t)
+{
+	if (! transport_can_starttls(t))
+		return -1;
+
+	return t->ops->starttls(t);
+}
@@ -0,0 +1,50 @@
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Where a protocol handler's output goes, and for client connections
+//  where their input comes from
+//  each implementation embeds this as its first member
+struct transport {
+	const struct transport_ops * ops;
+};
+
+// Interface each transport provides
+//  functions returning int give -1 on error, see transport.c for the rest
+struct transport_ops {
+	const char * name;
+
+	int (*write)(struct transport * t, const char * buf, size_t len);
+	int (*flush)(struct transport * t);
+	// copy len bytes of in_fd from *offset, may be NULL
+	int (*sendfile)(struct transport * t, int in_fd, off_t * offset, size_t len);
+	void (*close)(struct transport * t);
+
+	// input from the client, as recv() returns it, may be NULL
+	ssize_t (*read)(struct transport * t, char * buf, size_t len);
+	// speak TLS from here on, once queued output is flushed, may be NULL
+	int (*starttls)(struct transport * t);
+};
+
+// a connected socket, output is buffered until flushed
+struct transport * transport_socket(int fd);
+int transport_socket_fd(const struct transport * t);
+
+// in-process sink: output is kept (or only counted) in memory
+struct transport * transport_loopback(int keep);
+const char * transport_loopback_output(const struct transport * t, size_t * len);
+unsigned long long transport_loopback_total(const struct transport * t);
+void transport_loopback_clear(struct transport * t);
+
+int transport_write(struct transport * t, const char * buf, size_t len);
+int transport_puts(struct transport * t, const char * str);
+int transport_flush(struct transport * t);
+int transport_sendfile(struct transport * t, int in_fd, off_t * offset, size_t len);
+void transport_close(struct transport * t);
+ssize_t transport_read(struct transport * t, char * buf, size_t len);
+int transport_can_starttls(const struct transport * t);
+int transport_starttls(struct transport * t);
+
+#endif
@@ -0,0 +1,99 @@
+#include "transport.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// In-memory transport for tests, benchmarks and replay: no syscalls,
+//  and the output of a session is exactly reproducible
+struct loopback_transport {
+	struct transport base;
+	// if 0, output is only counted
+	int keep;
+	char * buf;
+	size_t len, max;
+	unsigned long long total;
+};
+
+static int loopback_write(struct transport * t, const char * buf, size_t len)
+{
+	struct loopback_transport * l = (struct loopback_transport *)t;
+
+	l->total += len;
+	if (! l->keep)
+		return 0;
+
+	if (l->len + len > l->max) {
+		size_t new_max = l->max * 2 + len + 4096;
+		char * new_buf = realloc(l->buf, new_max);
+
+		if (new_buf == NULL) {
+			perror("realloc(loopback)");
+			return -1;
+		}
+
+		l->buf = new_buf;
+		l->max = new_max;
+	}
+
+	memcpy(l->buf + l->len, buf, len);
+	l->len += len;
+	return 0;
+}
+
+static int loopback_flush(struct transport * t)
+{
+	(void)t;
+	return 0;
+}
+
+static void loopback_close(struct transport * t)
+{
+	struct loopback_transport * l = (struct loopback_transport *)t;
+
+	free(l->buf);
+	free(l);
+}
+
+static const struct transport_ops loopback_ops = {
+	.name = "loopback",
+	.write = loopback_write,
+	.flush = loopback_flush,
+	// files are read through the generic fallback
+	.sendfile = NULL,
+	.close = loopback_close
+};
+
+struct transport * transport_loopback(int keep)
+{
+	struct loopback_transport * l = calloc(1, sizeof(struct loopback_transport));
+
+	if (l == NULL) {
+		perror("calloc(struct loopback_transport)");
+		return NULL;
+	}
+
+	l->base.ops = &loopback_ops;
+	l->keep = keep;
+	return &l->base;
+}
+
+// Everything written since the last transport_loopback_clear()
+const char * transport_loopback_output(const struct transport * t, size_t * len)
+{
+	const struct loopback_transport * l = (const struct loopback_transport *)t;
+
+	*len = l->len;
+	return l->buf;
+}
+
+// Bytes written over the transport's lifetime, kept or not
+unsigned long long transport_loopback_total(const struct transport * t)
+{
+	return ((const struct loopback_transport *)t)->total;
+}
+
+void transport_loopback_clear(struct transport * t)
+{
+	((struct loopback_transport *)t)->len = 0;
+}
@@ -0,0 +1,158 @@
+#include "transport.h"
+#include "tls.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+// replies are collected up to this size, so a pipelined batch of
+//  commands is answered with one send()
+#define SOCKET_BUFFER 16384
+
+struct socket_transport {
+	struct transport base;
+	int fd;
+	// after STARTTLS, everything goes through here
+	struct tls * tls;
+	size_t len;
+	char buf[SOCKET_BUFFER];
+};
+
+// send a buffer of known length
+static int send_all(int fd, const char * buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+
+		if (sent == -1) {
+			perror("send");
+			return -1;
+		}
+
+		buf += sent;
+		len -= sent;
+	}
+
+	return 0;
+}
+
+static int socket_flush(struct transport * t)
+{
+	struct socket_transport * s = (struct socket_transport *)t;
+
+	if (s->len == 0)
+		return 0;
+
+	const int ret = s->tls != NULL ? tls_write(s->tls, s->buf, s->len) : send_all(s->fd, s->buf, s->len);
+	s->len = 0;
+
+	return ret;
+}
+
+static int socket_write(struct transport * t, const char * buf, size_t len)
+{
+	struct socket_transport * s = (struct socket_transport *)t;
+
+	if (s->len + len > SOCKET_BUFFER) {
+		if (socket_flush(t) == -1)
+			return -1;
+
+		// too big to be worth buffering
+		if (len > SOCKET_BUFFER)
+			return s->tls != NULL ? tls_write(s->tls, buf, len) : send_all(s->fd, buf, len);
+	}
+
+	memcpy(s->buf + s->len, buf, len);
+	s->len += len;
+	return 0;
+}
+
+static int socket_sendfile(struct transport * t, int in_fd, off_t * offset, size_t len)
+{
+	struct socket_transport * s = (struct socket_transport *)t;
+
+	if (socket_flush(t) == -1)
+		return -1;
+
+	if (s->tls != NULL)
+		return tls_sendfile(s->tls, in_fd, offset, len);
+
+	while (len > 0) {
+		ssize_t sent = sendfile(s->fd, in_fd, offset, len);
+
+		if (sent <= 0) {
+			perror("sendfile");
+			return -1;
+		}
+
+		len -= sent;
+	}
+
+	return 0;
+}
+
+static ssize_t socket_read(struct transport * t, char * buf, size_t len)
+{
+	struct socket_transport * s = (struct socket_transport *)t;
+
+	if (s->tls != NULL)
+		return tls_read(s->tls, buf, len);
+
+	return recv(s->fd, buf, len, 0);
+}
+
+static int socket_starttls(struct transport * t)
+{
+	struct socket_transport * s = (struct socket_transport *)t;
+
+	if (s->tls != NULL || socket_flush(t) == -1)
+		return -1;
+
+	s->tls = tls_new(s->fd);
+	return s->tls != NULL ? 0 : -1;
+}
+
+static void socket_close(struct transport * t)
+{
+	struct socket_transport * s = (struct socket_transport *)t;
+
+	if (s->tls != NULL)
+		tls_free(s->tls);
+	close(s->fd);
+	free(s);
+}
+
+static const struct transport_ops socket_ops = {
+	.name = "socket",
+	.write = socket_write,
+	.flush = socket_flush,
+	.sendfile = socket_sendfile,
+	.close = socket_close,
+	.read = socket_read,
+	.starttls = socket_starttls
+};
+
+// Wrap a connected socket, which the transport then owns
+struct transport * transport_socket(int fd)
+{
+	struct socket_transport * s = malloc(sizeof(struct socket_transport));
+
+	if (s == NULL) {
+		perror("malloc(struct socket_transport)");
+		return NULL;
+	}
+
+	s->base.ops = &socket_ops;
+	s->fd = fd;
+	s->tls = NULL;
+	s->len = 0;
+	return &s->base;
+}
+
+int transport_socket_fd(const struct transport * t)
+{
+	return ((const struct socket_transport *)t)->fd;
+}